@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/uio.h>
+
+#include <ctype.h>
+#include <event.h>
+#include <imsg.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "smtpd-api.h"
+
+#define BLOOM_MAXK	16
+
+static double
+bloom_now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * Keys are hashed case-insensitively: merging keys that differ by case
+ * can only add false positives, never hide a key from the backend.
+ */
+static uint64_t
+bloom_hash(const char *key)
+{
+	uint64_t	h = 14695981039346656037ULL;
+
+	for (; *key; key++)
+		h = (h ^ (unsigned char)tolower((unsigned char)*key)) *
+		    1099511628211ULL;
+
+	/* splitmix64 finalizer, FNV alone mixes the high bits poorly */
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	return (h ^ (h >> 31));
+}
+
+/*
+ * Bit i of the k probes, from two halves of the hash as in Kirsch and
+ * Mitzenmacher, reduced to nbits with a multiply instead of a modulo.
+ */
+static inline size_t
+bloom_bit(const struct bloom *b, uint64_t h, unsigned int i)
+{
+	uint64_t	g;
+
+	g = (h & 0xffffffffULL) + i * ((h >> 32) | 1);
+	return (((g & 0xffffffffULL) * b->nbits) >> 32);
+}
+
+void
+bloom_init(struct bloom *b, double fpr)
+{
+	memset(b, 0, sizeof *b);
+	b->fpr = fpr;
+}
+
+/*
+ * Start loading a new set of keys.  The current filter keeps answering
+ * until bloom_commit().
+ */
+void
+bloom_begin(struct bloom *b)
+{
+	b->npending = 0;
+	b->started = bloom_now();
+}
+
+int
+bloom_add(struct bloom *b, const char *key)
+{
+	uint64_t	*tmp;
+	size_t		 sz;
+
+	if (b->npending == b->pendingsz) {
+		sz = b->pendingsz ? b->pendingsz * 2 : 1024;
+		if ((tmp = reallocarray(b->pending, sz, sizeof(*tmp))) == NULL)
+			return (-1);
+		b->pending = tmp;
+		b->pendingsz = sz;
+	}
+	b->pending[b->npending++] = bloom_hash(key);
+	return (0);
+}
+
+/*
+ * Size the filter for the keys loaded and the target false positive
+ * rate, and replace the current one.
+ */
+int
+bloom_commit(struct bloom *b)
+{
+	uint64_t	*bits;
+	size_t		 n, nbits, i;
+	unsigned int	 j, k;
+
+	n = b->npending ? b->npending : 1;
+	nbits = ceil(-(double)n * log(b->fpr) / (M_LN2 * M_LN2));
+	nbits = (nbits + 63) & ~(size_t)63;
+	if (nbits > ((size_t)1 << 32))
+		nbits = (size_t)1 << 32;
+	k = round((double)nbits / n * M_LN2);
+	if (k < 1)
+		k = 1;
+	if (k > BLOOM_MAXK)
+		k = BLOOM_MAXK;
+
+	if ((bits = calloc(nbits / 64, sizeof(*bits))) == NULL) {
+		bloom_abort(b);
+		return (-1);
+	}
+
+	free(b->bits);
+	b->bits = bits;
+	b->nbits = nbits;
+	b->k = k;
+	for (i = 0; i < b->npending; i++)
+		for (j = 0; j < k; j++) {
+			n = bloom_bit(b, b->pending[i], j);
+			b->bits[n / 64] |= (uint64_t)1 << (n % 64);
+		}
+	b->nkeys = b->npending;
+
+	b->built = time(NULL);
+	b->buildtime = bloom_now() - b->started;
+	bloom_abort(b);
+	return (0);
+}
+
+/*
+ * Drop the keys being loaded.  The current filter, if any, is kept and
+ * is retried after the next refresh interval.
+ */
+void
+bloom_abort(struct bloom *b)
+{
+	free(b->pending);
+	b->pending = NULL;
+	b->npending = b->pendingsz = 0;
+	if (b->bits == NULL)
+		b->built = time(NULL);
+}
+
+/*
+ * Return 0 if key is definitely not in the set, 1 if it may be, or if
+ * there is no filter yet.
+ */
+int
+bloom_check(struct bloom *b, const char *key)
+{
+	uint64_t	h;
+	size_t		n;
+	unsigned int	i;
+
+	if (b->bits == NULL)
+		return (1);
+
+	b->lookups++;
+	h = bloom_hash(key);
+	for (i = 0; i < b->k; i++) {
+		n = bloom_bit(b, h, i);
+		if ((b->bits[n / 64] & ((uint64_t)1 << (n % 64))) == 0) {
+			b->negatives++;
+			return (0);
+		}
+	}
+	return (1);
+}
+
+int
+bloom_stale(const struct bloom *b, time_t refresh)
+{
+	return (b->built == 0 || time(NULL) - b->built >= refresh);
+}
+
+void
+bloom_log(const struct bloom *b, const char *table, const char *service)
+{
+	double	fpr;
+
+	if (b->bits == NULL)
+		return;
+
+	fpr = pow(1 - exp(-(double)b->k * b->nkeys / b->nbits), b->k);
+	log_info("info: %s: %s filter: %zu keys, %zu bytes, k=%u, "
+	    "false positives %.3f%%, built in %.3fs, "
+	    "%llu/%llu lookups answered locally", table, service, b->nkeys,
+	    b->nbits / 8, b->k, fpr * 100, b->buildtime,
+	    (unsigned long long)b->negatives,
+	    (unsigned long long)b->lookups);
+}
+
+void
+bloom_free(struct bloom *b)
+{
+	free(b->bits);
+	free(b->pending);
+	memset(b, 0, sizeof *b);
+}
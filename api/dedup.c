@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <event.h>
+#include <imsg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#include "smtpd-api.h"
+
+#define DEDUP_CHUNK	65536
+
+static uint64_t
+dedup_key(const unsigned char *digest)
+{
+	uint64_t	key;
+
+	memcpy(&key, digest, sizeof(key));
+	return (key);
+}
+
+/* hash the content of fd from the start, and return its length */
+static int
+dedup_hash(int fd, unsigned char *digest, size_t *len)
+{
+	static char	 buf[DEDUP_CHUNK];
+	EVP_MD_CTX	*ctx;
+	unsigned int	 dlen;
+	ssize_t		 n;
+	off_t		 off;
+	int		 ret = 0;
+
+	if ((ctx = EVP_MD_CTX_new()) == NULL) {
+		log_warnx("warn: dedup: EVP_MD_CTX_new");
+		return (0);
+	}
+	if (EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1) {
+		log_warnx("warn: dedup: EVP_DigestInit_ex");
+		goto done;
+	}
+	for (off = 0; (n = pread(fd, buf, sizeof(buf), off)) != 0; off += n) {
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			log_warn("warn: dedup: read");
+			goto done;
+		}
+		EVP_DigestUpdate(ctx, buf, n);
+	}
+	if (EVP_DigestFinal_ex(ctx, digest, &dlen) != 1 ||
+	    dlen != DEDUP_DIGEST_LEN) {
+		log_warnx("warn: dedup: EVP_DigestFinal_ex");
+		goto done;
+	}
+	*len = off;
+	ret = 1;
+done:
+	EVP_MD_CTX_free(ctx);
+	return (ret);
+}
+
+static int
+dedup_read(int fd, char *buf, size_t len)
+{
+	ssize_t	n;
+	size_t	off;
+
+	for (off = 0; off < len; off += n) {
+		n = pread(fd, buf + off, len - off, off);
+		if (n == -1 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n == -1) {
+			log_warn("warn: dedup: read");
+			return (0);
+		}
+		if (n == 0) {
+			log_warnx("warn: dedup: file shrunk while read");
+			return (0);
+		}
+	}
+	return (1);
+}
+
+void
+dedup_init(struct dedup *d)
+{
+	memset(d, 0, sizeof(*d));
+	tree_init(&d->bodies);
+}
+
+/*
+ * Return the body with the content of fd.  The content is hashed first,
+ * and only read into memory when no body has that digest yet, so that a
+ * duplicate costs a pass over the file and no allocation.
+ */
+struct dedup_body *
+dedup_load(struct dedup *d, int fd)
+{
+	struct dedup_body	*body, *old;
+	unsigned char		 digest[DEDUP_DIGEST_LEN];
+	size_t			 len;
+
+	if (!dedup_hash(fd, digest, &len))
+		return (NULL);
+
+	d->loads++;
+	old = tree_get(&d->bodies, dedup_key(digest));
+	if (old && old->len == len &&
+	    memcmp(old->digest, digest, sizeof(digest)) == 0) {
+		old->refs++;
+		d->hits++;
+		d->logical += len;
+		return (old);
+	}
+
+	if ((body = calloc(1, sizeof(*body))) == NULL) {
+		log_warn("warn: dedup: calloc");
+		return (NULL);
+	}
+	if (len && (body->buf = malloc(len)) == NULL) {
+		log_warn("warn: dedup: malloc");
+		free(body);
+		return (NULL);
+	}
+	if (!dedup_read(fd, body->buf, len)) {
+		free(body->buf);
+		free(body);
+		return (NULL);
+	}
+	memcpy(body->digest, digest, sizeof(digest));
+	body->len = len;
+	body->size = len;
+	body->refs = 1;
+
+	/* a different body with the same key keeps its own copy */
+	if (old == NULL) {
+		tree_xset(&d->bodies, dedup_key(digest), body);
+		body->shared = 1;
+	}
+	d->stored += len;
+	d->logical += len;
+
+	return (body);
+}
+
+void
+dedup_release(struct dedup *d, struct dedup_body *body)
+{
+	d->logical -= body->len;
+	if (--body->refs)
+		return;
+
+	if (body->shared)
+		tree_xpop(&d->bodies, dedup_key(body->digest));
+	d->stored -= body->size;
+	free(body->buf);
+	free(body);
+}
+
+/*
+ * Replace the content of a body with an encoding of it, the compressed
+ * content for example, which the owner of the store knows how to undo.
+ */
+void
+dedup_replace(struct dedup *d, struct dedup_body *body, char *buf,
+    size_t size, int encoding)
+{
+	d->stored -= body->size;
+	d->stored += size;
+	free(body->buf);
+	body->buf = buf;
+	body->size = size;
+	body->encoding = encoding;
+}
+
+void
+dedup_log(const struct dedup *d, const char *name)
+{
+	log_info("info: %s: %zu unique bodies, %llu/%llu commits "
+	    "deduplicated, %zu bytes stored for %zu (ratio %.2f), "
+	    "%zu bytes saved", name, tree_count(&d->bodies),
+	    (unsigned long long)d->hits, (unsigned long long)d->loads,
+	    d->stored, d->logical,
+	    d->stored ? (double)d->logical / d->stored : 1.0,
+	    d->logical - d->stored);
+}
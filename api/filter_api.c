@@ -38,28 +38,50 @@
 #include <smtpd-api.h>
 
 #define FILTER_HIWAT 65536
+#define FILTER_POOL_MAX 64
+#define FILTER_BUDGET (16 * 1024 * 1024)
 
 static struct tree	queries;
 static struct tree	sessions;
 
+/*
+ * Per-transaction data pipe state.  It is only attached to a session
+ * once DATA starts, and detached when the transaction ends.
+ */
+struct filter_pipe {
+	TAILQ_ENTRY(filter_pipe) entry;
+	TAILQ_ENTRY(filter_pipe) wait;
+	int		 waiting;
+	size_t		 queued;	/* output accounted in the budget */
+
+	int		 eom_called;
+
+	int		 error;
+	struct io	 iev;
+	struct iobuf	 ibuf;
+	size_t		 idatalen;
+	struct io	 oev;
+	struct iobuf	 obuf;
+	size_t		 odatalen;
+
+	void			*data_buffer;
+	void		       (*data_buffer_cb)(uint64_t, FILE *, void *);
+
+	struct rfc2822_parser	rfc2822_parser;
+	struct dict		headers_replace;
+	struct dict		headers_add;
+};
+
 struct filter_session {
+	TAILQ_ENTRY(filter_session) entry;
+
 	uint64_t	id;
 	uint64_t	qid;
 	int		qtype;
 	size_t		datalen;
 
 	int		tx;
-	struct {
-		int		 eom_called;
-
-		int		 error;
-		struct io	 iev;
-		struct iobuf	 ibuf;
-		size_t		 idatalen;
-		struct io	 oev;
-		struct iobuf	 obuf;
-		size_t		 odatalen;
-	} pipe;
+	struct filter_pipe *pipe;
 
 	struct {
 		int		 ready;
@@ -70,15 +92,30 @@ struct filter_session {
 
 	void			*usession;
 	void			*utx;
+};
 
-	void			*data_buffer;
-	void		       (*data_buffer_cb)(uint64_t, FILE *, void *);
-
-	struct rfc2822_parser	rfc2822_parser;
-	struct dict		headers_replace;
-	struct dict		headers_add;
+/*
+ * Released sessions and pipes are kept for reuse, so that connection
+ * churn does not translate into large allocations.  Pipes keep their
+ * iobuf memory while pooled.
+ */
+static struct filter_pool {
+	TAILQ_HEAD(, filter_session)	sessions;
+	TAILQ_HEAD(, filter_pipe)	pipes;
+	size_t				max;
+	struct filter_pool_stats	stats;
+} pool;
 
-};
+/*
+ * Output queued on all data pipes is accounted against a process-wide
+ * budget.  Once it is exceeded, inputs are paused until enough output
+ * has drained.
+ */
+static struct filter_budget {
+	TAILQ_HEAD(, filter_pipe)	waiting;
+	size_t				max;
+	size_t				used;
+} budget;
 
 struct filter_timer {
 	struct event		 ev;
@@ -127,6 +164,13 @@ static struct filter_internals {
 } fi;
 
 static void filter_api_init(void);
+static struct filter_session *filter_session_alloc(uint64_t);
+static void filter_session_free(struct filter_session *);
+static struct filter_pipe *filter_pipe_alloc(void);
+static void filter_pipe_free(struct filter_pipe *);
+static void filter_pipe_account(struct filter_pipe *);
+static void filter_pipe_throttle(struct filter_pipe *);
+static void filter_budget_release(void);
 static void filter_response(struct filter_session *, int, int, const char *);
 static void filter_send_response(struct filter_session *);
 static void filter_register_query(uint64_t, uint64_t, int);
@@ -153,7 +197,7 @@ static const char *query_to_str(int);
 static const char *event_to_str(int);
 
 static void	data_buffered_setup(struct filter_session *);
-static void	data_buffered_release(struct filter_session *);
+static void	data_buffered_release(struct filter_pipe *);
 static void	data_buffered_stream_process(uint64_t, FILE *, void *);
 
 
@@ -174,12 +218,12 @@ filter_response(struct filter_session *s, int status, int code, const char *line
 	/* eom is special, as the reponse has to be deferred until the pipe is all flushed */
 	if (s->qtype == QUERY_EOM) {
 		/* wait for the obuf to drain */
-		if (iobuf_queued(&s->pipe.obuf))
+		if (s->pipe && iobuf_queued(&s->pipe->obuf))
 			return;
 
-		if (s->pipe.oev.sock != -1) {
-			io_clear(&s->pipe.oev);
-			iobuf_clear(&s->pipe.obuf);
+		if (s->pipe && s->pipe->oev.sock != -1) {
+			io_clear(&s->pipe->oev);
+			iobuf_reset(&s->pipe->obuf);
 		}
 		filter_trigger_eom(s);
 	}
@@ -216,6 +260,173 @@ filter_send_response(struct filter_session *s)
 	s->response.ready = 0;
 }
 
+static struct filter_session *
+filter_session_alloc(uint64_t id)
+{
+	struct filter_session	*s;
+
+	if ((s = TAILQ_FIRST(&pool.sessions)) != NULL) {
+		TAILQ_REMOVE(&pool.sessions, s, entry);
+		pool.stats.sessions_idle--;
+		pool.stats.sessions_reused++;
+		memset(s, 0, sizeof(*s));
+	}
+	else {
+		s = calloc(1, sizeof(*s));
+		if (s == NULL)
+			fatal("filter_session_alloc");
+		pool.stats.sessions_alloc++;
+	}
+	pool.stats.sessions++;
+
+	s->id = id;
+	return (s);
+}
+
+static void
+filter_session_free(struct filter_session *s)
+{
+	if (s->pipe)
+		filter_pipe_free(s->pipe);
+	free(s->response.line);
+
+	pool.stats.sessions--;
+	if (pool.stats.sessions_idle >= pool.max) {
+		free(s);
+		return;
+	}
+	TAILQ_INSERT_HEAD(&pool.sessions, s, entry);
+	pool.stats.sessions_idle++;
+}
+
+static struct filter_pipe *
+filter_pipe_alloc(void)
+{
+	struct filter_pipe	*p;
+
+	if ((p = TAILQ_FIRST(&pool.pipes)) != NULL) {
+		TAILQ_REMOVE(&pool.pipes, p, entry);
+		pool.stats.pipes_idle--;
+		pool.stats.pipes_reused++;
+	}
+	else {
+		p = calloc(1, sizeof(*p));
+		if (p == NULL)
+			fatal("filter_pipe_alloc");
+		p->iev.sock = -1;
+		p->oev.sock = -1;
+		pool.stats.pipes_alloc++;
+	}
+	pool.stats.pipes++;
+
+	p->eom_called = 0;
+	p->error = 0;
+	p->idatalen = 0;
+	p->odatalen = 0;
+
+	/* reuse the buffers of a pooled pipe */
+	if (iobuf_reset(&p->ibuf) == -1 || iobuf_reset(&p->obuf) == -1)
+		fatal("filter_pipe_alloc");
+
+	return (p);
+}
+
+static void
+filter_pipe_free(struct filter_pipe *p)
+{
+	io_clear(&p->oev);
+	io_clear(&p->iev);
+
+	if (p->waiting) {
+		TAILQ_REMOVE(&budget.waiting, p, wait);
+		p->waiting = 0;
+		pool.stats.data_waiting--;
+	}
+	budget.used -= p->queued;
+	pool.stats.data_queued = budget.used;
+	p->queued = 0;
+	filter_budget_release();
+
+	if (p->data_buffer)
+		data_buffered_release(p);
+
+	pool.stats.pipes--;
+	if (pool.stats.pipes_idle >= pool.max) {
+		iobuf_clear(&p->ibuf);
+		iobuf_clear(&p->obuf);
+		free(p);
+		return;
+	}
+	TAILQ_INSERT_HEAD(&pool.pipes, p, entry);
+	pool.stats.pipes_idle++;
+}
+
+static void
+filter_pipe_account(struct filter_pipe *p)
+{
+	size_t	queued;
+
+	queued = iobuf_queued(&p->obuf);
+	budget.used = budget.used - p->queued + queued;
+	p->queued = queued;
+
+	pool.stats.data_queued = budget.used;
+	if (budget.used > pool.stats.data_queued_peak)
+		pool.stats.data_queued_peak = budget.used;
+
+	if (queued == 0)
+		filter_budget_release();
+}
+
+static void
+filter_pipe_throttle(struct filter_pipe *p)
+{
+	io_pause(&p->iev, IO_PAUSE_IN);
+	if (p->waiting)
+		return;
+	p->waiting = 1;
+	TAILQ_INSERT_TAIL(&budget.waiting, p, wait);
+	pool.stats.data_waiting++;
+	pool.stats.data_throttled++;
+}
+
+/*
+ * Resume throttled inputs once the budget is back under its low
+ * watermark, leaving room for each of them to queue a full pipe.  The
+ * message size is not known in advance, so the pipes that received the
+ * most data, the likeliest to reach EOM and release their buffers
+ * first, are resumed first.
+ */
+static void
+filter_budget_release(void)
+{
+	struct filter_pipe	*p, *best;
+	size_t			 room;
+
+	if (budget.max == 0)
+		room = SIZE_MAX;
+	else if (budget.used > budget.max - budget.max / 4)
+		return;
+	else
+		room = budget.max - budget.used;
+	while (room >= FILTER_HIWAT && !TAILQ_EMPTY(&budget.waiting)) {
+		best = TAILQ_FIRST(&budget.waiting);
+		TAILQ_FOREACH(p, &budget.waiting, wait)
+			if (p->idatalen > best->idatalen)
+				best = p;
+
+		TAILQ_REMOVE(&budget.waiting, best, wait);
+		best->waiting = 0;
+		pool.stats.data_waiting--;
+
+		/* still paused by its own output otherwise */
+		if (best->iev.sock != -1 &&
+		    iobuf_queued(&best->obuf) < FILTER_HIWAT)
+			io_resume(&best->iev, IO_PAUSE_IN);
+		room -= FILTER_HIWAT;
+	}
+}
+
 static void
 filter_dispatch(struct mproc *p, struct imsg *imsg)
 {
@@ -266,12 +477,7 @@ filter_dispatch(struct mproc *p, struct imsg *imsg)
 		m_end(&m);
 		switch (type) {
 		case EVENT_CONNECT:
-			s = calloc(1, sizeof(*s));
-			if (s == NULL)
-				fatal("filter_dispatch");
-			s->id = id;
-			s->pipe.iev.sock = -1;
-			s->pipe.oev.sock = -1;
+			s = filter_session_alloc(id);
 			tree_xset(&sessions, id, s);
 			if (fi.cb.session_alloc)
 				s->usession = fi.cb.session_alloc(id);
@@ -281,7 +487,7 @@ filter_dispatch(struct mproc *p, struct imsg *imsg)
 			s = tree_xpop(&sessions, id);
 			if (fi.cb.session_free && s->usession)
 				fi.cb.session_free(s->usession);
-			free(s);
+			filter_session_free(s);
 			break;
 		case EVENT_RESET:
 			filter_dispatch_reset(id);
@@ -368,19 +574,15 @@ filter_dispatch(struct mproc *p, struct imsg *imsg)
 		}
 		else {
 			s = tree_xget(&sessions, id);
+			if (s->pipe)
+				filter_pipe_free(s->pipe);
+			s->pipe = filter_pipe_alloc();
 
-			s->pipe.eom_called = 0;
-			s->pipe.error = 0;
-			s->pipe.idatalen = 0;
-			s->pipe.odatalen = 0;
-
-			iobuf_init(&s->pipe.obuf, 0, 0);
-			io_init(&s->pipe.oev, fdout, s, filter_io_out, &s->pipe.obuf);
-			io_set_write(&s->pipe.oev);
+			io_init(&s->pipe->oev, fdout, s, filter_io_out, &s->pipe->obuf);
+			io_set_write(&s->pipe->oev);
 
-			iobuf_init(&s->pipe.ibuf, 0, 0);
-			io_init(&s->pipe.iev, fds[0], s, filter_io_in, &s->pipe.ibuf);
-			io_set_read(&s->pipe.iev);
+			io_init(&s->pipe->iev, fds[0], s, filter_io_in, &s->pipe->ibuf);
+			io_set_read(&s->pipe->iev);
 
 			fdin = fds[1];
 		}
@@ -499,10 +701,10 @@ filter_dispatch_tx_commit(uint64_t id)
 		fatalx("tx-commit: session %016"PRIx64" not in transaction", id);
 
 	s->tx = 0;
-	io_clear(&s->pipe.oev);
-	iobuf_clear(&s->pipe.obuf);
-	io_clear(&s->pipe.iev);
-	iobuf_clear(&s->pipe.ibuf);
+	if (s->pipe) {
+		filter_pipe_free(s->pipe);
+		s->pipe = NULL;
+	}
 
 	if (fi.cb.tx_commit)
 		fi.cb.tx_commit(id);
@@ -511,9 +713,6 @@ filter_dispatch_tx_commit(uint64_t id)
 		fi.cb.tx_free(s->utx);
 		s->utx = NULL;
 	}
-
-	if (s->data_buffer)
-		data_buffered_release(s);
 }
 
 static void
@@ -526,10 +725,10 @@ filter_dispatch_tx_rollback(uint64_t id)
 		fatalx("tx-rollback: session %016"PRIx64" not in transaction", id);
 
 	s->tx = 0;
-	io_clear(&s->pipe.oev);
-	iobuf_clear(&s->pipe.obuf);
-	io_clear(&s->pipe.iev);
-	iobuf_clear(&s->pipe.ibuf);
+	if (s->pipe) {
+		filter_pipe_free(s->pipe);
+		s->pipe = NULL;
+	}
 
 	if (fi.cb.tx_rollback)
 		fi.cb.tx_rollback(id);
@@ -538,9 +737,6 @@ filter_dispatch_tx_rollback(uint64_t id)
 		fi.cb.tx_free(s->utx);
 		s->utx = NULL;
 	}
-
-	if (s->data_buffer)
-		data_buffered_release(s);
 }
 
 static void
@@ -589,8 +785,9 @@ static void
 filter_trigger_eom(struct filter_session *s)
 {
 	log_trace(TRACE_FILTERS, "filter-api:%s %016"PRIx64" filter_trigger_eom(%d, %d, %zu, %zu, %zu)",
-	    filter_name, s->id, s->pipe.iev.sock, s->pipe.oev.sock,
-	    s->datalen, s->pipe.idatalen, s->pipe.odatalen);
+	    filter_name, s->id, s->pipe ? s->pipe->iev.sock : -1,
+	    s->pipe ? s->pipe->oev.sock : -1, s->datalen,
+	    s->pipe ? s->pipe->idatalen : 0, s->pipe ? s->pipe->odatalen : 0);
 
 	/* This is called when
 	 * - EOM query is first received
@@ -598,24 +795,24 @@ filter_trigger_eom(struct filter_session *s)
 	 * - output has been written
 	 */
 
-	/* input not done yet, or EOM query not received */
-	if (s->pipe.iev.sock != -1 || s->qid == 0)
+	/* no data pipe, input not done yet, or EOM query not received */
+	if (s->pipe == NULL || s->pipe->iev.sock != -1 || s->qid == 0)
 		return;
 
-	if (s->pipe.error)
+	if (s->pipe->error)
 		goto fail;
 
 	/* if size don't match, error out */
-	if (s->pipe.idatalen != s->datalen) {
+	if (s->pipe->idatalen != s->datalen) {
 		log_trace(TRACE_FILTERS, "filter-api:%s tx datalen mismatch: %zu/%zu",
-		    filter_name, s->pipe.idatalen, s->datalen);
-		s->pipe.error = 1;
+		    filter_name, s->pipe->idatalen, s->datalen);
+		s->pipe->error = 1;
 		goto fail;
 	}
 
 	/* if we didn't send the eom to the user do it now */
-	if (!s->pipe.eom_called) {
-		s->pipe.eom_called = 1;
+	if (!s->pipe->eom_called) {
+		s->pipe->eom_called = 1;
 		if (fi.cb.msg_end)
 			fi.cb.msg_end(s->id, s->datalen);
 		else
@@ -623,14 +820,14 @@ filter_trigger_eom(struct filter_session *s)
 		return;
 	}
 
-	if (s->pipe.error)
+	if (s->pipe->error)
 		goto fail;
 
 	/* wait for the output socket to be closed */
-	if (s->pipe.oev.sock != -1)
+	if (s->pipe->oev.sock != -1)
 		return;
 
-	s->datalen = s->pipe.odatalen;
+	s->datalen = s->pipe->odatalen;
 	filter_send_response(s);
 
     fail:
@@ -651,51 +848,54 @@ filter_io_in(struct io *io, int evt)
 	switch (evt) {
 	case IO_DATAIN:
 	    nextline:
-		line = iobuf_getline(&s->pipe.ibuf, &len);
-		if ((line == NULL && iobuf_len(&s->pipe.ibuf) >= SMTPD_MAXLINESIZE) ||
+		line = iobuf_getline(&s->pipe->ibuf, &len);
+		if ((line == NULL && iobuf_len(&s->pipe->ibuf) >= SMTPD_MAXLINESIZE) ||
 		    (line && len >= SMTPD_MAXLINESIZE)) {
-			s->pipe.error = 1;
+			s->pipe->error = 1;
 			break;
 		}
 		/* No complete line received */
 		if (line == NULL) {
-			iobuf_normalize(&s->pipe.ibuf);
+			iobuf_normalize(&s->pipe->ibuf);
 			/* flow control */
-			if (iobuf_queued(&s->pipe.obuf) >= FILTER_HIWAT)
-				io_pause(&s->pipe.iev, IO_PAUSE_IN);
+			filter_pipe_account(s->pipe);
+			if (iobuf_queued(&s->pipe->obuf) >= FILTER_HIWAT)
+				io_pause(&s->pipe->iev, IO_PAUSE_IN);
+			else if (budget.max && budget.used >= budget.max)
+				filter_pipe_throttle(s->pipe);
 			return;
 		}
 
-		s->pipe.idatalen += len + 1;
+		s->pipe->idatalen += len + 1;
 		/* XXX warning: do not clear io from this call! */
-		if (s->data_buffer) {
+		if (s->pipe->data_buffer) {
 			/* XXX handle errors somehow */
-			fprintf(s->data_buffer, "%s\n", line);
+			fprintf(s->pipe->data_buffer, "%s\n", line);
 		}
 		filter_dispatch_msg_line(s->id, line);
 		goto nextline;
 
 	case IO_DISCONNECTED:
-		if (iobuf_len(&s->pipe.ibuf)) {
+		if (iobuf_len(&s->pipe->ibuf)) {
 			log_warn("warn: filter-api:%s %016"PRIx64" incomplete input",
 			    filter_name, s->id);
 		}
 		log_trace(TRACE_FILTERS, "filter-api:%s %016"PRIx64" input done (%zu bytes)",
-		    filter_name, s->id, s->pipe.idatalen);
+		    filter_name, s->id, s->pipe->idatalen);
 		break;
 
 	default:
 		log_warn("warn: filter-api:%s %016"PRIx64": unexpected io event %d on data pipe",
 		    filter_name, s->id, evt);
-		s->pipe.error = 1;
+		s->pipe->error = 1;
 
 	}
-	if (s->pipe.error) {
-		io_clear(&s->pipe.oev);
-		iobuf_clear(&s->pipe.obuf);
+	if (s->pipe->error) {
+		io_clear(&s->pipe->oev);
+		iobuf_reset(&s->pipe->obuf);
 	}
-	io_clear(&s->pipe.iev);
-	iobuf_clear(&s->pipe.ibuf);
+	io_clear(&s->pipe->iev);
+	iobuf_reset(&s->pipe->ibuf);
 	filter_trigger_eom(s);
 }
 
@@ -713,34 +913,39 @@ filter_io_out(struct io *io, int evt)
 	case IO_ERROR:
 		log_trace(TRACE_FILTERS, "filter-api:%s %016"PRIx64" io error on output pipe",
 		    filter_name, s->id);
-		s->pipe.error = 1;
+		s->pipe->error = 1;
 		break;
 
 	case IO_LOWAT:
+		filter_pipe_account(s->pipe);
+
 		/* flow control */
-		if (s->pipe.iev.sock != -1 && s->pipe.iev.flags & IO_PAUSE_IN) {
-			io_resume(&s->pipe.iev, IO_PAUSE_IN);
+		if (s->pipe->iev.sock != -1 && s->pipe->iev.flags & IO_PAUSE_IN) {
+			if (budget.max && budget.used >= budget.max)
+				filter_pipe_throttle(s->pipe);
+			else if (!s->pipe->waiting)
+				io_resume(&s->pipe->iev, IO_PAUSE_IN);
 			return;
 		}
 
 		/* if the input is done and there is a response we are done */
-		if (s->pipe.iev.sock == -1 && s->response.ready)
+		if (s->pipe->iev.sock == -1 && s->response.ready)
 			break;
 
 		/* just wait for more data to send or feed through callback */
-		if (s->data_buffer_cb)
-			s->data_buffer_cb(s->id, s->data_buffer, s);
+		if (s->pipe->data_buffer_cb)
+			s->pipe->data_buffer_cb(s->id, s->pipe->data_buffer, s);
 		return;
 
 	default:
 		fatalx("filter_io_out()");
 	}
 
-	io_clear(&s->pipe.oev);
-	iobuf_clear(&s->pipe.obuf);
-	if (s->pipe.error) {
-		io_clear(&s->pipe.iev);
-		iobuf_clear(&s->pipe.ibuf);
+	io_clear(&s->pipe->oev);
+	iobuf_reset(&s->pipe->obuf);
+	if (s->pipe->error) {
+		io_clear(&s->pipe->iev);
+		iobuf_reset(&s->pipe->ibuf);
 	}
 	filter_trigger_eom(s);
 }
@@ -921,6 +1126,14 @@ filter_api_init(void)
 	tree_init(&sessions);
 	event_init();
 
+	TAILQ_INIT(&pool.sessions);
+	TAILQ_INIT(&pool.pipes);
+	pool.max = FILTER_POOL_MAX;
+
+	TAILQ_INIT(&budget.waiting);
+	budget.max = FILTER_BUDGET;
+	pool.stats.data_budget = budget.max;
+
 	memset(&fi, 0, sizeof(fi));
 	fi.p.proc = PROC_PONY;
 	fi.p.name = "filter";
@@ -1138,14 +1351,15 @@ filter_api_writeln(uint64_t id, const char *line)
 
 	s = tree_xget(&sessions, id);
 
-	if (s->pipe.oev.sock == -1) {
+	if (s->pipe == NULL || s->pipe->oev.sock == -1) {
 		log_warnx("warn: session %016"PRIx64": write out of sequence", id);
 		return;
 	}
 
-	s->pipe.odatalen += strlen(line) + 1;
-	iobuf_fqueue(&s->pipe.obuf, "%s\n", line);
-	io_reload(&s->pipe.oev);
+	s->pipe->odatalen += strlen(line) + 1;
+	iobuf_fqueue(&s->pipe->obuf, "%s\n", line);
+	filter_pipe_account(s->pipe);
+	io_reload(&s->pipe->oev);
 }
 
 void
@@ -1160,17 +1374,18 @@ filter_api_printf(uint64_t id, const char *fmt, ...)
 
 	s = tree_xget(&sessions, id);
 
-	if (s->pipe.oev.sock == -1) {
+	if (s->pipe == NULL || s->pipe->oev.sock == -1) {
 		log_warnx("warn: session %016"PRIx64": write out of sequence", id);
 		return;
 	}
 
 	va_start(ap, fmt);
-	len = iobuf_vfqueue(&s->pipe.obuf, fmt, ap);
-	iobuf_fqueue(&s->pipe.obuf, "\n");
+	len = iobuf_vfqueue(&s->pipe->obuf, fmt, ap);
+	iobuf_fqueue(&s->pipe->obuf, "\n");
 	va_end(ap);
-	s->pipe.odatalen += len + 1;
-	io_reload(&s->pipe.oev);
+	s->pipe->odatalen += len + 1;
+	filter_pipe_account(s->pipe);
+	io_reload(&s->pipe->oev);
 }
 
 static void
@@ -1244,12 +1459,12 @@ data_buffered_stream_process(uint64_t id, FILE *fp, void *arg)
 		return;
 	}
 	line[strcspn(line, "\n")] = '\0';
-	rfc2822_parser_feed(&s->rfc2822_parser, line);
+	rfc2822_parser_feed(&s->pipe->rfc2822_parser, line);
 	free(line);
 
 	/* XXX - should be driven by parser_feed */
 	if (1)
-		io_callback(&s->pipe.oev, IO_LOWAT);
+		io_callback(&s->pipe->oev, IO_LOWAT);
 }
 
 static void
@@ -1291,7 +1506,7 @@ header_replace_callback(const struct rfc2822_header *hdr, void *arg)
 	key = xstrdup(hdr->name, "header_replace_callback");
 	lowercase(key, key, strlen(key)+1);
 
-	value = dict_xget(&s->headers_replace, key);
+	value = dict_xget(&s->pipe->headers_replace, key);
 	filter_api_printf(s->id, "%s: %s", hdr->name, value);
 	free(key);
 }
@@ -1305,7 +1520,7 @@ header_eoh_callback(void *arg)
 	void			*data;
 
 	iter = NULL;
-	while (dict_iter(&s->headers_add, &iter, &key, &data))
+	while (dict_iter(&s->pipe->headers_add, &iter, &key, &data))
 		filter_api_printf(s->id, "%s: %s", key, (char *)data);
 }
 
@@ -1327,40 +1542,64 @@ data_buffered_setup(struct filter_session *s)
 	}
 	unlink(pathname);
 
-	s->data_buffer = fp;
-	s->data_buffer_cb = data_buffered_stream_process;
+	s->pipe->data_buffer = fp;
+	s->pipe->data_buffer_cb = data_buffered_stream_process;
 
-	rfc2822_parser_init(&s->rfc2822_parser);
-	rfc2822_parser_reset(&s->rfc2822_parser);
-	rfc2822_header_default_callback(&s->rfc2822_parser,
+	rfc2822_parser_init(&s->pipe->rfc2822_parser);
+	rfc2822_parser_reset(&s->pipe->rfc2822_parser);
+	rfc2822_header_default_callback(&s->pipe->rfc2822_parser,
 	    default_header_callback, s);
-	rfc2822_body_callback(&s->rfc2822_parser,
+	rfc2822_body_callback(&s->pipe->rfc2822_parser,
 	    default_body_callback, s);
-	rfc2822_eoh_callback(&s->rfc2822_parser,
+	rfc2822_eoh_callback(&s->pipe->rfc2822_parser,
 	    header_eoh_callback, s);
 
-	dict_init(&s->headers_replace);
-	dict_init(&s->headers_add);
+	dict_init(&s->pipe->headers_replace);
+	dict_init(&s->pipe->headers_add);
 }
 
 static void
-data_buffered_release(struct filter_session *s)
+data_buffered_release(struct filter_pipe *p)
 {
 	void	*data;
 
-	rfc2822_parser_release(&s->rfc2822_parser);
-	if (s->data_buffer) {
-		fclose(s->data_buffer);
-		s->data_buffer = NULL;
+	rfc2822_parser_release(&p->rfc2822_parser);
+	if (p->data_buffer) {
+		fclose(p->data_buffer);
+		p->data_buffer = NULL;
 	}
+	p->data_buffer_cb = NULL;
 
-	while (dict_poproot(&s->headers_replace, &data))
+	while (dict_poproot(&p->headers_replace, &data))
 		free(data);
 
-	while (dict_poproot(&s->headers_add, &data))
+	while (dict_poproot(&p->headers_add, &data))
 		free(data);
 }
 
+void
+filter_api_pool_size(size_t max)
+{
+	filter_api_init();
+
+	pool.max = max;
+}
+
+void
+filter_api_data_budget(size_t max)
+{
+	filter_api_init();
+
+	budget.max = max;
+	pool.stats.data_budget = max;
+}
+
+void
+filter_api_pool_stats(struct filter_pool_stats *stats)
+{
+	*stats = pool.stats;
+}
+
 void
 filter_api_data_buffered(void)
 {
@@ -1373,9 +1612,13 @@ filter_api_data_buffered_stream(uint64_t id)
 	struct filter_session	*s;
 
 	s = tree_xget(&sessions, id);
-	if (s->data_buffer)
-		fseek(s->data_buffer, 0, 0);
-	io_callback(&s->pipe.oev, IO_LOWAT);
+	if (s->pipe == NULL) {
+		log_warnx("warn: session %016"PRIx64": no data pipe", id);
+		return;
+	}
+	if (s->pipe->data_buffer)
+		fseek(s->pipe->data_buffer, 0, 0);
+	io_callback(&s->pipe->oev, IO_LOWAT);
 }
 
 void
@@ -1384,7 +1627,11 @@ filter_api_header_remove(uint64_t id, const char *header)
 	struct filter_session	*s;
 
 	s = tree_xget(&sessions, id);
-	rfc2822_header_callback(&s->rfc2822_parser, header,
+	if (s->pipe == NULL) {
+		log_warnx("warn: session %016"PRIx64": no data pipe", id);
+		return;
+	}
+	rfc2822_header_callback(&s->pipe->rfc2822_parser, header,
 	    header_remove_callback, s);
 }
 
@@ -1397,16 +1644,20 @@ filter_api_header_replace(uint64_t id, const char *header, const char *fmt, ...)
 	va_list			ap;
 
 	s = tree_xget(&sessions, id);
+	if (s->pipe == NULL) {
+		log_warnx("warn: session %016"PRIx64": no data pipe", id);
+		return;
+	}
 	va_start(ap, fmt);
 	vasprintf(&buffer, fmt, ap);
 	va_end(ap);
 
 	key = xstrdup(header, "filter_api_header_replace");
 	lowercase(key, key, strlen(key)+1);
-	dict_set(&s->headers_replace, header, buffer);
+	dict_set(&s->pipe->headers_replace, header, buffer);
 	free(key);
 
-	rfc2822_header_callback(&s->rfc2822_parser, header,
+	rfc2822_header_callback(&s->pipe->rfc2822_parser, header,
 	    header_replace_callback, s);
 }
 
@@ -1419,12 +1670,16 @@ filter_api_header_add(uint64_t id, const char *header, const char *fmt, ...)
 	va_list			ap;
 
 	s = tree_xget(&sessions, id);
+	if (s->pipe == NULL) {
+		log_warnx("warn: session %016"PRIx64": no data pipe", id);
+		return;
+	}
 	va_start(ap, fmt);
 	vasprintf(&buffer, fmt, ap);
 	va_end(ap);
 
 	key = xstrdup(header, "filter_api_header_replace");
 	lowercase(key, key, strlen(key)+1);
-	dict_set(&s->headers_add, header, buffer);
+	dict_set(&s->pipe->headers_add, header, buffer);
 	free(key);
 }
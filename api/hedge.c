@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/uio.h>
+
+#include <event.h>
+#include <imsg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "smtpd-api.h"
+
+/* recompute the percentile after that many new samples */
+#define HEDGE_REFRESH	16
+
+static int
+hedge_cmp(const void *a, const void *b)
+{
+	double	x = *(const double *)a, y = *(const double *)b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+/*
+ * Track the latency of a backend.  The hedge delay is the given
+ * percentile of the recent samples, and never less than mindelay, which
+ * is also used until enough samples are known.
+ */
+void
+hedge_init(struct hedge *h, int percentile, double mindelay)
+{
+	memset(h, 0, sizeof *h);
+	h->percentile = percentile;
+	h->mindelay = mindelay;
+	h->delay = mindelay;
+}
+
+void
+hedge_record(struct hedge *h, double ms)
+{
+	h->samples[h->next] = ms;
+	h->next = (h->next + 1) % HEDGE_SAMPLES;
+	if (h->nsamples < HEDGE_SAMPLES)
+		h->nsamples++;
+	h->changed++;
+}
+
+double
+hedge_delay(struct hedge *h)
+{
+	double	sorted[HEDGE_SAMPLES];
+	size_t	i;
+
+	if (h->changed < HEDGE_REFRESH || h->nsamples < HEDGE_REFRESH)
+		return (h->delay);
+
+	memcpy(sorted, h->samples, h->nsamples * sizeof(*sorted));
+	qsort(sorted, h->nsamples, sizeof(*sorted), hedge_cmp);
+	i = (h->nsamples * h->percentile + 99) / 100;
+	if (i > 0)
+		i--;
+	h->delay = sorted[i] > h->mindelay ? sorted[i] : h->mindelay;
+	h->changed = 0;
+	return (h->delay);
+}
+
+/*
+ * Milliseconds since t0, on the monotonic clock.
+ */
+double
+hedge_elapsed(const struct timespec *t0)
+{
+	struct timespec	t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return ((t1.tv_sec - t0->tv_sec) * 1e3 +
+	    (t1.tv_nsec - t0->tv_nsec) / 1e6);
+}
@@ -79,6 +79,29 @@ iobuf_clear(struct iobuf *io)
 	memset(io, 0, sizeof (*io));
 }
 
+/*
+ * Empty the buffer, but keep its memory around for reuse.
+ */
+int
+iobuf_reset(struct iobuf *io)
+{
+	struct ioqbuf	*q;
+
+	if (io->buf == NULL)
+		return (iobuf_init(io, 0, 0));
+
+	while ((q = io->outq)) {
+		io->outq = q->next;
+		free(q);
+	}
+	io->outqlast = NULL;
+	io->queued = 0;
+	io->wpos = 0;
+	io->rpos = 0;
+
+	return (0);
+}
+
 void
 iobuf_drain(struct iobuf *io, size_t n)
 {
@@ -47,6 +47,7 @@ struct iobuf {
 
 int	iobuf_init(struct iobuf *, size_t, size_t);
 void	iobuf_clear(struct iobuf *);
+int	iobuf_reset(struct iobuf *);
 
 int	iobuf_extend(struct iobuf *, size_t);
 void	iobuf_normalize(struct iobuf *);
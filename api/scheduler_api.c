@@ -24,6 +24,7 @@
 
 #include <imsg.h>
 #include <pwd.h>
+#include <stddef.h>
 #include <grp.h> /* needed for setgroups */
 #include <string.h>
 #include <unistd.h>
@@ -36,6 +37,7 @@ static size_t (*handler_commit)(uint32_t);
 static size_t (*handler_rollback)(uint32_t);
 static int (*handler_update)(struct scheduler_info *);
 static int (*handler_delete)(uint64_t);
+static int (*handler_delete_result)(uint64_t, int);
 static int (*handler_hold)(uint64_t, uint64_t);
 static int (*handler_release)(int, uint64_t, int);
 static int (*handler_batch)(int, int *, size_t *, uint64_t *, int *);
@@ -55,6 +57,8 @@ static char		*rdata;
 static struct ibuf	*buf;
 static const char	*rootpath = PATH_CHROOT;
 static const char	*user = SMTPD_USER;
+static size_t		 infolen = offsetof(struct scheduler_info, dest);
+static int		 health;
 
 static void
 scheduler_msg_get(void *dst, size_t len)
@@ -115,6 +119,7 @@ scheduler_msg_dispatch(void)
 	uint32_t		 msgids[MAX_BATCH_SIZE], version, msgid;
 	struct scheduler_info	 info;
 	int			 typemask, r, type, types[MAX_BATCH_SIZE];
+	int			 result;
 	int			 delay;
 
 	switch (imsg.hdr.type) {
@@ -123,10 +128,16 @@ scheduler_msg_dispatch(void)
 		scheduler_msg_get(&version, sizeof(version));
 		scheduler_msg_end();
 
-		if (version != PROC_SCHEDULER_API_VERSION) {
+		if (version != PROC_SCHEDULER_API_VERSION &&
+		    version != PROC_SCHEDULER_API_HEALTH) {
 			log_warnx("warn: scheduler-api: bad API version");
 			fatalx("scheduler-api: exiting");
 		}
+		/* older peers know scheduler_info up to nexttry */
+		if (version == PROC_SCHEDULER_API_HEALTH) {
+			infolen = sizeof(info);
+			health = 1;
+		}
 
 		r = handler_init();
 
@@ -135,7 +146,8 @@ scheduler_msg_dispatch(void)
 
 	case PROC_SCHEDULER_INSERT:
 		log_debug("scheduler-api:  PROC_SCHEDULER_INSERT");
-		scheduler_msg_get(&info, sizeof(info));
+		memset(&info, 0, sizeof(info));
+		scheduler_msg_get(&info, infolen);
 		scheduler_msg_end();
 
 		r = handler_insert(&info);
@@ -165,23 +177,30 @@ scheduler_msg_dispatch(void)
 
 	case PROC_SCHEDULER_UPDATE:
 		log_debug("scheduler-api:  PROC_SCHEDULER_UPDATE");
-		scheduler_msg_get(&info, sizeof(info));
+		memset(&info, 0, sizeof(info));
+		scheduler_msg_get(&info, infolen);
 		scheduler_msg_end();
 
 		r = handler_update(&info);
 
 		scheduler_msg_add(&r, sizeof(r));
 		if (r == 1)
-			scheduler_msg_add(&info, sizeof(info));
+			scheduler_msg_add(&info, infolen);
 		scheduler_msg_close();
 		break;
 
 	case PROC_SCHEDULER_DELETE:
 		log_debug("scheduler-api:  PROC_SCHEDULER_DELETE");
 		scheduler_msg_get(&evpid, sizeof(evpid));
+		result = SCHED_RESULT_UNKNOWN;
+		if (health)
+			scheduler_msg_get(&result, sizeof(result));
 		scheduler_msg_end();
 
-		r = handler_delete(evpid);
+		if (handler_delete_result)
+			r = handler_delete_result(evpid, result);
+		else
+			r = handler_delete(evpid);
 
 		imsg_compose(&ibuf, PROC_SCHEDULER_OK, 0, 0, -1, &r, sizeof(r));
 		break;
@@ -341,6 +360,12 @@ scheduler_api_on_delete(int(*cb)(uint64_t))
 	handler_delete = cb;
 }
 
+void
+scheduler_api_on_delete_result(int(*cb)(uint64_t, int))
+{
+	handler_delete_result = cb;
+}
+
 void
 scheduler_api_on_batch(int(*cb)(int, int *, size_t *, uint64_t *, int *))
 {
@@ -136,6 +136,22 @@ struct filter_connect {
 	const char		*hostname;
 };
 
+struct filter_pool_stats {
+	size_t		sessions;	/* sessions in use */
+	size_t		sessions_idle;	/* sessions kept for reuse */
+	uint64_t	sessions_alloc;	/* sessions allocated */
+	uint64_t	sessions_reused;/* sessions taken from the pool */
+	size_t		pipes;		/* data pipes in use */
+	size_t		pipes_idle;
+	uint64_t	pipes_alloc;
+	uint64_t	pipes_reused;
+	size_t		data_budget;	/* limit on queued pipe output */
+	size_t		data_queued;
+	size_t		data_queued_peak;
+	size_t		data_waiting;	/* inputs paused by the budget */
+	uint64_t	data_throttled;
+};
+
 #define PROC_QUEUE_API_VERSION	2
 
 enum {
@@ -158,6 +174,7 @@ enum {
 };
 
 #define PROC_SCHEDULER_API_VERSION	2
+#define PROC_SCHEDULER_API_HEALTH	3	/* scheduler_info has dest, result */
 
 struct scheduler_info;
 
@@ -216,6 +233,10 @@ struct scheduler_info {
 	time_t			lasttry;
 	time_t			lastbounce;
 	time_t			nexttry;
+
+	/* only exchanged with PROC_SCHEDULER_API_HEALTH peers */
+	char			dest[SMTPD_MAXHOSTNAMELEN];	/* MTA relay */
+	int			result;		/* SCHED_RESULT_*, on update */
 };
 
 #define SCHED_REMOVE		0x01
@@ -225,7 +246,18 @@ struct scheduler_info {
 #define SCHED_MDA		0x10
 #define SCHED_MTA		0x20
 
+/*
+ * The outcome of a delivery, on update and, for PROC_SCHEDULER_API_HEALTH
+ * peers, following the evpid on delete.
+ */
+#define SCHED_RESULT_UNKNOWN	0
+#define SCHED_RESULT_CONNECT	1	/* the destination could not be reached */
+#define SCHED_RESULT_SERVICE	2	/* it refused service, with a 421 */
+#define SCHED_RESULT_RCPT	3	/* it only deferred the recipient */
+#define SCHED_RESULT_DONE	4	/* it accepted or refused it for good */
+
 #define PROC_TABLE_API_VERSION	2
+#define PROC_TABLE_API_STREAM	3	/* peer accepts PROC_TABLE_DATA */
 
 struct table_open_params {
 	uint32_t	version;
@@ -255,6 +287,90 @@ enum {
 	PROC_TABLE_CHECK,
 	PROC_TABLE_LOOKUP,
 	PROC_TABLE_FETCH,
+	PROC_TABLE_DATA,
+};
+
+/*
+ * Bloom filter of the keys known to a table service, answering negative
+ * lookups without a query to the backend.
+ */
+struct bloom {
+	uint64_t	*bits;
+	size_t		 nbits;
+	unsigned int	 k;
+	size_t		 nkeys;
+	double		 fpr;		/* target false positive rate */
+
+	uint64_t	*pending;	/* key hashes while loading */
+	size_t		 npending;
+	size_t		 pendingsz;
+	double		 started;
+
+	time_t		 built;
+	double		 buildtime;
+	uint64_t	 lookups;
+	uint64_t	 negatives;
+};
+
+/*
+ * Latency of the recent queries to a backend, from which the delay
+ * before a hedged query is derived.
+ */
+#define HEDGE_SAMPLES	128
+
+struct hedge {
+	double		 samples[HEDGE_SAMPLES];	/* ms */
+	size_t		 nsamples;
+	size_t		 next;
+	size_t		 changed;	/* samples since delay was computed */
+	int		 percentile;
+	double		 mindelay;
+	double		 delay;
+};
+
+/*
+ * Message bodies stored once, however many messages share them, and found
+ * by the SHA-256 of their content.
+ */
+#define DEDUP_DIGEST_LEN	32
+
+struct dedup_body {
+	unsigned char	 digest[DEDUP_DIGEST_LEN];
+	char		*buf;
+	size_t		 len;
+	size_t		 size;		/* of buf, once encoded */
+	int		 encoding;	/* 0 for the raw content */
+	size_t		 refs;
+	int		 shared;	/* in the store, not a colliding copy */
+};
+
+struct dedup {
+	struct tree	 bodies;	/* by the first 8 bytes of the digest */
+	uint64_t	 loads;
+	uint64_t	 hits;
+	size_t		 stored;	/* bytes held */
+	size_t		 logical;	/* bytes with a copy per message */
+};
+
+/* lookup result of arbitrary size, built in linear time */
+struct table_result {
+	char	*buf;
+	size_t	 len;
+	size_t	 size;
+};
+
+#define TABLE_PARAMS_MAX	16
+
+/* request parameters, pointing into the message being handled */
+struct table_param {
+	const char	*key;
+	const char	*value;
+};
+
+struct table_params {
+	size_t			 count;
+	struct table_param	*param;		/* local, or larger if needed */
+	struct table_param	 local[TABLE_PARAMS_MAX];
 };
 
 enum enhanced_status_code {
@@ -342,6 +458,24 @@ msgid_to_evpid(uint32_t msgid)
         return ((uint64_t)msgid << 32);
 }
 
+/* bloom.c */
+void bloom_init(struct bloom *, double);
+void bloom_begin(struct bloom *);
+int bloom_add(struct bloom *, const char *);
+int bloom_commit(struct bloom *);
+void bloom_abort(struct bloom *);
+int bloom_check(struct bloom *, const char *);
+int bloom_stale(const struct bloom *, time_t);
+void bloom_log(const struct bloom *, const char *, const char *);
+void bloom_free(struct bloom *);
+
+/* dedup.c */
+void dedup_init(struct dedup *);
+struct dedup_body *dedup_load(struct dedup *, int);
+void dedup_release(struct dedup *, struct dedup_body *);
+void dedup_replace(struct dedup *, struct dedup_body *, char *, size_t, int);
+void dedup_log(const struct dedup *, const char *);
+
 /* dict.c */
 #define dict_init(d) do { SPLAY_INIT(&((d)->dict)); (d)->count = 0; } while(0)
 #define dict_empty(d) SPLAY_EMPTY(&((d)->dict))
@@ -359,6 +493,12 @@ int dict_iter(struct dict *, void **, const char **, void **);
 int dict_iterfrom(struct dict *, void **, const char *, const char **, void **);
 void dict_merge(struct dict *, struct dict *);
 
+/* hedge.c */
+void hedge_init(struct hedge *, int, double);
+void hedge_record(struct hedge *, double);
+double hedge_delay(struct hedge *);
+double hedge_elapsed(const struct timespec *);
+
 
 /* esc.c */
 const char *esc_code(enum enhanced_status_class, enum enhanced_status_code);
@@ -378,8 +518,15 @@ void filter_api_setugid(uid_t, gid_t);
 void filter_api_set_chroot(const char *);
 void filter_api_no_chroot(void);
 
+void filter_api_pool_size(size_t);
+void filter_api_pool_stats(struct filter_pool_stats *);
+void filter_api_data_budget(size_t);
+
 void filter_api_data_buffered(void);
 void filter_api_data_buffered_stream(uint64_t);
+void filter_api_header_add(uint64_t, const char *, const char *, ...);
+void filter_api_header_replace(uint64_t, const char *, const char *, ...);
+void filter_api_header_remove(uint64_t, const char *);
 
 void filter_api_loop(void);
 int filter_api_accept(uint64_t);
@@ -493,6 +640,7 @@ void scheduler_api_on_commit(size_t(*)(uint32_t));
 void scheduler_api_on_rollback(size_t(*)(uint32_t));
 void scheduler_api_on_update(int(*)(struct scheduler_info *));
 void scheduler_api_on_delete(int(*)(uint64_t));
+void scheduler_api_on_delete_result(int(*)(uint64_t, int));
 void scheduler_api_on_hold(int(*)(uint64_t, uint64_t));
 void scheduler_api_on_release(int(*)(int, uint64_t, int));
 void scheduler_api_on_batch(int(*)(int, int *, size_t *, uint64_t *, int *));
@@ -512,6 +660,17 @@ void table_api_on_update(int(*)(void));
 void table_api_on_check(int(*)(int, struct dict *, const char *));
 void table_api_on_lookup(int(*)(int, struct dict *, const char *, char *, size_t));
 void table_api_on_fetch(int(*)(int, struct dict *, char *, size_t));
+void table_api_on_lookup_result(int(*)(int, struct dict *, const char *,
+    struct table_result *));
+void table_api_on_check_params(int(*)(int, const struct table_params *,
+    const char *));
+void table_api_on_lookup_params(int(*)(int, const struct table_params *,
+    const char *, struct table_result *));
+const char *table_params_get(const struct table_params *, const char *);
+int table_result_add(struct table_result *, const char *, const char *);
+int table_result_printf(struct table_result *, const char *, ...)
+    __attribute__((format (printf, 2, 3)));
+int table_api_breaker_config(struct dict *);
 int table_api_dispatch(void);
 const char *table_api_get_name(void);
 
@@ -22,21 +22,36 @@
 #include <sys/queue.h>
 #include <sys/uio.h>
 
+#include <errno.h>
 #include <event.h>
 #include <fcntl.h>
 #include <imsg.h>
+#include <limits.h>
+#include <poll.h>
 #include <pwd.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <smtpd-api.h>
 
+/* requests between two stats logs */
+#define TABLE_STATS_EVERY	10000
+
 static int (*handler_update)(void);
 static int (*handler_check)(int, struct dict *, const char *);
 static int (*handler_lookup)(int, struct dict *, const char *, char *, size_t);
 static int (*handler_fetch)(int, struct dict *, char *, size_t);
+static int (*handler_lookup_result)(int, struct dict *, const char *,
+    struct table_result *);
+static int (*handler_check_params)(int, const struct table_params *,
+    const char *);
+static int (*handler_lookup_params)(int, const struct table_params *,
+    const char *, struct table_result *);
 
 static int		 quit;
 static struct imsgbuf	 ibuf;
@@ -45,6 +60,70 @@ static size_t		 rlen;
 static char		*rdata;
 static struct ibuf	*buf;
 static char		*name;
+static uint32_t		 version;
+static struct table_result result;
+
+/*
+ * Replies to the requests of the current read batch.  All the requests
+ * read at once were outstanding at the same time, so identical ones are
+ * answered from the first one instead of running the handler again.
+ */
+struct table_flight {
+	int	 r;
+	size_t	 len;
+	char	 data[];
+};
+
+static struct dict		 flights;
+static struct table_result	 flightkey;
+static size_t			 nrequests;
+static size_t			 ncoalesced;
+
+/*
+ * Last known good replies, served when the backend fails or is too slow
+ * and the breaker opens.  Entries are evicted in insertion order.
+ */
+struct table_stale {
+	TAILQ_ENTRY(table_stale)	 entry;
+	char				*fkey;
+	time_t				 stored;
+	int				 r;
+	size_t				 len;
+	char				 data[];
+};
+
+enum {
+	BREAKER_CLOSED,
+	BREAKER_OPEN,
+	BREAKER_HALFOPEN
+};
+
+static const char *breaker_states[] = { "closed", "open", "half-open" };
+
+static struct {
+	int			 enabled;
+	int			 state;
+	long long		 latency;	/* ms */
+	long long		 failures;
+	long long		 cooldown;
+	long long		 maxstale;
+	long long		 maxentries;
+
+	int			 nfailures;
+	time_t			 opened;
+	struct dict		 entries;
+	TAILQ_HEAD(, table_stale) lru;
+	size_t			 nentries;
+
+	/* last request served stale, replayed to revalidate */
+	int			 reqtype;
+	char			*req;
+	size_t			 reqlen;
+
+	size_t			 nstale;
+	size_t			 nrejected;
+	size_t			 nslow;
+} breaker;
 
 #if 0
 static char		*rootpath;
@@ -101,41 +180,606 @@ table_msg_close(void)
 	buf = NULL;
 }
 
+/*
+ * Reply to a lookup or a fetch.  A result that does not fit in a single
+ * imsg is sent ahead in PROC_TABLE_DATA chunks, if the peer supports it,
+ * and the PROC_TABLE_OK message carries the last part.
+ */
+static void
+table_msg_result(int r, const char *data, size_t len)
+{
+	size_t	max, n;
+
+	max = MAX_IMSGSIZE - IMSG_HEADER_SIZE;
+	if (r == 1 && sizeof(r) + len + 1 > max) {
+		if (version < PROC_TABLE_API_STREAM) {
+			log_warnx("warn: table-api: result too large");
+			r = -1;
+		}
+		else
+			while (sizeof(r) + len + 1 > max) {
+				n = MIN(len, max);
+				if (imsg_compose(&ibuf, PROC_TABLE_DATA, 0, 0, -1,
+				    data, n) == -1) {
+					log_warnx("warn: table-api: imsg_compose failed");
+					fatalx("table-api: exiting");
+				}
+				data += n;
+				len -= n;
+			}
+	}
+
+	table_msg_add(&r, sizeof(r));
+	if (r == 1) {
+		table_msg_add(data, len);
+		table_msg_add("", 1);
+	}
+	table_msg_close();
+}
+
 static int
-table_read_params(struct dict *params)
+table_result_grow(struct table_result *res, size_t len)
 {
-	size_t	count;
-	char	*key;
-	char	*value;
+	char	*p;
+	size_t	 size;
 
-	dict_init(params);
+	if (len >= SIZE_MAX - res->len) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	if (res->len + len < res->size)
+		return (0);
+
+	size = res->size ? res->size : 1024;
+	while (size <= res->len + len) {
+		if (size > SIZE_MAX / 2) {
+			size = res->len + len + 1;
+			break;
+		}
+		size *= 2;
+	}
+	if ((p = realloc(res->buf, size)) == NULL)
+		return (-1);
+	res->buf = p;
+	res->size = size;
+	return (0);
+}
+
+/*
+ * Append str to the result, preceded by sep unless the result is empty.
+ */
+int
+table_result_add(struct table_result *res, const char *sep, const char *str)
+{
+	size_t	seplen, len;
+
+	seplen = (res->len && sep) ? strlen(sep) : 0;
+	len = strlen(str);
+	if (table_result_grow(res, seplen + len) == -1) {
+		log_warn("warn: table-api: result");
+		return (-1);
+	}
+	memcpy(res->buf + res->len, sep, seplen);
+	memcpy(res->buf + res->len + seplen, str, len);
+	res->len += seplen + len;
+	res->buf[res->len] = '\0';
+	return (0);
+}
+
+int
+table_result_printf(struct table_result *res, const char *fmt, ...)
+{
+	va_list	ap;
+	int	len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (len < 0 || table_result_grow(res, len) == -1) {
+		log_warn("warn: table-api: result");
+		return (-1);
+	}
+
+	va_start(ap, fmt);
+	vsnprintf(res->buf + res->len, res->size - res->len, fmt, ap);
+	va_end(ap);
+	res->len += len;
+	return (0);
+}
+
+/*
+ * Parameters are not copied: they point into the message, which lives
+ * until the request is answered.  Requests with more parameters than
+ * the local array holds use a heap array, kept for the next ones.
+ */
+static int
+table_read_params(struct table_params *params)
+{
+	static struct table_param	*extra;
+	static size_t			 nextra;
+	struct table_param		*p;
+	size_t				 count, i;
+	size_t				 len;
 
 	table_msg_get(&count, sizeof(count));
 
-	for (;count; count--) {
-		key = rdata;
-		table_msg_get(NULL, strlen(key) + 1);
-		value = rdata;
-		table_msg_get(NULL, strlen(value) + 1);
-		dict_set(params, key, value);
+	params->param = params->local;
+	if (count > TABLE_PARAMS_MAX) {
+		/* a parameter takes at least two bytes */
+		if (count > rlen / 2) {
+			log_warnx("warn: table-api: bad parameters");
+			fatalx("table-api: exiting");
+		}
+		if (count > nextra) {
+			if ((p = reallocarray(extra, count, sizeof(*p))) == NULL) {
+				log_warn("warn: table-api: parameters");
+				fatalx("table-api: exiting");
+			}
+			extra = p;
+			nextra = count;
+		}
+		params->param = extra;
+	}
+
+	for (i = 0; i < count; i++) {
+		params->param[i].key = rdata;
+		if ((len = strnlen(rdata, rlen)) == rlen)
+			break;
+		table_msg_get(NULL, len + 1);
+		params->param[i].value = rdata;
+		if ((len = strnlen(rdata, rlen)) == rlen)
+			break;
+		table_msg_get(NULL, len + 1);
+	}
+	if (i != count) {
+		log_warnx("warn: table-api: bad parameters");
+		fatalx("table-api: exiting");
 	}
+	params->count = count;
 
 	return (0);
 }
 
+const char *
+table_params_get(const struct table_params *params, const char *key)
+{
+	size_t	i;
+
+	for (i = 0; i < params->count; i++)
+		if (strcmp(params->param[i].key, key) == 0)
+			return (params->param[i].value);
+	return (NULL);
+}
+
+/*
+ * Build a dict from the parameters, for the handlers registered with the
+ * dict interface.
+ */
+static void
+table_params_dict(const struct table_params *params, struct dict *d)
+{
+	size_t	i;
+
+	dict_init(d);
+	for (i = 0; i < params->count; i++)
+		dict_set(d, params->param[i].key,
+		    (void *)params->param[i].value);
+}
+
 static void
-table_clear_params(struct dict *params)
+table_params_dict_clear(struct dict *d)
 {
-	while (dict_poproot(params, NULL))
+	while (dict_poproot(d, NULL))
 		;
 }
 
+/*
+ * Append a length-prefixed string to the flight key, without going
+ * through printf for each parameter.
+ */
+static int
+table_flight_add(const char *str)
+{
+	char	 num[24], *p;
+	size_t	 len;
+
+	len = strlen(str);
+	p = num + sizeof(num);
+	*--p = '\0';
+	*--p = ':';
+	do {
+		*--p = '0' + len % 10;
+		len /= 10;
+	} while (len);
+	if (table_result_add(&flightkey, NULL, p) == -1 ||
+	    table_result_add(&flightkey, NULL, str) == -1)
+		return (-1);
+	return (0);
+}
+
+static const char *
+table_flight_key(int msgtype, int service, const struct table_params *params,
+    const char *key)
+{
+	size_t	i;
+
+	flightkey.len = 0;
+	if (table_result_printf(&flightkey, "%d:%d:", msgtype, service) == -1)
+		return (NULL);
+	for (i = 0; i < params->count; i++)
+		if (table_flight_add(params->param[i].key) == -1 ||
+		    table_flight_add(params->param[i].value) == -1)
+			return (NULL);
+	if (table_result_add(&flightkey, NULL, key) == -1)
+		return (NULL);
+	return (flightkey.buf);
+}
+
+static void
+table_flight_stats(void)
+{
+	log_info("info: table-api: %s: %zu requests, %zu coalesced",
+	    name ? name : "table", nrequests, ncoalesced);
+	if (breaker.enabled)
+		log_info("info: table-api: %s: breaker %s, %zu slow calls, "
+		    "%zu served stale, %zu rejected, %zu replies kept",
+		    name ? name : "table", breaker_states[breaker.state],
+		    breaker.nslow, breaker.nstale, breaker.nrejected,
+		    breaker.nentries);
+}
+
+static struct table_flight *
+table_flight_get(const char *fkey)
+{
+	struct table_flight	*f;
+
+	if (++nrequests % TABLE_STATS_EVERY == 0)
+		table_flight_stats();
+	if (fkey == NULL || (f = dict_get(&flights, fkey)) == NULL)
+		return (NULL);
+	ncoalesced++;
+	return (f);
+}
+
+static void
+table_flight_set(const char *fkey, int r, const char *data, size_t len)
+{
+	struct table_flight	*f;
+
+	if (fkey == NULL)
+		return;
+	if ((f = malloc(sizeof(*f) + len + 1)) == NULL) {
+		log_warn("warn: table-api: flight");
+		return;
+	}
+	f->r = r;
+	f->len = len;
+	if (len)
+		memcpy(f->data, data, len);
+	f->data[len] = '\0';
+	dict_set(&flights, fkey, f);
+}
+
+static void
+table_flight_clear(void)
+{
+	void	*f;
+
+	while (dict_poproot(&flights, &f))
+		free(f);
+}
+
+static const char *breaker_keys[] = {
+	"breaker_latency", "breaker_failures", "breaker_cooldown",
+	"stale_max", "stale_entries"
+};
+
+/*
+ * Configure the breaker from the table configuration.  It is enabled
+ * as soon as one of its keys is set.
+ */
+int
+table_api_breaker_config(struct dict *conf)
+{
+	long long	*values[] = { &breaker.latency, &breaker.failures,
+	    &breaker.cooldown, &breaker.maxstale, &breaker.maxentries };
+	const char	*value, *e;
+	long long	 ll;
+	size_t		 i;
+
+	breaker.latency = 1000;
+	breaker.failures = 5;
+	breaker.cooldown = 30;
+	breaker.maxstale = 3600;
+	breaker.maxentries = 10000;
+	breaker.enabled = 0;
+
+	for (i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+		if ((value = dict_get(conf, breaker_keys[i])) == NULL)
+			continue;
+		ll = strtonum(value, 1, INT_MAX, &e);
+		if (e) {
+			log_warnx("warn: bad value for %s: %s",
+			    breaker_keys[i], e);
+			return (-1);
+		}
+		*values[i] = ll;
+		breaker.enabled = 1;
+	}
+	return (0);
+}
+
+static void
+breaker_set(int state)
+{
+	if (breaker.state == state)
+		return;
+	log_info("info: table-api: %s: breaker %s", name ? name : "table",
+	    breaker_states[state]);
+	breaker.state = state;
+	if (state == BREAKER_OPEN)
+		breaker.opened = time(NULL);
+	else if (state == BREAKER_CLOSED)
+		breaker.nfailures = 0;
+}
+
+static struct table_stale *
+stale_get(const char *fkey)
+{
+	struct table_stale	*st;
+
+	if (fkey == NULL || (st = dict_get(&breaker.entries, fkey)) == NULL)
+		return (NULL);
+	if (time(NULL) - st->stored > breaker.maxstale)
+		return (NULL);
+	return (st);
+}
+
+static void
+stale_remove(struct table_stale *st)
+{
+	dict_pop(&breaker.entries, st->fkey);
+	TAILQ_REMOVE(&breaker.lru, st, entry);
+	breaker.nentries--;
+	free(st->fkey);
+	free(st);
+}
+
+static void
+stale_set(const char *fkey, int r, const char *data, size_t len)
+{
+	struct table_stale	*st;
+
+	if ((st = dict_get(&breaker.entries, fkey)) != NULL)
+		stale_remove(st);
+	if (breaker.nentries >= (size_t)breaker.maxentries)
+		stale_remove(TAILQ_FIRST(&breaker.lru));
+
+	if ((st = malloc(sizeof(*st) + len + 1)) == NULL ||
+	    (st->fkey = strdup(fkey)) == NULL) {
+		log_warn("warn: table-api: stale");
+		free(st);
+		return;
+	}
+	st->stored = time(NULL);
+	st->r = r;
+	st->len = len;
+	if (len)
+		memcpy(st->data, data, len);
+	st->data[len] = '\0';
+	dict_set(&breaker.entries, st->fkey, st);
+	TAILQ_INSERT_TAIL(&breaker.lru, st, entry);
+	breaker.nentries++;
+}
+
+static void
+stale_clear(void)
+{
+	struct table_stale	*st;
+
+	while ((st = TAILQ_FIRST(&breaker.lru)) != NULL)
+		stale_remove(st);
+}
+
+/*
+ * Keep a copy of the request being served stale, so that it can be
+ * replayed when the pipe is idle.
+ */
+static void
+stale_keep_request(int msgtype, const void *req, size_t len)
+{
+	char	*p;
+
+	if ((p = malloc(len)) == NULL)
+		return;
+	memcpy(p, req, len);
+	free(breaker.req);
+	breaker.req = p;
+	breaker.reqlen = len;
+	breaker.reqtype = msgtype;
+}
+
+static int
+table_handler(int msgtype, int service, const struct table_params *params,
+    const char *key, const char **data, size_t *len)
+{
+	static char	 res[4096];
+	struct dict	 d;
+	int		 r;
+
+	*data = NULL;
+	*len = 0;
+
+	if (msgtype == PROC_TABLE_CHECK) {
+		if (handler_check_params)
+			return (handler_check_params(service, params, key));
+		if (handler_check == NULL)
+			return (-1);
+		table_params_dict(params, &d);
+		r = handler_check(service, &d, key);
+		table_params_dict_clear(&d);
+		return (r);
+	}
+
+	if (handler_lookup_params || handler_lookup_result) {
+		result.len = 0;
+		if (result.buf)
+			result.buf[0] = '\0';
+		if (handler_lookup_params)
+			r = handler_lookup_params(service, params, key, &result);
+		else {
+			table_params_dict(params, &d);
+			r = handler_lookup_result(service, &d, key, &result);
+			table_params_dict_clear(&d);
+		}
+		if (r == 1 && result.buf == NULL)
+			r = table_result_add(&result, NULL, "") ? -1 : 1;
+		if (r == 1) {
+			*data = result.buf;
+			*len = result.len;
+		}
+	}
+	else if (handler_lookup) {
+		table_params_dict(params, &d);
+		r = handler_lookup(service, &d, key, res, sizeof(res));
+		table_params_dict_clear(&d);
+		if (r == 1) {
+			*data = res;
+			*len = strlen(res);
+		}
+	}
+	else
+		r = -1;
+	return (r);
+}
+
+/*
+ * Run a check or lookup through the breaker.  A call that fails or takes
+ * longer than the latency budget counts as a failure, and enough of them
+ * in a row open the breaker: requests are then answered from the last
+ * known good replies, or fail at once, until the cooldown is over and a
+ * request is let through to probe the backend.  A slow call is not cut
+ * short: the handler runs to completion and its reply is used.
+ */
+static int
+table_call(int msgtype, int service, const struct table_params *params,
+    const char *key, const char *fkey, const char **data, size_t *len)
+{
+	struct table_stale	*st;
+	struct timespec		 t0, t1;
+	long long		 ms;
+	int			 r;
+
+	if (!breaker.enabled || fkey == NULL)
+		return (table_handler(msgtype, service, params, key, data, len));
+
+	if (breaker.state == BREAKER_OPEN) {
+		if (time(NULL) - breaker.opened < breaker.cooldown) {
+			*data = NULL;
+			*len = 0;
+			stale_keep_request(msgtype, imsg.data,
+			    imsg.hdr.len - IMSG_HEADER_SIZE);
+			if ((st = stale_get(fkey)) == NULL) {
+				breaker.nrejected++;
+				return (-1);
+			}
+			breaker.nstale++;
+			*data = st->data;
+			*len = st->len;
+			return (st->r);
+		}
+		breaker_set(BREAKER_HALFOPEN);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	r = table_handler(msgtype, service, params, key, data, len);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	ms = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000;
+
+	if (r != -1 && ms <= breaker.latency) {
+		breaker_set(BREAKER_CLOSED);
+		breaker.nfailures = 0;
+		stale_set(fkey, r, *data, *len);
+		return (r);
+	}
+
+	if (r != -1) {
+		/* slow but good, keep it */
+		breaker.nslow++;
+		stale_set(fkey, r, *data, *len);
+	}
+	if (breaker.state == BREAKER_HALFOPEN ||
+	    ++breaker.nfailures >= breaker.failures)
+		breaker_set(BREAKER_OPEN);
+
+	if (r == -1 && (st = stale_get(fkey)) != NULL) {
+		breaker.nstale++;
+		*data = st->data;
+		*len = st->len;
+		return (st->r);
+	}
+	return (r);
+}
+
+/*
+ * If no request comes in before the cooldown is over, replay the last
+ * request that was served stale, so that the backend is probed and the
+ * replies refreshed without a client waiting on it.
+ */
+static void
+table_breaker_idle(void)
+{
+	struct pollfd	 pfd;
+	struct table_params params;
+	const char	*fkey, *data;
+	char		*req, *saved;
+	size_t		 len, savedlen;
+	time_t		 wait;
+	int		 service;
+
+	if (!breaker.enabled || breaker.state != BREAKER_OPEN ||
+	    breaker.req == NULL)
+		return;
+
+	wait = breaker.opened + breaker.cooldown - time(NULL);
+	pfd.fd = ibuf.fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, wait > 0 ? wait * 1000 : 0) != 0)
+		return;
+
+	req = breaker.req;
+	breaker.req = NULL;
+	saved = rdata;
+	savedlen = rlen;
+	rdata = req;
+	rlen = breaker.reqlen;
+
+	table_msg_get(&service, sizeof(service));
+	table_read_params(&params);
+	if (rlen && rdata[rlen - 1] == '\0') {
+		log_debug("debug: table-api: %s: probing with \"%s\"",
+		    name ? name : "table", rdata);
+		fkey = table_flight_key(breaker.reqtype, service, &params,
+		    rdata);
+		(void)table_call(breaker.reqtype, service, &params, rdata,
+		    fkey, &data, &len);
+	}
+
+	rdata = saved;
+	rlen = savedlen;
+	free(req);
+}
+
 static void
 table_msg_dispatch(void)
 {
 	struct table_open_params op;
-	struct dict	 params;
+	struct table_flight *f;
+	struct table_params params;
+	struct dict	 d;
+	const char	*fkey, *data;
 	char		 res[4096];
+	size_t		 len;
 	int		 type, r;
 
 	switch (imsg.hdr.type) {
@@ -143,10 +787,12 @@ table_msg_dispatch(void)
 		table_msg_get(&op, sizeof op);
 		table_msg_end();
 
-		if (op.version != PROC_TABLE_API_VERSION) {
+		if (op.version != PROC_TABLE_API_VERSION &&
+		    op.version != PROC_TABLE_API_STREAM) {
 			log_warnx("warn: table-api: bad API version");
 			fatalx("table-api: terminating");
 		}
+		version = op.version;
 		if ((name = strdup(op.name)) == NULL) {
 			log_warn("warn: table-api");
 			fatalx("table-api: terminating");
@@ -158,6 +804,9 @@ table_msg_dispatch(void)
 	case PROC_TABLE_UPDATE:
 		table_msg_end();
 
+		table_flight_clear();
+		stale_clear();
+		breaker_set(BREAKER_CLOSED);
 		if (handler_update)
 			r = handler_update();
 		else
@@ -182,11 +831,14 @@ table_msg_dispatch(void)
 			fatalx("table-api: exiting");
 		}
 
-		if (handler_check)
-			r = handler_check(type, &params, rdata);
-		else
-			r = -1;
-		table_clear_params(&params);
+		fkey = table_flight_key(imsg.hdr.type, type, &params, rdata);
+		if ((f = table_flight_get(fkey)) != NULL)
+			r = f->r;
+		else {
+			r = table_call(imsg.hdr.type, type, &params, rdata, fkey,
+			    &data, &len);
+			table_flight_set(fkey, r, NULL, 0);
+		}
 		table_msg_get(NULL, rlen);
 		table_msg_end();
 
@@ -206,35 +858,37 @@ table_msg_dispatch(void)
 			fatalx("table-api: exiting");
 		}
 
-		if (handler_lookup)
-			r = handler_lookup(type, &params, rdata, res, sizeof(res));
-		else
-			r = -1;
-		table_clear_params(&params);
+		fkey = table_flight_key(imsg.hdr.type, type, &params, rdata);
+		if ((f = table_flight_get(fkey)) != NULL) {
+			r = f->r;
+			data = f->data;
+			len = f->len;
+		}
+		else {
+			r = table_call(imsg.hdr.type, type, &params, rdata, fkey,
+			    &data, &len);
+			table_flight_set(fkey, r, data, len);
+		}
 		table_msg_get(NULL, rlen);
 		table_msg_end();
 
-		table_msg_add(&r, sizeof(r));
-		if (r == 1)
-			table_msg_add(res, strlen(res) + 1);
-		table_msg_close();
+		table_msg_result(r, data, len);
 		break;
 
 
 	case PROC_TABLE_FETCH:
 		table_msg_get(&type, sizeof(type));
 		table_read_params(&params);
-		if (handler_fetch)
-			r = handler_fetch(type, &params, res, sizeof(res));
+		if (handler_fetch) {
+			table_params_dict(&params, &d);
+			r = handler_fetch(type, &d, res, sizeof(res));
+			table_params_dict_clear(&d);
+		}
 		else
 			r = -1;
-		table_clear_params(&params);
 		table_msg_end();
 
-		table_msg_add(&r, sizeof(r));
-		if (r == 1)
-			table_msg_add(res, strlen(res) + 1);
-		table_msg_close();
+		table_msg_result(r, res, r == 1 ? strlen(res) : 0);
 		break;
 
 	default:
@@ -267,6 +921,27 @@ table_api_on_fetch(int(*cb)(int, struct dict *, char *, size_t))
 	handler_fetch = cb;
 }
 
+void
+table_api_on_lookup_result(int(*cb)(int, struct dict *, const char *,
+    struct table_result *))
+{
+	handler_lookup_result = cb;
+}
+
+void
+table_api_on_check_params(int(*cb)(int, const struct table_params *,
+    const char *))
+{
+	handler_check_params = cb;
+}
+
+void
+table_api_on_lookup_params(int(*cb)(int, const struct table_params *,
+    const char *, struct table_result *))
+{
+	handler_lookup_params = cb;
+}
+
 const char *
 table_api_get_name(void)
 {
@@ -308,6 +983,9 @@ table_api_dispatch(void)
 #endif
 
 	imsg_init(&ibuf, 0);
+	dict_init(&flights);
+	dict_init(&breaker.entries);
+	TAILQ_INIT(&breaker.lru);
 
 	while (1) {
 		n = imsg_get(&ibuf, &imsg);
@@ -326,6 +1004,10 @@ table_api_dispatch(void)
 			continue;
 		}
 
+		/* the batch is answered, later requests must run again */
+		table_flight_clear();
+		table_breaker_idle();
+
 		n = imsg_read(&ibuf);
 		if (n == -1) {
 			log_warn("warn: table-api: imsg_read");
@@ -336,6 +1018,7 @@ table_api_dispatch(void)
 			break;
 		}
 	}
+	table_flight_stats();
 
 	return (1);
 }
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Check the body canonicalizations against known vectors, without smtpd.
+ * Each body is fed line by line as the filter receives it, and its hash
+ * is compared with the hash of the expected canonical form.
+ */
+
+#define main	filter_dkim_main
+#include "filter_dkim.c"
+#undef main
+
+#include <err.h>
+
+void filter_api_transaction_allocator(void *(*cb)(uint64_t)) { }
+void filter_api_transaction_destructor(void (*cb)(void *)) { }
+void *filter_api_transaction(uint64_t id) { return (NULL); }
+void filter_api_data_buffered(void) { }
+void filter_api_data_buffered_stream(uint64_t id) { }
+void filter_api_header_add(uint64_t id, const char *n, const char *f, ...) { }
+void filter_api_on_msg_line(void (*cb)(uint64_t, const char *)) { }
+void filter_api_on_msg_end(int (*cb)(uint64_t, size_t)) { }
+void filter_api_no_chroot(void) { }
+void filter_api_loop(void) { }
+
+static const struct {
+	const char	*what;
+	enum dkim_canon	 canon;
+	const char	*lines[8];
+	const char	*expect;
+} vectors[] = {
+	/* RFC 6376 section 3.4.5 */
+	{ "rfc 6376 example, simple", CANON_SIMPLE,
+	  { " C ", "D \t E", "", "", NULL },
+	  " C \r\nD \t E\r\n" },
+	{ "rfc 6376 example, relaxed", CANON_RELAXED,
+	  { " C ", "D \t E", "", "", NULL },
+	  " C\r\nD E\r\n" },
+
+	{ "indented lines, relaxed", CANON_RELAXED,
+	  { "Hello,", "", "    indented", "\t\ttabbed  text \t", "end", NULL },
+	  "Hello,\r\n\r\n indented\r\n tabbed text\r\nend\r\n" },
+	{ "whitespace only lines, relaxed", CANON_RELAXED,
+	  { "a", " \t ", "b", "  ", "\t", NULL },
+	  "a\r\n\r\nb\r\n" },
+	{ "empty body, simple", CANON_SIMPLE,
+	  { "", "", NULL },
+	  "\r\n" },
+	{ "empty body, relaxed", CANON_RELAXED,
+	  { "", NULL },
+	  "" },
+};
+
+static int
+check(size_t v)
+{
+	struct dkim_tx	 tx;
+	EVP_MD_CTX	*ctx;
+	unsigned char	 bh[EVP_MAX_MD_SIZE];
+	unsigned int	 bhlen;
+	size_t		 i;
+
+	memset(&tx, 0, sizeof tx);
+	tx.bcanon = vectors[v].canon;
+	tx.bleft = -1;
+	if ((tx.bctx = EVP_MD_CTX_new()) == NULL ||
+	    EVP_DigestInit_ex(tx.bctx, EVP_sha256(), NULL) != 1)
+		errx(1, "EVP_DigestInit_ex");
+	for (i = 0; vectors[v].lines[i]; i++)
+		body_update(&tx, vectors[v].lines[i]);
+	body_final(&tx);
+	EVP_MD_CTX_free(tx.bctx);
+
+	if ((ctx = EVP_MD_CTX_new()) == NULL ||
+	    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1)
+		errx(1, "EVP_DigestInit_ex");
+	EVP_DigestUpdate(ctx, vectors[v].expect, strlen(vectors[v].expect));
+	EVP_DigestFinal_ex(ctx, bh, &bhlen);
+	EVP_MD_CTX_free(ctx);
+
+	return (tx.bhlen == bhlen && memcmp(tx.bh, bh, bhlen) == 0);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t	i;
+	int	failed = 0;
+
+	log_init(1);
+
+	for (i = 0; i < nitems(vectors); i++) {
+		if (check(i))
+			printf("ok      %s\n", vectors[i].what);
+		else {
+			printf("FAIL    %s\n", vectors[i].what);
+			failed = 1;
+		}
+	}
+
+	return (failed);
+}
@@ -0,0 +1,1485 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <resolv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+#include <smtpd-api.h>
+
+#define	DKIM_THREADS		4
+#define	DKIM_HDR_MAX		(256 * 1024)
+#define	DKIM_SIG_MAX		1024
+#define	DKIM_KEY_TTL_MIN	60
+#define	DKIM_KEY_TTL_MAX	3600
+#define	DKIM_KEY_TTL_NEG	300
+#define	DKIM_PURGE_INTERVAL	60
+
+#define	DKIM_SIGN_HEADERS	"from:to:cc:subject:date:message-id:reply-to:" \
+				"in-reply-to:references:mime-version:content-type"
+
+enum dkim_canon {
+	CANON_SIMPLE,
+	CANON_RELAXED,
+};
+
+enum dkim_algo {
+	ALGO_RSA_SHA256,
+	ALGO_ED25519_SHA256,
+};
+
+enum dkim_mode {
+	MODE_NONE,
+	MODE_SIGN,
+	MODE_VERIFY,
+};
+
+enum dkim_result {
+	RES_NONE,
+	RES_PASS,
+	RES_FAIL,
+	RES_NEUTRAL,
+	RES_TEMPERROR,
+	RES_PERMERROR,
+};
+
+static const char *dkim_results[] = {
+	"none", "pass", "fail", "neutral", "temperror", "permerror"
+};
+static const char *dkim_algos[] = { "rsa-sha256", "ed25519-sha256" };
+
+enum key_status {
+	KEY_PENDING,
+	KEY_OK,
+	KEY_TEMPFAIL,
+	KEY_PERMFAIL,
+};
+
+struct dkim_signer {
+	char			*domain;
+	char			*selector;
+	enum dkim_algo		 algo;
+	EVP_PKEY		*pkey;
+};
+
+struct dkim_tx;
+
+/*
+ * Public keys fetched from DNS, shared by all transactions.  A pending
+ * entry collects the transactions waiting for the lookup to complete.
+ */
+struct dkim_key {
+	char			*name;
+	enum key_status		 status;
+	enum dkim_algo		 algo;
+	EVP_PKEY		*pkey;
+	time_t			 expire;
+	TAILQ_HEAD(, dkim_tx)	 waiters;
+};
+
+struct dkim_hdr {
+	char			*name;
+	size_t			 off;
+	size_t			 len;
+	int			 used;
+};
+
+struct dkim_sig {
+	size_t			 hdr;		/* index in headers */
+	enum dkim_algo		 algo;
+	enum dkim_canon		 hcanon;
+	enum dkim_canon		 bcanon;
+	char			*d;
+	char			*s;
+	char			*h;
+	long long		 l;
+	unsigned char		 bh[EVP_MAX_MD_SIZE];
+	size_t			 bhlen;
+	unsigned char		 b[DKIM_SIG_MAX];
+	size_t			 blen;
+};
+
+enum job_type {
+	JOB_SIGN,
+	JOB_VERIFY,
+	JOB_DNS,
+};
+
+struct job {
+	enum job_type		 type;
+	uint64_t		 id;
+	enum dkim_algo		 algo;
+	EVP_PKEY		*pkey;
+	unsigned char		 digest[EVP_MAX_MD_SIZE];
+	unsigned int		 dlen;
+	unsigned char		*sig;
+	size_t			 siglen;
+	struct dkim_key		*key;
+	uint32_t		 ttl;
+	int			 status;
+	TAILQ_ENTRY(job)	 entry;
+};
+
+struct dkim_tx {
+	uint64_t		 id;
+	struct rfc2822_parser	 parser;
+
+	char			*hdrs;
+	size_t			 hdrlen;
+	size_t			 hdrsize;
+	size_t			 mark;
+	struct dkim_hdr		*hv;
+	size_t			 nhdr;
+	size_t			 hvsize;
+	int			 overflow;
+	char			*from;
+
+	enum dkim_mode		 mode;
+	struct dkim_signer	*signer;
+	struct dkim_sig		*sig;
+	enum dkim_result	 result;
+	const char		*reason;
+
+	EVP_MD_CTX		*bctx;
+	int			 inbody;
+	enum dkim_canon		 bcanon;
+	size_t			 blank;
+	int			 nonempty;
+	long long		 bleft;
+	unsigned char		 bh[EVP_MAX_MD_SIZE];
+	unsigned int		 bhlen;
+	char			*sigvalue;
+
+	struct job		*job;
+	struct dkim_key		*wkey;
+	TAILQ_ENTRY(dkim_tx)	 wentry;
+};
+
+static struct {
+	pthread_mutex_t		 lock;
+	pthread_cond_t		 cond;
+	TAILQ_HEAD(, job)	 jobs;
+	int			 notify[2];
+	struct event		 ev;
+} pool;
+
+static struct {
+	uint64_t	signed_ok;
+	uint64_t	sign_fail;
+	uint64_t	verified[RES_PERMERROR + 1];
+	uint64_t	key_hits;
+	uint64_t	key_misses;
+} stats;
+
+static struct tree	 txs;
+static struct dict	 signers;
+static struct dict	 keys;
+static struct event	 ev_purge;
+static char		*sign_headers = DKIM_SIGN_HEADERS;
+static char		 authserv[SMTPD_MAXHOSTNAMELEN];
+static int		 verify;
+
+static void dkim_finish(struct dkim_tx *);
+static void dkim_verify_key(struct dkim_tx *, struct dkim_key *);
+
+
+/*
+ * Canonicalization
+ */
+
+static size_t
+canon_body_line(char *out, const char *line, enum dkim_canon canon)
+{
+	size_t	n = 0;
+	int	wsp = 0;
+
+	if (canon == CANON_SIMPLE) {
+		n = strlen(line);
+		memcpy(out, line, n);
+		return (n);
+	}
+
+	/* each WSP run becomes one SP, leading ones too; trailing WSP goes */
+	for (; *line; line++) {
+		if (*line == ' ' || *line == '\t') {
+			wsp = 1;
+			continue;
+		}
+		if (wsp)
+			out[n++] = ' ';
+		wsp = 0;
+		out[n++] = *line;
+	}
+	return (n);
+}
+
+/* relaxed header canonicalization of a raw, CRLF terminated header */
+static size_t
+canon_header_relaxed(char *out, const char *raw, size_t len)
+{
+	size_t	i = 0, n = 0, start;
+	int	wsp = 0;
+
+	for (; i < len && raw[i] != ':'; i++)
+		if (raw[i] != ' ' && raw[i] != '\t')
+			out[n++] = tolower((unsigned char)raw[i]);
+	out[n++] = ':';
+	start = n;
+
+	for (i++; i < len; i++) {
+		if (raw[i] == '\r' || raw[i] == '\n')
+			continue;
+		if (raw[i] == ' ' || raw[i] == '\t') {
+			wsp = 1;
+			continue;
+		}
+		if (wsp && n != start)
+			out[n++] = ' ';
+		wsp = 0;
+		out[n++] = raw[i];
+	}
+	out[n++] = '\r';
+	out[n++] = '\n';
+	return (n);
+}
+
+static void
+hash_header(EVP_MD_CTX *ctx, const char *raw, size_t len, enum dkim_canon canon,
+    int last)
+{
+	char	*buf;
+	size_t	 n;
+
+	if (canon == CANON_SIMPLE) {
+		EVP_DigestUpdate(ctx, raw, last ? len - 2 : len);
+		return;
+	}
+	buf = xmalloc(len + 3, "hash_header");
+	n = canon_header_relaxed(buf, raw, len);
+	EVP_DigestUpdate(ctx, buf, last ? n - 2 : n);
+	free(buf);
+}
+
+static void
+body_hash(struct dkim_tx *tx, const void *buf, size_t len)
+{
+	if (tx->bleft >= 0) {
+		if ((long long)len > tx->bleft)
+			len = tx->bleft;
+		tx->bleft -= len;
+	}
+	if (len)
+		EVP_DigestUpdate(tx->bctx, buf, len);
+}
+
+/*
+ * The body is hashed as lines arrive.  Empty lines are only counted, as
+ * trailing ones must be ignored; they are hashed when more content
+ * follows.
+ */
+static void
+body_update(struct dkim_tx *tx, const char *line)
+{
+	char	buf[SMTPD_MAXLINESIZE + 2];
+	size_t	n;
+
+	if (strlen(line) >= SMTPD_MAXLINESIZE) {
+		tx->mode = MODE_NONE;
+		return;
+	}
+	n = canon_body_line(buf, line, tx->bcanon);
+	if (n == 0) {
+		tx->blank++;
+		return;
+	}
+	for (; tx->blank; tx->blank--)
+		body_hash(tx, "\r\n", 2);
+	buf[n++] = '\r';
+	buf[n++] = '\n';
+	body_hash(tx, buf, n);
+	tx->nonempty = 1;
+}
+
+static void
+body_final(struct dkim_tx *tx)
+{
+	if (tx->bcanon == CANON_SIMPLE && !tx->nonempty)
+		body_hash(tx, "\r\n", 2);
+	EVP_DigestFinal_ex(tx->bctx, tx->bh, &tx->bhlen);
+}
+
+/*
+ * Feed the headers listed in h, each occurrence picked bottom-up.
+ */
+static void
+hash_signed_headers(struct dkim_tx *tx, EVP_MD_CTX *ctx, const char *h,
+    enum dkim_canon canon)
+{
+	char	 name[RFC2822_MAX_LINE_SIZE];
+	size_t	 i, n;
+
+	for (i = 0; i < tx->nhdr; i++)
+		tx->hv[i].used = 0;
+
+	while (*h) {
+		for (n = 0; *h && *h != ':'; h++)
+			if (!isspace((unsigned char)*h) && n < sizeof(name) - 1)
+				name[n++] = *h;
+		name[n] = '\0';
+		if (*h == ':')
+			h++;
+		for (i = tx->nhdr; i > 0; i--) {
+			if (tx->hv[i - 1].used ||
+			    strcasecmp(tx->hv[i - 1].name, name))
+				continue;
+			tx->hv[i - 1].used = 1;
+			hash_header(ctx, tx->hdrs + tx->hv[i - 1].off,
+			    tx->hv[i - 1].len, canon, 0);
+			break;
+		}
+	}
+}
+
+
+/*
+ * Worker pool
+ */
+
+static void
+job_submit(struct job *job)
+{
+	pthread_mutex_lock(&pool.lock);
+	TAILQ_INSERT_TAIL(&pool.jobs, job, entry);
+	pthread_cond_signal(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static void
+job_free(struct job *job)
+{
+	if (job->pkey)
+		EVP_PKEY_free(job->pkey);
+	free(job->sig);
+	free(job);
+}
+
+static int
+job_sign(struct job *job)
+{
+	EVP_PKEY_CTX	*ctx = NULL;
+	EVP_MD_CTX	*mctx = NULL;
+	int		 ret = -1;
+
+	if (job->algo == ALGO_RSA_SHA256) {
+		if ((ctx = EVP_PKEY_CTX_new(job->pkey, NULL)) == NULL ||
+		    EVP_PKEY_sign_init(ctx) <= 0 ||
+		    EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) <= 0 ||
+		    EVP_PKEY_CTX_set_signature_md(ctx, EVP_sha256()) <= 0 ||
+		    EVP_PKEY_sign(ctx, NULL, &job->siglen, job->digest,
+		    job->dlen) <= 0)
+			goto end;
+		if ((job->sig = malloc(job->siglen)) == NULL ||
+		    EVP_PKEY_sign(ctx, job->sig, &job->siglen, job->digest,
+		    job->dlen) <= 0)
+			goto end;
+		ret = 0;
+	}
+#ifdef EVP_PKEY_ED25519
+	else {
+		if ((mctx = EVP_MD_CTX_new()) == NULL ||
+		    EVP_DigestSignInit(mctx, NULL, NULL, NULL, job->pkey) <= 0 ||
+		    EVP_DigestSign(mctx, NULL, &job->siglen, job->digest,
+		    job->dlen) <= 0)
+			goto end;
+		if ((job->sig = malloc(job->siglen)) == NULL ||
+		    EVP_DigestSign(mctx, job->sig, &job->siglen, job->digest,
+		    job->dlen) <= 0)
+			goto end;
+		ret = 0;
+	}
+#endif
+
+end:
+	EVP_PKEY_CTX_free(ctx);
+	EVP_MD_CTX_free(mctx);
+	return (ret);
+}
+
+static int
+job_verify(struct job *job)
+{
+	EVP_PKEY_CTX	*ctx = NULL;
+	EVP_MD_CTX	*mctx = NULL;
+	int		 ret = -1;
+
+	if (job->algo == ALGO_RSA_SHA256) {
+		if ((ctx = EVP_PKEY_CTX_new(job->pkey, NULL)) == NULL ||
+		    EVP_PKEY_verify_init(ctx) <= 0 ||
+		    EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) <= 0 ||
+		    EVP_PKEY_CTX_set_signature_md(ctx, EVP_sha256()) <= 0)
+			goto end;
+		if (EVP_PKEY_verify(ctx, job->sig, job->siglen, job->digest,
+		    job->dlen) == 1)
+			ret = 0;
+	}
+#ifdef EVP_PKEY_ED25519
+	else {
+		if ((mctx = EVP_MD_CTX_new()) == NULL ||
+		    EVP_DigestVerifyInit(mctx, NULL, NULL, NULL, job->pkey) <= 0)
+			goto end;
+		if (EVP_DigestVerify(mctx, job->sig, job->siglen, job->digest,
+		    job->dlen) == 1)
+			ret = 0;
+	}
+#endif
+
+end:
+	EVP_PKEY_CTX_free(ctx);
+	EVP_MD_CTX_free(mctx);
+	return (ret);
+}
+
+/*
+ * Parse the "v=DKIM1; k=...; p=..." record into a public key.
+ */
+static enum key_status
+parse_key_record(struct job *job, const char *txt)
+{
+	unsigned char	 der[4096];
+	const unsigned char *p;
+	char		*buf, *rec, *tag, *val, *b64, *s, *d;
+	int		 k = ALGO_RSA_SHA256, len;
+	enum key_status	 status = KEY_PERMFAIL;
+
+	buf = rec = xstrdup(txt, "parse_key_record");
+	b64 = NULL;
+	while ((tag = strsep(&rec, ";")) != NULL) {
+		if ((val = strchr(tag, '=')) == NULL)
+			continue;
+		*val++ = '\0';
+		tag = strip(tag);
+		if (!strcmp(tag, "k")) {
+			val = strip(val);
+			if (!strcmp(val, "ed25519"))
+				k = ALGO_ED25519_SHA256;
+			else if (strcmp(val, "rsa"))
+				goto end;
+		}
+		else if (!strcmp(tag, "p"))
+			b64 = val;
+	}
+	if (b64 == NULL)
+		goto end;
+
+	/* strip folding whitespace */
+	for (s = d = b64; *s; s++)
+		if (!isspace((unsigned char)*s))
+			*d++ = *s;
+	*d = '\0';
+	if (*b64 == '\0')	/* revoked */
+		goto end;
+	if ((len = base64_decode(b64, der, sizeof der)) <= 0)
+		goto end;
+
+	p = der;
+	if (k == ALGO_RSA_SHA256)
+		job->pkey = d2i_PUBKEY(NULL, &p, len);
+#ifdef EVP_PKEY_ED25519
+	else
+		job->pkey = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, NULL,
+		    der, len);
+#endif
+	if (job->pkey == NULL)
+		goto end;
+	if (k == ALGO_RSA_SHA256 && EVP_PKEY_base_id(job->pkey) != EVP_PKEY_RSA) {
+		EVP_PKEY_free(job->pkey);
+		job->pkey = NULL;
+		goto end;
+	}
+	job->algo = k;
+	status = KEY_OK;
+
+end:
+	free(buf);
+	return (status);
+}
+
+static void
+job_dns(struct job *job)
+{
+	unsigned char	 ans[8192], *p, *end;
+	char		 txt[4096];
+	int		 n, qd, an, type, rdlen, len;
+	size_t		 tlen;
+
+	job->ttl = DKIM_KEY_TTL_NEG;
+	if ((n = res_query(job->key->name, C_IN, T_TXT, ans, sizeof ans)) < 0) {
+		job->status = (h_errno == HOST_NOT_FOUND || h_errno == NO_DATA) ?
+		    KEY_PERMFAIL : KEY_TEMPFAIL;
+		return;
+	}
+	if (n > (int)sizeof ans)
+		n = sizeof ans;
+
+	job->status = KEY_PERMFAIL;
+	p = ans + HFIXEDSZ;
+	end = ans + n;
+	if (n < HFIXEDSZ)
+		return;
+	qd = (ans[4] << 8) | ans[5];
+	an = (ans[6] << 8) | ans[7];
+
+	for (; qd > 0; qd--) {
+		if ((len = dn_skipname(p, end)) < 0 || p + len + QFIXEDSZ > end)
+			return;
+		p += len + QFIXEDSZ;
+	}
+
+	for (; an > 0; an--) {
+		if ((len = dn_skipname(p, end)) < 0 || p + len + RRFIXEDSZ > end)
+			return;
+		p += len;
+		type = (p[0] << 8) | p[1];
+		job->ttl = ((uint32_t)p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+		rdlen = (p[8] << 8) | p[9];
+		p += RRFIXEDSZ;
+		if (p + rdlen > end)
+			return;
+		if (type != T_TXT) {
+			p += rdlen;
+			continue;
+		}
+
+		/* a TXT record is a sequence of character-strings */
+		tlen = 0;
+		for (end = p + rdlen; p < end; p += len) {
+			len = *p++;
+			if (p + len > end || tlen + len >= sizeof txt)
+				return;
+			memcpy(txt + tlen, p, len);
+			tlen += len;
+		}
+		txt[tlen] = '\0';
+		end = ans + n;
+		if (strncmp(txt, "v=", 2) && strstr(txt, "p=") == NULL)
+			continue;
+		job->status = parse_key_record(job, txt);
+		return;
+	}
+}
+
+static void *
+worker(void *arg)
+{
+	struct job	*job;
+
+	for (;;) {
+		pthread_mutex_lock(&pool.lock);
+		while ((job = TAILQ_FIRST(&pool.jobs)) == NULL)
+			pthread_cond_wait(&pool.cond, &pool.lock);
+		TAILQ_REMOVE(&pool.jobs, job, entry);
+		pthread_mutex_unlock(&pool.lock);
+
+		switch (job->type) {
+		case JOB_SIGN:
+			job->status = job_sign(job);
+			break;
+		case JOB_VERIFY:
+			job->status = job_verify(job);
+			break;
+		case JOB_DNS:
+			job_dns(job);
+			break;
+		}
+
+		/* pointer sized writes to a pipe are atomic */
+		if (write(pool.notify[1], &job, sizeof job) != sizeof job)
+			abort();
+	}
+	return (NULL);
+}
+
+static void
+job_done(struct job *job)
+{
+	struct dkim_tx	*tx;
+	struct dkim_key	*key;
+	char		 b64[DKIM_SIG_MAX * 2], *value;
+	size_t		 i, n;
+	int		 len;
+
+	if (job->type == JOB_DNS) {
+		key = job->key;
+		key->status = job->status;
+		key->algo = job->algo;
+		key->pkey = job->pkey;
+		job->pkey = NULL;
+		if (job->ttl < DKIM_KEY_TTL_MIN)
+			job->ttl = DKIM_KEY_TTL_MIN;
+		if (job->ttl > DKIM_KEY_TTL_MAX)
+			job->ttl = DKIM_KEY_TTL_MAX;
+		if (key->status != KEY_OK)
+			job->ttl = DKIM_KEY_TTL_NEG;
+		key->expire = time(NULL) + job->ttl;
+		while ((tx = TAILQ_FIRST(&key->waiters)) != NULL) {
+			TAILQ_REMOVE(&key->waiters, tx, wentry);
+			tx->wkey = NULL;
+			dkim_verify_key(tx, key);
+		}
+		job_free(job);
+		return;
+	}
+
+	/* the transaction may have gone away while the job was running */
+	tx = tree_get(&txs, job->id);
+	if (tx == NULL || tx->job != job) {
+		job_free(job);
+		return;
+	}
+	tx->job = NULL;
+
+	if (job->type == JOB_VERIFY) {
+		tx->result = (job->status == 0) ? RES_PASS : RES_FAIL;
+		if (tx->result == RES_FAIL)
+			tx->reason = "signature did not verify";
+	}
+	else if (job->status == 0) {
+		len = base64_encode(job->sig, job->siglen, b64, sizeof b64);
+		if (len > 0) {
+			/* fold the signature, b= is excluded from the hash */
+			n = strlen(tx->sigvalue);
+			value = xmalloc(n + len + len / 64 * 3 + 1, "job_done");
+			memcpy(value, tx->sigvalue, n);
+			for (i = 0; i < (size_t)len; i += 64) {
+				if (i) {
+					memcpy(value + n, "\n\t ", 3);
+					n += 3;
+				}
+				memcpy(value + n, b64 + i,
+				    (size_t)len - i < 64 ? (size_t)len - i : 64);
+				n += (size_t)len - i < 64 ? (size_t)len - i : 64;
+			}
+			value[n] = '\0';
+			filter_api_header_add(tx->id, "DKIM-Signature", "%s", value);
+			free(value);
+			stats.signed_ok++;
+		}
+	}
+	else {
+		log_warnx("warn: session %016"PRIx64": signing failed", tx->id);
+		stats.sign_fail++;
+	}
+
+	job_free(job);
+	dkim_finish(tx);
+}
+
+static void
+pool_dispatch(int fd, short event, void *arg)
+{
+	struct job	*job;
+	ssize_t		 n;
+
+	while ((n = read(fd, &job, sizeof job)) == sizeof job)
+		job_done(job);
+	if (n == -1 && errno != EAGAIN && errno != EINTR)
+		fatal("pool_dispatch: read");
+}
+
+static void
+pool_init(int nthreads)
+{
+	pthread_t	th;
+	int		i;
+
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+	TAILQ_INIT(&pool.jobs);
+
+	if (pipe(pool.notify) == -1)
+		fatal("pipe");
+	io_set_nonblocking(pool.notify[0]);
+	event_set(&pool.ev, pool.notify[0], EV_READ | EV_PERSIST,
+	    pool_dispatch, NULL);
+	event_add(&pool.ev, NULL);
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&th, NULL, worker, NULL))
+			fatalx("pthread_create");
+		pthread_detach(th);
+	}
+}
+
+
+/*
+ * Signature handling
+ */
+
+static int
+parse_canon(const char *s, enum dkim_canon *c)
+{
+	if (!strcmp(s, "simple"))
+		*c = CANON_SIMPLE;
+	else if (!strcmp(s, "relaxed"))
+		*c = CANON_RELAXED;
+	else
+		return (-1);
+	return (0);
+}
+
+static void
+sig_free(struct dkim_sig *sig)
+{
+	if (sig == NULL)
+		return;
+	free(sig->d);
+	free(sig->s);
+	free(sig->h);
+	free(sig);
+}
+
+/* return a copy of s without any whitespace */
+static char *
+nowsp(const char *s)
+{
+	char	*r, *d;
+
+	r = d = xstrdup(s, "nowsp");
+	for (; *s; s++)
+		if (!isspace((unsigned char)*s))
+			*d++ = *s;
+	*d = '\0';
+	return (r);
+}
+
+static struct dkim_sig *
+sig_parse(const char *raw, size_t len)
+{
+	struct dkim_sig	*sig;
+	char		*buf, *p, *tag, *val, *c, *v;
+	const char	*errstr;
+	int		 n, version = 0;
+
+	sig = xcalloc(1, sizeof *sig, "sig_parse");
+	sig->l = -1;
+	sig->hcanon = sig->bcanon = CANON_SIMPLE;
+
+	buf = xmalloc(len + 1, "sig_parse");
+	memcpy(buf, raw, len);
+	buf[len] = '\0';
+	p = strchr(buf, ':') + 1;
+
+	while ((tag = strsep(&p, ";")) != NULL) {
+		if ((val = strchr(tag, '=')) == NULL) {
+			if (*strip(tag) == '\0')
+				continue;
+			goto fail;
+		}
+		*val++ = '\0';
+		tag = strip(tag);
+		val = strip(val);
+		v = nowsp(val);
+
+		if (!strcmp(tag, "v"))
+			version = !strcmp(v, "1");
+		else if (!strcmp(tag, "a")) {
+			if (!strcmp(v, "rsa-sha256"))
+				sig->algo = ALGO_RSA_SHA256;
+#ifdef EVP_PKEY_ED25519
+			else if (!strcmp(v, "ed25519-sha256"))
+				sig->algo = ALGO_ED25519_SHA256;
+#endif
+			else
+				goto failv;
+		}
+		else if (!strcmp(tag, "c")) {
+			if ((c = strchr(v, '/')) != NULL)
+				*c++ = '\0';
+			if (parse_canon(v, &sig->hcanon) == -1 ||
+			    (c && parse_canon(c, &sig->bcanon) == -1))
+				goto failv;
+		}
+		else if (!strcmp(tag, "d"))
+			sig->d = xstrdup(v, "sig_parse");
+		else if (!strcmp(tag, "s"))
+			sig->s = xstrdup(v, "sig_parse");
+		else if (!strcmp(tag, "h"))
+			sig->h = xstrdup(v, "sig_parse");
+		else if (!strcmp(tag, "l")) {
+			sig->l = strtonum(v, 0, LLONG_MAX, &errstr);
+			if (errstr)
+				goto failv;
+		}
+		else if (!strcmp(tag, "bh")) {
+			if ((n = base64_decode(v, sig->bh, sizeof sig->bh)) <= 0)
+				goto failv;
+			sig->bhlen = n;
+		}
+		else if (!strcmp(tag, "b")) {
+			if ((n = base64_decode(v, sig->b, sizeof sig->b)) <= 0)
+				goto failv;
+			sig->blen = n;
+		}
+		free(v);
+	}
+	free(buf);
+
+	if (!version || sig->d == NULL || sig->s == NULL || sig->h == NULL ||
+	    sig->bhlen == 0 || sig->blen == 0)
+		goto fail2;
+	return (sig);
+
+failv:
+	free(v);
+fail:
+	free(buf);
+fail2:
+	sig_free(sig);
+	return (NULL);
+}
+
+/*
+ * Copy a raw, CRLF terminated DKIM-Signature header with the value of its
+ * b= tag removed, as it is hashed when signing and verifying.
+ */
+static char *
+sig_strip_b(const char *raw, size_t len, size_t *outlen)
+{
+	char	*out;
+	size_t	 i, j, k, n = 0, end = len - 2;
+	int	 isb;
+
+	out = xmalloc(len + 1, "sig_strip_b");
+	for (i = 0; i < end && raw[i] != ':'; i++)
+		out[n++] = raw[i];
+	if (i < end)
+		out[n++] = raw[i++];
+
+	while (i < end) {
+		for (j = i; j < end && raw[j] != '=' && raw[j] != ';'; j++)
+			;
+		for (k = j; k > i && isspace((unsigned char)raw[k - 1]); k--)
+			;
+		while (i < k && isspace((unsigned char)raw[i]))
+			out[n++] = raw[i++];
+		isb = (k - i == 1 && raw[i] == 'b');
+		while (i < j)
+			out[n++] = raw[i++];
+		if (i < end && raw[i] == '=')
+			out[n++] = raw[i++];
+		for (; i < end && raw[i] != ';'; i++)
+			if (!isb)
+				out[n++] = raw[i];
+		if (i < end)
+			out[n++] = raw[i++];
+	}
+	out[n++] = '\r';
+	out[n++] = '\n';
+	*outlen = n;
+	return (out);
+}
+
+/* turn the LF folding of a header value into CRLF */
+static char *
+crlf_header(const char *name, const char *value, size_t *outlen)
+{
+	char	*out;
+	size_t	 n;
+
+	out = xmalloc(strlen(name) + 2 + strlen(value) * 2 + 3, "crlf_header");
+	n = strlen(name);
+	memcpy(out, name, n);
+	out[n++] = ':';
+	out[n++] = ' ';
+	for (; *value; value++) {
+		if (*value == '\n')
+			out[n++] = '\r';
+		out[n++] = *value;
+	}
+	out[n++] = '\r';
+	out[n++] = '\n';
+	*outlen = n;
+	return (out);
+}
+
+static void
+dkim_sign(struct dkim_tx *tx)
+{
+	struct dkim_signer	*signer = tx->signer;
+	EVP_MD_CTX		*ctx;
+	struct job		*job;
+	char			 bh[EVP_MAX_MD_SIZE * 2], *h, *raw, *p, *name;
+	size_t			 i, hlen;
+
+	if (base64_encode(tx->bh, tx->bhlen, bh, sizeof bh) <= 0)
+		goto fail;
+
+	/* list the configured headers that are present */
+	hlen = strlen(sign_headers) + 1;
+	h = xcalloc(1, hlen, "dkim_sign");
+	raw = xstrdup(sign_headers, "dkim_sign");
+	for (p = raw; (name = strsep(&p, ":")) != NULL; ) {
+		for (i = 0; i < tx->nhdr; i++)
+			if (!strcasecmp(tx->hv[i].name, name))
+				break;
+		if (i == tx->nhdr)
+			continue;
+		if (*h)
+			strlcat(h, ":", hlen);
+		strlcat(h, name, hlen);
+	}
+	free(raw);
+
+	if (asprintf(&tx->sigvalue, "v=1; a=%s; c=relaxed/relaxed; d=%s;"
+	    " s=%s;\n\tt=%lld; h=%s;\n\tbh=%s;\n\tb=",
+	    dkim_algos[signer->algo], signer->domain, signer->selector,
+	    (long long)time(NULL), h, bh) == -1)
+		fatal("asprintf");
+
+	ctx = EVP_MD_CTX_new();
+	if (ctx == NULL || EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1)
+		fatalx("dkim_sign: digest");
+	hash_signed_headers(tx, ctx, h, CANON_RELAXED);
+	free(h);
+
+	/* the signature header itself is hashed last, as it is inserted */
+	raw = crlf_header("DKIM-Signature", tx->sigvalue, &hlen);
+	hash_header(ctx, raw, hlen, CANON_RELAXED, 1);
+	free(raw);
+
+	job = xcalloc(1, sizeof *job, "dkim_sign");
+	job->type = JOB_SIGN;
+	job->id = tx->id;
+	job->algo = signer->algo;
+	job->pkey = signer->pkey;
+	EVP_PKEY_up_ref(job->pkey);
+	EVP_DigestFinal_ex(ctx, job->digest, &job->dlen);
+	EVP_MD_CTX_free(ctx);
+
+	tx->job = job;
+	job_submit(job);
+	return;
+
+fail:
+	dkim_finish(tx);
+}
+
+static void
+dkim_verify_key(struct dkim_tx *tx, struct dkim_key *key)
+{
+	struct dkim_sig	*sig = tx->sig;
+	struct dkim_hdr	*hdr = &tx->hv[sig->hdr];
+	EVP_MD_CTX	*ctx;
+	struct job	*job;
+	char		*raw;
+	size_t		 len;
+
+	switch (key->status) {
+	case KEY_PENDING:
+		tx->wkey = key;
+		TAILQ_INSERT_TAIL(&key->waiters, tx, wentry);
+		return;
+	case KEY_TEMPFAIL:
+		tx->result = RES_TEMPERROR;
+		tx->reason = "key lookup failed";
+		dkim_finish(tx);
+		return;
+	case KEY_PERMFAIL:
+		tx->result = RES_PERMERROR;
+		tx->reason = "no key for signature";
+		dkim_finish(tx);
+		return;
+	case KEY_OK:
+		break;
+	}
+	if (key->algo != sig->algo) {
+		tx->result = RES_PERMERROR;
+		tx->reason = "key type mismatch";
+		dkim_finish(tx);
+		return;
+	}
+
+	ctx = EVP_MD_CTX_new();
+	if (ctx == NULL || EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1)
+		fatalx("dkim_verify_key: digest");
+	hash_signed_headers(tx, ctx, sig->h, sig->hcanon);
+	raw = sig_strip_b(tx->hdrs + hdr->off, hdr->len, &len);
+	hash_header(ctx, raw, len, sig->hcanon, 1);
+	free(raw);
+
+	job = xcalloc(1, sizeof *job, "dkim_verify_key");
+	job->type = JOB_VERIFY;
+	job->id = tx->id;
+	job->algo = sig->algo;
+	job->pkey = key->pkey;
+	EVP_PKEY_up_ref(job->pkey);
+	job->sig = xmemdup(sig->b, sig->blen, "dkim_verify_key");
+	job->siglen = sig->blen;
+	EVP_DigestFinal_ex(ctx, job->digest, &job->dlen);
+	EVP_MD_CTX_free(ctx);
+
+	tx->job = job;
+	job_submit(job);
+}
+
+static void
+dkim_verify(struct dkim_tx *tx)
+{
+	struct dkim_sig	*sig = tx->sig;
+	struct dkim_key	*key;
+	struct job	*job;
+	char		 name[SMTPD_MAXHOSTNAMELEN];
+
+	if (sig->bhlen != tx->bhlen || memcmp(sig->bh, tx->bh, tx->bhlen)) {
+		tx->result = RES_FAIL;
+		tx->reason = "body hash did not verify";
+		dkim_finish(tx);
+		return;
+	}
+
+	if (snprintf(name, sizeof name, "%s._domainkey.%s", sig->s, sig->d)
+	    >= (int)sizeof name) {
+		tx->result = RES_PERMERROR;
+		tx->reason = "invalid key name";
+		dkim_finish(tx);
+		return;
+	}
+	lowercase(name, name, sizeof name);
+
+	if ((key = dict_get(&keys, name)) != NULL &&
+	    (key->status == KEY_PENDING || key->expire > time(NULL))) {
+		stats.key_hits++;
+		dkim_verify_key(tx, key);
+		return;
+	}
+	stats.key_misses++;
+
+	if (key == NULL) {
+		key = xcalloc(1, sizeof *key, "dkim_verify");
+		key->name = xstrdup(name, "dkim_verify");
+		TAILQ_INIT(&key->waiters);
+		dict_xset(&keys, name, key);
+	}
+	if (key->pkey) {
+		EVP_PKEY_free(key->pkey);
+		key->pkey = NULL;
+	}
+	key->status = KEY_PENDING;
+
+	job = xcalloc(1, sizeof *job, "dkim_verify");
+	job->type = JOB_DNS;
+	job->key = key;
+	job_submit(job);
+
+	dkim_verify_key(tx, key);
+}
+
+static void
+dkim_finish(struct dkim_tx *tx)
+{
+	struct dkim_sig	*sig = tx->sig;
+
+	if (tx->mode == MODE_VERIFY) {
+		stats.verified[tx->result]++;
+		log_info("info: session %016"PRIx64": dkim=%s d=%s s=%s%s%s",
+		    tx->id, dkim_results[tx->result], sig->d, sig->s,
+		    tx->reason ? " reason=" : "", tx->reason ? tx->reason : "");
+		filter_api_header_add(tx->id, "Authentication-Results",
+		    "%s; dkim=%s%s%s%s header.d=%s header.s=%s", authserv,
+		    dkim_results[tx->result], tx->reason ? " (" : "",
+		    tx->reason ? tx->reason : "", tx->reason ? ")" : "",
+		    sig->d, sig->s);
+	}
+	filter_api_data_buffered_stream(tx->id);
+}
+
+
+/*
+ * rfc2822 parser callbacks
+ */
+
+static void
+on_header(const struct rfc2822_header *hdr, void *arg)
+{
+	struct dkim_tx	*tx = arg;
+	struct dkim_hdr	*h;
+	char		*at, *end, *raw;
+	size_t		 len;
+
+	if (tx->overflow)
+		return;
+
+	if (tx->nhdr == tx->hvsize) {
+		tx->hvsize = tx->hvsize ? tx->hvsize * 2 : 32;
+		tx->hv = reallocarray(tx->hv, tx->hvsize, sizeof *tx->hv);
+		if (tx->hv == NULL)
+			fatal("on_header");
+	}
+	h = &tx->hv[tx->nhdr++];
+	h->name = xstrdup(hdr->name, "on_header");
+	h->off = tx->mark;
+	h->len = tx->hdrlen - tx->mark;
+	h->used = 0;
+	tx->mark = tx->hdrlen;
+
+	raw = tx->hdrs + h->off;
+	len = h->len;
+
+	if (!strcasecmp(hdr->name, "From") && tx->from == NULL) {
+		raw = xmalloc(len + 1, "on_header");
+		memcpy(raw, tx->hdrs + h->off, len);
+		raw[len] = '\0';
+		if ((at = strrchr(raw, '@')) != NULL) {
+			at++;
+			end = at + strcspn(at, "> \t\r\n;,");
+			*end = '\0';
+			tx->from = xstrdup(at, "on_header");
+			lowercase(tx->from, tx->from, strlen(tx->from) + 1);
+		}
+		free(raw);
+	}
+	else if (verify && tx->sig == NULL &&
+	    !strcasecmp(hdr->name, "DKIM-Signature")) {
+		if ((tx->sig = sig_parse(raw, len)) != NULL)
+			tx->sig->hdr = tx->nhdr - 1;
+	}
+}
+
+static void
+on_eoh(void *arg)
+{
+	struct dkim_tx	*tx = arg;
+
+	if (tx->overflow)
+		return;
+
+	if (tx->from && (tx->signer = dict_get(&signers, tx->from))) {
+		tx->mode = MODE_SIGN;
+		tx->bcanon = CANON_RELAXED;
+		tx->bleft = -1;
+	}
+	else if (tx->sig) {
+		tx->mode = MODE_VERIFY;
+		tx->bcanon = tx->sig->bcanon;
+		tx->bleft = tx->sig->l;
+	}
+	else
+		return;
+
+	if ((tx->bctx = EVP_MD_CTX_new()) == NULL ||
+	    EVP_DigestInit_ex(tx->bctx, EVP_sha256(), NULL) != 1)
+		fatalx("on_eoh: digest");
+}
+
+static void
+on_body(const char *line, void *arg)
+{
+	struct dkim_tx	*tx = arg;
+
+	/* the parser passes the empty line ending the headers along */
+	if (!tx->inbody) {
+		tx->inbody = 1;
+		return;
+	}
+	if (tx->mode != MODE_NONE)
+		body_update(tx, line);
+}
+
+
+/*
+ * filter callbacks
+ */
+
+static void *
+tx_alloc(uint64_t id)
+{
+	struct dkim_tx	*tx;
+
+	tx = xcalloc(1, sizeof *tx, "tx_alloc");
+	tx->id = id;
+	rfc2822_parser_init(&tx->parser);
+	rfc2822_parser_reset(&tx->parser);
+	rfc2822_header_default_callback(&tx->parser, on_header, tx);
+	rfc2822_eoh_callback(&tx->parser, on_eoh, tx);
+	rfc2822_body_callback(&tx->parser, on_body, tx);
+	tree_xset(&txs, id, tx);
+	return (tx);
+}
+
+static void
+tx_free(void *arg)
+{
+	struct dkim_tx	*tx = arg;
+	size_t		 i;
+
+	tree_xpop(&txs, tx->id);
+	if (tx->wkey)
+		TAILQ_REMOVE(&tx->wkey->waiters, tx, wentry);
+	rfc2822_parser_release(&tx->parser);
+	for (i = 0; i < tx->nhdr; i++)
+		free(tx->hv[i].name);
+	free(tx->hv);
+	free(tx->hdrs);
+	free(tx->from);
+	free(tx->sigvalue);
+	sig_free(tx->sig);
+	EVP_MD_CTX_free(tx->bctx);
+	free(tx);
+}
+
+static void
+on_msg_line(uint64_t id, const char *line)
+{
+	struct dkim_tx	*tx = filter_api_transaction(id);
+	size_t		 len;
+
+	if (!tx->parser.in_hdrs) {
+		rfc2822_parser_feed(&tx->parser, line);
+		return;
+	}
+
+	/* completes the previous header, see on_header() */
+	rfc2822_parser_feed(&tx->parser, line);
+	if (*line == '\0' || tx->overflow)
+		return;
+
+	/* keep the raw header block, simple canonicalization needs it */
+	len = strlen(line);
+	if (tx->hdrlen + len + 2 > DKIM_HDR_MAX) {
+		tx->overflow = 1;
+		return;
+	}
+	if (tx->hdrlen + len + 2 > tx->hdrsize) {
+		tx->hdrsize = tx->hdrsize ? tx->hdrsize * 2 : 4096;
+		while (tx->hdrlen + len + 2 > tx->hdrsize)
+			tx->hdrsize *= 2;
+		if ((tx->hdrs = realloc(tx->hdrs, tx->hdrsize)) == NULL)
+			fatal("on_msg_line");
+	}
+	memcpy(tx->hdrs + tx->hdrlen, line, len);
+	memcpy(tx->hdrs + tx->hdrlen + len, "\r\n", 2);
+	tx->hdrlen += len + 2;
+}
+
+static int
+on_msg_end(uint64_t id, size_t size)
+{
+	struct dkim_tx	*tx = filter_api_transaction(id);
+
+	if (tx->overflow)
+		tx->mode = MODE_NONE;
+
+	switch (tx->mode) {
+	case MODE_NONE:
+		dkim_finish(tx);
+		break;
+	case MODE_SIGN:
+		body_final(tx);
+		dkim_sign(tx);
+		break;
+	case MODE_VERIFY:
+		body_final(tx);
+		dkim_verify(tx);
+		break;
+	}
+	return (1);
+}
+
+static void
+key_purge(int fd, short event, void *arg)
+{
+	struct timeval	 tv;
+	struct dkim_key	*key;
+	const char	*name;
+	void		*iter;
+	time_t		 now = time(NULL);
+
+again:
+	iter = NULL;
+	while (dict_iter(&keys, &iter, &name, (void **)&key)) {
+		if (key->status == KEY_PENDING || key->expire > now)
+			continue;
+		dict_xpop(&keys, name);
+		EVP_PKEY_free(key->pkey);
+		free(key->name);
+		free(key);
+		goto again;
+	}
+
+	log_debug("debug: dkim: signed=%"PRIu64"/%"PRIu64" pass=%"PRIu64
+	    " fail=%"PRIu64" temperror=%"PRIu64" permerror=%"PRIu64
+	    " keys=%zu hits=%"PRIu64" misses=%"PRIu64,
+	    stats.signed_ok, stats.signed_ok + stats.sign_fail,
+	    stats.verified[RES_PASS], stats.verified[RES_FAIL],
+	    stats.verified[RES_TEMPERROR], stats.verified[RES_PERMERROR],
+	    dict_count(&keys), stats.key_hits, stats.key_misses);
+
+	tv.tv_sec = DKIM_PURGE_INTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_purge, &tv);
+}
+
+/*
+ * domain:selector:keyfile
+ */
+static void
+add_signer(char *spec)
+{
+	struct dkim_signer	*signer;
+	FILE			*fp;
+	char			*domain, *selector, *path;
+
+	domain = strsep(&spec, ":");
+	selector = strsep(&spec, ":");
+	path = spec;
+	if (domain == NULL || selector == NULL || path == NULL ||
+	    *domain == '\0' || *selector == '\0')
+		fatalx("invalid key specification");
+
+	signer = xcalloc(1, sizeof *signer, "add_signer");
+	signer->domain = xstrdup(domain, "add_signer");
+	lowercase(signer->domain, signer->domain, strlen(domain) + 1);
+	signer->selector = xstrdup(selector, "add_signer");
+
+	if ((fp = fopen(path, "r")) == NULL)
+		fatal("fopen: %s", path);
+	signer->pkey = PEM_read_PrivateKey(fp, NULL, NULL, NULL);
+	fclose(fp);
+	if (signer->pkey == NULL)
+		fatalx("%s: invalid private key", path);
+
+	switch (EVP_PKEY_base_id(signer->pkey)) {
+	case EVP_PKEY_RSA:
+		signer->algo = ALGO_RSA_SHA256;
+		break;
+#ifdef EVP_PKEY_ED25519
+	case EVP_PKEY_ED25519:
+		signer->algo = ALGO_ED25519_SHA256;
+		break;
+#endif
+	default:
+		fatalx("%s: unsupported key type", path);
+	}
+
+	if (dict_check(&signers, signer->domain))
+		fatalx("duplicate key for domain %s", signer->domain);
+	dict_xset(&signers, signer->domain, signer);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct timeval	 tv;
+	const char	*errstr;
+	int		 ch, d = 0, v = 0, nthreads = DKIM_THREADS;
+
+	log_init(1);
+
+	dict_init(&signers);
+	dict_init(&keys);
+	tree_init(&txs);
+
+	if (gethostname(authserv, sizeof authserv) == -1)
+		fatal("gethostname");
+
+	while ((ch = getopt(argc, argv, "dH:k:n:t:vV")) != -1) {
+		switch (ch) {
+		case 'd':
+			d = 1;
+			break;
+		case 'H':
+			sign_headers = optarg;
+			break;
+		case 'k':
+			add_signer(optarg);
+			break;
+		case 'n':
+			if (strlcpy(authserv, optarg, sizeof authserv)
+			    >= sizeof authserv)
+				fatalx("authserv-id too long");
+			break;
+		case 't':
+			nthreads = strtonum(optarg, 1, 256, &errstr);
+			if (errstr)
+				fatalx("thread count is %s: %s", errstr, optarg);
+			break;
+		case 'v':
+			v |= TRACE_DEBUG;
+			break;
+		case 'V':
+			verify = 1;
+			break;
+		default:
+			fatalx("bad option");
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc)
+		fatalx("bogus argument(s)");
+	if (dict_count(&signers) == 0 && !verify)
+		fatalx("neither signing keys nor verification configured");
+
+	log_init(d);
+	log_verbose(v);
+
+	log_debug("debug: starting...");
+
+	/* data is spooled to /tmp and keys are looked up in the DNS */
+	filter_api_no_chroot();
+	filter_api_data_buffered();
+
+	filter_api_transaction_allocator(tx_alloc);
+	filter_api_transaction_destructor(tx_free);
+	filter_api_on_msg_line(on_msg_line);
+	filter_api_on_msg_end(on_msg_end);
+
+	pool_init(nthreads);
+
+	evtimer_set(&ev_purge, key_purge, NULL);
+	tv.tv_sec = DKIM_PURGE_INTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_purge, &tv);
+
+	filter_api_loop();
+	log_debug("debug: exiting");
+
+	return 1;
+}
@@ -0,0 +1,592 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <ctype.h>
+#include <event.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <smtpd-api.h>
+
+#define	GREY_DELAY		300		/* 5 minutes */
+#define	GREY_EXPIRE		(4 * 3600)	/* 4 hours */
+#define	WHITE_EXPIRE		(36 * 86400)	/* 36 days */
+#define	GREY_SIZE		262144
+#define	GREY_INTERVAL		300
+#define	GREY_SWEEP_STEP		4096
+
+#define	GREY_MAGIC		0x47524c31	/* "GRL1" */
+
+enum grey_type {
+	GREY_PENDING,
+	GREY_PASSED,
+	GREY_WHITE,
+};
+
+/*
+ * Entries are keyed by a 64-bit fingerprint of the (network, sender,
+ * recipient) triplet, or of the (network, sender domain) pair for
+ * auto-whitelisted senders.  A zero fingerprint marks an empty slot.
+ */
+struct grey_entry {
+	uint64_t	fp;
+	uint32_t	first;
+	uint32_t	last;
+	uint16_t	type;
+	uint16_t	ref;
+	uint32_t	pass;
+};
+
+struct grey_snapshot_hdr {
+	uint32_t	magic;
+	uint32_t	entsize;
+	uint64_t	count;
+};
+
+struct grey_session {
+	int		skip;
+	uint64_t	net;
+	uint64_t	sender;
+	uint64_t	domain;
+};
+
+static struct grey {
+	struct grey_entry	*slots;
+	size_t			 mask;
+	size_t			 count;
+	size_t			 max;
+	size_t			 hand;
+} grey;
+
+static struct {
+	uint64_t	checks;
+	uint64_t	greylisted;
+	uint64_t	passed;
+	uint64_t	whitelisted;
+	uint64_t	expired;
+	uint64_t	evicted;
+} stats;
+
+static uint32_t		 grey_delay = GREY_DELAY;
+static uint32_t		 grey_expire = GREY_EXPIRE;
+static uint32_t		 white_expire = WHITE_EXPIRE;
+static uint32_t		 interval = GREY_INTERVAL;
+static const char	*snapshot;
+static pid_t		 snapshot_pid = -1;
+
+static struct event	 ev_sweep;
+static struct event	 ev_snapshot;
+
+static uint64_t
+grey_mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return (h);
+}
+
+static uint64_t
+grey_hash(const void *buf, size_t len, int lower)
+{
+	const unsigned char	*p = buf;
+	uint64_t		 h = 0xcbf29ce484222325ULL;
+	size_t			 i;
+
+	for (i = 0; i < len; i++) {
+		h ^= lower ? tolower(p[i]) : p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return (grey_mix(h));
+}
+
+static uint64_t
+grey_fp(uint64_t a, uint64_t b)
+{
+	uint64_t	fp;
+
+	fp = grey_mix(a ^ grey_mix(b + 0x9e3779b97f4a7c15ULL));
+	return (fp ? fp : 1);
+}
+
+static int
+grey_expired(struct grey_entry *e, uint32_t now)
+{
+	if (e->type == GREY_PENDING)
+		return (now - e->first > grey_expire);
+	return (now - e->last > white_expire);
+}
+
+static void
+grey_init(size_t max)
+{
+	size_t	nslots;
+
+	for (nslots = 1024; nslots < max + max / 3; nslots <<= 1)
+		;
+	grey.slots = xcalloc(nslots, sizeof *grey.slots, "grey_init");
+	grey.mask = nslots - 1;
+	grey.max = max;
+	grey.count = 0;
+	grey.hand = 0;
+}
+
+static struct grey_entry *
+grey_lookup(uint64_t fp)
+{
+	size_t	i;
+
+	for (i = fp & grey.mask; grey.slots[i].fp; i = (i + 1) & grey.mask)
+		if (grey.slots[i].fp == fp)
+			return (&grey.slots[i]);
+	return (NULL);
+}
+
+/*
+ * Linear probing with backward-shift deletion, so the table never
+ * accumulates tombstones.
+ */
+static void
+grey_delete(size_t i)
+{
+	size_t	j, k;
+
+	for (j = i;;) {
+		j = (j + 1) & grey.mask;
+		if (grey.slots[j].fp == 0)
+			break;
+		k = grey.slots[j].fp & grey.mask;
+		if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		grey.slots[i] = grey.slots[j];
+		i = j;
+	}
+	memset(&grey.slots[i], 0, sizeof grey.slots[i]);
+	grey.count--;
+}
+
+/*
+ * Advance the clock hand over at most n slots, dropping expired entries.
+ * When evict is set, stop at the first entry removed and treat entries
+ * whose reference bit is clear as victims.
+ */
+static int
+grey_sweep(size_t n, int evict, uint32_t now)
+{
+	struct grey_entry	*e;
+
+	while (n--) {
+		e = &grey.slots[grey.hand];
+		if (e->fp == 0)
+			goto next;
+		if (grey_expired(e, now)) {
+			stats.expired++;
+			grey_delete(grey.hand);
+			if (evict)
+				return (1);
+			/* an entry may have shifted into this slot */
+			continue;
+		}
+		if (evict) {
+			if (e->ref == 0) {
+				stats.evicted++;
+				grey_delete(grey.hand);
+				return (1);
+			}
+			e->ref = 0;
+		}
+	next:
+		grey.hand = (grey.hand + 1) & grey.mask;
+	}
+	return (0);
+}
+
+static struct grey_entry *
+grey_insert(uint64_t fp, enum grey_type type, uint32_t now)
+{
+	struct grey_entry	*e;
+	size_t			 i;
+
+	if ((e = grey_lookup(fp)) == NULL) {
+		if (grey.count >= grey.max)
+			grey_sweep(2 * (grey.mask + 1), 1, now);
+		for (i = fp & grey.mask; grey.slots[i].fp; i = (i + 1) & grey.mask)
+			;
+		e = &grey.slots[i];
+		grey.count++;
+	}
+	e->fp = fp;
+	e->first = now;
+	e->last = now;
+	e->type = type;
+	e->ref = 1;
+	e->pass = 0;
+	return (e);
+}
+
+static void
+grey_load(const char *path)
+{
+	struct grey_snapshot_hdr	 hdr;
+	struct grey_entry		 ent, *e;
+	FILE				*fp;
+	uint32_t			 now = time(NULL);
+	uint64_t			 n;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		log_debug("debug: greylist: no snapshot in %s", path);
+		return;
+	}
+	if (fread(&hdr, sizeof hdr, 1, fp) != 1 ||
+	    hdr.magic != GREY_MAGIC || hdr.entsize != sizeof ent) {
+		log_warnx("warn: greylist: ignoring invalid snapshot %s", path);
+		fclose(fp);
+		return;
+	}
+	for (n = 0; n < hdr.count && grey.count < grey.max; n++) {
+		if (fread(&ent, sizeof ent, 1, fp) != 1)
+			break;
+		if (ent.fp == 0 || grey_expired(&ent, now) || grey_lookup(ent.fp))
+			continue;
+		e = grey_insert(ent.fp, ent.type, now);
+		*e = ent;
+	}
+	fclose(fp);
+
+	log_info("info: greylist: loaded %zu entries from %s", grey.count, path);
+}
+
+static int
+grey_dump(const char *path)
+{
+	struct grey_snapshot_hdr	 hdr;
+	FILE				*fp;
+	char				 tmp[PATH_MAX];
+	size_t				 i;
+
+	if (snprintf(tmp, sizeof tmp, "%s.tmp", path) >= (int)sizeof tmp)
+		return (-1);
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		log_warn("warn: greylist: fopen: %s", tmp);
+		return (-1);
+	}
+
+	hdr.magic = GREY_MAGIC;
+	hdr.entsize = sizeof(struct grey_entry);
+	hdr.count = grey.count;
+	if (fwrite(&hdr, sizeof hdr, 1, fp) != 1)
+		goto fail;
+	for (i = 0; i <= grey.mask; i++) {
+		if (grey.slots[i].fp == 0)
+			continue;
+		if (fwrite(&grey.slots[i], sizeof grey.slots[i], 1, fp) != 1)
+			goto fail;
+	}
+	if (fflush(fp) != 0 || fsync(fileno(fp)) == -1)
+		goto fail;
+	if (fclose(fp) != 0) {
+		fp = NULL;
+		goto fail;
+	}
+	if (rename(tmp, path) == -1) {
+		log_warn("warn: greylist: rename: %s", path);
+		unlink(tmp);
+		return (-1);
+	}
+	return (0);
+
+fail:
+	log_warn("warn: greylist: write: %s", tmp);
+	if (fp)
+		fclose(fp);
+	unlink(tmp);
+	return (-1);
+}
+
+/*
+ * The snapshot is written by a forked child working on a copy-on-write
+ * image of the table, so the filter never blocks on disk I/O.
+ */
+static void
+grey_snapshot(int fd, short event, void *p)
+{
+	struct timeval	tv;
+	int		status;
+
+	log_info("info: greylist: entries=%zu/%zu checks=%"PRIu64
+	    " greylisted=%"PRIu64" passed=%"PRIu64" whitelisted=%"PRIu64
+	    " expired=%"PRIu64" evicted=%"PRIu64,
+	    grey.count, grey.max, stats.checks, stats.greylisted,
+	    stats.passed, stats.whitelisted, stats.expired, stats.evicted);
+
+	if (snapshot == NULL)
+		goto done;
+
+	if (snapshot_pid != -1) {
+		switch (waitpid(snapshot_pid, &status, WNOHANG)) {
+		case 0:
+			log_warnx("warn: greylist: previous snapshot still running");
+			goto done;
+		case -1:
+			log_warn("warn: greylist: waitpid");
+			break;
+		default:
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				log_warnx("warn: greylist: snapshot failed");
+		}
+		snapshot_pid = -1;
+	}
+
+	switch (snapshot_pid = fork()) {
+	case -1:
+		log_warn("warn: greylist: fork");
+		break;
+	case 0:
+		_exit(grey_dump(snapshot) == -1);
+	default:
+		break;
+	}
+
+done:
+	tv.tv_sec = interval;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_snapshot, &tv);
+}
+
+static void
+grey_sweep_timer(int fd, short event, void *p)
+{
+	struct timeval	tv;
+	size_t		n;
+
+	n = (grey.mask + 1) / 64;
+	if (n < GREY_SWEEP_STEP)
+		n = GREY_SWEEP_STEP;
+	grey_sweep(n, 0, time(NULL));
+
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_sweep, &tv);
+}
+
+static void *
+session_alloc(uint64_t id)
+{
+	return xcalloc(1, sizeof(struct grey_session), "session_alloc");
+}
+
+static void
+session_free(void *session)
+{
+	free(session);
+}
+
+static int
+on_connect(uint64_t id, struct filter_connect *conn)
+{
+	struct grey_session	*s = filter_api_session(id);
+	struct sockaddr_in	*sin;
+	struct sockaddr_in6	*sin6;
+	uint8_t			 net[8];
+
+	switch (conn->remote.ss_family) {
+	case AF_INET:
+		/* group IPv4 clients by /24 */
+		sin = (struct sockaddr_in *)&conn->remote;
+		memcpy(net, &sin->sin_addr, 3);
+		s->net = grey_hash(net, 3, 0);
+		break;
+	case AF_INET6:
+		/* group IPv6 clients by /64 */
+		sin6 = (struct sockaddr_in6 *)&conn->remote;
+		memcpy(net, &sin6->sin6_addr, 8);
+		s->net = grey_hash(net, 8, 0);
+		break;
+	default:
+		s->skip = 1;
+	}
+	return filter_api_accept(id);
+}
+
+static int
+on_mail(uint64_t id, struct mailaddr *mail)
+{
+	struct grey_session	*s = filter_api_session(id);
+	uint64_t		 user;
+
+	user = grey_hash(mail->user, strlen(mail->user), 1);
+	s->domain = grey_hash(mail->domain, strlen(mail->domain), 1);
+	s->sender = grey_fp(user, s->domain);
+	return filter_api_accept(id);
+}
+
+static int
+on_rcpt(uint64_t id, struct mailaddr *rcpt)
+{
+	struct grey_session	*s = filter_api_session(id);
+	struct grey_entry	*e;
+	uint64_t		 fp, wfp, r;
+	uint32_t		 now;
+
+	if (s->skip)
+		return filter_api_accept(id);
+
+	now = time(NULL);
+	stats.checks++;
+
+	wfp = grey_fp(s->net ^ 0x5745, s->domain);
+	if ((e = grey_lookup(wfp)) && !grey_expired(e, now)) {
+		e->last = now;
+		e->ref = 1;
+		e->pass++;
+		stats.whitelisted++;
+		return filter_api_accept(id);
+	}
+
+	r = grey_fp(grey_hash(rcpt->user, strlen(rcpt->user), 1),
+	    grey_hash(rcpt->domain, strlen(rcpt->domain), 1));
+	fp = grey_fp(grey_fp(s->net, s->sender), r);
+
+	e = grey_lookup(fp);
+	if (e == NULL || grey_expired(e, now)) {
+		grey_insert(fp, GREY_PENDING, now);
+		goto tempfail;
+	}
+
+	e->ref = 1;
+	e->last = now;
+	if (e->type == GREY_PENDING) {
+		if (now - e->first < grey_delay)
+			goto tempfail;
+		e->type = GREY_PASSED;
+		e->pass++;
+		/* sender retried: whitelist the network for its domain */
+		grey_insert(wfp, GREY_WHITE, now);
+	}
+	stats.passed++;
+	return filter_api_accept(id);
+
+tempfail:
+	stats.greylisted++;
+	log_debug("debug: session %016"PRIx64": greylisted", id);
+	return filter_api_reject_code(id, FILTER_FAIL, 451,
+	    "4.7.1 Greylisted, please try again later");
+}
+
+static uint32_t
+parse_seconds(const char *s, const char *what)
+{
+	const char	*errstr;
+	uint32_t	 n;
+
+	n = strtonum(s, 1, UINT32_MAX / 2, &errstr);
+	if (errstr)
+		fatalx("%s is %s: %s", what, errstr, s);
+	return (n);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct timeval	 tv;
+	const char	*errstr;
+	size_t		 size = GREY_SIZE;
+	int		 ch, d = 0, v = 0;
+
+	log_init(1);
+
+	while ((ch = getopt(argc, argv, "de:f:g:i:s:vw:")) != -1) {
+		switch (ch) {
+		case 'd':
+			d = 1;
+			break;
+		case 'e':
+			grey_expire = parse_seconds(optarg, "grey expiry");
+			break;
+		case 'f':
+			snapshot = optarg;
+			break;
+		case 'g':
+			grey_delay = parse_seconds(optarg, "grey delay");
+			break;
+		case 'i':
+			interval = parse_seconds(optarg, "snapshot interval");
+			break;
+		case 's':
+			size = strtonum(optarg, 1, SIZE_MAX / 2 / sizeof(struct grey_entry),
+			    &errstr);
+			if (errstr)
+				fatalx("table size is %s: %s", errstr, optarg);
+			break;
+		case 'v':
+			v |= TRACE_DEBUG;
+			break;
+		case 'w':
+			white_expire = parse_seconds(optarg, "white expiry");
+			break;
+		default:
+			fatalx("bad option");
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc)
+		fatalx("bogus argument(s)");
+
+	log_init(d);
+	log_verbose(v);
+
+	log_debug("debug: starting...");
+
+	grey_init(size);
+	if (snapshot) {
+		grey_load(snapshot);
+		filter_api_no_chroot();
+	}
+
+	filter_api_session_allocator(session_alloc);
+	filter_api_session_destructor(session_free);
+
+	filter_api_on_connect(on_connect);
+	filter_api_on_mail(on_mail);
+	filter_api_on_rcpt(on_rcpt);
+
+	evtimer_set(&ev_sweep, grey_sweep_timer, NULL);
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_sweep, &tv);
+
+	evtimer_set(&ev_snapshot, grey_snapshot, NULL);
+	tv.tv_sec = interval;
+	evtimer_add(&ev_snapshot, &tv);
+
+	filter_api_loop();
+	log_debug("debug: exiting");
+
+	return 1;
+}
@@ -0,0 +1,534 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <ctype.h>
+#include <event.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <smtpd-api.h>
+
+#define RATELIMIT_CONF	SMTPD_CONFDIR "/filter-ratelimit.conf"
+
+#define	RL_SHARDS	64
+#define	RL_SIZE		262144
+#define	RL_INTERVAL	300
+#define	RL_RULES_MAX	16
+#define	RL_SWEEP_BATCH	256
+
+enum rl_key {
+	RL_IP,
+	RL_NET,
+	RL_DOMAIN,
+	RL_KEY_MAX
+};
+
+enum rl_cmd {
+	RL_CONNECT,
+	RL_MAIL,
+	RL_RCPT,
+	RL_CMD_MAX
+};
+
+static const char *rl_keys[] = { "ip", "net", "domain" };
+static const char *rl_cmds[] = { "connect", "mail", "rcpt" };
+
+struct rule {
+	enum rl_key		 key;
+	enum rl_cmd		 cmd;
+	int			 id;		/* position among the cmd rules */
+	double			 burst;
+	double			 rate;		/* tokens per millisecond */
+	uint64_t		 throttled;
+	TAILQ_ENTRY(rule)	 entry;
+};
+
+TAILQ_HEAD(tq_rules, rule);
+
+/*
+ * Buckets are refilled lazily when they are used, so no per-bucket timer
+ * is needed.  A bucket that would be full again carries no information
+ * and is reclaimed by the sweeper.
+ */
+struct bucket {
+	double		tokens;
+	double		burst;
+	double		rate;
+	uint64_t	last;
+};
+
+struct rl_session {
+	int		skip;
+	int		throttled;
+	uint64_t	key[RL_KEY_MAX];
+};
+
+static struct tree	 shards[RL_SHARDS];
+static size_t		 nbuckets;
+static size_t		 maxbuckets = RL_SIZE;
+static size_t		 sweep_shard;
+
+static struct tq_rules	 rules[RL_CMD_MAX];
+static const char	*config = RATELIMIT_CONF;
+static uint32_t		 interval = RL_INTERVAL;
+
+static struct {
+	uint64_t	checks;
+	uint64_t	throttled;
+	uint64_t	sessions;
+	uint64_t	overflow;
+	uint64_t	reloads;
+} stats;
+
+static struct event	 ev_sweep;
+static struct event	 ev_stats;
+static struct event	 ev_sighup;
+
+static uint64_t
+rl_now(void)
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+	return ((uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000);
+}
+
+static uint64_t
+rl_hash(const void *buf, size_t len, uint64_t salt, int lower)
+{
+	const unsigned char	*p = buf;
+	uint64_t		 h = 0xcbf29ce484222325ULL ^ salt;
+	size_t			 i;
+
+	for (i = 0; i < len; i++) {
+		h ^= lower ? tolower(p[i]) : p[i];
+		h *= 0x100000001b3ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return (h);
+}
+
+static void
+bucket_refill(struct bucket *b, uint64_t now)
+{
+	if (now > b->last) {
+		b->tokens += (now - b->last) * b->rate;
+		if (b->tokens > b->burst)
+			b->tokens = b->burst;
+	}
+	b->last = now;
+}
+
+static struct bucket *
+bucket_get(uint64_t key, struct rule *r, uint64_t now)
+{
+	struct tree	*t = &shards[key % RL_SHARDS];
+	struct bucket	*b;
+
+	if ((b = tree_get(t, key)) != NULL) {
+		/* limits may have changed on reload */
+		b->burst = r->burst;
+		b->rate = r->rate;
+		bucket_refill(b, now);
+		return (b);
+	}
+
+	if (nbuckets >= maxbuckets) {
+		stats.overflow++;
+		return (NULL);
+	}
+
+	b = xcalloc(1, sizeof *b, "bucket_get");
+	b->tokens = r->burst;
+	b->burst = r->burst;
+	b->rate = r->rate;
+	b->last = now;
+	tree_xset(t, key, b);
+	nbuckets++;
+	return (b);
+}
+
+static void
+rl_sweep(int fd, short event, void *p)
+{
+	struct timeval	 tv;
+	struct tree	*t;
+	struct bucket	*b;
+	uint64_t	 key, idle[RL_SWEEP_BATCH], now = rl_now();
+	void		*iter;
+	size_t		 i, n;
+
+	t = &shards[sweep_shard];
+	sweep_shard = (sweep_shard + 1) % RL_SHARDS;
+
+	do {
+		n = 0;
+		iter = NULL;
+		while (n < RL_SWEEP_BATCH &&
+		    tree_iter(t, &iter, &key, (void **)&b)) {
+			bucket_refill(b, now);
+			if (b->tokens >= b->burst)
+				idle[n++] = key;
+		}
+		for (i = 0; i < n; i++) {
+			free(tree_xpop(t, idle[i]));
+			nbuckets--;
+		}
+	} while (n == RL_SWEEP_BATCH);
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 1000000 / RL_SHARDS * 10;
+	evtimer_add(&ev_sweep, &tv);
+}
+
+static void
+rl_stats(int fd, short event, void *p)
+{
+	struct timeval	 tv;
+	struct rule	*r;
+	int		 i;
+
+	log_info("info: ratelimit: buckets=%zu/%zu checks=%"PRIu64
+	    " throttled=%"PRIu64" sessions=%"PRIu64" overflow=%"PRIu64
+	    " reloads=%"PRIu64, nbuckets, maxbuckets, stats.checks,
+	    stats.throttled, stats.sessions, stats.overflow, stats.reloads);
+	for (i = 0; i < RL_CMD_MAX; i++)
+		TAILQ_FOREACH(r, &rules[i], entry)
+			log_info("info: ratelimit: %s %s: throttled=%"PRIu64,
+			    rl_keys[r->key], rl_cmds[r->cmd], r->throttled);
+
+	tv.tv_sec = interval;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_stats, &tv);
+}
+
+/*
+ * Every matching bucket must hold a token for the command to pass, and
+ * tokens are only taken once all of them have been checked.
+ */
+static int
+rl_check(uint64_t id, enum rl_cmd cmd)
+{
+	struct rl_session	*s = filter_api_session(id);
+	struct bucket		*b[RL_RULES_MAX];
+	struct rule		*r;
+	uint64_t		 now, key;
+	size_t			 i, n = 0;
+
+	if (s->skip || TAILQ_EMPTY(&rules[cmd]))
+		return filter_api_accept(id);
+
+	stats.checks++;
+	now = rl_now();
+
+	TAILQ_FOREACH(r, &rules[cmd], entry) {
+		/* each rule has its own buckets, even on the same key */
+		key = s->key[r->key] ^
+		    ((uint64_t)(r->cmd * RL_RULES_MAX + r->id) << 56);
+		if ((b[n] = bucket_get(key, r, now)) == NULL)
+			continue;
+		if (b[n]->tokens < 1.0) {
+			r->throttled++;
+			goto throttle;
+		}
+		n++;
+	}
+	for (i = 0; i < n; i++)
+		b[i]->tokens -= 1.0;
+	return filter_api_accept(id);
+
+throttle:
+	stats.throttled++;
+	if (!s->throttled) {
+		s->throttled = 1;
+		stats.sessions++;
+	}
+	log_debug("debug: session %016"PRIx64": throttled on %s",
+	    id, rl_cmds[cmd]);
+	return filter_api_reject_code(id, FILTER_FAIL, 451,
+	    "4.7.0 Rate limit exceeded, please try again later");
+}
+
+static void *
+session_alloc(uint64_t id)
+{
+	return xcalloc(1, sizeof(struct rl_session), "session_alloc");
+}
+
+static void
+session_free(void *session)
+{
+	free(session);
+}
+
+static int
+on_connect(uint64_t id, struct filter_connect *conn)
+{
+	struct rl_session	*s = filter_api_session(id);
+	struct sockaddr_in	*sin;
+	struct sockaddr_in6	*sin6;
+
+	switch (conn->remote.ss_family) {
+	case AF_INET:
+		sin = (struct sockaddr_in *)&conn->remote;
+		s->key[RL_IP] = rl_hash(&sin->sin_addr, 4, RL_IP, 0);
+		s->key[RL_NET] = rl_hash(&sin->sin_addr, 3, RL_NET, 0);
+		break;
+	case AF_INET6:
+		sin6 = (struct sockaddr_in6 *)&conn->remote;
+		s->key[RL_IP] = rl_hash(&sin6->sin6_addr, 16, RL_IP, 0);
+		s->key[RL_NET] = rl_hash(&sin6->sin6_addr, 8, RL_NET, 0);
+		break;
+	default:
+		s->skip = 1;
+	}
+	return rl_check(id, RL_CONNECT);
+}
+
+static int
+on_mail(uint64_t id, struct mailaddr *mail)
+{
+	struct rl_session	*s = filter_api_session(id);
+
+	s->key[RL_DOMAIN] = rl_hash(mail->domain, strlen(mail->domain),
+	    RL_DOMAIN, 1);
+	return rl_check(id, RL_MAIL);
+}
+
+static int
+on_rcpt(uint64_t id, struct mailaddr *rcpt)
+{
+	return rl_check(id, RL_RCPT);
+}
+
+static void
+free_rules(struct tq_rules *rs)
+{
+	struct rule	*r;
+	int		 i;
+
+	for (i = 0; i < RL_CMD_MAX; i++) {
+		while ((r = TAILQ_FIRST(&rs[i])) != NULL) {
+			TAILQ_REMOVE(&rs[i], r, entry);
+			free(r);
+		}
+	}
+}
+
+static int
+read_config(const char *path, struct tq_rules *rs)
+{
+	struct rule	*r;
+	FILE		*fp;
+	char		*line = NULL, *start, key[17], cmd[17];
+	ssize_t		 len;
+	size_t		 linelen = 0;
+	int		 n, i, k, c, lineno = 0, ret = -1;
+	int		 nrules[RL_CMD_MAX] = { 0 };
+	long long	 count, seconds, burst;
+
+	log_debug("info: config file is %s", path);
+
+	for (i = 0; i < RL_CMD_MAX; i++)
+		TAILQ_INIT(&rs[i]);
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		log_warn("warn: ratelimit: fopen: %s", path);
+		return (-1);
+	}
+
+	while ((len = getline(&line, &linelen, fp)) != -1) {
+		lineno += 1;
+		if (len)
+			len--;
+		for (start = line + len; start >= line && isspace((int)(*start)); start--)
+			*start = '\0';
+
+		for (start = line; *start && isspace((int)(*start)); start++)
+			;
+
+		if (*start == '\0')
+			continue;
+		if (*start == '#')
+			continue;
+
+		burst = 0;
+		n = sscanf(start, "limit %16s %lld/%lld on %16s burst %lld",
+		    key, &count, &seconds, cmd, &burst);
+		if (n < 4) {
+			log_warnx("warn: ratelimit: line %i: parse error", lineno);
+			goto end;
+		}
+
+		for (k = 0; k < RL_KEY_MAX; k++)
+			if (!strcmp(rl_keys[k], key))
+				break;
+		for (c = 0; c < RL_CMD_MAX; c++)
+			if (!strcmp(rl_cmds[c], cmd))
+				break;
+		if (k == RL_KEY_MAX || c == RL_CMD_MAX) {
+			log_warnx("warn: ratelimit: line %i: invalid key or command",
+			    lineno);
+			goto end;
+		}
+		if (k == RL_DOMAIN && c == RL_CONNECT) {
+			log_warnx("warn: ratelimit: line %i: domain limits apply to "
+			    "mail and rcpt only", lineno);
+			goto end;
+		}
+		if (count <= 0 || seconds <= 0 || burst < 0) {
+			log_warnx("warn: ratelimit: line %i: invalid limit", lineno);
+			goto end;
+		}
+
+		if (++nrules[c] > RL_RULES_MAX) {
+			log_warnx("warn: ratelimit: line %i: too many rules on %s",
+			    lineno, cmd);
+			goto end;
+		}
+
+		r = xcalloc(1, sizeof *r, "read_config: rule");
+		r->key = k;
+		r->cmd = c;
+		r->id = nrules[c] - 1;
+		r->burst = burst ? burst : count;
+		r->rate = (double)count / (seconds * 1000);
+		TAILQ_INSERT_TAIL(&rs[c], r, entry);
+	}
+
+	if (ferror(fp)) {
+		log_warn("warn: ratelimit: read: %s", path);
+		goto end;
+	}
+	ret = 0;
+
+end:
+	free(line);
+	fclose(fp);
+	if (ret == -1)
+		free_rules(rs);
+	return (ret);
+}
+
+static void
+rl_reload(int sig, short event, void *p)
+{
+	struct tq_rules	 rs[RL_CMD_MAX];
+	struct rule	*r;
+	int		 i;
+
+	log_info("info: ratelimit: reloading %s", config);
+	if (read_config(config, rs) == -1) {
+		log_warnx("warn: ratelimit: keeping previous configuration");
+		return;
+	}
+	free_rules(rules);
+	for (i = 0; i < RL_CMD_MAX; i++) {
+		while ((r = TAILQ_FIRST(&rs[i])) != NULL) {
+			TAILQ_REMOVE(&rs[i], r, entry);
+			TAILQ_INSERT_TAIL(&rules[i], r, entry);
+		}
+	}
+	stats.reloads++;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct timeval	 tv;
+	const char	*errstr;
+	int		 ch, d = 0, v = 0, i;
+
+	log_init(1);
+
+	while ((ch = getopt(argc, argv, "di:s:v")) != -1) {
+		switch (ch) {
+		case 'd':
+			d = 1;
+			break;
+		case 'i':
+			interval = strtonum(optarg, 1, 86400, &errstr);
+			if (errstr)
+				fatalx("stats interval is %s: %s", errstr, optarg);
+			break;
+		case 's':
+			maxbuckets = strtonum(optarg, 1, SIZE_MAX / 2, &errstr);
+			if (errstr)
+				fatalx("bucket count is %s: %s", errstr, optarg);
+			break;
+		case 'v':
+			v |= TRACE_DEBUG;
+			break;
+		default:
+			fatalx("bad option");
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1)
+		fatalx("bogus argument(s)");
+	if (argc == 1)
+		config = argv[0];
+
+	log_init(d);
+	log_verbose(v);
+
+	log_debug("debug: starting...");
+
+	if (read_config(config, rules) == -1)
+		fatalx("ratelimit: invalid configuration");
+	for (i = 0; i < RL_SHARDS; i++)
+		tree_init(&shards[i]);
+
+	/* the configuration must remain readable for reloads */
+	filter_api_no_chroot();
+
+	filter_api_session_allocator(session_alloc);
+	filter_api_session_destructor(session_free);
+
+	filter_api_on_connect(on_connect);
+	filter_api_on_mail(on_mail);
+	filter_api_on_rcpt(on_rcpt);
+
+	signal_set(&ev_sighup, SIGHUP, rl_reload, NULL);
+	signal_add(&ev_sighup, NULL);
+
+	evtimer_set(&ev_sweep, rl_sweep, NULL);
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	evtimer_add(&ev_sweep, &tv);
+
+	evtimer_set(&ev_stats, rl_stats, NULL);
+	tv.tv_sec = interval;
+	evtimer_add(&ev_stats, &tv);
+
+	filter_api_loop();
+	log_debug("debug: exiting");
+
+	return 1;
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Run the filter checks against configurations, without smtpd.  The
+ * filter API is replaced by stubs that record the verdicts.
+ */
+
+#define main	filter_ratelimit_main
+#include "filter_ratelimit.c"
+#undef main
+
+#include <err.h>
+
+static struct rl_session	 session;
+static int			 accepted;
+static int			 failed;
+
+void *
+filter_api_session(uint64_t id)
+{
+	return (&session);
+}
+
+int
+filter_api_accept(uint64_t id)
+{
+	accepted++;
+	return (1);
+}
+
+int
+filter_api_reject_code(uint64_t id, enum filter_status status, uint32_t code,
+    const char *line)
+{
+	return (0);
+}
+
+void filter_api_session_allocator(void *(*cb)(uint64_t)) { }
+void filter_api_session_destructor(void (*cb)(void *)) { }
+void filter_api_no_chroot(void) { }
+void filter_api_on_connect(int (*cb)(uint64_t, struct filter_connect *)) { }
+void filter_api_on_mail(int (*cb)(uint64_t, struct mailaddr *)) { }
+void filter_api_on_rcpt(int (*cb)(uint64_t, struct mailaddr *)) { }
+void filter_api_loop(void) { }
+
+static void
+load(const char *conf)
+{
+	char		 path[] = "/tmp/ratelimit_check.XXXXXXXXXX";
+	struct bucket	*b;
+	FILE		*fp;
+	int		 fd, i;
+
+	if ((fd = mkstemp(path)) == -1 || (fp = fdopen(fd, "w")) == NULL)
+		err(1, "mkstemp");
+	fputs(conf, fp);
+	fclose(fp);
+
+	free_rules(rules);
+	if (read_config(path, rules) == -1)
+		errx(1, "invalid configuration:\n%s", conf);
+	unlink(path);
+
+	/* each configuration starts with fresh buckets */
+	for (i = 0; i < RL_SHARDS; i++)
+		while (tree_poproot(&shards[i], NULL, (void **)&b))
+			free(b);
+	nbuckets = 0;
+}
+
+/*
+ * Open a session from 192.0.2.1 and send rcpt commands until one is
+ * throttled.  Returns the number of accepted rcpt.
+ */
+static int
+rcpts(int max)
+{
+	struct filter_connect	 conn;
+	struct sockaddr_in	*sin = (struct sockaddr_in *)&conn.remote;
+	struct mailaddr		 addr;
+	int			 n;
+
+	memset(&session, 0, sizeof session);
+	memset(&conn, 0, sizeof conn);
+	memset(&addr, 0, sizeof addr);
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(0xc0000201);
+	on_connect(1, &conn);
+	(void)strlcpy(addr.domain, "example.org", sizeof addr.domain);
+	on_mail(1, &addr);
+
+	for (n = 0; n < max; n++) {
+		accepted = 0;
+		on_rcpt(1, &addr);
+		if (!accepted)
+			break;
+	}
+	return (n);
+}
+
+static void
+check(const char *what, const char *conf, int want)
+{
+	int	got;
+
+	load(conf);
+	got = rcpts(want * 2 + 1);
+	if (got == want)
+		printf("ok      %s\n", what);
+	else {
+		printf("FAIL    %s: %d rcpt accepted, expected %d\n", what, got,
+		    want);
+		failed = 1;
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	int	i;
+
+	log_init(1);
+	for (i = 0; i < RL_CMD_MAX; i++)
+		TAILQ_INIT(&rules[i]);
+	for (i = 0; i < RL_SHARDS; i++)
+		tree_init(&shards[i]);
+
+	check("single rule",
+	    "limit ip 10/60 on rcpt\n", 10);
+	check("short period first",
+	    "limit ip 10/60 on rcpt\n"
+	    "limit ip 1000/3600 on rcpt\n", 10);
+	check("long period first",
+	    "limit ip 1000/3600 on rcpt burst 5\n"
+	    "limit ip 10/60 on rcpt\n", 5);
+	check("same key on another command",
+	    "limit ip 3/60 on mail\n"
+	    "limit ip 10/60 on rcpt\n", 10);
+	check("ip and net",
+	    "limit net 16/60 on rcpt\n"
+	    "limit ip 10/60 on rcpt\n"
+	    "limit net 1000/3600 on rcpt\n", 10);
+
+	return (failed);
+}
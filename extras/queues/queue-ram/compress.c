@@ -0,0 +1,331 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_QUEUE_RAM_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_QUEUE_RAM_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+#ifdef HAVE_QUEUE_RAM_ZLIB
+#include <zlib.h>
+#endif
+
+#include <smtpd-api.h>
+
+#include "compress.h"
+
+#define COMPRESS_DICTSIZE	(112 * 1024)	/* as zstd --train */
+
+static const struct {
+	const char	*name;
+	int		 id;
+	int		 level;		/* default */
+	int		 minlevel;
+	int		 maxlevel;
+} codecs[] = {
+	{ "none",	COMPRESS_NONE,	0,	0,	0 },
+#ifdef HAVE_QUEUE_RAM_LZ4
+	{ "lz4",	COMPRESS_LZ4,	1,	1,	65537 },	/* acceleration */
+#endif
+#ifdef HAVE_QUEUE_RAM_ZSTD
+	{ "zstd",	COMPRESS_ZSTD,	3,	1,	22 },
+#endif
+#ifdef HAVE_QUEUE_RAM_ZLIB
+	{ "zlib",	COMPRESS_ZLIB,	1,	1,	9 },
+#endif
+};
+
+#ifdef HAVE_QUEUE_RAM_ZSTD
+static ZSTD_CCtx	*cctx;
+static ZSTD_DCtx	*dctx;
+static ZSTD_CDict	*cdict;
+static ZSTD_DDict	*ddict;
+#endif
+
+int
+compress_find(const char *name)
+{
+	size_t	i;
+
+	for (i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++)
+		if (strcmp(codecs[i].name, name) == 0)
+			return (codecs[i].id);
+	return (-1);
+}
+
+const char *
+compress_name(int id)
+{
+	size_t	i;
+
+	for (i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++)
+		if (codecs[i].id == id)
+			return (codecs[i].name);
+	return ("unknown");
+}
+
+int
+compress_level(int id)
+{
+	size_t	i;
+
+	for (i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++)
+		if (codecs[i].id == id)
+			return (codecs[i].level);
+	return (0);
+}
+
+/*
+ * Check a level given for a codec, the lz4 acceleration being its level.
+ */
+void
+compress_check_level(int id, int level)
+{
+	size_t	i;
+
+	for (i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++)
+		if (codecs[i].id == id)
+			break;
+	if (i == sizeof(codecs) / sizeof(codecs[0]))
+		fatalx("unknown compression %d", id);
+	if (codecs[i].maxlevel == 0)
+		fatalx("%s takes no compression level", codecs[i].name);
+	if (level < codecs[i].minlevel || level > codecs[i].maxlevel)
+		fatalx("%s compression level must be between %d and %d: %d",
+		    codecs[i].name, codecs[i].minlevel, codecs[i].maxlevel,
+		    level);
+}
+
+/*
+ * Load a zstd dictionary, trained on a sample of the mail with
+ * compress_train() or zstd --train.  Bodies are then compressed with it.
+ */
+int
+compress_dictionary(const char *path, int level)
+{
+#ifdef HAVE_QUEUE_RAM_ZSTD
+	struct stat	 sb;
+	FILE		*fp;
+	char		*buf;
+	int		 ret = 0;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		log_warn("warn: compress: %s", path);
+		return (0);
+	}
+	if (fstat(fileno(fp), &sb) == -1) {
+		log_warn("warn: compress: %s", path);
+		fclose(fp);
+		return (0);
+	}
+	if ((buf = malloc(sb.st_size)) == NULL) {
+		log_warn("warn: compress: malloc");
+		fclose(fp);
+		return (0);
+	}
+	if (fread(buf, 1, sb.st_size, fp) != (size_t)sb.st_size)
+		log_warnx("warn: compress: %s: short read", path);
+	else if ((cdict = ZSTD_createCDict(buf, sb.st_size, level)) == NULL ||
+	    (ddict = ZSTD_createDDict(buf, sb.st_size)) == NULL)
+		log_warnx("warn: compress: %s: bad dictionary", path);
+	else
+		ret = 1;
+	free(buf);
+	fclose(fp);
+	return (ret);
+#else
+	log_warnx("warn: compress: dictionaries need zstd");
+	return (0);
+#endif
+}
+
+/* train a zstd dictionary on the samples and save it to path */
+int
+compress_train(const char *path, char **samples, size_t *sizes, size_t n)
+{
+#ifdef HAVE_QUEUE_RAM_ZSTD
+	FILE	*fp;
+	char	*all, *dict;
+	size_t	 i, total, len;
+	int	 ret = 0;
+
+	for (total = 0, i = 0; i < n; i++)
+		total += sizes[i];
+	all = malloc(total);
+	dict = malloc(COMPRESS_DICTSIZE);
+	if (all == NULL || dict == NULL) {
+		log_warn("warn: compress: malloc");
+		free(all);
+		free(dict);
+		return (0);
+	}
+	for (total = 0, i = 0; i < n; i++) {
+		memcpy(all + total, samples[i], sizes[i]);
+		total += sizes[i];
+	}
+
+	len = ZDICT_trainFromBuffer(dict, COMPRESS_DICTSIZE, all, sizes, n);
+	if (ZDICT_isError(len))
+		log_warnx("warn: compress: training: %s",
+		    ZDICT_getErrorName(len));
+	else if ((fp = fopen(path, "w")) == NULL)
+		log_warn("warn: compress: %s", path);
+	else {
+		if (fwrite(dict, 1, len, fp) != len || fclose(fp) == EOF)
+			log_warn("warn: compress: %s", path);
+		else
+			ret = 1;
+	}
+	free(all);
+	free(dict);
+	return (ret);
+#else
+	log_warnx("warn: compress: dictionaries need zstd");
+	return (0);
+#endif
+}
+
+/*
+ * Return a compressed copy of buf, or NULL when it is not smaller.  The
+ * copy is shrunk to its size, as it is kept for the life of the message.
+ */
+char *
+compress_body(int id, int level, const char *buf, size_t len, size_t *outlen)
+{
+	char	*out, *tmp;
+	size_t	 bound, n = 0;
+
+	switch (id) {
+#ifdef HAVE_QUEUE_RAM_LZ4
+	case COMPRESS_LZ4:
+		if (len > LZ4_MAX_INPUT_SIZE)
+			return (NULL);
+		bound = LZ4_compressBound(len);
+		break;
+#endif
+#ifdef HAVE_QUEUE_RAM_ZSTD
+	case COMPRESS_ZSTD:
+		bound = ZSTD_compressBound(len);
+		break;
+#endif
+#ifdef HAVE_QUEUE_RAM_ZLIB
+	case COMPRESS_ZLIB:
+		bound = compressBound(len);
+		break;
+#endif
+	default:
+		return (NULL);
+	}
+
+	if ((out = malloc(bound)) == NULL) {
+		log_warn("warn: compress: malloc");
+		return (NULL);
+	}
+
+	switch (id) {
+#ifdef HAVE_QUEUE_RAM_LZ4
+	case COMPRESS_LZ4: {
+		int	r;
+
+		r = LZ4_compress_fast(buf, out, len, bound, level);
+		n = r > 0 ? (size_t)r : len;
+		break;
+	}
+#endif
+#ifdef HAVE_QUEUE_RAM_ZSTD
+	case COMPRESS_ZSTD:
+		if (cctx == NULL && (cctx = ZSTD_createCCtx()) == NULL)
+			n = len;
+		else if (cdict)
+			n = ZSTD_compress_usingCDict(cctx, out, bound, buf, len,
+			    cdict);
+		else
+			n = ZSTD_compressCCtx(cctx, out, bound, buf, len, level);
+		if (ZSTD_isError(n))
+			n = len;
+		break;
+#endif
+#ifdef HAVE_QUEUE_RAM_ZLIB
+	case COMPRESS_ZLIB: {
+		uLongf	dlen = bound;
+
+		if (compress2((Bytef *)out, &dlen, (const Bytef *)buf, len,
+		    level) == Z_OK)
+			n = dlen;
+		else
+			n = len;
+		break;
+	}
+#endif
+	}
+
+	if (n >= len) {
+		free(out);
+		return (NULL);
+	}
+	if ((tmp = realloc(out, n)) != NULL)
+		out = tmp;
+	*outlen = n;
+	return (out);
+}
+
+/* decompress into out, which holds exactly the original content */
+int
+decompress_body(int id, const char *in, size_t inlen, char *out,
+    size_t outlen)
+{
+	switch (id) {
+#ifdef HAVE_QUEUE_RAM_LZ4
+	case COMPRESS_LZ4:
+		return (LZ4_decompress_safe(in, out, inlen, outlen) ==
+		    (int)outlen);
+#endif
+#ifdef HAVE_QUEUE_RAM_ZSTD
+	case COMPRESS_ZSTD: {
+		size_t	n;
+
+		if (dctx == NULL && (dctx = ZSTD_createDCtx()) == NULL)
+			return (0);
+		if (ddict)
+			n = ZSTD_decompress_usingDDict(dctx, out, outlen, in,
+			    inlen, ddict);
+		else
+			n = ZSTD_decompressDCtx(dctx, out, outlen, in, inlen);
+		return (!ZSTD_isError(n) && n == outlen);
+	}
+#endif
+#ifdef HAVE_QUEUE_RAM_ZLIB
+	case COMPRESS_ZLIB: {
+		uLongf	dlen = outlen;
+
+		return (uncompress((Bytef *)out, &dlen, (const Bytef *)in,
+		    inlen) == Z_OK && dlen == outlen);
+	}
+#endif
+	}
+	return (0);
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* encodings of a stored body, 0 being the raw content */
+enum {
+	COMPRESS_NONE,
+	COMPRESS_LZ4,
+	COMPRESS_ZSTD,
+	COMPRESS_ZLIB,
+};
+
+int compress_find(const char *);
+const char *compress_name(int);
+int compress_level(int);
+void compress_check_level(int, int);
+int compress_dictionary(const char *, int);
+int compress_train(const char *, char **, size_t *, size_t);
+char *compress_body(int, int, const char *, size_t, size_t *);
+int decompress_body(int, const char *, size_t, char *, size_t);
@@ -17,6 +17,7 @@
 #include "includes.h"
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <fcntl.h>
@@ -27,21 +28,45 @@
 
 #include <smtpd-api.h>
 
+#include "compress.h"
+
 #define stat_increment(a, b)	do {} while(0)
 #define stat_decrement(a, b)	do {} while(0)
 
+/* commits between two stats logs */
+#define QR_STATS_EVERY		1000
+
 struct qr_envelope {
 	char		*buf;
 	size_t		 len;
 };
 
 struct qr_message {
-	char		*buf;
-	size_t		 len;
-	struct tree	 envelopes;
+	struct dedup_body	*body;
+	struct tree		 envelopes;
 };
 
 static struct tree messages;
+static struct dedup bodies;
+
+static int	compression = COMPRESS_NONE;
+static int	level;
+static size_t	minsize = 1024;	/* smaller bodies are kept raw */
+
+static uint64_t	compressed;
+static uint64_t	compressed_in;
+static uint64_t	compressed_out;
+
+static void
+queue_ram_stats(void)
+{
+	dedup_log(&bodies, "queue-ram");
+	if (compression != COMPRESS_NONE)
+		log_info("info: queue-ram: %llu bodies compressed with %s, "
+		    "ratio %.2f", (unsigned long long)compressed,
+		    compress_name(compression), compressed_out ?
+		    (double)compressed_in / compressed_out : 1.0);
+}
 
 static struct qr_message *
 get_message(uint32_t msgid)
@@ -53,6 +78,24 @@ get_message(uint32_t msgid)
 	return msg;
 }
 
+static void
+message_free(struct qr_message *msg)
+{
+	struct qr_envelope	*evp;
+	uint64_t		 evpid;
+
+	while (tree_poproot(&msg->envelopes, &evpid, (void**)&evp)) {
+		stat_decrement("queue.ram.envelope.size", evp->len);
+		free(evp->buf);
+		free(evp);
+	}
+	if (msg->body) {
+		stat_decrement("queue.ram.message.size", msg->body->len);
+		dedup_release(&bodies, msg->body);
+	}
+	free(msg);
+}
+
 static int
 queue_ram_message_create(uint32_t *msgid)
 {
@@ -78,69 +121,88 @@ static int
 queue_ram_message_commit(uint32_t msgid, const char *path)
 {
 	struct qr_message	*msg;
-	struct stat		 sb;
-	size_t			 n;
-	FILE			*f;
-	int			 ret;
+	struct dedup_body	*body;
+	int			 fd;
 
 	if ((msg = tree_get(&messages, msgid)) == NULL) {
 		log_warnx("warn: msgid not found");
 		return 0;
 	}
 
-	if ((f = fopen(path, "rb")) == NULL) {
-		log_warn("warn: fopen: \"%s\"", path);
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		log_warn("warn: open: \"%s\"", path);
 		return 0;
 	}
-	if (fstat(fileno(f), &sb) == -1) {
-		log_warn("warn: fstat");
-		fclose(f);
+	body = dedup_load(&bodies, fd);
+	close(fd);
+	if (body == NULL)
 		return 0;
-	}
 
-	msg->len = sb.st_size;
-	msg->buf = malloc(msg->len);
-	if (msg->buf == NULL) {
-		log_warn("warn: malloc");
-		fclose(f);
-		return 0;
+	/* a new body, not one shared with messages already queued */
+	if (body->refs == 1 && compression != COMPRESS_NONE &&
+	    body->len >= minsize && body->len > 0) {
+		char	*buf;
+		size_t	 size;
+
+		buf = compress_body(compression, level, body->buf, body->len,
+		    &size);
+		if (buf) {
+			compressed++;
+			compressed_in += body->len;
+			compressed_out += size;
+			dedup_replace(&bodies, body, buf, size, compression);
+		}
 	}
 
-	ret = 0;
-	n = fread(msg->buf, 1, msg->len, f);
-	if (ferror(f))
-		log_warn("warn: fread");
-	else if ((off_t)n != sb.st_size)
-		log_warnx("warn: bad read");
-	else {
-		ret = 1;
-		stat_increment("queue.ram.message.size", msg->len);
+	if (msg->body) {
+		stat_decrement("queue.ram.message.size", msg->body->len);
+		dedup_release(&bodies, msg->body);
 	}
-	fclose(f);
+	msg->body = body;
+	stat_increment("queue.ram.message.size", body->len);
 
-	return ret;
+	if (bodies.loads % QR_STATS_EVERY == 0)
+		queue_ram_stats();
+
+	return 1;
 }
 
 static int
 queue_ram_message_delete(uint32_t msgid)
 {
 	struct qr_message	*msg;
-	struct qr_envelope	*evp;
-	uint64_t		 evpid;
 
 	if ((msg = tree_pop(&messages, msgid)) == NULL) {
 		log_warnx("warn: not found");
 		return 0;
 	}
-	while (tree_poproot(&messages, &evpid, (void**)&evp)) {
-		stat_decrement("queue.ram.envelope.size", evp->len);
-		free(evp->buf);
-		free(evp);
+	message_free(msg);
+	return 1;
+}
+
+/* decompress the body straight into the pages of the file */
+static int
+message_inflate(struct dedup_body *body, int fd)
+{
+	void	*p;
+	int	 ret;
+
+	if (ftruncate(fd, body->len) == -1) {
+		log_warn("warn: ftruncate");
+		return 0;
 	}
-	stat_decrement("queue.ram.message.size", msg->len);
-	free(msg->buf);
-	free(msg);
-	return 0;
+	p = mmap(NULL, body->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		log_warn("warn: mmap");
+		return 0;
+	}
+	ret = decompress_body(body->encoding, body->buf, body->size, p,
+	    body->len);
+	if (!ret)
+		log_warnx("warn: corrupted %s body",
+		    compress_name(body->encoding));
+	munmap(p, body->len);
+	return ret;
 }
 
 static int
@@ -155,6 +217,10 @@ queue_ram_message_fd_r(uint32_t msgid)
 		log_warnx("warn: not found");
 		return -1;
 	}
+	if (msg->body == NULL) {
+		log_warnx("warn: not committed");
+		return -1;
+	}
 
 	fd = mktmpfile();
 	if (fd == -1) {
@@ -175,8 +241,17 @@ queue_ram_message_fd_r(uint32_t msgid)
 		close(fd2);
 		return -1;
 	}
-	n = fwrite(msg->buf, 1, msg->len, f);
-	if (n != msg->len) {
+	if (msg->body->encoding != COMPRESS_NONE) {
+		fclose(f);
+		if (!message_inflate(msg->body, fd)) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	n = fwrite(msg->body->buf, 1, msg->body->len, f);
+	if (n != msg->body->len) {
 		log_warn("warn: write");
 		close(fd);
 		fclose(f);
@@ -248,9 +323,7 @@ queue_ram_envelope_delete(uint64_t evpid)
 	free(evp);
 	if (tree_empty(&msg->envelopes)) {
 		tree_xpop(&messages, evpid_to_msgid(evpid));
-		stat_decrement("queue.ram.message.size", msg->len);
-		free(msg->buf);
-		free(msg);
+		message_free(msg);
 	}
 	return 1;
 }
@@ -316,11 +389,20 @@ queue_ram_message_walk(uint64_t *evpid, char *buf, size_t len,
 	return -1;
 }
 
+static int
+queue_ram_close(void)
+{
+	queue_ram_stats();
+	return 1;
+}
+
 static int
 queue_ram_init(int server)
 {
 	tree_init(&messages);
+	dedup_init(&bodies);
 
+	queue_api_on_close(queue_ram_close);
 	queue_api_on_message_create(queue_ram_message_create);
 	queue_api_on_message_commit(queue_ram_message_commit);
 	queue_api_on_message_delete(queue_ram_message_delete);
@@ -340,12 +422,32 @@ queue_ram_init(int server)
 int
 main(int argc, char **argv)
 {
-	int ch;
+	const char	*errstr, *dictionary = NULL;
+	int		 ch;
 
 	log_init(1);
 
-	while ((ch = getopt(argc, argv, "")) != -1) {
+	level = -1;
+	while ((ch = getopt(argc, argv, "c:D:l:m:")) != -1) {
 		switch (ch) {
+		case 'c':
+			if ((compression = compress_find(optarg)) == -1)
+				fatalx("unsupported compression: %s", optarg);
+			break;
+		case 'D':
+			dictionary = optarg;
+			break;
+		case 'l':
+			level = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr)
+				fatalx("compression level is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'm':
+			minsize = strtonum(optarg, 0, INT_MAX, &errstr);
+			if (errstr)
+				fatalx("minimum size is %s: %s", errstr, optarg);
+			break;
 		default:
 			fatalx("bad option");
 			/* NOTREACHED */
@@ -354,6 +456,17 @@ main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
+	if (level == -1)
+		level = compress_level(compression);
+	else
+		compress_check_level(compression, level);
+	if (dictionary) {
+		if (compression != COMPRESS_ZSTD)
+			fatalx("a dictionary needs zstd compression");
+		if (!compress_dictionary(dictionary, level))
+			fatalx("cannot load dictionary %s", dictionary);
+	}
+
 	queue_ram_init(1);
 	queue_api_dispatch();
 
@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Measure the compression ratio and the CPU spent per message by the
+ * codecs queue-ram can store bodies with, on a sample of mail given as
+ * files or directories of files, a maildir for example.
+ *
+ *	queue-ram-bench [-D dictionary | -t dictionary] [-m minsize]
+ *	    [-n rounds] path ...
+ *
+ * With -t, a zstd dictionary is trained on the sample and saved, to be
+ * given to queue-ram with -D.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <smtpd-api.h>
+
+#include "compress.h"
+
+static char	**bodies;
+static size_t	 *sizes;
+static size_t	  nbodies;
+
+static const struct {
+	const char	*codec;
+	int		 level;
+} runs[] = {
+	{ "lz4",	1 },
+	{ "lz4",	8 },
+	{ "zstd",	1 },
+	{ "zstd",	3 },
+	{ "zstd",	9 },
+	{ "zlib",	1 },
+	{ "zlib",	6 },
+};
+
+static double
+elapsed(struct timespec *t0)
+{
+	struct timespec	t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+static void
+load_file(const char *path, size_t minsize)
+{
+	struct stat	 sb;
+	FILE		*fp;
+	char		*buf;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		warn("%s", path);
+		return;
+	}
+	if (fstat(fileno(fp), &sb) == -1)
+		err(1, "%s", path);
+	if (!S_ISREG(sb.st_mode) || (size_t)sb.st_size < minsize ||
+	    sb.st_size == 0) {
+		fclose(fp);
+		return;
+	}
+	if ((buf = malloc(sb.st_size)) == NULL)
+		err(1, "malloc");
+	if (fread(buf, 1, sb.st_size, fp) != (size_t)sb.st_size)
+		errx(1, "%s: short read", path);
+	fclose(fp);
+
+	bodies = reallocarray(bodies, nbodies + 1, sizeof(*bodies));
+	sizes = reallocarray(sizes, nbodies + 1, sizeof(*sizes));
+	if (bodies == NULL || sizes == NULL)
+		err(1, "reallocarray");
+	bodies[nbodies] = buf;
+	sizes[nbodies] = sb.st_size;
+	nbodies++;
+}
+
+static void
+load(const char *path, size_t minsize)
+{
+	struct dirent	*dp;
+	struct stat	 sb;
+	DIR		*d;
+	char		 file[PATH_MAX];
+
+	if (stat(path, &sb) == -1)
+		err(1, "%s", path);
+	if (!S_ISDIR(sb.st_mode)) {
+		load_file(path, minsize);
+		return;
+	}
+	if ((d = opendir(path)) == NULL)
+		err(1, "%s", path);
+	while ((dp = readdir(d)) != NULL) {
+		if (dp->d_name[0] == '.')
+			continue;
+		(void)snprintf(file, sizeof(file), "%s/%s", path, dp->d_name);
+		load_file(file, minsize);
+	}
+	closedir(d);
+}
+
+static void
+run(const char *name, int id, int level, size_t rounds)
+{
+	struct timespec	 t0;
+	char		*out, **packed;
+	size_t		*psizes, i, r, in = 0, stored = 0, raw = 0;
+	double		 tc, td;
+
+	packed = calloc(nbodies, sizeof(*packed));
+	psizes = calloc(nbodies, sizeof(*psizes));
+	if (packed == NULL || psizes == NULL)
+		err(1, "calloc");
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < nbodies; i++) {
+			free(packed[i]);
+			packed[i] = compress_body(id, level, bodies[i],
+			    sizes[i], &psizes[i]);
+		}
+	tc = elapsed(&t0);
+
+	for (i = 0; i < nbodies; i++) {
+		in += sizes[i];
+		if (packed[i])
+			stored += psizes[i];
+		else {
+			stored += sizes[i];
+			raw++;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < nbodies; i++) {
+			if (packed[i] == NULL)
+				continue;
+			if ((out = malloc(sizes[i])) == NULL)
+				err(1, "malloc");
+			if (!decompress_body(id, packed[i], psizes[i], out,
+			    sizes[i]) || memcmp(out, bodies[i], sizes[i]) != 0)
+				errx(1, "%s: body %zu does not round-trip",
+				    name, i);
+			free(out);
+		}
+	td = elapsed(&t0);
+
+	printf("%-10s %5d %7.2f %10.1f %10.1f %9.1f %9.1f %6zu\n", name,
+	    level, stored ? (double)in / stored : 1.0,
+	    tc * 1e6 / (rounds * nbodies), td * 1e6 / (rounds * nbodies),
+	    in * rounds / tc / 1e6, in * rounds / td / 1e6, raw);
+
+	for (i = 0; i < nbodies; i++)
+		free(packed[i]);
+	free(packed);
+	free(psizes);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: queue-ram-bench [-D dictionary | "
+	    "-t dictionary] [-m minsize] [-n rounds] path ...\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char	*errstr, *dictionary = NULL, *train = NULL;
+	size_t		 i, total, minsize = 1024, rounds = 3;
+	int		 ch, id;
+
+	log_init(1);
+
+	while ((ch = getopt(argc, argv, "D:m:n:t:")) != -1) {
+		switch (ch) {
+		case 'D':
+			dictionary = optarg;
+			break;
+		case 'm':
+			minsize = strtonum(optarg, 0, INT_MAX, &errstr);
+			if (errstr)
+				errx(1, "minimum size is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'n':
+			rounds = strtonum(optarg, 1, 1000, &errstr);
+			if (errstr)
+				errx(1, "rounds is %s: %s", errstr, optarg);
+			break;
+		case 't':
+			train = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc == 0 || (dictionary && train))
+		usage();
+
+	for (i = 0; i < (size_t)argc; i++)
+		load(argv[i], minsize);
+	if (nbodies == 0)
+		errx(1, "no message of %zu bytes or more", minsize);
+	for (total = 0, i = 0; i < nbodies; i++)
+		total += sizes[i];
+	printf("%zu messages, %zu bytes, %zu bytes on average\n\n", nbodies,
+	    total, total / nbodies);
+
+	printf("%-10s %5s %7s %10s %10s %9s %9s %6s\n", "codec", "level",
+	    "ratio", "comp us", "decomp us", "comp MB/s", "dec MB/s", "raw");
+	for (i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+		if ((id = compress_find(runs[i].codec)) == -1)
+			continue;
+		run(runs[i].codec, id, runs[i].level, rounds);
+	}
+
+	if (train) {
+		if (!compress_train(train, bodies, sizes, nbodies))
+			errx(1, "cannot train a dictionary");
+		dictionary = train;
+	}
+	if (dictionary) {
+		if ((id = compress_find("zstd")) == -1)
+			errx(1, "dictionaries need zstd");
+		if (!compress_dictionary(dictionary, compress_level(id)))
+			errx(1, "cannot load %s", dictionary);
+		run("zstd+dict", id, compress_level(id), rounds);
+	}
+
+	return (0);
+}
@@ -0,0 +1,664 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <smtpd-api.h>
+
+#include "aio.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+#define AIO_URING
+#endif
+
+#define AIO_LATBUCKETS	32	/* log2 of the latency in microseconds */
+#define AIO_STATS_EVERY	10000	/* completions between two stats logs */
+
+TAILQ_HEAD(aio_list, aio_req);
+
+static struct aio_list	 queued;	/* not submitted yet */
+static size_t		 inflight;
+static int		 use_uring;
+
+static struct {
+	uint64_t	 requests;
+	uint64_t	 submits;
+	uint64_t	 batches;
+	uint64_t	 completed;
+	uint64_t	 failed;
+	uint64_t	 depth_sum;
+	size_t		 depth_max;
+	uint64_t	 lat[AIO_LATBUCKETS];
+	uint64_t	 lat_max;
+} stats;
+
+static void aio_complete(struct aio_req *);
+static size_t aio_chain(struct aio_req *);
+static void aio_move(struct aio_list *, struct aio_list *);
+
+#ifdef AIO_URING
+
+static struct {
+	int			 fd;
+	unsigned int		 entries;
+	unsigned int		 cq_entries;
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_mask;
+	unsigned int		*sq_array;
+	struct io_uring_sqe	*sqes;
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_cqe	*cqes;
+	unsigned int		 pending;	/* filled, not entered */
+} ring;
+
+static int
+uring_enter(unsigned int submit, unsigned int wait)
+{
+	int	r;
+
+	r = syscall(__NR_io_uring_enter, ring.fd, submit, wait,
+	    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	return (r);
+}
+
+static int
+uring_probe(void)
+{
+	struct io_uring_probe	*probe;
+	size_t			 sz;
+	int			 ops[] = {
+		IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FSYNC,
+		IORING_OP_RENAMEAT, IORING_OP_UNLINKAT
+	};
+	int			 i, r;
+
+	sz = sizeof(*probe) + IORING_OP_LAST * sizeof(probe->ops[0]);
+	if ((probe = calloc(1, sz)) == NULL)
+		return (0);
+	r = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE,
+	    probe, IORING_OP_LAST);
+	if (r == -1) {
+		free(probe);
+		return (0);
+	}
+	for (i = 0; i < (int)(sizeof(ops) / sizeof(ops[0])); i++) {
+		if (ops[i] > probe->last_op ||
+		    !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+			log_warnx("warn: aio: io_uring lacks operation %d",
+			    ops[i]);
+			free(probe);
+			return (0);
+		}
+	}
+	free(probe);
+	return (1);
+}
+
+static int
+uring_init(unsigned int depth)
+{
+	struct io_uring_params	 p;
+	size_t			 sq_sz, cq_sz;
+	char			*sq, *cq;
+	void			*sqes;
+
+	memset(&p, 0, sizeof(p));
+	ring.fd = syscall(__NR_io_uring_setup, depth, &p);
+	if (ring.fd == -1) {
+		log_warn("warn: aio: io_uring_setup");
+		return (0);
+	}
+	if (!uring_probe())
+		goto fail;
+
+	sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_sz = cq_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+
+	sq = mmap(NULL, sq_sz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) {
+		log_warn("warn: aio: mmap");
+		goto fail;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else {
+		cq = mmap(NULL, cq_sz, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED) {
+			log_warn("warn: aio: mmap");
+			goto fail;
+		}
+	}
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+	    IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		log_warn("warn: aio: mmap");
+		goto fail;
+	}
+
+	ring.entries = p.sq_entries;
+	ring.cq_entries = p.cq_entries;
+	ring.sq_head = (unsigned int *)(sq + p.sq_off.head);
+	ring.sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned int *)(sq + p.sq_off.array);
+	ring.sqes = sqes;
+	ring.cq_head = (unsigned int *)(cq + p.cq_off.head);
+	ring.cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return (1);
+
+fail:
+	/* the mappings go away with the process, nothing else uses them */
+	close(ring.fd);
+	return (0);
+}
+
+static void
+uring_fill(struct aio_req *req)
+{
+	struct io_uring_sqe	*sqe;
+	unsigned int		 tail, idx;
+
+	tail = *ring.sq_tail;
+	idx = tail & *ring.sq_mask;
+	sqe = &ring.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+
+	switch (req->op) {
+	case AIO_READ:
+	case AIO_WRITE:
+		sqe->opcode = req->op == AIO_READ ?
+		    IORING_OP_READ : IORING_OP_WRITE;
+		sqe->fd = req->fd;
+		sqe->addr = (uintptr_t)req->buf;
+		sqe->len = req->len;
+		sqe->off = req->off;
+		break;
+	case AIO_FSYNC:
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fd = req->fd;
+		break;
+	case AIO_RENAME:
+		sqe->opcode = IORING_OP_RENAMEAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t)req->path;
+		sqe->len = AT_FDCWD;
+		sqe->addr2 = (uintptr_t)req->path2;
+		break;
+	case AIO_UNLINK:
+	case AIO_RMDIR:
+		sqe->opcode = IORING_OP_UNLINKAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t)req->path;
+		sqe->unlink_flags = req->op == AIO_RMDIR ? AT_REMOVEDIR : 0;
+		break;
+	}
+	if (req->flags & AIO_LINK)
+		sqe->flags |= IOSQE_IO_LINK;
+	sqe->user_data = (uintptr_t)req;
+
+	ring.sq_array[idx] = idx;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring.pending++;
+}
+
+static void
+uring_flush(void)
+{
+	int	r;
+
+	while (ring.pending) {
+		r = uring_enter(ring.pending, 0);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EBUSY) {
+				aio_reap();
+				continue;
+			}
+			fatal("aio: io_uring_enter");
+		}
+		ring.pending -= r;
+		stats.submits++;
+	}
+}
+
+static void
+uring_reap(void)
+{
+	struct io_uring_cqe	*cqe;
+	struct aio_req		*req;
+	unsigned int		 head, tail;
+
+	head = *ring.cq_head;
+	tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		cqe = &ring.cqes[head & *ring.cq_mask];
+		req = (struct aio_req *)(uintptr_t)cqe->user_data;
+		req->res = cqe->res;
+		clock_gettime(CLOCK_MONOTONIC, &req->completed);
+		head++;
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+		aio_complete(req);
+	}
+}
+
+static void
+uring_wait(void)
+{
+	uring_flush();
+	if (uring_enter(0, 1) == -1 && errno != EINTR)
+		fatal("aio: io_uring_enter");
+	uring_reap();
+}
+
+static void
+uring_submit(void)
+{
+	struct aio_req	*req;
+	size_t		 n, space;
+
+	while ((req = TAILQ_FIRST(&queued)) != NULL) {
+		/* a chain must not span two submissions */
+		n = aio_chain(req);
+		space = ring.entries -
+		    (*ring.sq_tail - __atomic_load_n(ring.sq_head,
+		    __ATOMIC_ACQUIRE));
+		if (space < n)
+			uring_flush();
+		/* completions beyond the CQ size would be dropped */
+		while (inflight + n > ring.cq_entries)
+			uring_wait();
+		while (n--) {
+			req = TAILQ_FIRST(&queued);
+			TAILQ_REMOVE(&queued, req, entry);
+			clock_gettime(CLOCK_MONOTONIC, &req->submitted);
+			uring_fill(req);
+			inflight++;
+		}
+	}
+	uring_flush();
+}
+
+#endif
+
+/*
+ * The fallback is a pool of threads running the chains with the plain
+ * system calls.  Requests are completed in the main thread, when reaped.
+ */
+static pthread_mutex_t	 tp_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	 tp_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	 tp_done = PTHREAD_COND_INITIALIZER;
+static struct aio_list	 tp_pending;
+static struct aio_list	 tp_completed;
+
+static ssize_t
+tp_run(struct aio_req *req)
+{
+	ssize_t	r;
+
+	switch (req->op) {
+	case AIO_READ:
+		r = pread(req->fd, req->buf, req->len, req->off);
+		break;
+	case AIO_WRITE:
+		r = pwrite(req->fd, req->buf, req->len, req->off);
+		break;
+	case AIO_FSYNC:
+		r = fsync(req->fd);
+		break;
+	case AIO_RENAME:
+		r = rename(req->path, req->path2);
+		break;
+	case AIO_UNLINK:
+		r = unlink(req->path);
+		break;
+	case AIO_RMDIR:
+		r = rmdir(req->path);
+		break;
+	default:
+		errno = EINVAL;
+		r = -1;
+	}
+	return (r == -1 ? -errno : r);
+}
+
+static void *
+tp_worker(void *arg)
+{
+	struct aio_list	 chain;
+	struct aio_req	*req;
+	size_t		 n;
+	int		 failed;
+
+	pthread_mutex_lock(&tp_lock);
+	for (;;) {
+		while (TAILQ_EMPTY(&tp_pending))
+			pthread_cond_wait(&tp_work, &tp_lock);
+
+		TAILQ_INIT(&chain);
+		n = aio_chain(TAILQ_FIRST(&tp_pending));
+		while (n--) {
+			req = TAILQ_FIRST(&tp_pending);
+			TAILQ_REMOVE(&tp_pending, req, entry);
+			TAILQ_INSERT_TAIL(&chain, req, entry);
+		}
+		pthread_mutex_unlock(&tp_lock);
+
+		/* like io_uring, a failed or short link cancels the rest */
+		failed = 0;
+		TAILQ_FOREACH(req, &chain, entry) {
+			if (failed)
+				req->res = -ECANCELED;
+			else {
+				req->res = tp_run(req);
+				if (req->res < 0 ||
+				    ((req->op == AIO_READ || req->op == AIO_WRITE) &&
+				    (size_t)req->res != req->len))
+					failed = req->flags & AIO_LINK;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &req->completed);
+		}
+
+		pthread_mutex_lock(&tp_lock);
+		aio_move(&tp_completed, &chain);
+		pthread_cond_signal(&tp_done);
+	}
+
+	return (NULL);
+}
+
+static int
+tp_init(int threads)
+{
+	pthread_t	t;
+	int		i, r;
+
+	TAILQ_INIT(&tp_pending);
+	TAILQ_INIT(&tp_completed);
+	for (i = 0; i < threads; i++) {
+		if ((r = pthread_create(&t, NULL, tp_worker, NULL)) != 0) {
+			errno = r;
+			log_warn("warn: aio: pthread_create");
+			return (0);
+		}
+		pthread_detach(t);
+	}
+	return (1);
+}
+
+static void
+tp_reap(int wait)
+{
+	struct aio_list	 done;
+	struct aio_req	*req;
+
+	TAILQ_INIT(&done);
+	pthread_mutex_lock(&tp_lock);
+	while (wait && TAILQ_EMPTY(&tp_completed))
+		pthread_cond_wait(&tp_done, &tp_lock);
+	aio_move(&done, &tp_completed);
+	pthread_mutex_unlock(&tp_lock);
+
+	while ((req = TAILQ_FIRST(&done)) != NULL) {
+		TAILQ_REMOVE(&done, req, entry);
+		aio_complete(req);
+	}
+}
+
+static void
+tp_submit(void)
+{
+	struct aio_req	*req;
+
+	TAILQ_FOREACH(req, &queued, entry) {
+		clock_gettime(CLOCK_MONOTONIC, &req->submitted);
+		inflight++;
+	}
+	pthread_mutex_lock(&tp_lock);
+	aio_move(&tp_pending, &queued);
+	pthread_cond_broadcast(&tp_work);
+	pthread_mutex_unlock(&tp_lock);
+	stats.submits++;
+}
+
+/* append the requests of src to dst */
+static void
+aio_move(struct aio_list *dst, struct aio_list *src)
+{
+	struct aio_req	*req;
+
+	while ((req = TAILQ_FIRST(src)) != NULL) {
+		TAILQ_REMOVE(src, req, entry);
+		TAILQ_INSERT_TAIL(dst, req, entry);
+	}
+}
+
+/* number of requests in the chain starting at req */
+static size_t
+aio_chain(struct aio_req *req)
+{
+	size_t	n;
+
+	for (n = 1; req->flags & AIO_LINK; n++)
+		if ((req = TAILQ_NEXT(req, entry)) == NULL)
+			fatalx("aio: unterminated chain");
+	return (n);
+}
+
+static void
+aio_complete(struct aio_req *req)
+{
+	uint64_t	us;
+	int		i;
+
+	inflight--;
+	req->done = 1;
+
+	us = (req->completed.tv_sec - req->submitted.tv_sec) * 1000000 +
+	    (req->completed.tv_nsec - req->submitted.tv_nsec) / 1000;
+	for (i = 0; i < AIO_LATBUCKETS - 1 && us >> i; i++)
+		;
+	stats.lat[i]++;
+	if (us > stats.lat_max)
+		stats.lat_max = us;
+	if (req->res < 0)
+		stats.failed++;
+	if (++stats.completed % AIO_STATS_EVERY == 0)
+		aio_log_stats();
+
+	if (req->flags & AIO_DETACH) {
+		if (req->res < 0 && req->res != -ENOENT) {
+			errno = -req->res;
+			log_warn("warn: aio: %s", req->path);
+		}
+		free(req);
+	}
+}
+
+int
+aio_init(unsigned int depth, int threads)
+{
+	TAILQ_INIT(&queued);
+
+#ifdef AIO_URING
+	if (threads == 0) {
+		if (uring_init(depth)) {
+			use_uring = 1;
+			return (1);
+		}
+		log_warnx("warn: aio: io_uring unavailable, using threads");
+	}
+#endif
+	return (tp_init(threads ? threads : 4));
+}
+
+const char *
+aio_backend(void)
+{
+	return (use_uring ? "io_uring" : "threads");
+}
+
+struct aio_req *
+aio_new(int op, int flags)
+{
+	struct aio_req	*req;
+
+	if ((req = calloc(1, sizeof(*req))) == NULL)
+		fatal("aio: calloc");
+	req->op = op;
+	req->flags = flags;
+	req->fd = -1;
+	return (req);
+}
+
+void
+aio_queue(struct aio_req *req)
+{
+	TAILQ_INSERT_TAIL(&queued, req, entry);
+	stats.requests++;
+}
+
+void
+aio_submit(void)
+{
+	if (TAILQ_EMPTY(&queued))
+		return;
+
+#ifdef AIO_URING
+	if (use_uring)
+		uring_submit();
+	else
+#endif
+		tp_submit();
+
+	stats.batches++;
+	stats.depth_sum += inflight;
+	if (inflight > stats.depth_max)
+		stats.depth_max = inflight;
+}
+
+void
+aio_reap(void)
+{
+#ifdef AIO_URING
+	if (use_uring) {
+		uring_reap();
+		return;
+	}
+#endif
+	tp_reap(0);
+}
+
+static void
+aio_wait_one(void)
+{
+#ifdef AIO_URING
+	if (use_uring) {
+		uring_wait();
+		return;
+	}
+#endif
+	tp_reap(1);
+}
+
+void
+aio_wait(struct aio_req *req)
+{
+	aio_submit();
+	aio_reap();
+	while (!req->done)
+		aio_wait_one();
+}
+
+void
+aio_wait_all(void)
+{
+	aio_submit();
+	aio_reap();
+	while (inflight)
+		aio_wait_one();
+}
+
+void
+aio_free(struct aio_req *req)
+{
+	free(req);
+}
+
+static uint64_t
+aio_percentile(double p)
+{
+	uint64_t	total, n, want;
+	int		i;
+
+	for (total = 0, i = 0; i < AIO_LATBUCKETS; i++)
+		total += stats.lat[i];
+	if (total == 0)
+		return (0);
+	want = total * p;
+	for (n = 0, i = 0; i < AIO_LATBUCKETS; i++) {
+		n += stats.lat[i];
+		if (n > want)
+			break;
+	}
+	return (i ? 1ULL << i : 1);
+}
+
+void
+aio_log_stats(void)
+{
+	log_info("info: aio: %s: %llu requests in %llu submissions, "
+	    "depth avg %.1f max %zu, latency p50 %lluus p99 %lluus max %lluus, "
+	    "%llu failed",
+	    aio_backend(),
+	    (unsigned long long)stats.requests,
+	    (unsigned long long)stats.submits,
+	    stats.batches ? (double)stats.depth_sum / stats.batches : 0.0,
+	    stats.depth_max,
+	    (unsigned long long)aio_percentile(0.50),
+	    (unsigned long long)aio_percentile(0.99),
+	    (unsigned long long)stats.lat_max,
+	    (unsigned long long)stats.failed);
+}
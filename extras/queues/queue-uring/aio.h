@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+enum aio_op {
+	AIO_READ,
+	AIO_WRITE,
+	AIO_FSYNC,
+	AIO_RENAME,
+	AIO_UNLINK,
+	AIO_RMDIR
+};
+
+/*
+ * The kernel only cancels the requests linked to a failed read, write or
+ * fsync: after a rename or an unlink, a link merely orders the requests.
+ */
+#define AIO_LINK	0x01	/* the next request runs if this one succeeds */
+#define AIO_DETACH	0x02	/* freed on completion, nobody waits for it */
+
+/*
+ * Requests are queued, then submitted in batches.  The caller owns the
+ * buffers and file descriptors until the request is completed.
+ */
+struct aio_req {
+	TAILQ_ENTRY(aio_req)	 entry;
+	int			 op;
+	int			 flags;
+	int			 fd;
+	void			*buf;
+	size_t			 len;
+	off_t			 off;
+	char			 path[SMTPD_MAXPATHLEN];
+	char			 path2[SMTPD_MAXPATHLEN];
+
+	ssize_t			 res;		/* result, or -errno */
+	int			 done;
+	struct timespec		 submitted;
+	struct timespec		 completed;
+};
+
+int aio_init(unsigned int, int);
+const char *aio_backend(void);
+struct aio_req *aio_new(int, int);
+void aio_queue(struct aio_req *);
+void aio_submit(void);
+void aio_wait(struct aio_req *);
+void aio_wait_all(void);
+void aio_reap(void);
+void aio_free(struct aio_req *);
+void aio_log_stats(void);
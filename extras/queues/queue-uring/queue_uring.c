@@ -0,0 +1,840 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A spool on disk, with the I/O going through io_uring, or through a pool
+ * of threads where io_uring is not available.  The layout is:
+ *
+ *	uring/incoming/<msgid>/{message,envelopes/<evpid>}
+ *	uring/queue/<bucket>/<msgid>/{message,envelopes/<evpid>}
+ *	uring/corrupt/<msgid>/
+ *
+ * relative to the spool.  Envelopes are written to a temporary file, then
+ * synced and renamed over the previous version in a single linked
+ * submission.  Deletions are submitted without waiting, so that they
+ * overlap with the next requests, and walks read envelopes in batches.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <smtpd-api.h>
+
+#include "aio.h"
+
+#define QU_ROOT		"uring"
+#define QU_BUCKETS	256
+#define QU_DIRLEN	64	/* uring/queue/xx/xxxxxxxx and the like */
+#define QU_EVPSIZE	8192	/* as the buffer of the queue API */
+#define QU_WALK_BATCH	32	/* envelopes read ahead by the walks */
+#define QU_CHUNK	65536
+#define QU_CHUNKS	8	/* chunks in flight when copying a message */
+
+struct qu_slot {
+	uint64_t	 evpid;
+	int		 fd;
+	struct aio_req	*req;
+	char		 buf[QU_EVPSIZE];
+};
+
+struct qu_walk {
+	int		 active;
+	int		 bucket;	/* next bucket, -1 for a single message */
+	DIR		*msgs;
+	DIR		*evps;
+	uint32_t	 msgid;
+	int		 eof;
+	size_t		 nslot;
+	size_t		 next;
+	struct qu_slot	 slot[QU_WALK_BATCH];
+};
+
+static struct tree	 incoming;
+static struct qu_walk	 envwalk;
+static struct qu_walk	 msgwalk;
+
+static void
+qu_msgdir(char *buf, size_t len, uint32_t msgid)
+{
+	if (tree_check(&incoming, msgid))
+		(void)snprintf(buf, len, QU_ROOT "/incoming/%08" PRIx32, msgid);
+	else
+		(void)snprintf(buf, len, QU_ROOT "/queue/%02x/%08" PRIx32,
+		    msgid & 0xff, msgid);
+}
+
+static void
+qu_evppath(char *buf, size_t len, uint64_t evpid, int tmp)
+{
+	char	dir[QU_DIRLEN];
+
+	qu_msgdir(dir, sizeof(dir), evpid_to_msgid(evpid));
+	(void)snprintf(buf, len, "%s/envelopes/%s%016" PRIx64, dir,
+	    tmp ? "." : "", evpid);
+}
+
+static int
+qu_failed(struct aio_req *req, const char *what)
+{
+	if (req->res == -ECANCELED)
+		return (1);
+	if (req->res < 0) {
+		errno = -req->res;
+		log_warn("warn: queue-uring: %s", what);
+		return (1);
+	}
+	if ((req->op == AIO_READ || req->op == AIO_WRITE) &&
+	    (size_t)req->res != req->len) {
+		log_warnx("warn: queue-uring: %s: short transfer", what);
+		return (1);
+	}
+	return (0);
+}
+
+/*
+ * Remove a message directory.  The envelopes and the message are unlinked
+ * in one batch, and the directories once they are gone.  Nothing waits for
+ * the directories.  The envelope directory is already gone when the last
+ * envelope was deleted.
+ */
+static int
+qu_remove(const char *dir)
+{
+	struct aio_req	*req, *req2;
+	struct dirent	*dp;
+	DIR		*d;
+	char		 evpdir[QU_DIRLEN];
+
+	/* deletions of earlier messages still in flight */
+	aio_wait_all();
+
+	if ((size_t)snprintf(evpdir, sizeof(evpdir), "%s/envelopes", dir) >=
+	    sizeof(evpdir)) {
+		log_warnx("warn: queue-uring: bad directory: %s", dir);
+		return (0);
+	}
+	if ((d = opendir(evpdir)) == NULL) {
+		if (errno != ENOENT) {
+			log_warn("warn: queue-uring: opendir: %s", evpdir);
+			return (0);
+		}
+		if (access(dir, F_OK) == -1)
+			return (0);
+	}
+	while (d && (dp = readdir(d)) != NULL) {
+		if (strcmp(dp->d_name, ".") == 0 ||
+		    strcmp(dp->d_name, "..") == 0)
+			continue;
+		req = aio_new(AIO_UNLINK, AIO_DETACH);
+		(void)snprintf(req->path, sizeof(req->path), "%s/%s",
+		    evpdir, dp->d_name);
+		aio_queue(req);
+	}
+
+	req = aio_new(AIO_UNLINK, AIO_DETACH);
+	(void)snprintf(req->path, sizeof(req->path), "%s/message", dir);
+	aio_queue(req);
+	aio_wait_all();
+
+	if (d) {
+		closedir(d);
+		req = aio_new(AIO_RMDIR, AIO_LINK | AIO_DETACH);
+		(void)strlcpy(req->path, evpdir, sizeof(req->path));
+		aio_queue(req);
+	}
+	req2 = aio_new(AIO_RMDIR, AIO_DETACH);
+	(void)strlcpy(req2->path, dir, sizeof(req2->path));
+	aio_queue(req2);
+	aio_submit();
+
+	return (1);
+}
+
+/*
+ * Copy the message across file systems.  A window of chunks is read in a
+ * single submission, then written back in another.
+ */
+static int
+qu_copy(int src, const char *dst)
+{
+	struct aio_req	*rd[QU_CHUNKS], *wr[QU_CHUNKS], *req;
+	char		*buf;
+	off_t		 off;
+	size_t		 i, n;
+	int		 fd, eof, failed, ret;
+
+	if ((fd = open(dst, O_CREAT | O_TRUNC | O_WRONLY, 0600)) == -1) {
+		log_warn("warn: queue-uring: open: %s", dst);
+		return (0);
+	}
+	if ((buf = malloc(QU_CHUNKS * QU_CHUNK)) == NULL) {
+		log_warn("warn: queue-uring: malloc");
+		close(fd);
+		return (0);
+	}
+
+	ret = 0;
+	for (off = 0, eof = 0; !eof; off += QU_CHUNKS * QU_CHUNK) {
+		for (i = 0; i < QU_CHUNKS; i++) {
+			rd[i] = aio_new(AIO_READ, 0);
+			rd[i]->fd = src;
+			rd[i]->buf = buf + i * QU_CHUNK;
+			rd[i]->len = QU_CHUNK;
+			rd[i]->off = off + i * QU_CHUNK;
+			aio_queue(rd[i]);
+		}
+		aio_submit();
+		for (i = 0; i < QU_CHUNKS; i++)
+			aio_wait(rd[i]);
+
+		for (n = 0; n < QU_CHUNKS; n++) {
+			if (rd[n]->res < 0) {
+				errno = -rd[n]->res;
+				log_warn("warn: queue-uring: read");
+				goto done;
+			}
+			if ((size_t)rd[n]->res < QU_CHUNK) {
+				eof = 1;
+				break;
+			}
+		}
+		if (n < QU_CHUNKS && rd[n]->res > 0)
+			n++;
+
+		for (i = 0; i < n; i++) {
+			wr[i] = aio_new(AIO_WRITE, 0);
+			wr[i]->fd = fd;
+			wr[i]->buf = rd[i]->buf;
+			wr[i]->len = rd[i]->res;
+			wr[i]->off = rd[i]->off;
+			aio_queue(wr[i]);
+		}
+		aio_submit();
+		for (i = 0; i < n; i++)
+			aio_wait(wr[i]);
+		for (i = 0, failed = 0; i < n; i++) {
+			if (!failed)
+				failed = qu_failed(wr[i], "write");
+			aio_free(wr[i]);
+		}
+		if (failed)
+			goto done;
+		for (i = 0; i < QU_CHUNKS; i++)
+			aio_free(rd[i]);
+	}
+
+	req = aio_new(AIO_FSYNC, 0);
+	req->fd = fd;
+	aio_queue(req);
+	aio_wait(req);
+	ret = !qu_failed(req, "fsync");
+	aio_free(req);
+	goto out;
+
+done:
+	for (i = 0; i < QU_CHUNKS; i++)
+		aio_free(rd[i]);
+out:
+	free(buf);
+	close(fd);
+	if (!ret)
+		unlink(dst);
+	return (ret);
+}
+
+static int
+qu_envelope_write(uint64_t evpid, const char *buf, size_t len)
+{
+	struct aio_req	*wr, *sync, *mv;
+	char		 tmp[SMTPD_MAXPATHLEN], path[SMTPD_MAXPATHLEN];
+	int		 fd, ret;
+
+	qu_evppath(tmp, sizeof(tmp), evpid, 1);
+	qu_evppath(path, sizeof(path), evpid, 0);
+
+	if ((fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0600)) == -1) {
+		log_warn("warn: queue-uring: open: %s", tmp);
+		return (0);
+	}
+
+	wr = aio_new(AIO_WRITE, AIO_LINK);
+	wr->fd = fd;
+	wr->buf = (void *)buf;
+	wr->len = len;
+	sync = aio_new(AIO_FSYNC, AIO_LINK);
+	sync->fd = fd;
+	mv = aio_new(AIO_RENAME, 0);
+	(void)strlcpy(mv->path, tmp, sizeof(mv->path));
+	(void)strlcpy(mv->path2, path, sizeof(mv->path2));
+	aio_queue(wr);
+	aio_queue(sync);
+	aio_queue(mv);
+	aio_wait(wr);
+	aio_wait(sync);
+	aio_wait(mv);
+
+	ret = !qu_failed(wr, "write") && !qu_failed(sync, "fsync") &&
+	    !qu_failed(mv, "rename");
+	aio_free(wr);
+	aio_free(sync);
+	aio_free(mv);
+	close(fd);
+	if (!ret)
+		unlink(tmp);
+	return (ret);
+}
+
+static int
+queue_uring_message_create(uint32_t *msgid)
+{
+	char	dir[QU_DIRLEN], path[SMTPD_MAXPATHLEN];
+
+again:
+	*msgid = queue_generate_msgid();
+	qu_msgdir(dir, sizeof(dir), *msgid);
+	if (access(dir, F_OK) == 0)
+		goto again;
+	(void)snprintf(dir, sizeof(dir), QU_ROOT "/incoming/%08" PRIx32,
+	    *msgid);
+	if (mkdir(dir, 0700) == -1) {
+		if (errno == EEXIST)
+			goto again;
+		log_warn("warn: queue-uring: mkdir: %s", dir);
+		return (0);
+	}
+	(void)snprintf(path, sizeof(path), "%s/envelopes", dir);
+	if (mkdir(path, 0700) == -1) {
+		log_warn("warn: queue-uring: mkdir: %s", path);
+		rmdir(dir);
+		return (0);
+	}
+	tree_xset(&incoming, *msgid, NULL);
+
+	return (1);
+}
+
+static int
+queue_uring_message_commit(uint32_t msgid, const char *path)
+{
+	struct aio_req	*sync, *mv, *commit;
+	char		 dir[QU_DIRLEN], msg[SMTPD_MAXPATHLEN];
+	int		 fd, ret;
+
+	if (!tree_check(&incoming, msgid)) {
+		log_warnx("warn: queue-uring: msgid not found");
+		return (0);
+	}
+	qu_msgdir(dir, sizeof(dir), msgid);
+	(void)snprintf(msg, sizeof(msg), "%s/message", dir);
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		log_warn("warn: queue-uring: open: %s", path);
+		return (0);
+	}
+
+	/*
+	 * Sync the message and move it in, then commit the directory.  The
+	 * kernel does not cancel the requests linked to a failed rename, so
+	 * the commit waits for the move.
+	 */
+	sync = aio_new(AIO_FSYNC, AIO_LINK);
+	sync->fd = fd;
+	mv = aio_new(AIO_RENAME, 0);
+	(void)strlcpy(mv->path, path, sizeof(mv->path));
+	(void)strlcpy(mv->path2, msg, sizeof(mv->path2));
+	commit = aio_new(AIO_RENAME, 0);
+	(void)strlcpy(commit->path, dir, sizeof(commit->path));
+	(void)snprintf(commit->path2, sizeof(commit->path2),
+	    QU_ROOT "/queue/%02x/%08" PRIx32, msgid & 0xff, msgid);
+	aio_queue(sync);
+	aio_queue(mv);
+	aio_wait(sync);
+	aio_wait(mv);
+
+	ret = 0;
+	if (qu_failed(sync, "fsync"))
+		goto out;
+	if (mv->res == -EXDEV) {
+		if (!qu_copy(fd, msg))
+			goto out;
+		unlink(path);
+	}
+	else if (qu_failed(mv, "rename"))
+		goto out;
+
+	aio_queue(commit);
+	aio_wait(commit);
+	if (qu_failed(commit, "rename"))
+		goto out;
+
+	tree_xpop(&incoming, msgid);
+	ret = 1;
+out:
+	aio_free(sync);
+	aio_free(mv);
+	aio_free(commit);
+	close(fd);
+	return (ret);
+}
+
+static int
+queue_uring_message_delete(uint32_t msgid)
+{
+	char	dir[QU_DIRLEN];
+
+	qu_msgdir(dir, sizeof(dir), msgid);
+	tree_pop(&incoming, msgid);
+	if (!qu_remove(dir)) {
+		log_warnx("warn: queue-uring: message not found");
+		return (0);
+	}
+	return (1);
+}
+
+static int
+queue_uring_message_fd_r(uint32_t msgid)
+{
+	char	dir[QU_DIRLEN], path[SMTPD_MAXPATHLEN];
+	int	fd;
+
+	qu_msgdir(dir, sizeof(dir), msgid);
+	(void)snprintf(path, sizeof(path), "%s/message", dir);
+	if ((fd = open(path, O_RDONLY)) == -1)
+		log_warn("warn: queue-uring: open: %s", path);
+	return (fd);
+}
+
+static int
+queue_uring_message_corrupt(uint32_t msgid)
+{
+	char	dir[QU_DIRLEN], path[SMTPD_MAXPATHLEN];
+
+	aio_wait_all();
+	qu_msgdir(dir, sizeof(dir), msgid);
+	(void)snprintf(path, sizeof(path), QU_ROOT "/corrupt/%08" PRIx32,
+	    msgid);
+	if (rename(dir, path) == -1) {
+		log_warn("warn: queue-uring: rename: %s", dir);
+		return (0);
+	}
+	tree_pop(&incoming, msgid);
+	return (1);
+}
+
+static int
+queue_uring_message_uncorrupt(uint32_t msgid)
+{
+	char	dir[QU_DIRLEN], path[SMTPD_MAXPATHLEN];
+
+	(void)snprintf(path, sizeof(path), QU_ROOT "/corrupt/%08" PRIx32,
+	    msgid);
+	qu_msgdir(dir, sizeof(dir), msgid);
+	if (rename(path, dir) == -1) {
+		log_warn("warn: queue-uring: rename: %s", path);
+		return (0);
+	}
+	return (1);
+}
+
+static int
+queue_uring_envelope_create(uint32_t msgid, const char *buf, size_t len,
+    uint64_t *evpid)
+{
+	char	path[SMTPD_MAXPATHLEN];
+
+	do {
+		*evpid = queue_generate_evpid(msgid);
+		qu_evppath(path, sizeof(path), *evpid, 0);
+	} while (access(path, F_OK) == 0);
+
+	return (qu_envelope_write(*evpid, buf, len));
+}
+
+static int
+queue_uring_envelope_delete(uint64_t evpid)
+{
+	struct aio_req	*req;
+	char		 dir[QU_DIRLEN], evpdir[SMTPD_MAXPATHLEN];
+	int		 failed;
+
+	req = aio_new(AIO_UNLINK, 0);
+	qu_evppath(req->path, sizeof(req->path), evpid, 0);
+	aio_queue(req);
+	aio_wait(req);
+	failed = req->res != -ENOENT && qu_failed(req, "unlink");
+	aio_free(req);
+	if (failed)
+		return (0);
+
+	/* the message goes with its last envelope */
+	qu_msgdir(dir, sizeof(dir), evpid_to_msgid(evpid));
+	(void)snprintf(evpdir, sizeof(evpdir), "%s/envelopes", dir);
+	if (rmdir(evpdir) == 0)
+		qu_remove(dir);
+
+	return (1);
+}
+
+static int
+queue_uring_envelope_update(uint64_t evpid, const char *buf, size_t len)
+{
+	return (qu_envelope_write(evpid, buf, len));
+}
+
+static int
+queue_uring_envelope_load(uint64_t evpid, char *buf, size_t len)
+{
+	struct aio_req	*req;
+	char		 path[SMTPD_MAXPATHLEN];
+	int		 fd, r;
+
+	qu_evppath(path, sizeof(path), evpid, 0);
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		log_warn("warn: queue-uring: open: %s", path);
+		return (0);
+	}
+	req = aio_new(AIO_READ, 0);
+	req->fd = fd;
+	req->buf = buf;
+	req->len = len;
+	aio_queue(req);
+	aio_wait(req);
+	close(fd);
+
+	r = req->res;
+	aio_free(req);
+	if (r < 0) {
+		errno = -r;
+		log_warn("warn: queue-uring: read: %s", path);
+		return (0);
+	}
+	if ((size_t)r == len) {
+		log_warnx("warn: queue-uring: buffer too small");
+		return (0);
+	}
+	return (r);
+}
+
+static void
+qu_walk_reset(struct qu_walk *w)
+{
+	size_t	i;
+
+	for (i = w->next; i < w->nslot; i++)
+		aio_free(w->slot[i].req);
+	if (w->evps)
+		closedir(w->evps);
+	if (w->msgs)
+		closedir(w->msgs);
+	w->evps = NULL;
+	w->msgs = NULL;
+	w->active = 0;
+	w->eof = 0;
+	w->nslot = w->next = 0;
+}
+
+/* the next envelope in the directories being walked */
+static int
+qu_walk_evpid(struct qu_walk *w, uint64_t *evpid)
+{
+	struct dirent	*dp;
+	char		 path[SMTPD_MAXPATHLEN], *end;
+	unsigned long	 msgid;
+
+	for (;;) {
+		while (w->evps && (dp = readdir(w->evps)) != NULL) {
+			/* temporary files start with a dot */
+			if (dp->d_name[0] == '.')
+				continue;
+			errno = 0;
+			*evpid = strtoull(dp->d_name, &end, 16);
+			if (*end || errno)
+				continue;
+			return (1);
+		}
+		if (w->evps) {
+			closedir(w->evps);
+			w->evps = NULL;
+		}
+		if (w->bucket == -1)
+			return (0);
+
+		while (w->msgs && (dp = readdir(w->msgs)) != NULL) {
+			if (dp->d_name[0] == '.')
+				continue;
+			errno = 0;
+			msgid = strtoul(dp->d_name, &end, 16);
+			if (*end || errno || msgid > UINT32_MAX)
+				continue;
+			(void)snprintf(path, sizeof(path),
+			    QU_ROOT "/queue/%02x/%08lx/envelopes",
+			    (unsigned int)msgid & 0xff, msgid);
+			if ((w->evps = opendir(path)) != NULL)
+				break;
+		}
+		if (w->evps)
+			continue;
+		if (w->msgs) {
+			closedir(w->msgs);
+			w->msgs = NULL;
+		}
+
+		if (w->bucket == QU_BUCKETS)
+			return (0);
+		(void)snprintf(path, sizeof(path), QU_ROOT "/queue/%02x",
+		    w->bucket++);
+		w->msgs = opendir(path);
+	}
+}
+
+static void
+qu_walk_fill(struct qu_walk *w)
+{
+	struct qu_slot	*s;
+	char		 path[SMTPD_MAXPATHLEN];
+	uint64_t	 evpid;
+	size_t		 i;
+
+	/* deletions in flight must not show up in the walk */
+	aio_wait_all();
+
+	w->nslot = w->next = 0;
+	while (w->nslot < QU_WALK_BATCH) {
+		if (!qu_walk_evpid(w, &evpid)) {
+			w->eof = 1;
+			break;
+		}
+		qu_evppath(path, sizeof(path), evpid, 0);
+		s = &w->slot[w->nslot];
+		/* deleted since the directory was read */
+		if ((s->fd = open(path, O_RDONLY)) == -1)
+			continue;
+		s->evpid = evpid;
+		s->req = aio_new(AIO_READ, 0);
+		s->req->fd = s->fd;
+		s->req->buf = s->buf;
+		s->req->len = sizeof(s->buf);
+		aio_queue(s->req);
+		w->nslot++;
+	}
+	aio_submit();
+	for (i = 0; i < w->nslot; i++) {
+		aio_wait(w->slot[i].req);
+		close(w->slot[i].fd);
+	}
+}
+
+static int
+qu_walk_next(struct qu_walk *w, uint64_t *evpid, char *buf, size_t len)
+{
+	struct qu_slot	*s;
+	ssize_t		 n;
+
+	if (w->next == w->nslot) {
+		if (w->eof) {
+			qu_walk_reset(w);
+			return (-1);
+		}
+		qu_walk_fill(w);
+		if (w->nslot == 0) {
+			qu_walk_reset(w);
+			return (-1);
+		}
+	}
+
+	s = &w->slot[w->next++];
+	*evpid = s->evpid;
+	n = s->req->res;
+	aio_free(s->req);
+	s->req = NULL;
+
+	if (n < 0) {
+		errno = -n;
+		log_warn("warn: queue-uring: read");
+		return (0);
+	}
+	if ((size_t)n == sizeof(s->buf) || (size_t)n > len) {
+		log_warnx("warn: queue-uring: envelope too large");
+		return (0);
+	}
+	memmove(buf, s->buf, n);
+	return (n);
+}
+
+static int
+queue_uring_envelope_walk(uint64_t *evpid, char *buf, size_t len)
+{
+	if (!envwalk.active) {
+		envwalk.active = 1;
+		envwalk.bucket = 0;
+	}
+	return (qu_walk_next(&envwalk, evpid, buf, len));
+}
+
+static int
+queue_uring_message_walk(uint64_t *evpid, char *buf, size_t len,
+    uint32_t msgid, int *done, void **data)
+{
+	char	dir[QU_DIRLEN], path[SMTPD_MAXPATHLEN];
+
+	if (msgwalk.active && msgwalk.msgid != msgid)
+		qu_walk_reset(&msgwalk);
+	if (!msgwalk.active) {
+		msgwalk.active = 1;
+		msgwalk.bucket = -1;
+		msgwalk.msgid = msgid;
+		qu_msgdir(dir, sizeof(dir), msgid);
+		(void)snprintf(path, sizeof(path), "%s/envelopes", dir);
+		if ((msgwalk.evps = opendir(path)) == NULL)
+			log_warn("warn: queue-uring: opendir: %s", path);
+	}
+	return (qu_walk_next(&msgwalk, evpid, buf, len));
+}
+
+static int
+queue_uring_close(void)
+{
+	aio_wait_all();
+	aio_log_stats();
+	return (1);
+}
+
+static void
+qu_mkdir(const char *path, struct passwd *pw)
+{
+	if (mkdir(path, 0700) == -1 && errno != EEXIST)
+		fatal("queue-uring: mkdir: %s", path);
+	if (pw && chown(path, pw->pw_uid, pw->pw_gid) == -1)
+		fatal("queue-uring: chown: %s", path);
+}
+
+static int
+queue_uring_init(struct passwd *pw)
+{
+	struct dirent	*dp;
+	DIR		*d;
+	char		 path[SMTPD_MAXPATHLEN];
+	int		 i;
+
+	tree_init(&incoming);
+
+	qu_mkdir(QU_ROOT, pw);
+	qu_mkdir(QU_ROOT "/incoming", pw);
+	qu_mkdir(QU_ROOT "/queue", pw);
+	qu_mkdir(QU_ROOT "/corrupt", pw);
+	for (i = 0; i < QU_BUCKETS; i++) {
+		(void)snprintf(path, sizeof(path), QU_ROOT "/queue/%02x", i);
+		qu_mkdir(path, pw);
+	}
+
+	/* messages that were never committed */
+	if ((d = opendir(QU_ROOT "/incoming")) == NULL)
+		fatal("queue-uring: opendir");
+	while ((dp = readdir(d)) != NULL) {
+		if (dp->d_name[0] == '.')
+			continue;
+		(void)snprintf(path, sizeof(path), QU_ROOT "/incoming/%s",
+		    dp->d_name);
+		log_debug("debug: queue-uring: removing %s", path);
+		qu_remove(path);
+	}
+	closedir(d);
+	aio_wait_all();
+
+	queue_api_on_close(queue_uring_close);
+	queue_api_on_message_create(queue_uring_message_create);
+	queue_api_on_message_commit(queue_uring_message_commit);
+	queue_api_on_message_delete(queue_uring_message_delete);
+	queue_api_on_message_fd_r(queue_uring_message_fd_r);
+	queue_api_on_message_corrupt(queue_uring_message_corrupt);
+	queue_api_on_message_uncorrupt(queue_uring_message_uncorrupt);
+	queue_api_on_envelope_create(queue_uring_envelope_create);
+	queue_api_on_envelope_delete(queue_uring_envelope_delete);
+	queue_api_on_envelope_update(queue_uring_envelope_update);
+	queue_api_on_envelope_load(queue_uring_envelope_load);
+	queue_api_on_envelope_walk(queue_uring_envelope_walk);
+	queue_api_on_message_walk(queue_uring_message_walk);
+
+	return (1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct passwd	*pw = NULL;
+	const char	*errstr, *spool = NULL;
+	int		 ch, depth = 64, threads = 0;
+
+	log_init(1);
+
+	while ((ch = getopt(argc, argv, "d:q:t:")) != -1) {
+		switch (ch) {
+		case 'd':
+			spool = optarg;
+			break;
+		case 'q':
+			depth = strtonum(optarg, 8, 4096, &errstr);
+			if (errstr)
+				fatalx("queue depth is %s: %s", errstr, optarg);
+			break;
+		case 't':
+			threads = strtonum(optarg, 1, 256, &errstr);
+			if (errstr)
+				fatalx("thread count is %s: %s", errstr, optarg);
+			break;
+		default:
+			fatalx("bad option");
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	/* with -d, run in place as the current user, for testing */
+	if (spool) {
+		queue_api_no_chroot();
+		queue_api_set_user(NULL);
+	}
+	else {
+		spool = PATH_SPOOL;
+		if ((pw = getpwnam(SMTPD_QUEUE_USER)) == NULL)
+			fatalx("queue-uring: unknown user %s", SMTPD_QUEUE_USER);
+	}
+	if (chdir(spool) == -1)
+		fatal("queue-uring: chdir: %s", spool);
+
+	if (!aio_init(depth, threads))
+		fatalx("queue-uring: cannot initialize aio");
+	log_debug("debug: queue-uring: using %s", aio_backend());
+
+	queue_uring_init(pw);
+	queue_api_dispatch();
+
+	return (0);
+}
@@ -23,9 +23,11 @@
 #include <sys/socket.h>
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <imsg.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -49,6 +51,7 @@ struct rq_message {
 struct rq_envelope {
 	TAILQ_ENTRY(rq_envelope) entry;
 	SPLAY_ENTRY(rq_envelope) t_entry;
+	TAILQ_ENTRY(rq_envelope) x_entry;
 
 	uint64_t		 evpid;
 	uint64_t		 holdq;
@@ -58,6 +61,8 @@ struct rq_envelope {
 #define	RQ_EVPSTATE_SCHEDULED	 1
 #define	RQ_EVPSTATE_INFLIGHT	 2
 #define	RQ_EVPSTATE_HELD	 3
+#define	RQ_EVPSTATE_PARKED	 4
+#define	RQ_EVPSTATE_RINGED	 5	/* scheduled, in a ring of its shard */
 	uint8_t			 state;
 
 #define	RQ_ENVELOPE_EXPIRED	 0x01
@@ -65,6 +70,8 @@ struct rq_envelope {
 #define	RQ_ENVELOPE_SUSPEND	 0x04
 #define	RQ_ENVELOPE_UPDATE	 0x08
 #define	RQ_ENVELOPE_OVERFLOW	 0x10
+#define	RQ_ENVELOPE_PROBE	 0x20
+#define	RQ_ENVELOPE_GATHERED	 0x40
 	uint8_t			 flags;
 
 	time_t			 ctime;
@@ -72,6 +79,8 @@ struct rq_envelope {
 	time_t			 expire;
 
 	struct rq_message	*message;
+	struct rq_expiry	*expiry;
+	struct rq_dest		*dest;		/* MTA only */
 
 	time_t			 t_inflight;
 	time_t			 t_scheduled;
@@ -82,10 +91,49 @@ struct rq_holdq {
 	size_t			 count;
 };
 
+/* the pending and parked envelopes that expire within the same minute */
+struct rq_expiry {
+	uint64_t		 minute;
+	struct evplist		 q;
+	size_t			 count;
+};
+
+/*
+ * An MTA destination.  Failing to reach it too many times in a row takes
+ * it down: its envelopes are then parked instead of each being retried on
+ * its own schedule, and a single probe is sent when the backoff is over.
+ * The first delivery that gets an answer brings it back up and releases
+ * the parked envelopes together.  Destinations are shared by the shards,
+ * under dests_lock.
+ */
+struct rq_dest {
+#define	RQ_DEST_UP		 0
+#define	RQ_DEST_DOWN		 1
+#define	RQ_DEST_PROBING		 2
+	int			 state;
+	uint32_t		 failures;	/* in a row */
+	uint32_t		 outages;	/* failed probes in a row */
+	time_t			 until;		/* next probe, or probe sent */
+
+	size_t			 refs;		/* envelopes */
+	char			 name[SMTPD_MAXHOSTNAMELEN];
+};
+
+/* the envelopes of a queue parked on a destination */
+struct rq_parking {
+	TAILQ_ENTRY(rq_parking)	 entry;
+	struct rq_dest		*dest;
+	struct evplist		 q;
+	size_t			 count;
+};
+
 struct rq_queue {
 	size_t			 evpcount;
 	struct tree		 messages;
 	SPLAY_HEAD(prioqtree, rq_envelope)	q_priotree;
+	struct tree		 q_expiry;	/* rq_expiry, by minute */
+	struct tree		 q_parked;	/* rq_parking, by destination */
+	TAILQ_HEAD(, rq_parking) q_parkings;
 
 	struct evplist		 q_pending;
 	struct evplist		 q_inflight;
@@ -96,6 +144,56 @@ struct rq_queue {
 	struct evplist		 q_update;
 	struct evplist		 q_expired;
 	struct evplist		 q_removed;
+
+	struct rq_envelope	**gather;	/* see rq_queue_gather() */
+	size_t			 gathersz;
+};
+
+/*
+ * With -t, the queue is split by msgid into shards, each with a worker
+ * thread that schedules its envelopes and moves the ready ones to a ring
+ * per type of batch.  The API thread works on the shard of a message
+ * under its lock, and merges the rings into batches without it.
+ *
+ * A scheduled envelope in a ring is RINGED, on no list.  Schedule, remove
+ * or suspend pull it back as from its list, and count its ring entry as
+ * pulled so that the batch skips it.  The batch hands the others out and
+ * returns them to the shard on the taken ring, to be put in-flight by
+ * whoever holds the lock of the shard next.
+ */
+#define RING_REMOVE		 0
+#define RING_EXPIRE		 1
+#define RING_UPDATE		 2
+#define RING_BOUNCE		 3
+#define RING_MDA		 4
+#define RING_MTA		 5
+#define RING_MAX		 6
+
+#define RING_SIZE		 1024	/* a power of two */
+
+struct rq_ring {
+	uint64_t		 evpids[RING_SIZE];
+	uint8_t			 more[RING_SIZE];	/* same group next */
+	size_t			 head;
+	size_t			 tail;
+};
+
+struct rq_shard {
+	struct rq_queue		 rq;
+	struct rq_ring		 rings[RING_MAX];
+	struct rq_ring		 taken;		/* handed out, to put in-flight */
+	struct tree		 pulled;	/* the API thread's, see above */
+
+	pthread_t		 thread;
+	pthread_mutex_t		 lock;
+	pthread_cond_t		 wake;
+	pthread_cond_t		 done;
+	int			 kick;
+	uint64_t		 passes;
+	uint64_t		 waitpass;
+	time_t			 next;		/* next envelope due, or -1 */
+
+	int			 ingroup;	/* an MTA group goes on */
 };
 
 static int rq_envelope_cmp(struct rq_envelope *, struct rq_envelope *);
@@ -103,24 +201,81 @@ static int rq_envelope_cmp(struct rq_envelope *, struct rq_envelope *);
 SPLAY_PROTOTYPE(prioqtree, rq_envelope, t_entry, rq_envelope_cmp);
 
 static void sorted_insert(struct rq_queue *, struct rq_envelope *);
+static void rq_expiry_insert(struct rq_queue *, struct rq_envelope *);
+static void rq_expiry_remove(struct rq_queue *, struct rq_envelope *);
+static time_t rq_expiry_next(struct rq_queue *);
+static size_t rq_expiry_count(struct rq_queue *, time_t);
+static struct rq_dest *rq_dest_get(const char *);
+static void rq_dest_unref(struct rq_dest *);
+static int rq_dest_isup(struct rq_dest *);
+static time_t rq_dest_until(struct rq_dest *);
+static void rq_dest_park(struct rq_queue *, struct rq_envelope *);
+static void rq_dest_unpark(struct rq_queue *, struct rq_envelope *);
+static int rq_dest_wait(struct rq_envelope *);
+static void rq_dest_update(struct rq_envelope *, int);
+static void rq_dest_up(struct rq_dest *);
+
+static struct rq_shard *rq_shard_lock(uint32_t);
+static void rq_shard_unlock(struct rq_shard *, int);
+static void *rq_shard_run(void *);
+static void rq_shards_pass(int);
+static void rq_shards_released(void);
+static int rq_shards_ready(int);
+static int rq_ring_full(struct rq_ring *);
+static int rq_ring_empty(struct rq_ring *);
+static void rq_ring_push(struct rq_ring *, uint64_t, int);
+static int rq_ring_pop(struct rq_ring *, uint64_t *, int *);
+static void rq_shard_pull(struct rq_envelope *);
+static int rq_shard_take(struct rq_shard *, uint64_t);
+static void rq_shard_taken(struct rq_shard *);
+static int scheduler_ram_batch_shards(int, int *, size_t *, uint64_t *,
+    int *);
 
 static void rq_queue_init(struct rq_queue *);
 static void rq_queue_merge(struct rq_queue *, struct rq_queue *);
 static void rq_queue_dump(struct rq_queue *, const char *);
 static void rq_queue_schedule(struct rq_queue *rq);
+static void rq_queue_expire(struct rq_queue *rq);
+static void rq_queue_parked(struct rq_queue *rq);
+static time_t rq_queue_next(struct rq_queue *rq);
+static void rq_queue_gather(struct rq_queue *, struct rq_envelope *);
 static struct evplist *rq_envelope_list(struct rq_queue *, struct rq_envelope *);
 static void rq_envelope_schedule(struct rq_queue *, struct rq_envelope *);
 static int rq_envelope_remove(struct rq_queue *, struct rq_envelope *);
 static int rq_envelope_suspend(struct rq_queue *, struct rq_envelope *);
 static int rq_envelope_resume(struct rq_queue *, struct rq_envelope *);
 static void rq_envelope_delete(struct rq_queue *, struct rq_envelope *);
+static void rq_envelope_inflight(struct rq_queue *, struct rq_envelope *);
+static void rq_envelope_reschedule(struct rq_queue *, struct rq_envelope *);
+static int rq_envelope_group(struct rq_envelope *, struct rq_envelope *);
 static const char *rq_envelope_to_text(struct rq_envelope *);
 
-static struct rq_queue	ramqueue;
+static struct rq_shard	*shards;
+static size_t		 nshards = 1;
+static int		 threaded;
+
+/* the API thread's */
 static struct tree	updates;
 static struct tree	holdqs[3]; /* delivery type */
 
-static time_t		currtime;
+static struct dict	dests;
+static pthread_mutex_t	dests_lock = PTHREAD_MUTEX_INITIALIZER;
+static int		dests_released;
+
+#define DESTS_LOCK()	do {						\
+	if (threaded)							\
+		pthread_mutex_lock(&dests_lock);			\
+} while (0)
+#define DESTS_UNLOCK()	do {						\
+	if (threaded)							\
+		pthread_mutex_unlock(&dests_lock);			\
+} while (0)
+
+static __thread time_t	currtime;
+
+/* MTA envelopes handed out, and in how many (message, destination) groups */
+static uint64_t		mta_groups;
+static uint64_t		mta_grouped;
 
 int verbose;
 
@@ -196,11 +351,39 @@ scheduler_next(time_t t0, time_t base, uint32_t step)
 static int
 scheduler_ram_init(void)
 {
-	rq_queue_init(&ramqueue);
+	struct rq_shard	*s;
+	size_t		 i;
+	int		 r;
+
+	if ((shards = calloc(nshards, sizeof(*shards))) == NULL)
+		fatal("scheduler_ram_init: calloc");
+	for (i = 0; i < nshards; i++) {
+		rq_queue_init(&shards[i].rq);
+		tree_init(&shards[i].pulled);
+	}
 	tree_init(&updates);
 	tree_init(&holdqs[D_MDA]);
 	tree_init(&holdqs[D_MTA]);
 	tree_init(&holdqs[D_BOUNCE]);
+	dict_init(&dests);
+
+	if (!threaded)
+		return 1;
+
+	for (i = 0; i < nshards; i++) {
+		s = &shards[i];
+		s->next = -1;
+		pthread_mutex_init(&s->lock, NULL);
+		pthread_cond_init(&s->wake, NULL);
+		pthread_cond_init(&s->done, NULL);
+		if ((r = pthread_create(&s->thread, NULL, rq_shard_run, s))) {
+			errno = r;
+			log_warn("warn: scheduler-ram: pthread_create");
+			return 0;
+		}
+		pthread_detach(s->thread);
+	}
+	log_info("info: scheduler-ram: %zu shards", nshards);
 
 	return 1;
 }
@@ -241,6 +424,9 @@ scheduler_ram_insert(struct scheduler_info *si)
 	envelope->message = message;
 	envelope->ctime = si->creation;
 	envelope->expire = si->creation + si->expire;
+	si->dest[sizeof(si->dest) - 1] = '\0';
+	if (si->type == D_MTA && si->dest[0] != '\0')
+		envelope->dest = rq_dest_get(si->dest);
 	envelope->sched = scheduler_backoff(si->creation,
 	    (si->type == D_MTA) ? BACKOFF_TRANSFER : BACKOFF_DELIVERY, si->retry);
 	tree_xset(&message->envelopes, envelope->evpid, envelope);
@@ -259,6 +445,7 @@ scheduler_ram_insert(struct scheduler_info *si)
 static size_t
 scheduler_ram_commit(uint32_t msgid)
 {
+	struct rq_shard	*s;
 	struct rq_queue	*update;
 	size_t		 r;
 
@@ -270,12 +457,16 @@ scheduler_ram_commit(uint32_t msgid)
 	if (verbose & TRACE_SCHEDULER)
 		rq_queue_dump(update, "update to commit");
 
-	rq_queue_merge(&ramqueue, update);
+	s = rq_shard_lock(msgid);
+	rq_queue_merge(&s->rq, update);
 
 	if (verbose & TRACE_SCHEDULER)
-		rq_queue_dump(&ramqueue, "resulting queue");
+		rq_queue_dump(&s->rq, "resulting queue");
 
-	rq_queue_schedule(&ramqueue);
+	/* the worker of the shard schedules them */
+	if (!threaded)
+		rq_queue_schedule(&s->rq);
+	rq_shard_unlock(s, 1);
 
 	free(update);
 	stat_decrement("scheduler.ramqueue.update", 1);
@@ -310,48 +501,66 @@ scheduler_ram_rollback(uint32_t msgid)
 static int
 scheduler_ram_update(struct scheduler_info *si)
 {
+	struct rq_shard		*s;
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
 	uint32_t		 msgid;
+	time_t			 until;
 
 	currtime = time(NULL);
 
 	msgid = evpid_to_msgid(si->evpid);
-	msg = tree_xget(&ramqueue.messages, msgid);
+	s = rq_shard_lock(msgid);
+	msg = tree_xget(&s->rq.messages, msgid);
 	evp = tree_xget(&msg->envelopes, si->evpid);
 
 	/* it *must* be in-flight */
 	if (evp->state != RQ_EVPSTATE_INFLIGHT)
 		fatalx("evp:%016" PRIx64 " not in-flight", si->evpid);
 
-	TAILQ_REMOVE(&ramqueue.q_inflight, evp, entry);
+	TAILQ_REMOVE(&s->rq.q_inflight, evp, entry);
 
 	/*
 	 * If the envelope was removed while inflight,  schedule it for
 	 * removal immediatly.
 	 */
 	if (evp->flags & RQ_ENVELOPE_REMOVED) {
-		TAILQ_INSERT_TAIL(&ramqueue.q_removed, evp, entry);
+		TAILQ_INSERT_TAIL(&s->rq.q_removed, evp, entry);
 		evp->state = RQ_EVPSTATE_SCHEDULED;
 		evp->t_scheduled = currtime;
+		rq_shard_unlock(s, 1);
 		return 1;
 	}
 
+	if (evp->dest)
+		rq_dest_update(evp, si->result);
+
 	evp->sched = scheduler_next(evp->ctime,
 	    (si->type == D_MTA) ? BACKOFF_TRANSFER : BACKOFF_DELIVERY, si->retry);
 
 	evp->state = RQ_EVPSTATE_PENDING;
-	if (!(evp->flags & RQ_ENVELOPE_SUSPEND))
-		sorted_insert(&ramqueue, evp);
+	if (!(evp->flags & RQ_ENVELOPE_SUSPEND)) {
+		if (evp->dest && !rq_dest_isup(evp->dest))
+			rq_dest_park(&s->rq, evp);
+		else
+			sorted_insert(&s->rq, evp);
+	}
 
 	si->nexttry = evp->sched;
+	if (evp->state == RQ_EVPSTATE_PARKED &&
+	    (until = rq_dest_until(evp->dest)) > evp->sched)
+		si->nexttry = until;
+
+	rq_shard_unlock(s, 0);
+	rq_shards_released();
 
 	return 1;
 }
 
 static int
-scheduler_ram_delete(uint64_t evpid)
+scheduler_ram_delete(uint64_t evpid, int result)
 {
+	struct rq_shard		*s;
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
 	uint32_t		 msgid;
@@ -359,16 +568,27 @@ scheduler_ram_delete(uint64_t evpid)
 	currtime = time(NULL);
 
 	msgid = evpid_to_msgid(evpid);
-	msg = tree_xget(&ramqueue.messages, msgid);
+	s = rq_shard_lock(msgid);
+	msg = tree_xget(&s->rq.messages, msgid);
 	evp = tree_xget(&msg->envelopes, evpid);
 
 	/* it *must* be in-flight */
 	if (evp->state != RQ_EVPSTATE_INFLIGHT)
 		fatalx("evp:%016" PRIx64 " not in-flight", evpid);
 
-	TAILQ_REMOVE(&ramqueue.q_inflight, evp, entry);
+	TAILQ_REMOVE(&s->rq.q_inflight, evp, entry);
+
+	/*
+	 * A permanent failure may come from a destination that never
+	 * answered, only the result tells.
+	 */
+	if (evp->dest)
+		rq_dest_update(evp, result);
+
+	rq_envelope_delete(&s->rq, evp);
 
-	rq_envelope_delete(&ramqueue, evp);
+	rq_shard_unlock(s, 0);
+	rq_shards_released();
 
 	return 1;
 }
@@ -378,6 +598,7 @@ scheduler_ram_delete(uint64_t evpid)
 static int
 scheduler_ram_hold(uint64_t evpid, uint64_t holdq)
 {
+	struct rq_shard		*s;
 	struct rq_holdq		*hq;
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
@@ -386,18 +607,20 @@ scheduler_ram_hold(uint64_t evpid, uint64_t holdq)
 	currtime = time(NULL);
 
 	msgid = evpid_to_msgid(evpid);
-	msg = tree_xget(&ramqueue.messages, msgid);
+	s = rq_shard_lock(msgid);
+	msg = tree_xget(&s->rq.messages, msgid);
 	evp = tree_xget(&msg->envelopes, evpid);
 
 	/* it *must* be in-flight */
 	if (evp->state != RQ_EVPSTATE_INFLIGHT)
 		fatalx("evp:%016" PRIx64 " not in-flight", evpid);
 
-	TAILQ_REMOVE(&ramqueue.q_inflight, evp, entry);
+	TAILQ_REMOVE(&s->rq.q_inflight, evp, entry);
 
 	/* If the envelope is suspended, just mark it as pending */
 	if (evp->flags & RQ_ENVELOPE_SUSPEND) {
 		evp->state = RQ_EVPSTATE_PENDING;
+		rq_shard_unlock(s, 0);
 		return 0;
 	}
 
@@ -414,8 +637,9 @@ scheduler_ram_hold(uint64_t evpid, uint64_t holdq)
 		evp->state = RQ_EVPSTATE_PENDING;
 		evp->flags |= RQ_ENVELOPE_UPDATE;
 		evp->flags |= RQ_ENVELOPE_OVERFLOW;
-		sorted_insert(&ramqueue, evp);
+		sorted_insert(&s->rq, evp);
 		stat_increment("scheduler.ramqueue.hold-overflow", 1);
+		rq_shard_unlock(s, 1);
 		return 0;
 	}
 
@@ -431,12 +655,14 @@ scheduler_ram_hold(uint64_t evpid, uint64_t holdq)
 	hq->count += 1;
 	stat_increment("scheduler.ramqueue.hold", 1);
 
+	rq_shard_unlock(s, 0);
 	return 1;
 }
 
 static int
 scheduler_ram_release(int type, uint64_t holdq, int n)
 {
+	struct rq_shard		*s;
 	struct rq_holdq		*hq;
 	struct rq_envelope	*evp;
 	int			 i, update;
@@ -458,6 +684,8 @@ scheduler_ram_release(int type, uint64_t holdq, int n)
 		if (evp == NULL)
 			break;
 
+		/* the holdqs are the API thread's, the envelope its shard's */
+		s = rq_shard_lock(evpid_to_msgid(evp->evpid));
 		TAILQ_REMOVE(&hq->q, evp, entry);
 		hq->count -= 1;
 		evp->holdq = 0;
@@ -469,7 +697,8 @@ scheduler_ram_release(int type, uint64_t holdq, int n)
 		evp->state = RQ_EVPSTATE_PENDING;
 		if (update)
 			evp->flags |= RQ_ENVELOPE_UPDATE;
-		sorted_insert(&ramqueue, evp);
+		sorted_insert(&s->rq, evp);
+		rq_shard_unlock(s, 1);
 	}
 
 	if (TAILQ_EMPTY(&hq->q)) {
@@ -482,102 +711,138 @@ scheduler_ram_release(int type, uint64_t holdq, int n)
 	return i;
 }
 
+/*
+ * Hand out expired envelopes only, so that a bulk expiry fills batches of
+ * its own instead of taking a slot in every round of deliveries.
+ */
 static int
-scheduler_ram_batch(int mask, int *delay, size_t *count, uint64_t *evpids, int *types)
+scheduler_ram_batch_expired(struct rq_queue *rq, size_t *count,
+    uint64_t *evpids, int *types)
 {
 	struct rq_envelope	*evp;
+	size_t			 i;
+
+	for (i = 0; i < *count; i++) {
+		if ((evp = TAILQ_FIRST(&rq->q_expired)) == NULL)
+			break;
+		TAILQ_REMOVE(&rq->q_expired, evp, entry);
+		types[i] = SCHED_EXPIRE;
+		evpids[i] = evp->evpid;
+		rq_envelope_delete(rq, evp);
+	}
+	*count = i;
+	return 1;
+}
+
+#define GROUP_LOG	1000
+
+/* an MTA group is handed out */
+static void
+scheduler_ram_group(void)
+{
+	if (++mta_groups % GROUP_LOG == 0)
+		log_info("info: scheduler-ram: %llu MTA envelopes in %llu "
+		    "groups, %.2f recipients per group",
+		    (unsigned long long)mta_grouped,
+		    (unsigned long long)mta_groups,
+		    (double)mta_grouped / mta_groups);
+}
+
+static int
+scheduler_ram_batch(int mask, int *delay, size_t *count, uint64_t *evpids, int *types)
+{
+	static int		 expireturn;
+	struct rq_shard		*s = &shards[0];
+	struct rq_queue		*rq = &s->rq;
+	struct rq_envelope	*evp, *group;
 	size_t			 i, n;
 	time_t			 t;
+	int			 expire;
+
+	if (threaded)
+		return scheduler_ram_batch_shards(mask, delay, count, evpids,
+		    types);
 
 	currtime = time(NULL);
 
-	rq_queue_schedule(&ramqueue);
+	rq_queue_schedule(rq);
 	if (verbose & TRACE_SCHEDULER)
-		rq_queue_dump(&ramqueue, "scheduler_ram_batch()");
+		rq_queue_dump(rq, "scheduler_ram_batch()");
+
+	/* expirations and deliveries take turns while both are waiting */
+	expire = (mask & SCHED_EXPIRE) && !TAILQ_EMPTY(&rq->q_expired);
+	if (expire && (expireturn = !expireturn))
+		return scheduler_ram_batch_expired(rq, count, evpids, types);
 
 	i = 0;
 	n = 0;
 
 	for (;;) {
 
-		if (mask & SCHED_REMOVE && (evp = TAILQ_FIRST(&ramqueue.q_removed))) {
-			TAILQ_REMOVE(&ramqueue.q_removed, evp, entry);
+		if (mask & SCHED_REMOVE && (evp = TAILQ_FIRST(&rq->q_removed))) {
+			TAILQ_REMOVE(&rq->q_removed, evp, entry);
 			types[i] = SCHED_REMOVE;
 			evpids[i] = evp->evpid;
-			rq_envelope_delete(&ramqueue, evp);
+			rq_envelope_delete(rq, evp);
 
 			if (++i == *count)
 				break;
 		}
 
-		if (mask & SCHED_EXPIRE && (evp = TAILQ_FIRST(&ramqueue.q_expired))) {
-			TAILQ_REMOVE(&ramqueue.q_expired, evp, entry);
-			types[i] = SCHED_EXPIRE;
-			evpids[i] = evp->evpid;
-			rq_envelope_delete(&ramqueue, evp);
-
-			if (++i == *count)
-				break;
-		}
-
-		if (mask & SCHED_UPDATE && (evp = TAILQ_FIRST(&ramqueue.q_update))) {
-			TAILQ_REMOVE(&ramqueue.q_update, evp, entry);
+		if (mask & SCHED_UPDATE && (evp = TAILQ_FIRST(&rq->q_update))) {
+			TAILQ_REMOVE(&rq->q_update, evp, entry);
 			types[i] = SCHED_UPDATE;
 			evpids[i] = evp->evpid;
-
-			if (evp->flags & RQ_ENVELOPE_OVERFLOW)
-				t = BACKOFF_OVERFLOW;
-			else if (evp->type == D_MTA)
-				t = BACKOFF_TRANSFER;
-			else
-				t = BACKOFF_DELIVERY;
-
-			evp->sched = scheduler_next(evp->ctime, t, 0);
-			evp->flags &= ~(RQ_ENVELOPE_UPDATE|RQ_ENVELOPE_OVERFLOW);
-			evp->state = RQ_EVPSTATE_PENDING;
-			if (!(evp->flags & RQ_ENVELOPE_SUSPEND))
-				sorted_insert(&ramqueue, evp);
+			rq_envelope_reschedule(rq, evp);
 
 			if (++i == *count)
 				break;
 		}
 
-		if (mask & SCHED_BOUNCE && (evp = TAILQ_FIRST(&ramqueue.q_bounce))) {
-			TAILQ_REMOVE(&ramqueue.q_bounce, evp, entry);
+		if (mask & SCHED_BOUNCE && (evp = TAILQ_FIRST(&rq->q_bounce))) {
+			TAILQ_REMOVE(&rq->q_bounce, evp, entry);
 			types[i] = SCHED_BOUNCE;
 			evpids[i] = evp->evpid;
-
-			TAILQ_INSERT_TAIL(&ramqueue.q_inflight, evp, entry);
-			evp->state = RQ_EVPSTATE_INFLIGHT;
-			evp->t_inflight = currtime;
+			rq_envelope_inflight(rq, evp);
 
 			if (++i == *count)
 				break;
 		}
 
-		if (mask & SCHED_MDA && (evp = TAILQ_FIRST(&ramqueue.q_mda))) {
-			TAILQ_REMOVE(&ramqueue.q_mda, evp, entry);
+		if (mask & SCHED_MDA && (evp = TAILQ_FIRST(&rq->q_mda))) {
+			TAILQ_REMOVE(&rq->q_mda, evp, entry);
 			types[i] = SCHED_MDA;
 			evpids[i] = evp->evpid;
-
-			TAILQ_INSERT_TAIL(&ramqueue.q_inflight, evp, entry);
-			evp->state = RQ_EVPSTATE_INFLIGHT;
-			evp->t_inflight = currtime;
+			rq_envelope_inflight(rq, evp);
 
 			if (++i == *count)
 				break;
 		}
 
-		if (mask & SCHED_MTA && (evp = TAILQ_FIRST(&ramqueue.q_mta))) {
-			TAILQ_REMOVE(&ramqueue.q_mta, evp, entry);
-			types[i] = SCHED_MTA;
-			evpids[i] = evp->evpid;
-
-			TAILQ_INSERT_TAIL(&ramqueue.q_inflight, evp, entry);
-			evp->state = RQ_EVPSTATE_INFLIGHT;
-			evp->t_inflight = currtime;
-
-			if (++i == *count)
+		if (mask & SCHED_MTA && (evp = TAILQ_FIRST(&rq->q_mta))) {
+			/* the whole group of the first one, in one round */
+			if (!s->ingroup)
+				scheduler_ram_group();
+			group = evp;
+			do {
+				TAILQ_REMOVE(&rq->q_mta, evp, entry);
+				if (!(evp->flags & RQ_ENVELOPE_GATHERED))
+					rq_queue_gather(rq, evp);
+				evp->flags &= ~RQ_ENVELOPE_GATHERED;
+				types[i] = SCHED_MTA;
+				evpids[i] = evp->evpid;
+				rq_envelope_inflight(rq, evp);
+				mta_grouped += 1;
+			} while (++i < *count &&
+			    (evp = TAILQ_FIRST(&rq->q_mta)) &&
+			    rq_envelope_group(evp, group));
+
+			/* the next batch carries on with the group */
+			s->ingroup = i == *count &&
+			    (evp = TAILQ_FIRST(&rq->q_mta)) &&
+			    rq_envelope_group(evp, group);
+
+			if (i == *count)
 				break;
 		}
 
@@ -592,30 +857,209 @@ scheduler_ram_batch(int mask, int *delay, size_t *count, uint64_t *evpids, int *
 		*count = i;
 		return 1;
 	}
+	if (expire)
+		return scheduler_ram_batch_expired(rq, count, evpids, types);
 
-	if ((evp = TAILQ_FIRST(&ramqueue.q_pending))) {
-		if (evp->sched < evp->expire)
-			t = evp->sched;
-		else
-			t = evp->expire;
+	t = rq_queue_next(rq);
+	if (t != -1)
 		*delay = (t < currtime) ? 0 : (t - currtime);
-	} else
+	else
 		*delay = -1;
 	return 0;
 }
 
+static const struct {
+	int	type;
+	int	ring;
+	int	ringed;		/* envelopes wait in the ring */
+} batchrings[] = {
+	{ SCHED_REMOVE,	RING_REMOVE,	0 },
+	{ SCHED_UPDATE,	RING_UPDATE,	0 },
+	{ SCHED_BOUNCE,	RING_BOUNCE,	1 },
+	{ SCHED_MDA,	RING_MDA,	1 },
+	{ SCHED_MTA,	RING_MTA,	1 },
+};
+
+/*
+ * The batch of the sharded queue, merged from the rings of the shards in
+ * the same order as the envelopes of one queue are.  The shards are only
+ * made to run a pass and waited for when their rings have nothing to
+ * give, and are sent to refill them otherwise.  Ring entries pulled back
+ * since they were pushed are left out.
+ */
+static int
+scheduler_ram_batch_shards(int mask, int *delay, size_t *count,
+    uint64_t *evpids, int *types)
+{
+	static int	 expireturn;
+	static size_t	 first;
+	struct rq_shard	*s;
+	struct rq_ring	*r;
+	size_t		 i, j, k, n;
+	time_t		 t, next;
+	int		 expire, more, stale, took;
+
+	currtime = time(NULL);
+
+	if (!rq_shards_ready(mask))
+		rq_shards_pass(1);
+
+	/* expirations and deliveries take turns while both are waiting */
+	expire = (mask & SCHED_EXPIRE) && rq_shards_ready(SCHED_EXPIRE);
+	if (expire && (expireturn = !expireturn))
+		goto expired;
+
+	/* a group cut by the last batch goes on first */
+	for (k = 0; k < nshards; k++)
+		if (shards[k].ingroup) {
+			first = k;
+			break;
+		}
+
+	stale = 0;
+merge:
+	i = 0;
+	n = 0;
+
+	for (;;) {
+		for (k = 0; k < nshards && i < *count; k++) {
+			s = &shards[(first + k) % nshards];
+			for (j = 0; j < nitems(batchrings) && i < *count; j++) {
+				if (!(mask & batchrings[j].type))
+					continue;
+				r = &s->rings[batchrings[j].ring];
+				if (batchrings[j].ring != RING_MTA) {
+					while (rq_ring_pop(r, &evpids[i], &more)) {
+						if (!batchrings[j].ringed ||
+						    rq_shard_take(s, evpids[i])) {
+							types[i++] = batchrings[j].type;
+							break;
+						}
+						stale = 1;
+					}
+					continue;
+				}
+				/* the whole group, as rq_shard_fill() ordered */
+				took = 0;
+				while (i < *count &&
+				    rq_ring_pop(r, &evpids[i], &more)) {
+					if (!rq_shard_take(s, evpids[i])) {
+						/* the group may end with it */
+						stale = 1;
+						if (more)
+							continue;
+						s->ingroup = 0;
+						if (took)
+							break;
+						continue;
+					}
+					if (!s->ingroup)
+						scheduler_ram_group();
+					mta_grouped += 1;
+					types[i++] = SCHED_MTA;
+					took = 1;
+					if (!(s->ingroup = more))
+						break;
+				}
+			}
+		}
+
+		/* nothing seen this round */
+		if (i == n || i == *count)
+			break;
+
+		n = i;
+	}
+	first = (first + 1) % nshards;
+
+	if (i) {
+		rq_shards_pass(0);
+		*count = i;
+		return 1;
+	}
+
+	/* the rings only had envelopes pulled back, have them refilled */
+	if (stale) {
+		stale = 0;
+		rq_shards_pass(1);
+		goto merge;
+	}
+	if (expire)
+		goto expired;
+
+	t = -1;
+	for (k = 0; k < nshards; k++) {
+		next = __atomic_load_n(&shards[k].next, __ATOMIC_ACQUIRE);
+		if (next != -1 && (t == -1 || next < t))
+			t = next;
+	}
+	if (t != -1)
+		*delay = (t < currtime) ? 0 : (t - currtime);
+	else
+		*delay = -1;
+	return 0;
+
+expired:
+	for (i = 0, n = ~0; i < *count && n != i; ) {
+		n = i;
+		for (k = 0; k < nshards && i < *count; k++)
+			if (rq_ring_pop(&shards[k].rings[RING_EXPIRE],
+			    &evpids[i], &more))
+				types[i++] = SCHED_EXPIRE;
+	}
+	rq_shards_pass(0);
+	*count = i;
+	return 1;
+}
+
+static int
+scheduler_ram_msgid_cmp(const void *a, const void *b)
+{
+	uint32_t	m1 = *(const uint32_t *)a;
+	uint32_t	m2 = *(const uint32_t *)b;
+
+	return (m1 < m2) ? -1 : (m1 > m2);
+}
+
 static size_t
 scheduler_ram_messages(uint32_t from, uint32_t *dst, size_t size)
 {
-	uint64_t id;
-	size_t	 n;
-	void	*i;
+	struct rq_shard	*s;
+	uint64_t	 id;
+	uint32_t	*all;
+	size_t		 k, n, total = 0;
+	void		*i;
+
+	if (!threaded) {
+		for (n = 0, i = NULL; n < size; n++) {
+			if (tree_iterfrom(&shards[0].rq.messages, &i, from,
+			    &id, NULL) == 0)
+				break;
+			dst[n] = id;
+		}
+		return n;
+	}
 
-	for (n = 0, i = NULL; n < size; n++) {
-		if (tree_iterfrom(&ramqueue.messages, &i, from, &id, NULL) == 0)
-			break;
-		dst[n] = id;
+	/* the first size of every shard, of which the first size overall */
+	if ((all = reallocarray(NULL, nshards, size * sizeof(*all))) == NULL) {
+		log_warn("warn: scheduler-ram: reallocarray");
+		return 0;
+	}
+	for (k = 0; k < nshards; k++) {
+		s = &shards[k];
+		pthread_mutex_lock(&s->lock);
+		for (n = 0, i = NULL; n < size; n++) {
+			if (tree_iterfrom(&s->rq.messages, &i, from, &id,
+			    NULL) == 0)
+				break;
+			all[total++] = id;
+		}
+		pthread_mutex_unlock(&s->lock);
 	}
+	qsort(all, total, sizeof(*all), scheduler_ram_msgid_cmp);
+	n = (total < size) ? total : size;
+	memcpy(dst, all, n * sizeof(*dst));
+	free(all);
 
 	return n;
 }
@@ -623,13 +1067,17 @@ scheduler_ram_messages(uint32_t from, uint32_t *dst, size_t size)
 static size_t
 scheduler_ram_envelopes(uint64_t from, struct evpstate *dst, size_t size)
 {
+	struct rq_shard		*s;
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
 	void			*i;
 	size_t			 n;
 
-	if ((msg = tree_get(&ramqueue.messages, evpid_to_msgid(from))) == NULL)
+	s = rq_shard_lock(evpid_to_msgid(from));
+	if ((msg = tree_get(&s->rq.messages, evpid_to_msgid(from))) == NULL) {
+		rq_shard_unlock(s, 0);
 		return 0;
+	}
 
 	for (n = 0, i = NULL; n < size; ) {
 
@@ -648,7 +1096,8 @@ scheduler_ram_envelopes(uint64_t from, struct evpstate *dst, size_t size)
 		if (evp->state == RQ_EVPSTATE_PENDING) {
 			dst[n].time = evp->sched;
 			dst[n].flags = EF_PENDING;
-		} else if (evp->state == RQ_EVPSTATE_SCHEDULED) {
+		} else if (evp->state == RQ_EVPSTATE_SCHEDULED ||
+		    evp->state == RQ_EVPSTATE_RINGED) {
 			dst[n].time = evp->t_scheduled;
 			dst[n].flags = EF_PENDING;
 		} else if (evp->state == RQ_EVPSTATE_INFLIGHT) {
@@ -659,6 +1108,10 @@ scheduler_ram_envelopes(uint64_t from, struct evpstate *dst, size_t size)
 			dst[n].time = evp->t_scheduled;
 			dst[n].flags = EF_PENDING;
 			dst[n].flags |= EF_HOLD;
+		} else if (evp->state == RQ_EVPSTATE_PARKED) {
+			/* pending until its destination is probed */
+			dst[n].time = rq_dest_until(evp->dest);
+			dst[n].flags = EF_PENDING;
 		}
 		if (evp->flags & RQ_ENVELOPE_SUSPEND)
 			dst[n].flags |= EF_SUSPEND;
@@ -666,12 +1119,14 @@ scheduler_ram_envelopes(uint64_t from, struct evpstate *dst, size_t size)
 		n++;
 	}
 
+	rq_shard_unlock(s, 0);
 	return n;
 }
 
 static int
 scheduler_ram_schedule(uint64_t evpid)
 {
+	struct rq_shard		*s;
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
 	uint32_t		 msgid;
@@ -680,35 +1135,41 @@ scheduler_ram_schedule(uint64_t evpid)
 
 	currtime = time(NULL);
 
-	if (evpid > 0xffffffff) {
+	if (evpid > 0xffffffff)
 		msgid = evpid_to_msgid(evpid);
-		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
-			return 0;
+	else
+		msgid = evpid;
+
+	r = 0;
+	s = rq_shard_lock(msgid);
+	if ((msg = tree_get(&s->rq.messages, msgid)) == NULL)
+		goto done;
+
+	if (evpid > 0xffffffff) {
 		if ((evp = tree_get(&msg->envelopes, evpid)) == NULL)
-			return 0;
+			goto done;
 		if (evp->state == RQ_EVPSTATE_INFLIGHT)
-			return 0;
-		rq_envelope_schedule(&ramqueue, evp);
-		return 1;
+			goto done;
+		rq_envelope_schedule(&s->rq, evp);
+		r = 1;
 	} else {
-		msgid = evpid;
-		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
-			return 0;
 		i = NULL;
-		r = 0;
 		while (tree_iter(&msg->envelopes, &i, NULL, (void*)(&evp))) {
 			if (evp->state == RQ_EVPSTATE_INFLIGHT)
 				continue;
-			rq_envelope_schedule(&ramqueue, evp);
+			rq_envelope_schedule(&s->rq, evp);
 			r++;
 		}
-		return r;
 	}
+done:
+	rq_shard_unlock(s, r);
+	return r;
 }
 
 static int
 scheduler_ram_remove(uint64_t evpid)
 {
+	struct rq_shard		*s;
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
 	uint32_t		 msgid;
@@ -717,31 +1178,36 @@ scheduler_ram_remove(uint64_t evpid)
 
 	currtime = time(NULL);
 
-	if (evpid > 0xffffffff) {
+	if (evpid > 0xffffffff)
 		msgid = evpid_to_msgid(evpid);
-		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
-			return 0;
+	else
+		msgid = evpid;
+
+	r = 0;
+	s = rq_shard_lock(msgid);
+	if ((msg = tree_get(&s->rq.messages, msgid)) == NULL)
+		goto done;
+
+	if (evpid > 0xffffffff) {
 		if ((evp = tree_get(&msg->envelopes, evpid)) == NULL)
-			return 0;
-		if (rq_envelope_remove(&ramqueue, evp))
-			return 1;
-		return 0;
+			goto done;
+		if (rq_envelope_remove(&s->rq, evp))
+			r = 1;
 	} else {
-		msgid = evpid;
-		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
-			return 0;
 		i = NULL;
-		r = 0;
 		while (tree_iter(&msg->envelopes, &i, NULL, (void*)(&evp)))
-			if (rq_envelope_remove(&ramqueue, evp))
+			if (rq_envelope_remove(&s->rq, evp))
 				r++;
-		return r;
 	}
+done:
+	rq_shard_unlock(s, r);
+	return r;
 }
 
 static int
 scheduler_ram_suspend(uint64_t evpid)
 {
+	struct rq_shard		*s;
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
 	uint32_t		 msgid;
@@ -750,31 +1216,36 @@ scheduler_ram_suspend(uint64_t evpid)
 
 	currtime = time(NULL);
 
-	if (evpid > 0xffffffff) {
+	if (evpid > 0xffffffff)
 		msgid = evpid_to_msgid(evpid);
-		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
-			return 0;
+	else
+		msgid = evpid;
+
+	r = 0;
+	s = rq_shard_lock(msgid);
+	if ((msg = tree_get(&s->rq.messages, msgid)) == NULL)
+		goto done;
+
+	if (evpid > 0xffffffff) {
 		if ((evp = tree_get(&msg->envelopes, evpid)) == NULL)
-			return 0;
-		if (rq_envelope_suspend(&ramqueue, evp))
-			return 1;
-		return 0;
+			goto done;
+		if (rq_envelope_suspend(&s->rq, evp))
+			r = 1;
 	} else {
-		msgid = evpid;
-		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
-			return 0;
 		i = NULL;
-		r = 0;
 		while (tree_iter(&msg->envelopes, &i, NULL, (void*)(&evp)))
-			if (rq_envelope_suspend(&ramqueue, evp))
+			if (rq_envelope_suspend(&s->rq, evp))
 				r++;
-		return r;
 	}
+done:
+	rq_shard_unlock(s, 0);
+	return r;
 }
 
 static int
 scheduler_ram_resume(uint64_t evpid)
 {
+	struct rq_shard		*s;
 	struct rq_message	*msg;
 	struct rq_envelope	*evp;
 	uint32_t		 msgid;
@@ -783,26 +1254,30 @@ scheduler_ram_resume(uint64_t evpid)
 
 	currtime = time(NULL);
 
-	if (evpid > 0xffffffff) {
+	if (evpid > 0xffffffff)
 		msgid = evpid_to_msgid(evpid);
-		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
-			return 0;
+	else
+		msgid = evpid;
+
+	r = 0;
+	s = rq_shard_lock(msgid);
+	if ((msg = tree_get(&s->rq.messages, msgid)) == NULL)
+		goto done;
+
+	if (evpid > 0xffffffff) {
 		if ((evp = tree_get(&msg->envelopes, evpid)) == NULL)
-			return 0;
-		if (rq_envelope_resume(&ramqueue, evp))
-			return 1;
-		return 0;
+			goto done;
+		if (rq_envelope_resume(&s->rq, evp))
+			r = 1;
 	} else {
-		msgid = evpid;
-		if ((msg = tree_get(&ramqueue.messages, msgid)) == NULL)
-			return 0;
 		i = NULL;
-		r = 0;
 		while (tree_iter(&msg->envelopes, &i, NULL, (void*)(&evp)))
-			if (rq_envelope_resume(&ramqueue, evp))
+			if (rq_envelope_resume(&s->rq, evp))
 				r++;
-		return r;
 	}
+done:
+	rq_shard_unlock(s, r);
+	return r;
 }
 
 static void
@@ -816,6 +1291,643 @@ sorted_insert(struct rq_queue *rq, struct rq_envelope *evp)
 		TAILQ_INSERT_BEFORE(evp2, evp, entry);
 	else
 		TAILQ_INSERT_TAIL(&rq->q_pending, evp, entry);
+	rq_expiry_insert(rq, evp);
+}
+
+#define EXPIRY_BUCKET	60
+
+/*
+ * Pending envelopes are also indexed by the minute they expire in, apart
+ * from the retry schedule, so that whole minutes are expired at once.
+ */
+static void
+rq_expiry_insert(struct rq_queue *rq, struct rq_envelope *evp)
+{
+	struct rq_expiry	*x;
+	uint64_t		 minute;
+
+	minute = evp->expire / EXPIRY_BUCKET;
+	if ((x = tree_get(&rq->q_expiry, minute)) == NULL) {
+		x = xcalloc(1, sizeof *x, "rq_expiry_insert");
+		x->minute = minute;
+		TAILQ_INIT(&x->q);
+		tree_xset(&rq->q_expiry, minute, x);
+		stat_increment("scheduler.ramqueue.expiry", 1);
+	}
+	TAILQ_INSERT_TAIL(&x->q, evp, x_entry);
+	x->count += 1;
+	evp->expiry = x;
+}
+
+static void
+rq_expiry_remove(struct rq_queue *rq, struct rq_envelope *evp)
+{
+	struct rq_expiry	*x;
+
+	if ((x = evp->expiry) == NULL)
+		return;
+	TAILQ_REMOVE(&x->q, evp, x_entry);
+	evp->expiry = NULL;
+	if (--x->count == 0) {
+		tree_xpop(&rq->q_expiry, x->minute);
+		free(x);
+		stat_decrement("scheduler.ramqueue.expiry", 1);
+	}
+}
+
+/* when the earliest minute is over, or -1 */
+static time_t
+rq_expiry_next(struct rq_queue *rq)
+{
+	uint64_t	 minute;
+	void		*i = NULL;
+
+	if (!tree_iter(&rq->q_expiry, &i, &minute, NULL))
+		return -1;
+	return (minute + 1) * EXPIRY_BUCKET;
+}
+
+/* the number of pending and parked envelopes that expire before t */
+static size_t
+rq_expiry_count(struct rq_queue *rq, time_t t)
+{
+	struct rq_expiry	*x;
+	size_t			 n = 0;
+	void			*i = NULL;
+
+	while (tree_iter(&rq->q_expiry, &i, NULL, (void **)&x)) {
+		if ((time_t)x->minute * EXPIRY_BUCKET >= t)
+			break;
+		n += x->count;
+	}
+	return n;
+}
+
+#define DEST_FAILURES		5	/* in a row, to take it down */
+#define DEST_BACKOFF		120	/* before the first probe */
+#define DEST_BACKOFF_MAX	3600
+#define DEST_OUTAGES_MAX	5	/* doublings of the backoff */
+
+static struct rq_dest *
+rq_dest_get(const char *name)
+{
+	struct rq_dest	*d;
+
+	DESTS_LOCK();
+	if ((d = dict_get(&dests, name)) == NULL) {
+		d = xcalloc(1, sizeof *d, "rq_dest_get");
+		(void)strlcpy(d->name, name, sizeof d->name);
+		dict_xset(&dests, d->name, d);
+		stat_increment("scheduler.ramqueue.dest", 1);
+	}
+	d->refs += 1;
+	DESTS_UNLOCK();
+	return d;
+}
+
+static void
+rq_dest_unref(struct rq_dest *d)
+{
+	DESTS_LOCK();
+	if (--d->refs == 0) {
+		dict_xpop(&dests, d->name);
+		free(d);
+		stat_decrement("scheduler.ramqueue.dest", 1);
+	}
+	DESTS_UNLOCK();
+}
+
+static int
+rq_dest_isup(struct rq_dest *d)
+{
+	int	up;
+
+	DESTS_LOCK();
+	up = d->state == RQ_DEST_UP;
+	DESTS_UNLOCK();
+	return up;
+}
+
+static time_t
+rq_dest_until(struct rq_dest *d)
+{
+	time_t	until;
+
+	DESTS_LOCK();
+	until = d->until;
+	DESTS_UNLOCK();
+	return until;
+}
+
+/* parked envelopes still expire on time */
+static void
+rq_dest_park(struct rq_queue *rq, struct rq_envelope *evp)
+{
+	struct rq_parking	*p;
+	uint64_t		 key = (uintptr_t)evp->dest;
+
+	if ((p = tree_get(&rq->q_parked, key)) == NULL) {
+		p = xcalloc(1, sizeof *p, "rq_dest_park");
+		p->dest = evp->dest;
+		TAILQ_INIT(&p->q);
+		tree_xset(&rq->q_parked, key, p);
+		TAILQ_INSERT_TAIL(&rq->q_parkings, p, entry);
+	}
+	TAILQ_INSERT_TAIL(&p->q, evp, entry);
+	p->count += 1;
+	evp->state = RQ_EVPSTATE_PARKED;
+	evp->flags &= ~RQ_ENVELOPE_PROBE;
+	rq_expiry_insert(rq, evp);
+}
+
+static void
+rq_dest_unpark(struct rq_queue *rq, struct rq_envelope *evp)
+{
+	struct rq_parking	*p;
+	uint64_t		 key = (uintptr_t)evp->dest;
+
+	p = tree_xget(&rq->q_parked, key);
+	TAILQ_REMOVE(&p->q, evp, entry);
+	if (--p->count == 0) {
+		tree_xpop(&rq->q_parked, key);
+		TAILQ_REMOVE(&rq->q_parkings, p, entry);
+		free(p);
+	}
+	rq_expiry_remove(rq, evp);
+}
+
+/* the functions below are called with the destinations locked */
+
+static void
+rq_dest_down(struct rq_dest *d)
+{
+	time_t	delay;
+
+	delay = (time_t)DEST_BACKOFF << d->outages;
+	if (delay > DEST_BACKOFF_MAX)
+		delay = DEST_BACKOFF_MAX;
+
+	d->state = RQ_DEST_DOWN;
+	d->until = currtime + delay;
+
+	log_info("info: scheduler-ram: %s is down, next probe in %s",
+	    d->name, duration_to_text(delay));
+}
+
+/*
+ * The destination answered.  Its envelopes are released by the next
+ * schedule of every queue that parked some.
+ */
+static void
+rq_dest_up(struct rq_dest *d)
+{
+	d->failures = 0;
+	d->outages = 0;
+	if (d->state == RQ_DEST_UP)
+		return;
+
+	d->state = RQ_DEST_UP;
+	dests_released = 1;
+
+	log_info("info: scheduler-ram: %s is up", d->name);
+}
+
+/* whether evp is sent as the probe of its destination */
+static int
+rq_dest_probe(struct rq_dest *d, struct rq_envelope *evp)
+{
+	/* a probe that never reported back is given up on */
+	if (d->state == RQ_DEST_PROBING &&
+	    d->until + DEST_BACKOFF_MAX <= currtime)
+		d->state = RQ_DEST_DOWN;
+
+	if (d->state != RQ_DEST_DOWN || d->until > currtime)
+		return 0;
+
+	d->state = RQ_DEST_PROBING;
+	d->until = currtime;
+	evp->flags |= RQ_ENVELOPE_PROBE;
+	return 1;
+}
+
+/* the functions below lock the destinations themselves */
+
+/* whether evp has to wait for its destination to come back */
+static int
+rq_dest_wait(struct rq_envelope *evp)
+{
+	int	wait;
+
+	DESTS_LOCK();
+	wait = evp->dest->state != RQ_DEST_UP &&
+	    !rq_dest_probe(evp->dest, evp);
+	DESTS_UNLOCK();
+	return wait;
+}
+
+/* account for the outcome of a delivery to the destination of evp */
+static void
+rq_dest_update(struct rq_envelope *evp, int result)
+{
+	struct rq_dest	*d = evp->dest;
+	int		 probe;
+
+	DESTS_LOCK();
+	probe = (evp->flags & RQ_ENVELOPE_PROBE) &&
+	    d->state == RQ_DEST_PROBING;
+	evp->flags &= ~RQ_ENVELOPE_PROBE;
+
+	switch (result) {
+	case SCHED_RESULT_CONNECT:
+	case SCHED_RESULT_SERVICE:
+		if (probe) {
+			if (d->outages < DEST_OUTAGES_MAX)
+				d->outages += 1;
+			rq_dest_down(d);
+		} else if (d->state == RQ_DEST_UP &&
+		    ++d->failures >= DEST_FAILURES)
+			rq_dest_down(d);
+		break;
+	case SCHED_RESULT_RCPT:
+	case SCHED_RESULT_DONE:
+		rq_dest_up(d);
+		break;
+	default:
+		/* nothing learnt from the probe, send another one */
+		if (probe) {
+			d->state = RQ_DEST_DOWN;
+			d->until = currtime;
+		}
+		break;
+	}
+	DESTS_UNLOCK();
+}
+
+/*
+ * Release the envelopes parked on destinations that came back up, and
+ * send one as a probe to those whose backoff is over.
+ */
+static void
+rq_queue_parked(struct rq_queue *rq)
+{
+	struct rq_parking	*p, *next;
+	struct rq_envelope	*evp;
+	size_t			 n;
+	int			 up, probe;
+
+	for (p = TAILQ_FIRST(&rq->q_parkings); p; p = next) {
+		next = TAILQ_NEXT(p, entry);
+		evp = TAILQ_FIRST(&p->q);
+
+		DESTS_LOCK();
+		up = p->dest->state == RQ_DEST_UP;
+		probe = !up && rq_dest_probe(p->dest, evp);
+		DESTS_UNLOCK();
+
+		if (probe) {
+			rq_dest_unpark(rq, evp);
+			TAILQ_INSERT_TAIL(&rq->q_mta, evp, entry);
+			evp->state = RQ_EVPSTATE_SCHEDULED;
+			evp->t_scheduled = currtime;
+			continue;
+		}
+		if (!up)
+			continue;
+
+		/* p goes away with its last envelope */
+		for (n = p->count; n; n--) {
+			evp = TAILQ_FIRST(&p->q);
+			rq_dest_unpark(rq, evp);
+			evp->state = RQ_EVPSTATE_PENDING;
+			evp->sched = currtime;
+			sorted_insert(rq, evp);
+		}
+	}
+}
+
+/* when the next probe is due, or -1 */
+static time_t
+rq_queue_nextprobe(struct rq_queue *rq)
+{
+	struct rq_parking	*p;
+	time_t			 t = -1;
+
+	DESTS_LOCK();
+	TAILQ_FOREACH(p, &rq->q_parkings, entry) {
+		if (p->dest->state != RQ_DEST_DOWN)
+			continue;
+		if (t == -1 || p->dest->until < t)
+			t = p->dest->until;
+	}
+	DESTS_UNLOCK();
+	return t;
+}
+
+/* when the next envelope of the queue is due, or -1 */
+static time_t
+rq_queue_next(struct rq_queue *rq)
+{
+	struct rq_envelope	*evp;
+	time_t			 t, t2;
+
+	t = -1;
+	if ((evp = TAILQ_FIRST(&rq->q_pending)))
+		t = evp->sched;
+	if ((t2 = rq_expiry_next(rq)) != -1 && (t == -1 || t2 < t))
+		t = t2;
+	if ((t2 = rq_queue_nextprobe(rq)) != -1 && (t == -1 || t2 < t))
+		t = t2;
+	return t;
+}
+
+static struct rq_shard *
+rq_shard_lock(uint32_t msgid)
+{
+	struct rq_shard	*s = &shards[msgid % nshards];
+
+	if (threaded) {
+		pthread_mutex_lock(&s->lock);
+		rq_shard_taken(s);
+	}
+	return s;
+}
+
+/* kick the worker of the shard when there is new work for it */
+static void
+rq_shard_unlock(struct rq_shard *s, int kick)
+{
+	if (!threaded)
+		return;
+	if (kick) {
+		s->kick = 1;
+		pthread_cond_signal(&s->wake);
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* have every shard run a pass, and wait for them to be done */
+static void
+rq_shards_pass(int wait)
+{
+	struct rq_shard	*s;
+	size_t		 i;
+
+	for (i = 0; i < nshards; i++) {
+		s = &shards[i];
+		pthread_mutex_lock(&s->lock);
+		s->kick = 1;
+		s->waitpass = s->passes;
+		pthread_cond_signal(&s->wake);
+		pthread_mutex_unlock(&s->lock);
+	}
+	if (!wait)
+		return;
+
+	for (i = 0; i < nshards; i++) {
+		s = &shards[i];
+		pthread_mutex_lock(&s->lock);
+		while (s->passes == s->waitpass)
+			pthread_cond_wait(&s->done, &s->lock);
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+/* the parked envelopes of a destination back up are in every shard */
+static void
+rq_shards_released(void)
+{
+	if (!threaded || !dests_released)
+		return;
+	dests_released = 0;
+	rq_shards_pass(0);
+}
+
+/* whether a ring of a type in mask has envelopes */
+static int
+rq_shards_ready(int mask)
+{
+	size_t	i, j;
+
+	for (i = 0; i < nshards; i++) {
+		if (mask & SCHED_EXPIRE &&
+		    !rq_ring_empty(&shards[i].rings[RING_EXPIRE]))
+			return 1;
+		for (j = 0; j < nitems(batchrings); j++)
+			if (mask & batchrings[j].type &&
+			    !rq_ring_empty(&shards[i].rings[batchrings[j].ring]))
+				return 1;
+	}
+	return 0;
+}
+
+/*
+ * The rings have a single producer, the worker of the shard, and a
+ * single consumer, the API thread.  The taken ring goes the other way,
+ * its consumers take turns under the lock of the shard.
+ */
+static int
+rq_ring_full(struct rq_ring *r)
+{
+	return (r->tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) ==
+	    RING_SIZE);
+}
+
+static int
+rq_ring_empty(struct rq_ring *r)
+{
+	return (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) ==
+	    __atomic_load_n(&r->head, __ATOMIC_ACQUIRE));
+}
+
+static void
+rq_ring_push(struct rq_ring *r, uint64_t evpid, int more)
+{
+	size_t	tail = r->tail;
+
+	r->evpids[tail % RING_SIZE] = evpid;
+	r->more[tail % RING_SIZE] = more;
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int
+rq_ring_pop(struct rq_ring *r, uint64_t *evpid, int *more)
+{
+	size_t	head = r->head;
+
+	if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+		return 0;
+	*evpid = r->evpids[head % RING_SIZE];
+	*more = r->more[head % RING_SIZE];
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ * Move what is ready in the queue of the shard to its rings.  Removals,
+ * expirations and updates are done as scheduler_ram_batch() does when it
+ * hands them out, the others are RINGED.  The lock of the shard is taken
+ * ring by ring, not for the whole pass.
+ */
+static void
+rq_shard_fill(struct rq_shard *s)
+{
+	struct rq_queue		*rq = &s->rq;
+	struct rq_envelope	*evp, *next;
+
+	pthread_mutex_lock(&s->lock);
+	while (!rq_ring_full(&s->rings[RING_REMOVE]) &&
+	    (evp = TAILQ_FIRST(&rq->q_removed))) {
+		TAILQ_REMOVE(&rq->q_removed, evp, entry);
+		rq_ring_push(&s->rings[RING_REMOVE], evp->evpid, 0);
+		rq_envelope_delete(rq, evp);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	pthread_mutex_lock(&s->lock);
+	while (!rq_ring_full(&s->rings[RING_EXPIRE]) &&
+	    (evp = TAILQ_FIRST(&rq->q_expired))) {
+		TAILQ_REMOVE(&rq->q_expired, evp, entry);
+		rq_ring_push(&s->rings[RING_EXPIRE], evp->evpid, 0);
+		rq_envelope_delete(rq, evp);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	pthread_mutex_lock(&s->lock);
+	while (!rq_ring_full(&s->rings[RING_UPDATE]) &&
+	    (evp = TAILQ_FIRST(&rq->q_update))) {
+		TAILQ_REMOVE(&rq->q_update, evp, entry);
+		rq_ring_push(&s->rings[RING_UPDATE], evp->evpid, 0);
+		rq_envelope_reschedule(rq, evp);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	pthread_mutex_lock(&s->lock);
+	while (!rq_ring_full(&s->rings[RING_BOUNCE]) &&
+	    (evp = TAILQ_FIRST(&rq->q_bounce))) {
+		TAILQ_REMOVE(&rq->q_bounce, evp, entry);
+		evp->state = RQ_EVPSTATE_RINGED;
+		rq_ring_push(&s->rings[RING_BOUNCE], evp->evpid, 0);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	pthread_mutex_lock(&s->lock);
+	while (!rq_ring_full(&s->rings[RING_MDA]) &&
+	    (evp = TAILQ_FIRST(&rq->q_mda))) {
+		TAILQ_REMOVE(&rq->q_mda, evp, entry);
+		evp->state = RQ_EVPSTATE_RINGED;
+		rq_ring_push(&s->rings[RING_MDA], evp->evpid, 0);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	/* groups are kept together, see rq_queue_gather() */
+	pthread_mutex_lock(&s->lock);
+	while (!rq_ring_full(&s->rings[RING_MTA]) &&
+	    (evp = TAILQ_FIRST(&rq->q_mta))) {
+		TAILQ_REMOVE(&rq->q_mta, evp, entry);
+		if (!(evp->flags & RQ_ENVELOPE_GATHERED))
+			rq_queue_gather(rq, evp);
+		evp->flags &= ~RQ_ENVELOPE_GATHERED;
+		evp->state = RQ_EVPSTATE_RINGED;
+		next = TAILQ_FIRST(&rq->q_mta);
+		rq_ring_push(&s->rings[RING_MTA], evp->evpid,
+		    next && rq_envelope_group(next, evp));
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* the ring entry of a RINGED envelope pulled back is to be skipped */
+static void
+rq_shard_pull(struct rq_envelope *evp)
+{
+	struct rq_shard	*s = &shards[evp->message->msgid % nshards];
+	uintptr_t	 n;
+
+	n = (uintptr_t)tree_get(&s->pulled, evp->evpid);
+	tree_set(&s->pulled, evp->evpid, (void *)(n + 1));
+}
+
+/*
+ * In the API thread, without the lock of the shard: hand out an envelope
+ * popped from a ring, unless its entry was pulled back.
+ */
+static int
+rq_shard_take(struct rq_shard *s, uint64_t evpid)
+{
+	uintptr_t	n;
+
+	if ((n = (uintptr_t)tree_get(&s->pulled, evpid))) {
+		if (n == 1)
+			tree_xpop(&s->pulled, evpid);
+		else
+			tree_set(&s->pulled, evpid, (void *)(n - 1));
+		return 0;
+	}
+
+	if (rq_ring_full(&s->taken)) {
+		pthread_mutex_lock(&s->lock);
+		rq_shard_taken(s);
+		pthread_mutex_unlock(&s->lock);
+	}
+	rq_ring_push(&s->taken, evpid, 0);
+	return 1;
+}
+
+/* under the lock of the shard, put the envelopes handed out in-flight */
+static void
+rq_shard_taken(struct rq_shard *s)
+{
+	struct rq_message	*msg;
+	struct rq_envelope	*evp;
+	uint64_t		 evpid;
+	int			 more;
+
+	while (rq_ring_pop(&s->taken, &evpid, &more)) {
+		msg = tree_xget(&s->rq.messages, evpid_to_msgid(evpid));
+		evp = tree_xget(&msg->envelopes, evpid);
+		if (evp->state != RQ_EVPSTATE_RINGED)
+			fatalx("evp:%016" PRIx64 " not ringed", evpid);
+		rq_envelope_inflight(&s->rq, evp);
+	}
+}
+
+static void *
+rq_shard_run(void *arg)
+{
+	struct rq_shard	*s = arg;
+	struct timespec	 ts;
+	time_t		 next;
+
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		s->kick = 0;
+		currtime = time(NULL);
+		rq_shard_taken(s);
+		rq_queue_schedule(&s->rq);
+		pthread_mutex_unlock(&s->lock);
+
+		rq_shard_fill(s);
+
+		pthread_mutex_lock(&s->lock);
+		next = rq_queue_next(&s->rq);
+		__atomic_store_n(&s->next, next, __ATOMIC_RELEASE);
+		s->passes += 1;
+		pthread_cond_broadcast(&s->done);
+
+		/* what is due and left out for lack of room is retried */
+		if (next != -1 && next <= currtime)
+			next = currtime + 1;
+		ts.tv_sec = next;
+		ts.tv_nsec = 0;
+		while (!s->kick) {
+			if (next == -1)
+				pthread_cond_wait(&s->wake, &s->lock);
+			else if (pthread_cond_timedwait(&s->wake, &s->lock,
+			    &ts) == ETIMEDOUT)
+				break;
+		}
+	}
+
+	return (NULL);
 }
 
 static void
@@ -832,6 +1944,9 @@ rq_queue_init(struct rq_queue *rq)
 	TAILQ_INIT(&rq->q_expired);
 	TAILQ_INIT(&rq->q_removed);
 	SPLAY_INIT(&rq->q_priotree);
+	tree_init(&rq->q_expiry);
+	tree_init(&rq->q_parked);
+	TAILQ_INIT(&rq->q_parkings);
 }
 
 static void
@@ -875,9 +1990,13 @@ rq_queue_schedule(struct rq_queue *rq)
 	struct rq_envelope	*evp;
 	size_t			 n;
 
+	/* expired envelopes must not be scheduled */
+	rq_queue_expire(rq);
+	rq_queue_parked(rq);
+
 	n = 0;
 	while ((evp = TAILQ_FIRST(&rq->q_pending))) {
-		if (evp->sched > currtime && evp->expire > currtime)
+		if (evp->sched > currtime)
 			break;
 
 		if (n == SCHEDULEMAX)
@@ -887,17 +2006,127 @@ rq_queue_schedule(struct rq_queue *rq)
 			fatalx("evp:%016" PRIx64 " flags=0x%x", evp->evpid,
 			    evp->flags);
 
-		if (evp->expire <= currtime) {
+		/* wait with the others for the destination to come back */
+		if (evp->dest && !(evp->flags & RQ_ENVELOPE_UPDATE) &&
+		    rq_dest_wait(evp)) {
 			TAILQ_REMOVE(&rq->q_pending, evp, entry);
 			SPLAY_REMOVE(prioqtree, &rq->q_priotree, evp);
+			rq_expiry_remove(rq, evp);
+			rq_dest_park(rq, evp);
+			n += 1;
+			continue;
+		}
+
+		rq_envelope_schedule(rq, evp);
+		n += 1;
+	}
+}
+
+/*
+ * Expire the pending envelopes of every minute that is over, whatever
+ * their retry schedule.  An envelope expires at the end of the minute its
+ * expiry falls in.
+ */
+static void
+rq_queue_expire(struct rq_queue *rq)
+{
+	struct rq_expiry	*x;
+	struct rq_envelope	*evp;
+	uint64_t		 minute;
+	size_t			 n = 0;
+	void			*i;
+
+	for (;;) {
+		i = NULL;
+		if (!tree_iter(&rq->q_expiry, &i, &minute, (void **)&x))
+			break;
+		if ((time_t)(minute + 1) * EXPIRY_BUCKET > currtime)
+			break;
+
+		tree_xpop(&rq->q_expiry, minute);
+		while ((evp = TAILQ_FIRST(&x->q))) {
+			TAILQ_REMOVE(&x->q, evp, x_entry);
+			evp->expiry = NULL;
+			if (evp->state == RQ_EVPSTATE_PARKED)
+				rq_dest_unpark(rq, evp);
+			else {
+				TAILQ_REMOVE(&rq->q_pending, evp, entry);
+				SPLAY_REMOVE(prioqtree, &rq->q_priotree, evp);
+			}
 			TAILQ_INSERT_TAIL(&rq->q_expired, evp, entry);
 			evp->state = RQ_EVPSTATE_SCHEDULED;
 			evp->flags |= RQ_ENVELOPE_EXPIRED;
 			evp->t_scheduled = currtime;
+			n += 1;
+		}
+		free(x);
+		stat_decrement("scheduler.ramqueue.expiry", 1);
+	}
+
+	if (n && verbose & TRACE_SCHEDULER)
+		log_debug("debug: scheduler-ram: %zu envelopes expired", n);
+}
+
+/* for rq_gather_cmp(), in the thread of the queue */
+static __thread struct rq_envelope	*gather_first;
+
+/* the destination of the first envelope first, then by destination */
+static int
+rq_gather_cmp(const void *a, const void *b)
+{
+	const struct rq_envelope	*e1 = *(struct rq_envelope * const *)a;
+	const struct rq_envelope	*e2 = *(struct rq_envelope * const *)b;
+
+	if ((e1->dest == gather_first->dest) !=
+	    (e2->dest == gather_first->dest))
+		return (e1->dest == gather_first->dest) ? -1 : 1;
+	if (e1->dest != e2->dest)
+		return ((uintptr_t)e1->dest < (uintptr_t)e2->dest) ? -1 : 1;
+	if (e1->evpid != e2->evpid)
+		return (e1->evpid < e2->evpid) ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Move the other MTA envelopes of the message of evp that are ready to
+ * go to the head of q_mta, grouped by destination, those for the
+ * destination of evp first, so that each group is handed out in a row
+ * and smtpd sends it as one transaction with many recipients.  evp has
+ * been taken off q_mta already.
+ */
+static void
+rq_queue_gather(struct rq_queue *rq, struct rq_envelope *evp)
+{
+	struct rq_envelope	 *e, **tmp;
+	size_t			  i, n = 0;
+	void			 *iter = NULL;
+
+	while (tree_iter(&evp->message->envelopes, &iter, NULL, (void **)&e)) {
+		if (e == evp || e->state != RQ_EVPSTATE_SCHEDULED ||
+		    e->flags & RQ_ENVELOPE_SUSPEND ||
+		    rq_envelope_list(rq, e) != &rq->q_mta)
 			continue;
+		if (n == rq->gathersz) {
+			tmp = reallocarray(rq->gather,
+			    rq->gathersz ? rq->gathersz * 2 : 64, sizeof(*tmp));
+			if (tmp == NULL) {
+				log_warn("warn: scheduler-ram: reallocarray");
+				break;
+			}
+			rq->gather = tmp;
+			rq->gathersz = rq->gathersz ? rq->gathersz * 2 : 64;
 		}
-		rq_envelope_schedule(rq, evp);
-		n += 1;
+		rq->gather[n++] = e;
+	}
+	if (n == 0)
+		return;
+
+	gather_first = evp;
+	qsort(rq->gather, n, sizeof(*rq->gather), rq_gather_cmp);
+	for (i = n; i-- > 0; ) {
+		TAILQ_REMOVE(&rq->q_mta, rq->gather[i], entry);
+		TAILQ_INSERT_HEAD(&rq->q_mta, rq->gather[i], entry);
+		rq->gather[i]->flags |= RQ_ENVELOPE_GATHERED;
 	}
 }
 
@@ -925,6 +2154,8 @@ rq_envelope_list(struct rq_queue *rq, struct rq_envelope *evp)
 	case RQ_EVPSTATE_INFLIGHT:
 		return &rq->q_inflight;
 	case RQ_EVPSTATE_HELD:
+	case RQ_EVPSTATE_PARKED:
+	case RQ_EVPSTATE_RINGED:
 		return NULL;
 	}
 	fatalx("%016" PRIx64 " bad state %d", evp->evpid, evp->state);
@@ -962,9 +2193,14 @@ rq_envelope_schedule(struct rq_queue *rq, struct rq_envelope *evp)
 		}
 		evp->holdq = 0;
 		stat_decrement("scheduler.ramqueue.hold", 1);
+	} else if (evp->state == RQ_EVPSTATE_PARKED) {
+		rq_dest_unpark(rq, evp);
+	} else if (evp->state == RQ_EVPSTATE_RINGED) {
+		rq_shard_pull(evp);
 	} else if (!(evp->flags & RQ_ENVELOPE_SUSPEND)) {
 		TAILQ_REMOVE(&rq->q_pending, evp, entry);
 		SPLAY_REMOVE(prioqtree, &rq->q_priotree, evp);
+		rq_expiry_remove(rq, evp);
 	}
 
 	TAILQ_INSERT_TAIL(q, evp, entry);
@@ -998,16 +2234,24 @@ rq_envelope_remove(struct rq_queue *rq, struct rq_envelope *evp)
 		}
 		evp->holdq = 0;
 		stat_decrement("scheduler.ramqueue.hold", 1);
+	} else if (evp->state == RQ_EVPSTATE_PARKED) {
+		rq_dest_unpark(rq, evp);
+	} else if (evp->state == RQ_EVPSTATE_RINGED) {
+		rq_shard_pull(evp);
 	} else if (!(evp->flags & RQ_ENVELOPE_SUSPEND)) {
 		evl = rq_envelope_list(rq, evp);
 		TAILQ_REMOVE(evl, evp, entry);
-		if (evl == &rq->q_pending)
+		if (evl == &rq->q_pending) {
 			SPLAY_REMOVE(prioqtree, &rq->q_priotree, evp);
+			rq_expiry_remove(rq, evp);
+		}
 	}
 
+	/* on q_removed, it must not be listed again on resume */
 	TAILQ_INSERT_TAIL(&rq->q_removed, evp, entry);
 	evp->state = RQ_EVPSTATE_SCHEDULED;
 	evp->flags |= RQ_ENVELOPE_REMOVED;
+	evp->flags &= ~RQ_ENVELOPE_SUSPEND;
 	evp->t_scheduled = currtime;
 
 	return 1;
@@ -1033,14 +2277,24 @@ rq_envelope_suspend(struct rq_queue *rq, struct rq_envelope *evp)
 		evp->holdq = 0;
 		evp->state = RQ_EVPSTATE_PENDING;
 		stat_decrement("scheduler.ramqueue.hold", 1);
+	} else if (evp->state == RQ_EVPSTATE_PARKED) {
+		rq_dest_unpark(rq, evp);
+		evp->state = RQ_EVPSTATE_PENDING;
+	} else if (evp->state == RQ_EVPSTATE_RINGED) {
+		/* resumed, it goes back on its list */
+		rq_shard_pull(evp);
+		evp->state = RQ_EVPSTATE_SCHEDULED;
 	} else if (evp->state != RQ_EVPSTATE_INFLIGHT) {
 		evl = rq_envelope_list(rq, evp);
 		TAILQ_REMOVE(evl, evp, entry);
-		if (evl == &rq->q_pending)
+		if (evl == &rq->q_pending) {
 			SPLAY_REMOVE(prioqtree, &rq->q_priotree, evp);
+			rq_expiry_remove(rq, evp);
+		}
 	}
 
 	evp->flags |= RQ_ENVELOPE_SUSPEND;
+	evp->flags &= ~RQ_ENVELOPE_GATHERED;
 
 	return 1;
 }
@@ -1076,11 +2330,52 @@ rq_envelope_delete(struct rq_queue *rq, struct rq_envelope *evp)
 		stat_decrement("scheduler.ramqueue.message", 1);
 	}
 
+	if (evp->dest) {
+		/* a probe that went away tells nothing */
+		rq_dest_update(evp, SCHED_RESULT_UNKNOWN);
+		rq_dest_unref(evp->dest);
+	}
+
 	free(evp);
 	rq->evpcount--;
 	stat_decrement("scheduler.ramqueue.envelope", 1);
 }
 
+static void
+rq_envelope_inflight(struct rq_queue *rq, struct rq_envelope *evp)
+{
+	TAILQ_INSERT_TAIL(&rq->q_inflight, evp, entry);
+	evp->state = RQ_EVPSTATE_INFLIGHT;
+	evp->t_inflight = currtime;
+}
+
+/* the update of evp is handed out, it goes back to pending */
+static void
+rq_envelope_reschedule(struct rq_queue *rq, struct rq_envelope *evp)
+{
+	time_t	t;
+
+	if (evp->flags & RQ_ENVELOPE_OVERFLOW)
+		t = BACKOFF_OVERFLOW;
+	else if (evp->type == D_MTA)
+		t = BACKOFF_TRANSFER;
+	else
+		t = BACKOFF_DELIVERY;
+
+	evp->sched = scheduler_next(evp->ctime, t, 0);
+	evp->flags &= ~(RQ_ENVELOPE_UPDATE|RQ_ENVELOPE_OVERFLOW);
+	evp->state = RQ_EVPSTATE_PENDING;
+	if (!(evp->flags & RQ_ENVELOPE_SUSPEND))
+		sorted_insert(rq, evp);
+}
+
+/* whether two envelopes go out in the same MTA transaction */
+static int
+rq_envelope_group(struct rq_envelope *e1, struct rq_envelope *e2)
+{
+	return (e1->message == e2->message && e1->dest == e2->dest);
+}
+
 static const char *
 rq_envelope_to_text(struct rq_envelope *e)
 {
@@ -1125,6 +2420,18 @@ rq_envelope_to_text(struct rq_envelope *e)
 		    duration_to_text(currtime - e->t_inflight));
 		(void)strlcat(buf, t, sizeof buf);
 		break;
+
+	case RQ_EVPSTATE_PARKED:
+		(void)snprintf(t, sizeof t, ",parked=%s",
+		    duration_to_text(rq_dest_until(e->dest) - currtime));
+		(void)strlcat(buf, t, sizeof buf);
+		break;
+
+	case RQ_EVPSTATE_RINGED:
+		(void)snprintf(t, sizeof t, ",ringed=%s",
+		    duration_to_text(currtime - e->t_scheduled));
+		(void)strlcat(buf, t, sizeof buf);
+		break;
 	default:
 		fatalx("%016" PRIx64 " bad state %d", e->evpid, e->state);
 	}
@@ -1150,6 +2457,8 @@ rq_queue_dump(struct rq_queue *rq, const char * name)
 	uint64_t		 id;
 
 	log_debug("debug: /--- ramqueue: %s", name);
+	log_debug("debug: | %zu envelopes expire within the hour",
+	    rq_expiry_count(rq, currtime + 3600));
 
 	i = NULL;
 	while ((tree_iter(&rq->messages, &i, &id, (void*)&message))) {
@@ -1166,12 +2475,8 @@ rq_queue_dump(struct rq_queue *rq, const char * name)
 static int
 rq_envelope_cmp(struct rq_envelope *e1, struct rq_envelope *e2)
 {
-	time_t	ref1, ref2;
-
-	ref1 = (e1->sched < e1->expire) ? e1->sched : e1->expire;
-	ref2 = (e2->sched < e2->expire) ? e2->sched : e2->expire;
-	if (ref1 != ref2)
-		return (ref1 < ref2) ? -1 : 1;
+	if (e1->sched != e2->sched)
+		return (e1->sched < e2->sched) ? -1 : 1;
 
 	if (e1->evpid != e2->evpid)
 		return (e1->evpid < e2->evpid) ? -1 : 1;
@@ -1184,13 +2489,20 @@ SPLAY_GENERATE(prioqtree, rq_envelope, t_entry, rq_envelope_cmp);
 int
 main(int argc, char **argv)
 {
-	int ch;
+	const char	*errstr;
+	int		 ch;
 
 	log_init(1);
 	log_verbose(~0);
 
-	while ((ch = getopt(argc, argv, "")) != -1) {
+	while ((ch = getopt(argc, argv, "t:")) != -1) {
 		switch (ch) {
+		case 't':
+			nshards = strtonum(optarg, 1, 64, &errstr);
+			if (errstr)
+				fatalx("threads is %s: %s", errstr, optarg);
+			threaded = 1;
+			break;
 		default:
 			fatalx("bad option");
 			/* NOTREACHED */
@@ -1204,7 +2516,7 @@ main(int argc, char **argv)
 	scheduler_api_on_commit(scheduler_ram_commit);
 	scheduler_api_on_rollback(scheduler_ram_rollback);
 	scheduler_api_on_update(scheduler_ram_update);
-	scheduler_api_on_delete(scheduler_ram_delete);
+	scheduler_api_on_delete_result(scheduler_ram_delete);
 	scheduler_api_on_hold(scheduler_ram_hold);
 	scheduler_api_on_release(scheduler_ram_release);
 	scheduler_api_on_batch(scheduler_ram_batch);
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Drive the scheduler the way smtpd does, from one thread and without
+ * the pipe: commit messages, take batches and delete or defer what they
+ * hand out, over a backlog of deferred envelopes.
+ *
+ *	scheduler-ram-bench [-t threads] [-b batch] [-d deferred%]
+ *	    [-n messages] [-p backlog] [-r rcpts]
+ *
+ * It reports the wall time and the CPU time of the calling thread, which
+ * is the one smtpd waits on, per envelope.
+ */
+
+#define main	scheduler_ram_main
+#include "scheduler_ram.c"
+#undef main
+
+#include <err.h>
+
+#define BENCH_DESTS	64
+
+static void
+bench_message(uint32_t msgid, size_t rcpts, uint16_t retry)
+{
+	struct scheduler_info	si;
+	size_t			i;
+
+	for (i = 0; i < rcpts; i++) {
+		memset(&si, 0, sizeof si);
+		si.evpid = ((uint64_t)msgid << 32) | (i + 1);
+		si.type = D_MTA;
+		si.retry = retry;
+		si.creation = time(NULL);
+		si.expire = 4 * 86400;
+		(void)snprintf(si.dest, sizeof si.dest, "mx%u.example.org",
+		    (unsigned int)((msgid + i) % BENCH_DESTS));
+		scheduler_ram_insert(&si);
+	}
+	scheduler_ram_commit(msgid);
+}
+
+static double
+elapsed(clockid_t clock, struct timespec *t0)
+{
+	struct timespec	t1;
+
+	clock_gettime(clock, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct scheduler_info	 si;
+	struct timespec		 w0, c0;
+	const char		*errstr;
+	uint64_t		*evpids;
+	size_t			 backlog = 100000, messages = 100000, rcpts = 3;
+	size_t			 batchsz = 100, total, done, n, i;
+	uint32_t		 msgid = 0, last;
+	double			 wall, cpu;
+	int			*types, ch, delay, deferred = 10;
+
+	while ((ch = getopt(argc, argv, "b:d:n:p:r:t:")) != -1) {
+		switch (ch) {
+		case 'b':
+			batchsz = strtonum(optarg, 1, 10000, &errstr);
+			break;
+		case 'd':
+			deferred = strtonum(optarg, 0, 100, &errstr);
+			break;
+		case 'n':
+			messages = strtonum(optarg, 1, UINT32_MAX / 2, &errstr);
+			break;
+		case 'p':
+			backlog = strtonum(optarg, 0, UINT32_MAX / 2, &errstr);
+			break;
+		case 'r':
+			rcpts = strtonum(optarg, 1, 1000, &errstr);
+			break;
+		case 't':
+			nshards = strtonum(optarg, 1, 64, &errstr);
+			threaded = 1;
+			break;
+		default:
+			errx(1, "usage: scheduler-ram-bench [-t threads] "
+			    "[-b batch] [-d deferred%%] [-n messages] "
+			    "[-p backlog] [-r rcpts]");
+		}
+		if (errstr)
+			errx(1, "-%c is %s: %s", ch, errstr, optarg);
+	}
+
+	log_init(1);
+	if ((evpids = calloc(batchsz, sizeof(*evpids))) == NULL ||
+	    (types = calloc(batchsz, sizeof(*types))) == NULL)
+		err(1, "calloc");
+	if (!scheduler_ram_init())
+		errx(1, "scheduler_ram_init");
+
+	/* deferred for a long while, they only weigh on the queue */
+	for (i = 0; i < backlog; i++)
+		bench_message(++msgid, 1, 50);
+
+	total = messages * rcpts;
+	done = 0;
+	last = msgid + messages;
+
+	clock_gettime(CLOCK_MONOTONIC, &w0);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c0);
+	while (done < total) {
+		/* new mail keeps coming in while the queue runs */
+		for (i = 0; i < batchsz / rcpts + 1 && msgid < last; i++)
+			bench_message(++msgid, rcpts, 0);
+
+		n = batchsz;
+		if (!scheduler_ram_batch(SCHED_REMOVE | SCHED_EXPIRE |
+		    SCHED_UPDATE | SCHED_BOUNCE | SCHED_MDA | SCHED_MTA,
+		    &delay, &n, evpids, types))
+			continue;
+
+		for (i = 0; i < n; i++) {
+			if (types[i] != SCHED_MTA)
+				continue;
+			done++;
+			if ((evpids[i] >> 32) % 100 >= (uint64_t)deferred) {
+				scheduler_ram_delete(evpids[i],
+				    SCHED_RESULT_DONE);
+				continue;
+			}
+			memset(&si, 0, sizeof si);
+			si.evpid = evpids[i];
+			si.type = D_MTA;
+			si.retry = 1;
+			si.result = SCHED_RESULT_RCPT;
+			scheduler_ram_update(&si);
+		}
+	}
+	wall = elapsed(CLOCK_MONOTONIC, &w0);
+	cpu = elapsed(CLOCK_THREAD_CPUTIME_ID, &c0);
+
+	if (threaded)
+		printf("-t %-3zu", nshards);
+	else
+		printf("%-6s", "no -t");
+	printf(" %zu envelopes in %.3f s, %.0f/s, API thread %.2f us CPU "
+	    "each\n", total, wall, total / wall, cpu * 1e6 / total);
+
+	return (0);
+}
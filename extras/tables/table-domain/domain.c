@@ -0,0 +1,354 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "domain.h"
+
+static inline uint32_t
+edge_hash(uint32_t parent, const char *label, size_t len)
+{
+	uint32_t	h = 2166136261U ^ parent;
+	size_t		i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char)label[i]) * 16777619U;
+	return (h ^ (h >> 15));
+}
+
+/*
+ * Order reversed names label by label, so that the names sharing their
+ * first labels are contiguous and sorted as the children of a node.
+ */
+static int
+entry_cmp(const void *a, const void *b)
+{
+	const struct domain_entry	*ea = a, *eb = b;
+	const unsigned char		*pa, *pb;
+	int				 ca, cb;
+
+	pa = (const unsigned char *)ea->name;
+	pb = (const unsigned char *)eb->name;
+	for (;; pa++, pb++) {
+		ca = (*pa == '.') ? 1 : *pa;
+		cb = (*pb == '.') ? 1 : *pb;
+		if (ca != cb)
+			return (ca - cb);
+		if (ca == 0)
+			return (0);
+	}
+}
+
+/*
+ * Add a domain, or a wildcard in the "*.example.org" form, to the table.
+ */
+int
+domain_table_add(struct domain_table *t, const char *name)
+{
+	struct domain_entry	*e;
+	const char		*end, *dot;
+	char			*q;
+	size_t			 len, sz, i;
+	uint8_t			 flags = DOMAIN_EXACT;
+
+	if (strncmp(name, "*.", 2) == 0) {
+		flags = DOMAIN_WILDCARD;
+		name += 2;
+	}
+	len = strlen(name);
+	if (len && name[len - 1] == '.')
+		len--;
+	if (len == 0 || len > DOMAIN_MAXLEN) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (t->nentries == t->entriesz) {
+		sz = t->entriesz ? t->entriesz * 2 : 1024;
+		if ((e = reallocarray(t->entries, sz, sizeof(*e))) == NULL)
+			return (-1);
+		t->entries = e;
+		t->entriesz = sz;
+	}
+	e = &t->entries[t->nentries];
+	if ((e->name = malloc(len + 1)) == NULL)
+		return (-1);
+	e->cur = e->name;
+	e->flags = flags;
+
+	/* copy the labels in reverse order */
+	q = e->name;
+	for (end = name + len;; end = dot - 1) {
+		for (dot = end; dot > name && dot[-1] != '.'; dot--)
+			;
+		if (end == dot || end - dot > LABEL_MAXLEN)
+			goto invalid;
+		if (q != e->name)
+			*q++ = '.';
+		for (i = 0; i < (size_t)(end - dot); i++) {
+			if (!isalnum((unsigned char)dot[i]) &&
+			    dot[i] != '-' && dot[i] != '_')
+				goto invalid;
+			*q++ = tolower((unsigned char)dot[i]);
+		}
+		if (dot == name)
+			break;
+	}
+	*q = '\0';
+
+	t->nentries++;
+	return (0);
+
+invalid:
+	free(e->name);
+	errno = EINVAL;
+	return (-1);
+}
+
+static int
+domain_reserve(struct domain_table *t, size_t nodes, size_t labels)
+{
+	void	*tmp;
+	size_t	 sz;
+
+	if (t->nnodes + nodes > t->nodesz) {
+		for (sz = t->nodesz ? t->nodesz : 1024;
+		    sz < t->nnodes + nodes; sz *= 2)
+			;
+		if ((tmp = reallocarray(t->nodes, sz, sizeof(*t->nodes)))
+		    == NULL)
+			return (-1);
+		t->nodes = tmp;
+		t->nodesz = sz;
+	}
+	if (t->labelslen + labels > t->labelsz) {
+		for (sz = t->labelsz ? t->labelsz : 4096;
+		    sz < t->labelslen + labels; sz *= 2)
+			;
+		if ((tmp = realloc(t->labels, sz)) == NULL)
+			return (-1);
+		t->labels = tmp;
+		t->labelsz = sz;
+	}
+	return (0);
+}
+
+static size_t
+entry_label(const struct domain_entry *e)
+{
+	return (strcspn(e->cur, "."));
+}
+
+/*
+ * Create the children of node ni from the sorted entries e[0..n), which
+ * all share the labels up to their cursor.
+ */
+static int
+domain_build(struct domain_table *t, size_t ni, struct domain_entry *e,
+    size_t n)
+{
+	struct domain_node	*node;
+	size_t			 i, j, m, len, child;
+
+	/* names ending here sort first */
+	for (i = 0; i < n && *e[i].cur == '\0'; i++)
+		t->nodes[ni].flags |= e[i].flags;
+
+	for (; i < n; i = j) {
+		len = entry_label(&e[i]);
+		for (j = i + 1; j < n && entry_label(&e[j]) == len &&
+		    memcmp(e[i].cur, e[j].cur, len) == 0; j++)
+			;
+
+		if (domain_reserve(t, 1, len) == -1)
+			return (-1);
+		child = t->nnodes++;
+		node = &t->nodes[child];
+		memset(node, 0, sizeof *node);
+		node->label = t->labelslen;
+		node->parent = ni;
+		node->len = len;
+		memcpy(t->labels + t->labelslen, e[i].cur, len);
+		t->labelslen += len;
+
+		/* step over the label and the dot */
+		for (m = i; m < j; m++) {
+			e[m].cur += len;
+			if (*e[m].cur == '.')
+				e[m].cur++;
+		}
+		if (domain_build(t, child, e + i, j - i) == -1)
+			return (-1);
+	}
+	return (0);
+}
+
+static int
+domain_edges(struct domain_table *t)
+{
+	const struct domain_node	*node;
+	size_t				 i, h, sz;
+
+	/* keep the load under one half */
+	for (sz = 16; sz < 2 * t->nnodes; sz *= 2)
+		;
+	if ((t->edges = calloc(sz, sizeof(*t->edges))) == NULL)
+		return (-1);
+	t->edgemask = sz - 1;
+
+	for (i = 1; i < t->nnodes; i++) {
+		node = &t->nodes[i];
+		h = edge_hash(node->parent, t->labels + node->label, node->len);
+		while (t->edges[h & t->edgemask])
+			h++;
+		t->edges[h & t->edgemask] = i + 1;
+	}
+	return (0);
+}
+
+/*
+ * Sort the entries and compile them into the trie.  Node 0 is the root.
+ */
+int
+domain_table_build(struct domain_table *t)
+{
+	size_t	i;
+	int	ret;
+
+	free(t->nodes);
+	free(t->labels);
+	free(t->edges);
+	t->nodes = NULL;
+	t->labels = NULL;
+	t->edges = NULL;
+	t->nnodes = t->nodesz = t->labelslen = t->labelsz = 0;
+
+	if (t->nentries)
+		qsort(t->entries, t->nentries, sizeof(*t->entries), entry_cmp);
+
+	ret = -1;
+	if (domain_reserve(t, 1, 0) == 0) {
+		memset(&t->nodes[0], 0, sizeof(t->nodes[0]));
+		t->nnodes = 1;
+		ret = domain_build(t, 0, t->entries, t->nentries);
+		if (ret == 0)
+			ret = domain_edges(t);
+	}
+
+	for (i = 0; i < t->nentries; i++)
+		free(t->entries[i].name);
+	free(t->entries);
+	t->entries = NULL;
+	t->nentries = t->entriesz = 0;
+
+	return (ret);
+}
+
+static const struct domain_node *
+domain_child(const struct domain_table *t, uint32_t parent,
+    const char *label, size_t len)
+{
+	const struct domain_node	*c;
+	uint32_t			 h, i;
+
+	h = edge_hash(parent, label, len);
+	for (; (i = t->edges[h & t->edgemask]) != 0; h++) {
+		c = &t->nodes[i - 1];
+		if (c->parent == parent && c->len == len &&
+		    memcmp(t->labels + c->label, label, len) == 0)
+			return (c);
+	}
+	return (NULL);
+}
+
+/*
+ * Walk the labels of key from the right, and return 1 if it is in the
+ * table or below a wildcard.  An exact match takes precedence, then the
+ * longest wildcard.
+ */
+int
+domain_table_lookup(const struct domain_table *t, const char *key,
+    struct domain_match *match)
+{
+	const struct domain_node	*node;
+	char				 buf[DOMAIN_MAXLEN + 2];
+	const char			*end, *dot;
+	size_t				 len, i;
+
+	if (t->edges == NULL)
+		return (0);
+
+	len = strlen(key);
+	if (len && key[len - 1] == '.')
+		len--;
+	if (len == 0 || len > DOMAIN_MAXLEN)
+		return (0);
+	for (i = 0; i < len; i++)
+		buf[i] = tolower((unsigned char)key[i]);
+	buf[len] = '\0';
+
+	match->flags = 0;
+	node = &t->nodes[0];
+	for (end = buf + len;; end = dot - 1) {
+		for (dot = end; dot > buf && dot[-1] != '.'; dot--)
+			;
+		if ((node = domain_child(t, node - t->nodes, dot,
+		    end - dot)) == NULL)
+			break;
+		if (dot == buf) {
+			if (node->flags & DOMAIN_EXACT) {
+				match->flags = DOMAIN_EXACT;
+				match->suffix = key;
+			}
+			break;
+		}
+		if (node->flags & DOMAIN_WILDCARD) {
+			match->flags = DOMAIN_WILDCARD;
+			match->suffix = key + (dot - buf);
+		}
+	}
+
+	return (match->flags != 0);
+}
+
+size_t
+domain_table_size(const struct domain_table *t)
+{
+	return (t->nnodes * sizeof(*t->nodes) + t->labelslen +
+	    (t->edges ? (t->edgemask + 1) * sizeof(*t->edges) : 0));
+}
+
+void
+domain_table_free(struct domain_table *t)
+{
+	size_t	i;
+
+	for (i = 0; i < t->nentries; i++)
+		free(t->entries[i].name);
+	free(t->entries);
+	free(t->nodes);
+	free(t->labels);
+	free(t->edges);
+	memset(t, 0, sizeof *t);
+}
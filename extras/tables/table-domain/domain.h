@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define DOMAIN_MAXLEN	253
+#define LABEL_MAXLEN	63
+
+#define DOMAIN_EXACT	0x01	/* the name itself */
+#define DOMAIN_WILDCARD	0x02	/* any name below it */
+
+/*
+ * Domains are stored in a trie of labels, starting from the top-level
+ * domain.  Nodes live in a single array, and the edges are found in one
+ * open addressing hash table keyed on the parent node and the label, so
+ * that each level costs a probe whatever the number of children.
+ */
+struct domain_node {
+	uint32_t	label;		/* offset in the label pool */
+	uint32_t	parent;
+	uint8_t		len;
+	uint8_t		flags;
+};
+
+struct domain_entry {
+	char		*name;		/* labels in reverse order */
+	char		*cur;
+	uint8_t		 flags;
+};
+
+struct domain_table {
+	struct domain_entry	*entries;	/* only while loading */
+	size_t			 nentries;
+	size_t			 entriesz;
+
+	struct domain_node	*nodes;
+	size_t			 nnodes;
+	size_t			 nodesz;
+	char			*labels;
+	size_t			 labelslen;
+	size_t			 labelsz;
+	uint32_t		*edges;		/* node index + 1, or 0 */
+	size_t			 edgemask;
+};
+
+struct domain_match {
+	const char	*suffix;	/* matching part of the key */
+	uint8_t		 flags;		/* DOMAIN_EXACT or DOMAIN_WILDCARD */
+};
+
+int domain_table_add(struct domain_table *, const char *);
+int domain_table_build(struct domain_table *);
+int domain_table_lookup(const struct domain_table *, const char *,
+    struct domain_match *);
+size_t domain_table_size(const struct domain_table *);
+void domain_table_free(struct domain_table *);
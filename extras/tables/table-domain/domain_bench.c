@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Build a table of random hosted domains, one in ten being a wildcard,
+ * and measure memory use and lookups per second for exact matches,
+ * wildcard matches and misses.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "domain.h"
+
+static const char *tlds[] = {
+	"com", "net", "org", "de", "fr", "nl", "co.uk", "com.au", "io"
+};
+
+static double
+elapsed(struct timespec *t0)
+{
+	struct timespec	t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+static void
+random_label(char *buf, size_t sz)
+{
+	size_t	i, len;
+
+	len = 3 + random() % 10;
+	for (i = 0; i < len && i < sz - 1; i++)
+		buf[i] = 'a' + random() % 26;
+	buf[i] = '\0';
+}
+
+static void
+random_domain(char *buf, size_t sz)
+{
+	char	label[16];
+
+	random_label(label, sizeof label);
+	snprintf(buf, sz, "%s.%s", label,
+	    tlds[random() % (sizeof(tlds) / sizeof(tlds[0]))]);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct domain_table	 t;
+	struct domain_match	 m;
+	struct timespec		 t0;
+	char			**names, **keys, label[16], buf[DOMAIN_MAXLEN];
+	size_t			 ndomains = 500000, nlookups = 5000000;
+	size_t			 i, n, found[3];
+	double			 tb, tl;
+
+	if (argc > 1)
+		ndomains = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		nlookups = strtoul(argv[2], NULL, 10);
+	srandom(42);
+
+	if ((names = calloc(ndomains, sizeof(*names))) == NULL ||
+	    (keys = calloc(nlookups, sizeof(*keys))) == NULL)
+		err(1, "calloc");
+
+	memset(&t, 0, sizeof t);
+	for (i = 0; i < ndomains; i++) {
+		random_domain(buf, sizeof buf);
+		if ((names[i] = strdup(buf)) == NULL)
+			err(1, "strdup");
+		if (i % 10 == 0)
+			snprintf(buf, sizeof buf, "*.%s", names[i]);
+		if (domain_table_add(&t, buf) == -1)
+			err(1, "domain_table_add: %s", buf);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (domain_table_build(&t) == -1)
+		err(1, "domain_table_build");
+	tb = elapsed(&t0);
+
+	/* exact names, names below a wildcard, and random names */
+	for (i = 0; i < nlookups; i++) {
+		n = random() % ndomains;
+		switch (i % 3) {
+		case 0:
+			if (n % 10 == 0)
+				n = (n + 1) % ndomains;
+			snprintf(buf, sizeof buf, "%s", names[n]);
+			break;
+		case 1:
+			random_label(label, sizeof label);
+			snprintf(buf, sizeof buf, "%s.%s", label,
+			    names[n - n % 10]);
+			break;
+		default:
+			random_domain(buf, sizeof buf);
+		}
+		if ((keys[i] = strdup(buf)) == NULL)
+			err(1, "strdup");
+	}
+
+	memset(found, 0, sizeof found);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nlookups; i++)
+		if (domain_table_lookup(&t, keys[i], &m))
+			found[i % 3]++;
+	tl = elapsed(&t0);
+
+	printf("%zu domains, %zu nodes, %.1f MB, build %.2fs\n",
+	    ndomains, t.nnodes, domain_table_size(&t) / 1048576.0, tb);
+	printf("%.1fM lookups/s, found %zu/%zu exact, %zu/%zu wildcard, "
+	    "%zu/%zu random\n", nlookups / tl / 1e6,
+	    found[0], (nlookups + 2) / 3, found[1], (nlookups + 1) / 3,
+	    found[2], nlookups / 3);
+
+	for (i = 0; i < ndomains; i++)
+		free(names[i]);
+	for (i = 0; i < nlookups; i++)
+		free(keys[i]);
+	free(names);
+	free(keys);
+	domain_table_free(&t);
+	return (0);
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <smtpd-api.h>
+
+#include "domain.h"
+
+static char			*config;
+static struct domain_table	*table;
+
+static int
+table_domain_update(void)
+{
+	FILE			*fp;
+	struct domain_table	*ntable;
+	char			*buf = NULL, *line, *end;
+	size_t			 sz = 0, lineno = 0;
+	ssize_t			 len;
+
+	if ((fp = fopen(config, "r")) == NULL) {
+		log_warn("warn: \"%s\"", config);
+		return 0;
+	}
+
+	if ((ntable = calloc(1, sizeof(*ntable))) == NULL) {
+		log_warn("warn: calloc");
+		fclose(fp);
+		return 0;
+	}
+
+	while ((len = getline(&buf, &sz, fp)) != -1) {
+		lineno++;
+		if ((end = strchr(buf, '#')) != NULL)
+			*end = '\0';
+		line = buf + strspn(buf, " \t");
+		line[strcspn(line, " \t\r\n")] = '\0';
+		if (*line == '\0')
+			continue;
+
+		if (domain_table_add(ntable, line) == -1) {
+			log_warn("warn: %s:%zu: \"%s\"", config, lineno, line);
+			goto err;
+		}
+	}
+	if (ferror(fp)) {
+		log_warn("warn: \"%s\"", config);
+		goto err;
+	}
+
+	if (domain_table_build(ntable) == -1) {
+		log_warn("warn: domain_table_build");
+		goto err;
+	}
+	free(buf);
+	fclose(fp);
+
+	log_debug("debug: table-domain: %zu nodes, %zu bytes",
+	    ntable->nnodes, domain_table_size(ntable));
+
+	/* swap the tables, the old one stays in use on error */
+	if (table) {
+		domain_table_free(table);
+		free(table);
+	}
+	table = ntable;
+
+	return 1;
+
+err:
+	free(buf);
+	fclose(fp);
+	domain_table_free(ntable);
+	free(ntable);
+	return 0;
+}
+
+static int
+table_domain_check(int service, struct dict *params, const char *key)
+{
+	struct domain_match	m;
+
+	if (service != K_DOMAIN)
+		return -1;
+
+	return domain_table_lookup(table, key, &m);
+}
+
+static int
+table_domain_lookup(int service, struct dict *params, const char *key,
+    char *dst, size_t sz)
+{
+	struct domain_match	m;
+	int			n;
+
+	if (service != K_DOMAIN)
+		return -1;
+
+	if (domain_table_lookup(table, key, &m) == 0)
+		return 0;
+
+	if (m.flags & DOMAIN_WILDCARD)
+		n = snprintf(dst, sz, "*.%s", m.suffix);
+	else
+		n = snprintf(dst, sz, "%s", m.suffix);
+	if (n < 0 || (size_t)n >= sz) {
+		log_warnx("warn: result too large");
+		return -1;
+	}
+	return 1;
+}
+
+static int
+table_domain_fetch(int service, struct dict *params, char *dst, size_t sz)
+{
+	return -1;
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch;
+
+	log_init(1);
+
+	while ((ch = getopt(argc, argv, "")) != -1) {
+		switch (ch) {
+		default:
+			fatalx("bad option");
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1)
+		fatalx("bogus argument(s)");
+
+	config = argv[0];
+
+	if (table_domain_update() == 0)
+		fatalx("error parsing config file");
+
+	table_api_on_update(table_domain_update);
+	table_api_on_check(table_domain_check);
+	table_api_on_lookup(table_domain_lookup);
+	table_api_on_fetch(table_domain_fetch);
+	table_api_dispatch();
+
+	return 0;
+}
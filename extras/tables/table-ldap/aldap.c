@@ -148,9 +148,41 @@ int
 aldap_search(struct aldap *ldap, char *basedn, enum scope scope, char *filter,
     char **attrs, int typesonly, int sizelimit, int timelimit,
     struct aldap_page_control *page)
+{
+	struct ber_element *f = NULL, *a = NULL;
+	int ret = -1;
+
+	if ((f = ldap_parse_search_filter(NULL, filter)) == NULL) {
+		ldap->err = ALDAP_ERR_PARSER_ERROR;
+		goto done;
+	}
+	if ((a = aldap_attributes(attrs)) == NULL) {
+		ldap->err = ALDAP_ERR_OPERATION_FAILED;
+		goto done;
+	}
+	ret = aldap_search_filter(ldap, basedn, scope, f, a, typesonly,
+	    sizelimit, timelimit, page);
+
+done:
+	if (f != NULL)
+		ber_free_elements(f);
+	if (a != NULL)
+		ber_free_elements(a);
+	return (ret);
+}
+
+/*
+ * Same as aldap_search(), with a filter and an attribute list that are
+ * already encoded.  They are linked into the request while it is written
+ * and left untouched, so that they can be reused.
+ */
+int
+aldap_search_filter(struct aldap *ldap, char *basedn, enum scope scope,
+    struct ber_element *filter, struct ber_element *attrs, int typesonly,
+    int sizelimit, int timelimit, struct aldap_page_control *page)
 {
 	struct ber_element *root = NULL, *ber, *c;
-	int i, error;
+	int error;
 
 	if ((root = ber_add_sequence(NULL)) == NULL)
 		goto fail;
@@ -171,24 +203,16 @@ aldap_search(struct aldap *ldap, char *basedn, enum scope scope, char *filter,
 		goto fail;
 	}
 
-	if ((ber = ldap_parse_search_filter(ber, filter)) == NULL) {
-		ldap->err = ALDAP_ERR_PARSER_ERROR;
-		goto fail;
-	}
-
-	if ((ber = ber_add_sequence(ber)) == NULL)
-		goto fail;
-	if (attrs != NULL)
-		for (i = 0; attrs[i] != NULL; i++) {
-			if ((ber = ber_add_string(ber, attrs[i])) == NULL)
-				goto fail;
-		}
+	ber->be_next = filter;
+	filter->be_next = attrs;
 
 	aldap_create_page_control(c, 100, page);
 
 	LDAP_DEBUG("aldap_search", root);
 
 	error = ber_write_elements(&ldap->ber, root);
+	ber->be_next = NULL;
+	filter->be_next = NULL;
 	ber_free_elements(root);
 	root = NULL;
 	if (error == -1) {
@@ -205,6 +229,158 @@ fail:
 	return (-1);
 }
 
+/*
+ * Encode a NULL terminated list of attributes, NULL meaning all of them.
+ */
+struct ber_element *
+aldap_attributes(char **attrs)
+{
+	struct ber_element *root, *ber;
+	int i;
+
+	if ((root = ber_add_sequence(NULL)) == NULL)
+		return (NULL);
+	ber = root;
+	if (attrs != NULL)
+		for (i = 0; attrs[i] != NULL; i++) {
+			if ((ber = ber_add_string(ber, attrs[i])) == NULL) {
+				ber_free_elements(root);
+				return (NULL);
+			}
+		}
+
+	return (root);
+}
+
+static int
+aldap_filter_slots(struct aldap_filter *f, struct ber_element *elm)
+{
+	struct aldap_filter_slot *slot;
+
+	for (; elm != NULL; elm = elm->be_next) {
+		if (elm->be_encoding == BER_TYPE_SEQUENCE ||
+		    elm->be_encoding == BER_TYPE_SET) {
+			if (aldap_filter_slots(f, elm->be_sub) == -1)
+				return (-1);
+			continue;
+		}
+		if (elm->be_encoding != BER_TYPE_OCTETSTRING ||
+		    memchr(elm->be_val, '%', elm->be_len) == NULL)
+			continue;
+
+		if (f->nslots == ALDAP_MAX_SLOTS)
+			return (-1);
+		slot = &f->slots[f->nslots++];
+		slot->elm = elm;
+		slot->fmt = elm->be_val;
+		slot->fmtlen = elm->be_len;
+
+		/* the value now points to the expansion buffer */
+		elm->be_val = NULL;
+		elm->be_len = 0;
+		elm->be_free = 0;
+	}
+	return (0);
+}
+
+/*
+ * Parse a search filter in which "%s" stands for a key, and "%%" for a
+ * literal "%", into a filter template.  Keys are substituted in the
+ * encoded values, so they need no filter escaping.
+ */
+struct aldap_filter *
+aldap_filter_compile(const char *filter)
+{
+	struct aldap_filter *f;
+	const char *p;
+	char *buf;
+
+	for (p = filter; (p = strchr(p, '%')) != NULL; p += 2)
+		if (p[1] != 's' && p[1] != '%') {
+			errno = EINVAL;
+			return (NULL);
+		}
+
+	if ((f = calloc(1, sizeof(*f))) == NULL)
+		return (NULL);
+	if ((buf = strdup(filter)) == NULL) {
+		free(f);
+		return (NULL);
+	}
+	f->root = ldap_parse_search_filter(NULL, buf);
+	free(buf);
+	if (f->root == NULL || aldap_filter_slots(f, f->root) == -1) {
+		aldap_filter_free(f);
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	return (f);
+}
+
+/*
+ * Substitute key in all the slots of the template.
+ */
+int
+aldap_filter_expand(struct aldap_filter *f, const char *key)
+{
+	struct aldap_filter_slot *slot;
+	size_t i, n, len, keylen;
+	char *buf;
+	int s;
+
+	keylen = strlen(key);
+	for (s = 0; s < f->nslots; s++) {
+		slot = &f->slots[s];
+
+		for (i = 0, len = 0; i < slot->fmtlen; i++) {
+			if (slot->fmt[i] == '%' && i + 1 < slot->fmtlen) {
+				len += slot->fmt[++i] == 's' ? keylen : 1;
+				continue;
+			}
+			len++;
+		}
+		if (len > slot->bufsz) {
+			if ((buf = realloc(slot->buf, len)) == NULL)
+				return (-1);
+			slot->buf = buf;
+			slot->bufsz = len;
+		}
+
+		for (i = 0, n = 0; i < slot->fmtlen; i++) {
+			if (slot->fmt[i] == '%' && i + 1 < slot->fmtlen) {
+				if (slot->fmt[++i] == 's') {
+					memcpy(slot->buf + n, key, keylen);
+					n += keylen;
+				}
+				else
+					slot->buf[n++] = '%';
+				continue;
+			}
+			slot->buf[n++] = slot->fmt[i];
+		}
+		slot->elm->be_val = slot->buf;
+		slot->elm->be_len = n;
+	}
+
+	return (0);
+}
+
+void
+aldap_filter_free(struct aldap_filter *f)
+{
+	int s;
+
+	for (s = 0; s < f->nslots; s++) {
+		f->slots[s].elm->be_val = NULL;
+		free(f->slots[s].fmt);
+		free(f->slots[s].buf);
+	}
+	if (f->root != NULL)
+		ber_free_elements(f->root);
+	free(f);
+}
+
 int
 aldap_create_page_control(struct ber_element *elm, int size,
     struct aldap_page_control *page)
@@ -38,6 +38,23 @@ struct aldap_page_control {
 	unsigned int cookie_len;
 };
 
+#define ALDAP_MAX_SLOTS	8
+
+struct aldap_filter_slot {
+	struct ber_element	*elm;
+	char			*fmt;
+	size_t			 fmtlen;
+	char			*buf;
+	size_t			 bufsz;
+};
+
+/* search filter encoded once, with slots where a key is substituted */
+struct aldap_filter {
+	struct ber_element		*root;
+	struct aldap_filter_slot	 slots[ALDAP_MAX_SLOTS];
+	int				 nslots;
+};
+
 struct aldap_message {
 	int msgid;
 	int message_type;
@@ -194,6 +211,11 @@ void			 aldap_freemsg(struct aldap_message *);
 int	 aldap_bind(struct aldap *, char *, char *);
 int	 aldap_unbind(struct aldap *);
 int	 aldap_search(struct aldap *, char *, enum scope, char *, char **, int, int, int, struct aldap_page_control *);
+int	 aldap_search_filter(struct aldap *, char *, enum scope, struct ber_element *, struct ber_element *, int, int, int, struct aldap_page_control *);
+struct ber_element *aldap_attributes(char **);
+struct aldap_filter *aldap_filter_compile(const char *);
+int	 aldap_filter_expand(struct aldap_filter *, const char *);
+void	 aldap_filter_free(struct aldap_filter *);
 int	 aldap_get_errno(struct aldap *, const char **);
 
 int	 aldap_get_resultcode(struct aldap_message *);
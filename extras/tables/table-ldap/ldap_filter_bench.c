@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Compare the cost of encoding a search request from a filter string,
+ * as table-ldap used to do on each lookup, with the expansion of a
+ * precompiled filter template.  Requests are encoded in memory only.
+ */
+
+#include "includes.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aldap.h"
+
+static const char *filters[] = {
+	"(uid=%s)",
+	"(&(objectClass=posixAccount)(uid=%s))",
+	"(|(mail=%s)(mailAlternateAddress=%s))",
+	"(&(objectClass=mailAccount)(|(mail=%s)(mailAlias=%s))(!(disabled=TRUE)))",
+	"(&(objectClass=domain)(dc=*%s*))",
+};
+
+static const char *keys[] = {
+	"gilles",
+	"gilles@example.org",
+	"postmaster@mail.example.org",
+	"eric@openbsd.org",
+};
+
+static char *attrs[] = { "uid", "uidNumber", "gidNumber", "homeDirectory",
+    NULL };
+
+static double
+elapsed(struct timespec *t0)
+{
+	struct timespec	t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct aldap		*a;
+	struct aldap_filter	*f;
+	struct ber_element	*al;
+	struct timespec		 t0;
+	char			 text[1024];
+	size_t			 nf, nk, i, k, n, rounds = 200000;
+	double			 ts, tt;
+
+	if (argc > 1)
+		rounds = strtoul(argv[1], NULL, 10);
+
+	if ((a = aldap_init(-1)) == NULL)
+		err(1, "aldap_init");
+	if ((al = aldap_attributes(attrs)) == NULL)
+		err(1, "aldap_attributes");
+
+	nf = sizeof(filters) / sizeof(filters[0]);
+	nk = sizeof(keys) / sizeof(keys[0]);
+
+	printf("%-72s %10s %10s %6s\n", "filter", "text ns", "tmpl ns",
+	    "ratio");
+	for (i = 0; i < nf; i++) {
+		if ((f = aldap_filter_compile(filters[i])) == NULL)
+			err(1, "aldap_filter_compile: %s", filters[i]);
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (n = 0; n < rounds; n++) {
+			k = n % nk;
+			snprintf(text, sizeof text, filters[i], keys[k], keys[k]);
+			if (aldap_search(a, "dc=example,dc=org",
+			    LDAP_SCOPE_SUBTREE, text, attrs, 0, 0, 0, NULL) == -1)
+				errx(1, "aldap_search: %s", text);
+		}
+		ts = elapsed(&t0);
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (n = 0; n < rounds; n++) {
+			k = n % nk;
+			if (aldap_filter_expand(f, keys[k]) == -1)
+				err(1, "aldap_filter_expand");
+			if (aldap_search_filter(a, "dc=example,dc=org",
+			    LDAP_SCOPE_SUBTREE, f->root, al, 0, 0, 0, NULL) == -1)
+				errx(1, "aldap_search_filter: %s", filters[i]);
+		}
+		tt = elapsed(&t0);
+
+		printf("%-72s %10.0f %10.0f %6.2f\n", filters[i],
+		    ts * 1e9 / rounds, tt * 1e9 / rounds, ts / tt);
+		aldap_filter_free(f);
+	}
+
+	ber_free_elements(al);
+	aldap_close(a);
+	return (0);
+}
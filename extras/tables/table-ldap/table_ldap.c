@@ -23,6 +23,7 @@
 #include <netdb.h>
 
 #include <ctype.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -59,11 +60,32 @@ struct query {
 	char	*filter;
 	char	*attrs[MAX_ATTRS];
 	int	 attrn;
+
+	/* encoded once at startup */
+	struct aldap_filter	*tmpl;
+	struct ber_element	*attrlist;
+
+	/* filter of the keys known to exist */
+	char		*bloom_filter;
+	char		*bloom_attrs[2];
+	struct bloom	 bloom;
+};
+
+#define DEFAULT_BLOOM_REFRESH	300
+#define DEFAULT_BLOOM_FPR	0.01
+
+static const char *services[LDAP_MAX] = {
+	"alias", "domain", "credentials", "netaddr",
+	"userinfo", "source", "mailaddr", "addrname"
 };
 
-static int ldap_run_query(int type, const char *, char *, size_t);
+static int ldap_run_query(int type, const char *, struct table_result *);
+static int ldap_open(void);
+static void ldap_bloom_init(void);
 
 static char *config, *url, *username, *password, *basedn;
+static int bloom_refresh = DEFAULT_BLOOM_REFRESH;
+static double bloom_fpr = DEFAULT_BLOOM_FPR;
 
 static struct aldap *aldap;
 static struct query queries[LDAP_MAX];
@@ -71,6 +93,7 @@ static struct query queries[LDAP_MAX];
 static int
 table_ldap_update(void)
 {
+	ldap_bloom_init();
 	return 1;
 }
 
@@ -85,7 +108,7 @@ table_ldap_check(int service, struct dict *params, const char *key)
 	case K_CREDENTIALS:
 	case K_USERINFO:
 	case K_MAILADDR:
-		if ((ret = ldap_run_query(service, key, NULL, 0)) >= 0) {
+		if ((ret = ldap_run_query(service, key, NULL)) >= 0) {
 			return ret;
 		}
 		log_debug("debug: table-ldap: reconnecting");
@@ -99,7 +122,8 @@ table_ldap_check(int service, struct dict *params, const char *key)
 }
 
 static int
-table_ldap_lookup(int service, struct dict *params, const char *key, char *dst, size_t sz)
+table_ldap_lookup(int service, struct dict *params, const char *key,
+    struct table_result *out)
 {
 	switch(service) {
 	case K_ALIAS:
@@ -107,7 +131,7 @@ table_ldap_lookup(int service, struct dict *params, const char *key, char *dst,
 	case K_CREDENTIALS:
 	case K_USERINFO:
 	case K_MAILADDR:
-		return ldap_run_query(service, key, dst, sz);
+		return ldap_run_query(service, key, out);
 	default:
 		return -1;
 	}
@@ -230,13 +254,67 @@ ldap_parse_attributes(struct query *query, const char *key, const char *line,
 	return 1;
 }
 
+/*
+ * Handle the "<service>_bloom_filter" and "<service>_bloom_attribute"
+ * keys, return 0 if key is not one of them.
+ */
+static int
+ldap_parse_bloom(const char *key, const char *value)
+{
+	size_t	i, len;
+
+	for (i = 0; i < LDAP_MAX; i++) {
+		len = strlen(services[i]);
+		if (strncmp(key, services[i], len) != 0)
+			continue;
+		if (!strcmp(key + len, "_bloom_filter")) {
+			read_value(&queries[i].bloom_filter, key, value);
+			return 1;
+		}
+		if (!strcmp(key + len, "_bloom_attribute")) {
+			read_value(&queries[i].bloom_attrs[0], key, value);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int
+ldap_compile(void)
+{
+	struct query	*q;
+	int		 i;
+
+	for (i = 0; i < LDAP_MAX; i++) {
+		q = &queries[i];
+		bloom_init(&q->bloom, bloom_fpr);
+		if ((q->bloom_filter == NULL) != (q->bloom_attrs[0] == NULL)) {
+			log_warnx("warn: %s_bloom_filter and %s_bloom_attribute "
+			    "go together", services[i], services[i]);
+			return 0;
+		}
+		if (q->filter == NULL)
+			continue;
+		if ((q->tmpl = aldap_filter_compile(q->filter)) == NULL) {
+			log_warnx("warn: invalid filter \"%s\"", q->filter);
+			return 0;
+		}
+		if ((q->attrlist = aldap_attributes(q->attrs)) == NULL) {
+			log_warnx("warn: aldap_attributes");
+			return 0;
+		}
+	}
+	return 1;
+}
+
 static int
 ldap_config(void)
 {
 	size_t		 sz = 0;
 	ssize_t		 flen;
 	FILE		*fp;
-	char		*key, *value, *buf = NULL;
+	char		*key, *value, *buf = NULL, *ep;
+	const char	*e;
 
 	if ((fp = fopen(config, "r")) == NULL) {
 		log_warn("warn: \"%s\"", config);
@@ -301,13 +379,26 @@ ldap_config(void)
 		else if (!strcmp(key, "mailaddr_attributes")) {
 			ldap_parse_attributes(&queries[LDAP_MAILADDR],
 			    key, value, 1);
-		} else
+		} else if (!strcmp(key, "bloom_refresh")) {
+			e = NULL;
+			bloom_refresh = strtonum(value, 1, INT_MAX, &e);
+			if (e) {
+				log_warnx("warn: bad value for bloom_refresh: %s", e);
+				bloom_refresh = DEFAULT_BLOOM_REFRESH;
+			}
+		} else if (!strcmp(key, "bloom_fpr")) {
+			bloom_fpr = strtod(value, &ep);
+			if (*ep || !(bloom_fpr > 0 && bloom_fpr < 1)) {
+				log_warnx("warn: bad value for bloom_fpr: %s", value);
+				bloom_fpr = DEFAULT_BLOOM_FPR;
+			}
+		} else if (!ldap_parse_bloom(key, value))
 			log_warnx("warn: bogus entry \"%s\"", key);
 	}
 
 	free(buf);
 	fclose(fp);
-	return 1;
+	return ldap_compile();
 }
 
 static int
@@ -362,23 +453,18 @@ err:
 }
 
 static int
-ldap_query(const char *filter, char **attributes, char ***outp, size_t n)
+ldap_query(struct query *q, const char *key, char ***outp)
 {
 	struct aldap_message		*m = NULL;
 	struct aldap_page_control	*pg = NULL;
-	int				 ret, found;
-	size_t				 i;
-	char				 basedn__[MAX_LDAP_BASELEN];
-	char				 filter__[MAX_LDAP_FILTERLEN];
+	int				 ret, found, i;
 
-	if (strlcpy(basedn__, basedn, sizeof basedn__) >= sizeof basedn__)
-		return -1;
-	if (strlcpy(filter__, filter, sizeof filter__) >= sizeof filter__)
+	if (aldap_filter_expand(q->tmpl, key) == -1)
 		return -1;
 	found = 0;
 	do {
-		if ((ret = aldap_search(aldap, basedn__, LDAP_SCOPE_SUBTREE,
-		    filter__, NULL, 0, 0, 0, pg)) == -1) {
+		if ((ret = aldap_search_filter(aldap, basedn, LDAP_SCOPE_SUBTREE,
+		    q->tmpl->root, q->attrlist, 0, 0, 0, pg)) == -1) {
 			log_debug("ret=%d", ret);
 			return -1;
 		}
@@ -401,8 +487,8 @@ ldap_query(const char *filter, char **attributes, char ***outp, size_t n)
 				goto error;
 
 			found = 1;
-			for (i = 0; i < n; ++i)
-				if (aldap_match_attr(m, attributes[i], &outp[i]) != 1)
+			for (i = 0; i < q->attrn; ++i)
+				if (aldap_match_attr(m, q->attrs[i], &outp[i]) != 1)
 					goto error;
 			aldap_freemsg(m);
 			m = NULL;
@@ -418,15 +504,97 @@ error:
 end:
 	if (m)
 		aldap_freemsg(m);
-	log_debug("debug: table_ldap: ldap_query: filter=%s, ret=%d", filter, ret);
+	log_debug("debug: table_ldap: ldap_query: filter=%s, key=%s, ret=%d",
+	    q->filter, key, ret);
 	return ret;
 }
 
+/*
+ * Load the values of the bloom attribute of all the entries matching the
+ * bloom filter of a query.  The search must complete: a partial key set,
+ * because of a size limit for instance, would hide existing keys.  On
+ * failure, the previous filter, if any, is kept.
+ */
+static void
+ldap_bloom_load(struct query *q, const char *service)
+{
+	struct aldap_message		*m = NULL;
+	struct aldap_page_control	*pg = NULL;
+	char				**values;
+	int				 i, ret, done;
+
+	bloom_begin(&q->bloom);
+	do {
+		if (aldap_search(aldap, basedn, LDAP_SCOPE_SUBTREE,
+		    q->bloom_filter, q->bloom_attrs, 0, 0, 0, pg) == -1)
+			goto fail;
+		if (pg != NULL) {
+			aldap_freepage(pg);
+			pg = NULL;
+		}
+
+		done = 0;
+		while ((m = aldap_parse(aldap)) != NULL) {
+			if (aldap->msgid != m->msgid)
+				goto fail;
+			if (m->message_type == LDAP_RES_SEARCH_RESULT) {
+				if (aldap_get_resultcode(m) != LDAP_SUCCESS)
+					goto fail;
+				if (m->page != NULL && m->page->cookie_len)
+					pg = m->page;
+				aldap_freemsg(m);
+				m = NULL;
+				done = 1;
+				break;
+			}
+			if (m->message_type != LDAP_RES_SEARCH_ENTRY)
+				goto fail;
+
+			if (aldap_match_attr(m, q->bloom_attrs[0], &values) == 1) {
+				for (i = 0, ret = 0; values[i] && ret == 0; i++)
+					ret = bloom_add(&q->bloom, values[i]);
+				aldap_free_attr(values);
+				if (ret == -1)
+					goto fail;
+			}
+			aldap_freemsg(m);
+			m = NULL;
+		}
+		if (!done)
+			goto fail;
+	} while (pg != NULL);
+
+	if (bloom_commit(&q->bloom) == -1) {
+		log_warn("warn: bloom_commit");
+		return;
+	}
+	bloom_log(&q->bloom, "table-ldap", service);
+	return;
+
+fail:
+	log_warnx("warn: table-ldap: could not load the %s filter", service);
+	if (m)
+		aldap_freemsg(m);
+	if (pg)
+		aldap_freepage(pg);
+	bloom_abort(&q->bloom);
+}
+
+static void
+ldap_bloom_init(void)
+{
+	int	i;
+
+	for (i = 0; i < LDAP_MAX; i++)
+		if (queries[i].bloom_filter)
+			ldap_bloom_load(&queries[i], services[i]);
+}
+
 static int
-ldap_run_query(int type, const char *key, char *dst, size_t sz)
+ldap_run_query(int type, const char *key, struct table_result *out)
 {
 	struct query	 *q;
-	char		**res[4], filter[MAX_LDAP_FILTERLEN];
+	char		**res[4];
 	int		  ret, i;
 
 	switch (type) {
@@ -442,27 +610,31 @@ ldap_run_query(int type, const char *key, char *dst, size_t sz)
 		return -1;
 	}
 
-	if (snprintf(filter, sizeof(filter), q->filter, key)
-	    >= (int)sizeof(filter)) {
+	if (q->tmpl == NULL)
+		return -1;
+
+	if (q->bloom_filter) {
+		if (bloom_stale(&q->bloom, bloom_refresh))
+			ldap_bloom_load(q, services[q - queries]);
+		if (bloom_check(&q->bloom, key) == 0)
+			return 0;
+	}
+
+	if (strlen(q->filter) + strlen(key) >= MAX_LDAP_FILTERLEN) {
 		log_warnx("warn: filter too large");
 		return -1;
 	}
 
 	memset(res, 0, sizeof(res));
-	ret = ldap_query(filter, q->attrs, res, q->attrn);
-	if (ret <= 0 || dst == NULL)
+	ret = ldap_query(q, key, res);
+	if (ret <= 0 || out == NULL)
 		goto end;
 
 	switch (type) {
 
 	case K_ALIAS:
-		memset(dst, 0, sz);
 		for (i = 0; res[0][i]; i++) {
-			if (i && strlcat(dst, ", ", sz) >= sz) {
-				ret = -1;
-				break;
-			}
-			if (strlcat(dst, res[0][i], sz) >= sz) {
+			if (table_result_add(out, ", ", res[0][i]) == -1) {
 				ret = -1;
 				break;
 			}
@@ -470,16 +642,16 @@ ldap_run_query(int type, const char *key, char *dst, size_t sz)
 		break;
 	case K_DOMAIN:
 	case K_MAILADDR:
-		if (strlcpy(dst, res[0][0], sz) >= sz)
+		if (table_result_add(out, NULL, res[0][0]) == -1)
 			ret = -1;
 		break;
 	case K_CREDENTIALS:
-		if (snprintf(dst, sz, "%s:%s", res[0][0], res[1][0]) >= (int)sz)
+		if (table_result_printf(out, "%s:%s", res[0][0], res[1][0]) == -1)
 			ret = -1;
 		break;
 	case K_USERINFO:
-		if (snprintf(dst, sz, "%s:%s:%s", res[0][0], res[1][0],
-		    res[2][0]) >= (int)sz)
+		if (table_result_printf(out, "%s:%s:%s", res[0][0], res[1][0],
+		    res[2][0]) == -1)
 			ret = -1;
 		break;
 	default:
@@ -528,10 +700,11 @@ main(int argc, char **argv)
 	if (!ldap_open())
 		fatalx("failed to connect");
 	log_debug("debug: connected");
+	ldap_bloom_init();
 
 	table_api_on_update(table_ldap_update);
 	table_api_on_check(table_ldap_check);
-	table_api_on_lookup(table_ldap_lookup);
+	table_api_on_lookup_result(table_ldap_lookup);
 	table_api_on_fetch(table_ldap_fetch);
 	table_api_dispatch();
 
@@ -56,6 +56,9 @@ struct config {
 	size_t		 source_ncall;
 	int		 source_expire;
 	time_t		 source_update;
+	const char	*bloom_queries[SQL_MAX];
+	struct bloom	 bloom[SQL_MAX];
+	int		 bloom_refresh;
 };
 
 static MYSQL_STMT *table_mysql_query(const char *, int);
@@ -67,6 +70,14 @@ static void		 config_free(struct config *);
 #define	DEFAULT_EXPIRE	60
 #define	DEFAULT_REFRESH	1000
 
+#define	DEFAULT_BLOOM_REFRESH	300
+#define	DEFAULT_BLOOM_FPR	0.01
+
+static const char	*services[SQL_MAX] = {
+	"alias", "domain", "credentials", "netaddr",
+	"userinfo", "source", "mailaddr", "addrname"
+};
+
 static MYSQL_BIND	 results[SQL_MAX_RESULT];
 static char		 results_buffer[SQL_MAX_RESULT][SMTPD_MAXLINESIZE];
 static char		*conffile;
@@ -115,9 +126,12 @@ config_load(const char *path)
 	FILE		*fp;
 	size_t		 sz = 0;
 	ssize_t		 flen;
-	char		*key, *value, *buf = NULL;
+	char		*key, *value, *buf = NULL, *ep;
+	char		 name[32];
 	const char	*e;
 	long long	 ll;
+	double		 fpr;
+	size_t		 i;
 
 	if ((conf = calloc(1, sizeof(*conf))) == NULL) {
 		log_warn("warn: calloc");
@@ -129,6 +143,7 @@ config_load(const char *path)
 
 	conf->source_refresh = DEFAULT_REFRESH;
 	conf->source_expire = DEFAULT_EXPIRE;
+	conf->bloom_refresh = DEFAULT_BLOOM_REFRESH;
 
 	if ((fp = fopen(path, "r")) == NULL) {
 		log_warn("warn: \"%s\"", path);
@@ -192,6 +207,28 @@ config_load(const char *path)
 		}
 		conf->source_refresh = ll;
 	}
+	if ((value = dict_get(&conf->conf, "bloom_refresh"))) {
+		e = NULL;
+		ll = strtonum(value, 1, INT_MAX, &e);
+		if (e) {
+			log_warnx("warn: bad value for bloom_refresh: %s", e);
+			goto end;
+		}
+		conf->bloom_refresh = ll;
+	}
+	fpr = DEFAULT_BLOOM_FPR;
+	if ((value = dict_get(&conf->conf, "bloom_fpr"))) {
+		fpr = strtod(value, &ep);
+		if (*ep || !(fpr > 0 && fpr < 1)) {
+			log_warnx("warn: bad value for bloom_fpr: %s", value);
+			goto end;
+		}
+	}
+	for (i = 0; i < SQL_MAX; i++) {
+		bloom_init(&conf->bloom[i], fpr);
+		(void)snprintf(name, sizeof name, "bloom_query_%s", services[i]);
+		conf->bloom_queries[i] = dict_get(&conf->conf, name);
+	}
 
 	free(buf);
 	fclose(fp);
@@ -297,9 +334,13 @@ static void
 config_free(struct config *conf)
 {
 	void	*value;
+	size_t	 i;
 
 	config_reset(conf);
 
+	for (i = 0; i < SQL_MAX; i++)
+		bloom_free(&conf->bloom[i]);
+
 	while (dict_poproot(&conf->conf, &value))
 		free(value);
 
@@ -309,6 +350,89 @@ config_free(struct config *conf)
 	free(conf);
 }
 
+/*
+ * Load the keys returned by the bloom query of a service into its filter.
+ * On failure, the previous filter, if any, is kept.
+ */
+static void
+table_mysql_bloom_load(struct config *conf, int i)
+{
+	MYSQL_RES	*res;
+	MYSQL_ROW	 row;
+
+	bloom_begin(&conf->bloom[i]);
+
+	if (mysql_query(conf->db, conf->bloom_queries[i]) != 0) {
+		log_warnx("warn: mysql_query: %s", mysql_error(conf->db));
+		bloom_abort(&conf->bloom[i]);
+		return;
+	}
+	/* rows are streamed, the key set may not fit in memory twice */
+	if ((res = mysql_use_result(conf->db)) == NULL) {
+		log_warnx("warn: mysql_use_result: %s", mysql_error(conf->db));
+		bloom_abort(&conf->bloom[i]);
+		return;
+	}
+	if (mysql_num_fields(res) < 1) {
+		log_warnx("warn: bloom_query_%s returns no column", services[i]);
+		goto fail;
+	}
+	while ((row = mysql_fetch_row(res)) != NULL) {
+		if (row[0] == NULL)
+			continue;
+		if (bloom_add(&conf->bloom[i], row[0]) == -1) {
+			log_warn("warn: bloom_add");
+			goto fail;
+		}
+	}
+	if (mysql_errno(conf->db)) {
+		log_warnx("warn: mysql_fetch_row: %s", mysql_error(conf->db));
+		goto fail;
+	}
+	mysql_free_result(res);
+
+	if (bloom_commit(&conf->bloom[i]) == -1) {
+		log_warn("warn: bloom_commit");
+		return;
+	}
+	bloom_log(&conf->bloom[i], "table-mysql", services[i]);
+	return;
+
+fail:
+	mysql_free_result(res);
+	bloom_abort(&conf->bloom[i]);
+}
+
+/*
+ * Return 0 if the key is known to be absent, without asking the server.
+ */
+static int
+table_mysql_bloom(int service, const char *key)
+{
+	int	i;
+
+	for (i = 0; i < SQL_MAX; i++)
+		if (service == 1 << i)
+			break;
+	if (i == SQL_MAX || config->bloom_queries[i] == NULL)
+		return 1;
+
+	if (bloom_stale(&config->bloom[i], config->bloom_refresh))
+		table_mysql_bloom_load(config, i);
+
+	return bloom_check(&config->bloom[i], key);
+}
+
+static void
+table_mysql_bloom_init(struct config *conf)
+{
+	int	i;
+
+	for (i = 0; i < SQL_MAX; i++)
+		if (conf->bloom_queries[i])
+			table_mysql_bloom_load(conf, i);
+}
+
 static int
 table_mysql_update(void)
 {
@@ -316,10 +440,12 @@ table_mysql_update(void)
 
 	if ((c = config_load(conffile)) == NULL)
 		return 0;
-	if (config_connect(c) == 0) {
+	if (config_connect(c) == 0 ||
+	    table_api_breaker_config(&c->conf) == -1) {
 		config_free(c);
 		return 0;
 	}
+	table_mysql_bloom_init(c);
 
 	config_free(config);
 	config = c;
@@ -389,6 +515,9 @@ table_mysql_check(int service, struct dict *params, const char *key)
 	if (config->db == NULL && config_connect(config) == 0)
 		return -1;
 
+	if (table_mysql_bloom(service, key) == 0)
+		return 0;
+
 	stmt = table_mysql_query(key, service);
 	if (stmt == NULL)
 		return -1;
@@ -409,7 +538,8 @@ table_mysql_check(int service, struct dict *params, const char *key)
 }
 
 static int
-table_mysql_lookup(int service, struct dict *params, const char *key, char *dst, size_t sz)
+table_mysql_lookup(int service, struct dict *params, const char *key,
+    struct table_result *out)
 {
 	MYSQL_STMT	*stmt;
 	int		 r, s;
@@ -417,6 +547,9 @@ table_mysql_lookup(int service, struct dict *params, const char *key, char *dst,
 	if (config->db == NULL && config_connect(config) == 0)
 		return -1;
 
+	if (table_mysql_bloom(service, key) == 0)
+		return 0;
+
 	if ((stmt = table_mysql_query(key, service)) == NULL)
 		return -1;
 
@@ -435,15 +568,8 @@ table_mysql_lookup(int service, struct dict *params, const char *key, char *dst,
 
 	switch(service) {
 	case K_ALIAS:
-		memset(dst, 0, sz);
 		do {
-			if (dst[0] && strlcat(dst, ", ", sz) >= sz) {
-				log_warnx("warn: result too large");
-				r = -1;
-				break;
-			}
-			if (strlcat(dst, results_buffer[0], sz) >= sz) {
-				log_warnx("warn: result too large");
+			if (table_result_add(out, ", ", results_buffer[0]) == -1) {
 				r = -1;
 				break;
 			}
@@ -456,31 +582,25 @@ table_mysql_lookup(int service, struct dict *params, const char *key, char *dst,
 		}
 		break;
 	case K_CREDENTIALS:
-		if (snprintf(dst, sz, "%s:%s",
+		if (table_result_printf(out, "%s:%s",
 		    results_buffer[0],
-		    results_buffer[1]) > (ssize_t)sz) {
-			log_warnx("warn: result too large");
+		    results_buffer[1]) == -1)
 			r = -1;
-		}
 		break;
 	case K_USERINFO:
-		if (snprintf(dst, sz, "%s:%s:%s",
+		if (table_result_printf(out, "%s:%s:%s",
 		    results_buffer[0],
 		    results_buffer[1],
-		    results_buffer[2]) > (ssize_t)sz) {
-			log_warnx("warn: result too large");
+		    results_buffer[2]) == -1)
 			r = -1;
-		}
 		break;
 	case K_DOMAIN:
 	case K_NETADDR:
 	case K_SOURCE:
 	case K_MAILADDR:
 	case K_ADDRNAME:
-		if (strlcpy(dst, results_buffer[0], sz) >= sz) {
-			log_warnx("warn: result too large");
+		if (table_result_add(out, NULL, results_buffer[0]) == -1)
 			r = -1;
-		}
 		break;
 	default:
 		log_warnx("warn: unknown service %d",
@@ -592,12 +712,15 @@ main(int argc, char **argv)
 
 	if ((config = config_load(conffile)) == NULL)
 		fatalx("error parsing config file");
+	if (table_api_breaker_config(&config->conf) == -1)
+		fatalx("error parsing config file");
 	if (config_connect(config) == 0)
 		fatalx("could not connect");
+	table_mysql_bloom_init(config);
 
 	table_api_on_update(table_mysql_update);
 	table_api_on_check(table_mysql_check);
-	table_api_on_lookup(table_mysql_lookup);
+	table_api_on_lookup_result(table_mysql_lookup);
 	table_api_on_fetch(table_mysql_fetch);
 	table_api_dispatch();
 
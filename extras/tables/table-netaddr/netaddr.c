@@ -0,0 +1,449 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "netaddr.h"
+
+#define STRIDE		6
+
+static inline unsigned int
+poptrie_bits(const uint64_t key[2], int off)
+{
+	if (off <= 64 - STRIDE)
+		return (key[0] >> (64 - STRIDE - off)) & 63;
+	if (off < 64)
+		return ((key[0] << (off - (64 - STRIDE))) |
+		    (key[1] >> (128 - STRIDE - off))) & 63;
+	off -= 64;
+	if (off <= 64 - STRIDE)
+		return (key[1] >> (64 - STRIDE - off)) & 63;
+	return (key[1] << (off - (64 - STRIDE))) & 63;
+}
+
+static void
+netaddr_mask(struct netaddr_prefix *p)
+{
+	if (p->len == 0) {
+		p->key[0] = p->key[1] = 0;
+	}
+	else if (p->len <= 64) {
+		p->key[0] &= ~(uint64_t)0 << (64 - p->len);
+		p->key[1] = 0;
+	}
+	else if (p->len < 128)
+		p->key[1] &= ~(uint64_t)0 << (128 - p->len);
+}
+
+/*
+ * Parse an address or a network in CIDR notation.  IPv6 addresses may be
+ * enclosed in brackets or prefixed with "IPv6:" as in SMTP.
+ */
+int
+netaddr_parse(const char *s, struct netaddr_prefix *p)
+{
+	struct in_addr	 in;
+	struct in6_addr	 in6;
+	const char	*errstr;
+	char		 buf[INET6_ADDRSTRLEN + 8], *len, *end;
+	int		 i, max;
+
+	if (strncasecmp(s, "IPv6:", 5) == 0)
+		s += 5;
+	if (strlcpy(buf, s, sizeof buf) >= sizeof buf)
+		return (-1);
+	if ((len = strchr(buf, '/')) != NULL)
+		*len++ = '\0';
+
+	s = buf;
+	if (*s == '[') {
+		if ((end = strchr(++s, ']')) == NULL || end[1] != '\0')
+			return (-1);
+		*end = '\0';
+	}
+
+	memset(p, 0, sizeof *p);
+	if (inet_pton(AF_INET, s, &in) == 1) {
+		p->af = AF_INET;
+		p->key[0] = (uint64_t)ntohl(in.s_addr) << 32;
+		max = 32;
+	}
+	else if (inet_pton(AF_INET6, s, &in6) == 1) {
+		p->af = AF_INET6;
+		for (i = 0; i < 16; i++)
+			p->key[i / 8] = (p->key[i / 8] << 8) | in6.s6_addr[i];
+		max = 128;
+	}
+	else
+		return (-1);
+
+	p->len = max;
+	if (len) {
+		p->len = strtonum(len, 0, max, &errstr);
+		if (errstr)
+			return (-1);
+	}
+	netaddr_mask(p);
+	return (0);
+}
+
+int
+netaddr_format(const struct netaddr_prefix *p, char *buf, size_t sz)
+{
+	struct in_addr	 in;
+	struct in6_addr	 in6;
+	char		 addr[INET6_ADDRSTRLEN];
+	int		 i, n;
+
+	if (p->af == AF_INET) {
+		in.s_addr = htonl(p->key[0] >> 32);
+		inet_ntop(AF_INET, &in, addr, sizeof addr);
+	}
+	else {
+		for (i = 0; i < 16; i++)
+			in6.s6_addr[i] = p->key[i / 8] >> (56 - 8 * (i % 8));
+		inet_ntop(AF_INET6, &in6, addr, sizeof addr);
+	}
+
+	n = snprintf(buf, sz, "%s/%d", addr, p->len);
+	if (n < 0 || (size_t)n >= sz)
+		return (-1);
+	return (0);
+}
+
+int
+netaddr_table_add(struct netaddr_table *t, const struct netaddr_prefix *p)
+{
+	struct netaddr_prefix	*tmp;
+	size_t			 sz;
+
+	if (t->nprefixes == t->prefixesz) {
+		sz = t->prefixesz ? t->prefixesz * 2 : 1024;
+		tmp = reallocarray(t->prefixes, sz, sizeof(*tmp));
+		if (tmp == NULL)
+			return (-1);
+		t->prefixes = tmp;
+		t->prefixesz = sz;
+	}
+	t->prefixes[t->nprefixes++] = *p;
+	return (0);
+}
+
+static int
+netaddr_cmp(const void *a, const void *b)
+{
+	const struct netaddr_prefix	*pa = a, *pb = b;
+
+	if (pa->af != pb->af)
+		return (pa->af < pb->af ? -1 : 1);
+	if (pa->key[0] != pb->key[0])
+		return (pa->key[0] < pb->key[0] ? -1 : 1);
+	if (pa->key[1] != pb->key[1])
+		return (pa->key[1] < pb->key[1] ? -1 : 1);
+	if (pa->len != pb->len)
+		return (pa->len < pb->len ? -1 : 1);
+	return (0);
+}
+
+static int
+poptrie_reserve(struct poptrie *pt, size_t nodes, size_t leaves)
+{
+	void	*tmp;
+	size_t	 sz;
+
+	if (pt->nnodes + nodes > pt->nodesz) {
+		for (sz = pt->nodesz ? pt->nodesz : 256;
+		    sz < pt->nnodes + nodes; sz *= 2)
+			;
+		if ((tmp = reallocarray(pt->nodes, sz, sizeof(*pt->nodes)))
+		    == NULL)
+			return (-1);
+		pt->nodes = tmp;
+		pt->nodesz = sz;
+	}
+	if (pt->nleaves + leaves > pt->leavesz) {
+		for (sz = pt->leavesz ? pt->leavesz : 1024;
+		    sz < pt->nleaves + leaves; sz *= 2)
+			;
+		if ((tmp = reallocarray(pt->leaves, sz, sizeof(*pt->leaves)))
+		    == NULL)
+			return (-1);
+		pt->leaves = tmp;
+		pt->leavesz = sz;
+	}
+	return (0);
+}
+
+/*
+ * Fill node ni from the sorted prefixes p[0..n), which all share the
+ * first off bits and are longer than off.  Leaf values are the index of
+ * the prefix in the table plus one, p[0] being at index base.  dflt is
+ * the longest prefix shorter than off covering the node.
+ */
+static int
+poptrie_build(struct poptrie *pt, size_t ni, const struct netaddr_prefix *p,
+    size_t n, uint32_t base, int off, uint32_t dflt)
+{
+	struct poptrie_node	 node;
+	uint32_t		 leaf[64];
+	uint8_t			 llen[64];
+	size_t			 first[64], last[64], i;
+	unsigned int		 s, v, span;
+	int			 c;
+
+	for (s = 0; s < 64; s++) {
+		leaf[s] = dflt;
+		llen[s] = 0;
+		first[s] = last[s] = 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		v = poptrie_bits(p[i].key, off);
+		if (p[i].len > off + STRIDE) {
+			if (last[v] == 0)
+				first[v] = i;
+			last[v] = i + 1;
+			continue;
+		}
+		span = 1U << (off + STRIDE - p[i].len);
+		for (s = v & ~(span - 1); s < (v & ~(span - 1)) + span; s++)
+			if (p[i].len >= llen[s]) {
+				leaf[s] = base + i + 1;
+				llen[s] = p[i].len;
+			}
+	}
+
+	memset(&node, 0, sizeof node);
+	for (s = 0; s < 64; s++)
+		if (last[s])
+			node.vector |= (uint64_t)1 << s;
+
+	if (poptrie_reserve(pt, __builtin_popcountll(node.vector), 64) == -1)
+		return (-1);
+	node.base0 = pt->nleaves;
+	node.base1 = pt->nnodes;
+	pt->nnodes += __builtin_popcountll(node.vector);
+
+	for (s = 0, c = 0; s < 64; s++) {
+		if (last[s])
+			continue;
+		if (c == 0 || leaf[s] != pt->leaves[pt->nleaves - 1]) {
+			node.leafvec |= (uint64_t)1 << s;
+			pt->leaves[pt->nleaves++] = leaf[s];
+		}
+		c = 1;
+	}
+	pt->nodes[ni] = node;
+
+	for (s = 0, c = 0; s < 64; s++) {
+		if (last[s] == 0)
+			continue;
+		if (poptrie_build(pt, node.base1 + c++, p + first[s],
+		    last[s] - first[s], base + first[s], off + STRIDE,
+		    leaf[s]) == -1)
+			return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * The first POPTRIE_DIRECT bits index an array, as with the direct
+ * pointing of the original Poptrie, which saves the top levels of nodes.
+ */
+static int
+poptrie_build_direct(struct poptrie *pt, const struct netaddr_prefix *p,
+    size_t n, uint32_t base)
+{
+	const size_t	 slots = 1 << POPTRIE_DIRECT;
+	uint8_t		*llen = NULL;
+	size_t		*first = NULL, *last = NULL, i, s, v, span;
+	int		 ret = -1;
+
+	if ((pt->direct = calloc(slots, sizeof(*pt->direct))) == NULL ||
+	    (llen = calloc(slots, sizeof(*llen))) == NULL ||
+	    (first = calloc(slots, sizeof(*first))) == NULL ||
+	    (last = calloc(slots, sizeof(*last))) == NULL)
+		goto done;
+
+	for (i = 0; i < n; i++) {
+		v = p[i].key[0] >> (64 - POPTRIE_DIRECT);
+		if (p[i].len > POPTRIE_DIRECT) {
+			if (last[v] == 0)
+				first[v] = i;
+			last[v] = i + 1;
+			continue;
+		}
+		span = (size_t)1 << (POPTRIE_DIRECT - p[i].len);
+		for (s = v & ~(span - 1); s < (v & ~(span - 1)) + span; s++)
+			if (p[i].len >= llen[s]) {
+				pt->direct[s] = base + i + 1;
+				llen[s] = p[i].len;
+			}
+	}
+
+	for (s = 0; s < slots; s++) {
+		if (last[s] == 0) {
+			pt->direct[s] |= POPTRIE_LEAF;
+			continue;
+		}
+		if (poptrie_reserve(pt, 1, 0) == -1)
+			goto done;
+		i = pt->nnodes++;
+		if (poptrie_build(pt, i, p + first[s], last[s] - first[s],
+		    base + first[s], POPTRIE_DIRECT, pt->direct[s]) == -1)
+			goto done;
+		pt->direct[s] = i;
+	}
+	ret = 0;
+
+done:
+	free(llen);
+	free(first);
+	free(last);
+	return (ret);
+}
+
+static uint32_t
+poptrie_lookup(const struct poptrie *pt, const uint64_t key[2])
+{
+	const struct poptrie_node	*node;
+	uint64_t			 bit, mask;
+	uint32_t			 d;
+	int				 off;
+
+	d = pt->direct[key[0] >> (64 - POPTRIE_DIRECT)];
+	if (d & POPTRIE_LEAF)
+		return (d & ~POPTRIE_LEAF);
+	node = &pt->nodes[d];
+
+	for (off = POPTRIE_DIRECT;; off += STRIDE) {
+		bit = (uint64_t)1 << poptrie_bits(key, off);
+		mask = bit | (bit - 1);
+		if ((node->vector & bit) == 0)
+			return (pt->leaves[node->base0 +
+			    __builtin_popcountll(node->leafvec & mask) - 1]);
+		node = &pt->nodes[node->base1 +
+		    __builtin_popcountll(node->vector & mask) - 1];
+	}
+}
+
+static void
+poptrie_free(struct poptrie *pt)
+{
+	free(pt->direct);
+	free(pt->nodes);
+	free(pt->leaves);
+	memset(pt, 0, sizeof *pt);
+}
+
+/*
+ * Sort and deduplicate the prefixes, then build one trie per family.
+ */
+int
+netaddr_table_build(struct netaddr_table *t)
+{
+	struct netaddr_prefix	*p;
+	size_t			 i, n, n4;
+
+	poptrie_free(&t->v4);
+	poptrie_free(&t->v6);
+
+	if (t->nprefixes)
+		qsort(t->prefixes, t->nprefixes, sizeof(*t->prefixes),
+		    netaddr_cmp);
+	for (i = 0, n = 0; i < t->nprefixes; i++)
+		if (n == 0 || netaddr_cmp(&t->prefixes[n - 1],
+		    &t->prefixes[i]))
+			t->prefixes[n++] = t->prefixes[i];
+	t->nprefixes = n;
+
+	p = t->prefixes;
+	for (n4 = 0; n4 < n && p[n4].af == AF_INET; n4++)
+		;
+
+	if (poptrie_build_direct(&t->v4, p, n4, 0) == -1)
+		return (-1);
+	if (poptrie_build_direct(&t->v6, p + n4, n - n4, n4) == -1)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Return the longest prefix containing the address or network p.
+ */
+const struct netaddr_prefix *
+netaddr_table_lookup(const struct netaddr_table *t,
+    const struct netaddr_prefix *p)
+{
+	const struct poptrie	*pt;
+	struct netaddr_prefix	 k, *m;
+	uint32_t		 leaf;
+
+	pt = (p->af == AF_INET) ? &t->v4 : &t->v6;
+	if (pt->direct == NULL)
+		return (NULL);
+	if ((leaf = poptrie_lookup(pt, p->key)) == 0)
+		return (NULL);
+	if (p->len == (p->af == AF_INET ? 32 : 128) ||
+	    t->prefixes[leaf - 1].len <= p->len)
+		return (&t->prefixes[leaf - 1]);
+
+	/*
+	 * The network is split by longer prefixes, look for the enclosing
+	 * ones in the sorted array.
+	 */
+	k = *p;
+	do {
+		netaddr_mask(&k);
+		if ((m = bsearch(&k, t->prefixes, t->nprefixes, sizeof(k),
+		    netaddr_cmp)) != NULL)
+			return (m);
+	} while (k.len-- > 0);
+
+	return (NULL);
+}
+
+size_t
+netaddr_table_size(const struct netaddr_table *t)
+{
+	return (t->nprefixes * sizeof(*t->prefixes) +
+	    2 * (sizeof(uint32_t) << POPTRIE_DIRECT) +
+	    (t->v4.nnodes + t->v6.nnodes) * sizeof(struct poptrie_node) +
+	    (t->v4.nleaves + t->v6.nleaves) * sizeof(uint32_t));
+}
+
+void
+netaddr_table_free(struct netaddr_table *t)
+{
+	poptrie_free(&t->v4);
+	poptrie_free(&t->v6);
+	free(t->prefixes);
+	memset(t, 0, sizeof *t);
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Addresses are kept as 128-bit keys, most significant bit first.
+ * IPv4 addresses use the upper 32 bits of key[0].
+ */
+struct netaddr_prefix {
+	uint64_t	key[2];
+	uint8_t		af;
+	uint8_t		len;
+};
+
+/*
+ * Poptrie node: 64 slots indexed by 6 bits of the key.  A slot either
+ * points to a child node, or to a leaf.  Children are contiguous from
+ * base1, and consecutive slots holding the same leaf share one entry
+ * from base0, so both are found by counting bits in the vectors.
+ */
+struct poptrie_node {
+	uint64_t	vector;		/* slots with a child */
+	uint64_t	leafvec;	/* slots starting a run of leaves */
+	uint32_t	base0;
+	uint32_t	base1;
+};
+
+#define POPTRIE_DIRECT	16		/* bits resolved by the first array */
+#define POPTRIE_LEAF	0x80000000U
+
+struct poptrie {
+	uint32_t		*direct;	/* node index, or leaf | POPTRIE_LEAF */
+	struct poptrie_node	*nodes;
+	size_t			 nnodes;
+	size_t			 nodesz;
+	uint32_t		*leaves;	/* index in prefixes + 1, or 0 */
+	size_t			 nleaves;
+	size_t			 leavesz;
+};
+
+struct netaddr_table {
+	struct netaddr_prefix	*prefixes;
+	size_t			 nprefixes;
+	size_t			 prefixesz;
+	struct poptrie		 v4;
+	struct poptrie		 v6;
+};
+
+int netaddr_parse(const char *, struct netaddr_prefix *);
+int netaddr_format(const struct netaddr_prefix *, char *, size_t);
+int netaddr_table_add(struct netaddr_table *, const struct netaddr_prefix *);
+int netaddr_table_build(struct netaddr_table *);
+const struct netaddr_prefix *netaddr_table_lookup(const struct netaddr_table *,
+    const struct netaddr_prefix *);
+size_t netaddr_table_size(const struct netaddr_table *);
+void netaddr_table_free(struct netaddr_table *);
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Build a table from random prefixes and measure lookups per second.
+ * Prefix lengths roughly follow a routing table: mostly /24 for IPv4
+ * and /48 for IPv6.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "netaddr.h"
+
+static double
+elapsed(struct timespec *t0)
+{
+	struct timespec	t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+static uint64_t
+rand64(void)
+{
+	return ((uint64_t)random() << 62) ^ ((uint64_t)random() << 31) ^
+	    random();
+}
+
+static void
+random_prefix(struct netaddr_prefix *p, int af)
+{
+	static const uint8_t	 len4[] = { 8, 12, 16, 19, 20, 22, 23, 24, 24,
+	    24, 24, 24, 24, 28, 32 };
+	static const uint8_t	 len6[] = { 24, 29, 32, 36, 40, 44, 48, 48, 48,
+	    48, 56, 64, 128 };
+	char			 buf[64];
+
+	memset(p, 0, sizeof *p);
+	p->af = af;
+	if (af == AF_INET) {
+		p->key[0] = rand64() << 32;
+		p->len = len4[random() % sizeof(len4)];
+	}
+	else {
+		/* stay in 2000::/3 */
+		p->key[0] = (rand64() >> 3) | ((uint64_t)1 << 61);
+		p->key[1] = rand64();
+		p->len = len6[random() % sizeof(len6)];
+	}
+
+	/* normalize through the parser */
+	netaddr_format(p, buf, sizeof buf);
+	if (netaddr_parse(buf, p) == -1)
+		errx(1, "netaddr_parse: %s", buf);
+}
+
+static void
+bench(int af, size_t nprefixes, size_t nlookups)
+{
+	struct netaddr_table	 t;
+	struct netaddr_prefix	 p, *keys;
+	struct timespec		 t0;
+	size_t			 i, found;
+	double			 tb, tl;
+
+	memset(&t, 0, sizeof t);
+	for (i = 0; i < nprefixes; i++) {
+		random_prefix(&p, af);
+		if (netaddr_table_add(&t, &p) == -1)
+			err(1, "netaddr_table_add");
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (netaddr_table_build(&t) == -1)
+		err(1, "netaddr_table_build");
+	tb = elapsed(&t0);
+
+	/* half of the keys fall inside a prefix */
+	if ((keys = calloc(nlookups, sizeof(*keys))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < nlookups; i++) {
+		random_prefix(&keys[i], af);
+		if (i % 2) {
+			p = t.prefixes[random() % t.nprefixes];
+			keys[i].key[0] = p.key[0] | (keys[i].key[0] &
+			    (p.len >= 64 ? 0 : ~(uint64_t)0 >> p.len));
+		}
+		keys[i].len = (af == AF_INET) ? 32 : 128;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0, found = 0; i < nlookups; i++)
+		if (netaddr_table_lookup(&t, &keys[i]))
+			found++;
+	tl = elapsed(&t0);
+
+	printf("%s: %zu prefixes, %zu nodes, %.1f MB, build %.2fs, "
+	    "%.1fM lookups/s (%zu/%zu found)\n",
+	    af == AF_INET ? "inet" : "inet6", t.nprefixes,
+	    af == AF_INET ? t.v4.nnodes : t.v6.nnodes,
+	    netaddr_table_size(&t) / 1048576.0, tb,
+	    nlookups / tl / 1e6, found, nlookups);
+
+	free(keys);
+	netaddr_table_free(&t);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t	nprefixes = 1000000, nlookups = 10000000;
+
+	if (argc > 1)
+		nprefixes = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		nlookups = strtoul(argv[2], NULL, 10);
+
+	srandom(42);
+	bench(AF_INET, nprefixes, nlookups);
+	bench(AF_INET6, nprefixes, nlookups);
+	return (0);
+}
@@ -19,8 +19,10 @@
 #include <sys/types.h>
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,6 +46,11 @@ enum {
 	SQL_MAX
 };
 
+enum {
+	PG_PRIMARY = 0,
+	PG_REPLICA
+};
+
 struct config {
 	struct dict	 conf;
 	PGconn		*db;
@@ -55,11 +62,37 @@ struct config {
 	size_t		 source_ncall;
 	int		 source_expire;
 	time_t		 source_update;
+	const char	*bloom_queries[SQL_MAX];
+	struct bloom	 bloom[SQL_MAX];
+	int		 bloom_refresh;
+
+	/* hedged lookups, when a replica is configured */
+	PGconn		*replica;
+	char		*replica_statements[SQL_MAX];
+	int		 busy[2];
+	struct timespec	 sent[2];
+	struct hedge	 hedge[2];
+	size_t		 nqueries;
+	size_t		 nhedged;
+	size_t		 nreplica;
 };
 
 #define	DEFAULT_EXPIRE	60
 #define	DEFAULT_REFRESH	1000
 
+#define	DEFAULT_BLOOM_REFRESH	300
+#define	DEFAULT_BLOOM_FPR	0.01
+
+#define	DEFAULT_HEDGE_PERCENTILE	95
+#define	DEFAULT_HEDGE_DELAY		5
+
+static const char	*services[SQL_MAX] = {
+	"alias", "domain", "credentials", "netaddr",
+	"userinfo", "source", "mailaddr", "addrname"
+};
+
+static int		 table_postgres_ready(int, int);
+
 static char		*conffile;
 static struct config	*config;
 
@@ -92,11 +125,16 @@ config_reset(struct config *conf)
 {
 	size_t	i;
 
-	for (i = 0; i < SQL_MAX; i++)
+	for (i = 0; i < SQL_MAX; i++) {
 		if (conf->statements[i]) {
 			free(conf->statements[i]);
 			conf->statements[i] = NULL;
 		}
+		if (conf->replica_statements[i]) {
+			free(conf->replica_statements[i]);
+			conf->replica_statements[i] = NULL;
+		}
+	}
 	if (conf->stmt_fetch_source) {
 		free(conf->stmt_fetch_source);
 		conf->stmt_fetch_source = NULL;
@@ -105,15 +143,24 @@ config_reset(struct config *conf)
 		PQfinish(conf->db);
 		conf->db = NULL;
 	}
+	if (conf->replica) {
+		PQfinish(conf->replica);
+		conf->replica = NULL;
+	}
+	conf->busy[PG_PRIMARY] = conf->busy[PG_REPLICA] = 0;
 }
 
 static void
 config_free(struct config *conf)
 {
 	void	*value;
+	size_t	 i;
 
 	config_reset(conf);
 
+	for (i = 0; i < SQL_MAX; i++)
+		bloom_free(&conf->bloom[i]);
+
 	while (dict_poproot(&conf->conf, &value))
 		free(value);
 
@@ -130,9 +177,13 @@ config_load(const char *path)
 	FILE		*fp;
 	size_t		 sz = 0;
 	ssize_t		 flen;
-	char		*key, *value, *buf = NULL;
+	char		*key, *value, *buf = NULL, *ep;
+	char		 name[32];
 	const char	*e;
 	long long	 ll;
+	double		 fpr;
+	size_t		 i;
+	int		 percentile, delay;
 
 	if ((conf = calloc(1, sizeof(*conf))) == NULL) {
 		log_warn("warn: calloc");
@@ -144,6 +195,7 @@ config_load(const char *path)
 
 	conf->source_refresh = DEFAULT_REFRESH;
 	conf->source_expire = DEFAULT_EXPIRE;
+	conf->bloom_refresh = DEFAULT_BLOOM_REFRESH;
 
 	if ((fp = fopen(path, "r")) == NULL) {
 		log_warn("warn: \"%s\"", path);
@@ -207,6 +259,49 @@ config_load(const char *path)
 		}
 		conf->source_refresh = ll;
 	}
+	if ((value = dict_get(&conf->conf, "bloom_refresh"))) {
+		e = NULL;
+		ll = strtonum(value, 1, INT_MAX, &e);
+		if (e) {
+			log_warnx("warn: bad value for bloom_refresh: %s", e);
+			goto end;
+		}
+		conf->bloom_refresh = ll;
+	}
+	fpr = DEFAULT_BLOOM_FPR;
+	if ((value = dict_get(&conf->conf, "bloom_fpr"))) {
+		fpr = strtod(value, &ep);
+		if (*ep || !(fpr > 0 && fpr < 1)) {
+			log_warnx("warn: bad value for bloom_fpr: %s", value);
+			goto end;
+		}
+	}
+	percentile = DEFAULT_HEDGE_PERCENTILE;
+	if ((value = dict_get(&conf->conf, "hedge_percentile"))) {
+		e = NULL;
+		percentile = strtonum(value, 1, 100, &e);
+		if (e) {
+			log_warnx("warn: bad value for hedge_percentile: %s", e);
+			goto end;
+		}
+	}
+	delay = DEFAULT_HEDGE_DELAY;
+	if ((value = dict_get(&conf->conf, "hedge_delay"))) {
+		e = NULL;
+		delay = strtonum(value, 0, INT_MAX, &e);
+		if (e) {
+			log_warnx("warn: bad value for hedge_delay: %s", e);
+			goto end;
+		}
+	}
+	hedge_init(&conf->hedge[PG_PRIMARY], percentile, delay);
+	hedge_init(&conf->hedge[PG_REPLICA], percentile, delay);
+
+	for (i = 0; i < SQL_MAX; i++) {
+		bloom_init(&conf->bloom[i], fpr);
+		(void)snprintf(name, sizeof name, "bloom_query_%s", services[i]);
+		conf->bloom_queries[i] = dict_get(&conf->conf, name);
+	}
 
 	free(buf);
 	fclose(fp);
@@ -272,6 +367,23 @@ config_connect(struct config *conf)
 	    q, 0, 1)) == NULL)
 		goto end;
 
+	/* the table works without its replica */
+	conninfo = dict_get(&conf->conf, "replica_conninfo");
+	if (conninfo && (conf->replica = PQconnectdb(conninfo)) != NULL) {
+		if (PQstatus(conf->replica) != CONNECTION_OK) {
+			log_warnx("warn: replica: PQconnectdb: %s",
+			    PQerrorMessage(conf->replica));
+			goto noreplica;
+		}
+		for (i = 0; i < SQL_MAX; i++) {
+			q = dict_get(&conf->conf, qspec[i].name);
+			if (q && (conf->replica_statements[i] =
+			    table_postgres_prepare_stmt(conf->replica, q, 1,
+			    qspec[i].cols)) == NULL)
+				goto noreplica;
+		}
+	}
+
 	log_debug("debug: connected");
 
 	return 1;
@@ -279,6 +391,89 @@ config_connect(struct config *conf)
     end:
 	config_reset(conf);
 	return 0;
+
+    noreplica:
+	for (i = 0; i < SQL_MAX; i++) {
+		free(conf->replica_statements[i]);
+		conf->replica_statements[i] = NULL;
+	}
+	PQfinish(conf->replica);
+	conf->replica = NULL;
+	log_debug("debug: connected without replica");
+	return 1;
+}
+
+/*
+ * Load the keys returned by the bloom query of a service into its filter.
+ * On failure, the previous filter, if any, is kept.
+ */
+static void
+table_postgres_bloom_load(struct config *conf, int i)
+{
+	PGresult	*res;
+	int		 n;
+
+	bloom_begin(&conf->bloom[i]);
+
+	res = PQexec(conf->db, conf->bloom_queries[i]);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		log_warnx("warn: PQexec: %s", PQerrorMessage(conf->db));
+		goto fail;
+	}
+	if (PQnfields(res) < 1) {
+		log_warnx("warn: bloom_query_%s returns no column", services[i]);
+		goto fail;
+	}
+	for (n = 0; n < PQntuples(res); n++) {
+		if (bloom_add(&conf->bloom[i], PQgetvalue(res, n, 0)) == -1) {
+			log_warn("warn: bloom_add");
+			goto fail;
+		}
+	}
+	PQclear(res);
+
+	if (bloom_commit(&conf->bloom[i]) == -1) {
+		log_warn("warn: bloom_commit");
+		return;
+	}
+	bloom_log(&conf->bloom[i], "table-postgres", services[i]);
+	return;
+
+fail:
+	PQclear(res);
+	bloom_abort(&conf->bloom[i]);
+}
+
+/*
+ * Return 0 if the key is known to be absent, without asking the server.
+ */
+static int
+table_postgres_bloom(int service, const char *key)
+{
+	int	i;
+
+	for (i = 0; i < SQL_MAX; i++)
+		if (service == 1 << i)
+			break;
+	if (i == SQL_MAX || config->bloom_queries[i] == NULL)
+		return 1;
+
+	if (bloom_stale(&config->bloom[i], config->bloom_refresh)) {
+		table_postgres_ready(PG_PRIMARY, 1);
+		table_postgres_bloom_load(config, i);
+	}
+
+	return bloom_check(&config->bloom[i], key);
+}
+
+static void
+table_postgres_bloom_init(struct config *conf)
+{
+	int	i;
+
+	for (i = 0; i < SQL_MAX; i++)
+		if (conf->bloom_queries[i])
+			table_postgres_bloom_load(conf, i);
 }
 
 static int
@@ -288,10 +483,12 @@ table_postgres_update(void)
 
 	if ((c = config_load(conffile)) == NULL)
 		return 0;
-	if (config_connect(c) == 0) {
+	if (config_connect(c) == 0 ||
+	    table_api_breaker_config(&c->conf) == -1) {
 		config_free(c);
 		return 0;
 	}
+	table_postgres_bloom_init(c);
 
 	config_free(config);
 	config = c;
@@ -299,6 +496,163 @@ table_postgres_update(void)
 	return 1;
 }
 
+static PGconn *
+table_postgres_conn(int j)
+{
+	return (j == PG_PRIMARY ? config->db : config->replica);
+}
+
+/*
+ * A query that lost a hedge is left running.  Drop its result before
+ * the connection is used again, waiting for it only if block is set.
+ * Return 1 if the connection can take a new query.
+ */
+static int
+table_postgres_ready(int j, int block)
+{
+	PGconn		*conn = table_postgres_conn(j);
+	PGresult	*res;
+
+	if (conn == NULL)
+		return 0;
+	if (!config->busy[j])
+		return 1;
+	if (!block && (PQconsumeInput(conn) == 0 || PQisBusy(conn)))
+		return 0;
+	while ((res = PQgetResult(conn)) != NULL)
+		PQclear(res);
+	hedge_record(&config->hedge[j], hedge_elapsed(&config->sent[j]));
+	config->busy[j] = 0;
+	return 1;
+}
+
+static int
+table_postgres_send(int j, int i, const char *key)
+{
+	PGconn	*conn = table_postgres_conn(j);
+	char	*stmt;
+
+	stmt = (j == PG_PRIMARY) ? config->statements[i] :
+	    config->replica_statements[i];
+	if (stmt == NULL || !table_postgres_ready(j, 0))
+		return 0;
+	if (!PQsendQueryPrepared(conn, stmt, 1, &key, NULL, NULL, 0)) {
+		log_warnx("warn: PQsendQueryPrepared: %s", PQerrorMessage(conn));
+		return 0;
+	}
+	config->busy[j] = 1;
+	clock_gettime(CLOCK_MONOTONIC, &config->sent[j]);
+	return 1;
+}
+
+/*
+ * Return 1 and the result if the query on connection j is complete, 0 if
+ * it is still running, or -1 if the connection failed.
+ */
+static int
+table_postgres_receive(int j, PGresult **resp)
+{
+	PGconn		*conn = table_postgres_conn(j);
+	PGresult	*res;
+
+	if (PQconsumeInput(conn) == 0) {
+		log_warnx("warn: PQconsumeInput: %s", PQerrorMessage(conn));
+		return -1;
+	}
+	if (PQisBusy(conn))
+		return 0;
+	*resp = PQgetResult(conn);
+	while ((res = PQgetResult(conn)) != NULL)
+		PQclear(res);
+	hedge_record(&config->hedge[j], hedge_elapsed(&config->sent[j]));
+	config->busy[j] = 0;
+	return 1;
+}
+
+/*
+ * Send the query to the primary, and to the replica as well if the
+ * primary has not answered within the hedge delay, derived from its
+ * recent latency.  The first good answer is used.  Return NULL if there
+ * is none, for the caller to run the query on the primary alone.
+ */
+static PGresult *
+table_postgres_hedge(int i, const char *key)
+{
+	struct pollfd	 pfd[2];
+	PGresult	*res;
+	double		 delay, left;
+	int		 idx[2], running = 0, hedged = 0, j, k, n, nfds;
+
+	if (++config->nqueries % 10000 == 0)
+		log_info("info: table-postgres: %zu lookups, %zu hedged, "
+		    "%zu answered by the replica, hedge delay %.1fms",
+		    config->nqueries, config->nhedged, config->nreplica,
+		    config->hedge[PG_PRIMARY].delay);
+
+	delay = hedge_delay(&config->hedge[PG_PRIMARY]);
+	if (table_postgres_send(PG_PRIMARY, i, key))
+		running |= 1 << PG_PRIMARY;
+	else if (table_postgres_send(PG_REPLICA, i, key)) {
+		running |= 1 << PG_REPLICA;
+		hedged = 1;
+	}
+
+	while (running) {
+		for (j = 0, nfds = 0; j < 2; j++) {
+			if ((running & (1 << j)) == 0)
+				continue;
+			pfd[nfds].fd = PQsocket(table_postgres_conn(j));
+			pfd[nfds].events = POLLIN;
+			idx[nfds++] = j;
+		}
+		left = -1;
+		if (!hedged) {
+			left = delay - hedge_elapsed(&config->sent[PG_PRIMARY]);
+			if (left < 0)
+				left = 0;
+		}
+		if ((n = poll(pfd, nfds, left < 0 ? -1 : (int)left + 1)) == -1) {
+			if (errno == EINTR)
+				continue;
+			log_warn("warn: poll");
+			return NULL;
+		}
+		if (n == 0) {
+			hedged = 1;
+			if (table_postgres_send(PG_REPLICA, i, key)) {
+				running |= 1 << PG_REPLICA;
+				config->nhedged++;
+			}
+			continue;
+		}
+
+		for (k = 0; k < nfds; k++) {
+			if (pfd[k].revents == 0)
+				continue;
+			j = idx[k];
+			res = NULL;
+			switch (table_postgres_receive(j, &res)) {
+			case 0:
+				continue;
+			case -1:
+				running &= ~(1 << j);
+				continue;
+			}
+			running &= ~(1 << j);
+			if (res && PQresultStatus(res) == PGRES_TUPLES_OK) {
+				if (j == PG_REPLICA)
+					config->nreplica++;
+				return res;
+			}
+			log_warnx("warn: table-postgres: %s: %s",
+			    j == PG_PRIMARY ? "primary" : "replica",
+			    res ? PQresultErrorMessage(res) : "no result");
+			PQclear(res);
+		}
+	}
+	return NULL;
+}
+
 static PGresult *
 table_postgres_query(const char *key, int service)
 {
@@ -318,6 +672,10 @@ retry:
 	if (stmt == NULL)
 		return NULL;
 
+	if (config->replica && (res = table_postgres_hedge(i, key)) != NULL)
+		return res;
+	table_postgres_ready(PG_PRIMARY, 1);
+
 	res = PQexecPrepared(config->db, stmt, 1, &key, NULL, NULL, 0);
 
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
@@ -349,6 +707,9 @@ table_postgres_check(int service, struct dict *params, const char *key)
 	if (config->db == NULL && config_connect(config) == 0)
 		return -1;
 
+	if (table_postgres_bloom(service, key) == 0)
+		return 0;
+
 	res = table_postgres_query(key, service);
 	if (res == NULL)
 		return -1;
@@ -361,7 +722,8 @@ table_postgres_check(int service, struct dict *params, const char *key)
 }
 
 static int
-table_postgres_lookup(int service, struct dict *params, const char *key, char *dst, size_t sz)
+table_postgres_lookup(int service, struct dict *params, const char *key,
+    struct table_result *out)
 {
 	PGresult	*res;
 	int		 r, i;
@@ -369,6 +731,9 @@ table_postgres_lookup(int service, struct dict *params, const char *key, char *d
 	if (config->db == NULL && config_connect(config) == 0)
 		return -1;
 
+	if (table_postgres_bloom(service, key) == 0)
+		return 0;
+
 	res = table_postgres_query(key, service);
 	if (res == NULL)
 		return -1;
@@ -381,44 +746,32 @@ table_postgres_lookup(int service, struct dict *params, const char *key, char *d
 	r = 1;
 	switch(service) {
 	case K_ALIAS:
-		memset(dst, 0, sz);
 		for (i = 0; i < PQntuples(res); i++) {
-			if (dst[0] && strlcat(dst, ", ", sz) >= sz) {
-				log_warnx("warn: result too large");
-				r = -1;
-				break;
-			}
-			if (strlcat(dst, PQgetvalue(res, i, 0), sz) >= sz) {
-				log_warnx("warn: esult too large");
+			if (table_result_add(out, ", ",
+			    PQgetvalue(res, i, 0)) == -1) {
 				r = -1;
 				break;
 			}
 		}
 		break;
 	case K_CREDENTIALS:
-		if (snprintf(dst, sz, "%s:%s", PQgetvalue(res, 0, 0),
- 		    PQgetvalue(res, 0, 1)) > (ssize_t)sz) {
-			log_warnx("warn: result too large");
+		if (table_result_printf(out, "%s:%s", PQgetvalue(res, 0, 0),
+		    PQgetvalue(res, 0, 1)) == -1)
 			r = -1;
-		}
 		break;
 	case K_USERINFO:
-		if (snprintf(dst, sz, "%s:%s:%s", PQgetvalue(res, 0, 0),
+		if (table_result_printf(out, "%s:%s:%s", PQgetvalue(res, 0, 0),
 		    PQgetvalue(res, 0, 1),
-		    PQgetvalue(res, 0, 2)) > (ssize_t)sz) {
-			log_warnx("warn: result too large");
+		    PQgetvalue(res, 0, 2)) == -1)
 			r = -1;
-		}
 		break;
 	case K_DOMAIN:
 	case K_NETADDR:
 	case K_SOURCE:
 	case K_MAILADDR:
 	case K_ADDRNAME:
-		if (strlcpy(dst, PQgetvalue(res, 0, 0), sz) >= sz) {
-			log_warnx("warn: result too large");
+		if (table_result_add(out, NULL, PQgetvalue(res, 0, 0)) == -1)
 			r = -1;
-		}
 		break;
 	default:
 		log_warnx("warn: unknown service %d",
@@ -449,6 +802,8 @@ retry:
 	if ((stmt = config->stmt_fetch_source) == NULL)
 		return -1;
 
+	table_postgres_ready(PG_PRIMARY, 1);
+
 	if (config->source_ncall < config->source_refresh &&
 	    time(NULL) - config->source_update < config->source_expire)
 	    goto fetch;
@@ -520,12 +875,15 @@ main(int argc, char **argv)
 
 	if ((config = config_load(conffile)) == NULL)
 		fatalx("error parsing config file");
+	if (table_api_breaker_config(&config->conf) == -1)
+		fatalx("error parsing config file");
 	if (config_connect(config) == 0)
 		fatalx("could not connect");
+	table_postgres_bloom_init(config);
 
 	table_api_on_update(table_postgres_update);
 	table_api_on_check(table_postgres_check);
-	table_api_on_lookup(table_postgres_lookup);
+	table_api_on_lookup_result(table_postgres_lookup);
 	table_api_on_fetch(table_postgres_fetch);
 	table_api_dispatch();
 
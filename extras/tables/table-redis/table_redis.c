@@ -21,7 +21,10 @@
 #include <sys/types.h>
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -45,14 +48,64 @@ enum {
 	REDIS_MAX
 };
 
+enum {
+	REDIS_MASTER = 0,
+	REDIS_SLAVE
+};
+
+#define	REDIS_SLOTS		16384
+#define	REDIS_REDIRECTS		5
+#define	DEFAULT_CLUSTER_REFRESH	60
+
+struct redis_node {
+	char		*host;
+	int		 port;
+	redisContext	*ctx;
+};
+
+struct redis_cluster {
+	struct redis_node	*nodes;
+	size_t			 nnodes;
+	uint32_t		 slots[REDIS_SLOTS];	/* node index + 1, or 0 */
+	char			*password;
+	int			 refresh;
+	time_t			 updated;
+	size_t			 nmoved;
+	size_t			 nask;
+};
+
 struct config {
 	struct dict	 conf;
 	redisContext    *master;
 	redisContext	*slave;
 	char		*queries[REDIS_MAX];
+	struct redis_cluster *cluster;
+	const char	*bloom_queries[REDIS_MAX];
+	struct bloom	 bloom[REDIS_MAX];
+	int		 bloom_refresh;
+
+	/* hedged lookups to the slave */
+	int		 hedging;
+	int		 pending[2];
+	struct timespec	 sent[2];
+	struct hedge	 hedge[2];
+	size_t		 nqueries;
+	size_t		 nhedged;
+	size_t		 nslave;
+};
+
+#define	DEFAULT_BLOOM_REFRESH	300
+#define	DEFAULT_BLOOM_FPR	0.01
+
+#define	DEFAULT_HEDGE_PERCENTILE	95
+
+static const char	*services[REDIS_MAX] = {
+	"alias", "domain", "credentials", "netaddr",
+	"userinfo", "source", "mailaddr", "addrname"
 };
 
 static void		 config_free(struct config *);
+static void		 table_redis_drain(int);
 
 static char		*conffile;
 static struct config	*config;
@@ -64,7 +117,13 @@ config_load(const char *path)
 	FILE		*fp;
 	size_t		 sz = 0;
 	ssize_t		 flen;
-	char		*key, *value, *buf = NULL;
+	char		*key, *value, *buf = NULL, *ep;
+	char		 name[32];
+	const char	*e;
+	long long	 ll;
+	double		 fpr;
+	size_t		 i;
+	int		 percentile, delay;
 
 	if ((config = calloc(1, sizeof(*config))) == NULL) {
 		log_warn("warn: calloc");
@@ -73,6 +132,8 @@ config_load(const char *path)
 
 	dict_init(&config->conf);
 
+	config->bloom_refresh = DEFAULT_BLOOM_REFRESH;
+
 	if ((fp = fopen(path, "r")) == NULL) {
 		log_warn("warn: \"%s\"", path);
 		goto end;
@@ -116,6 +177,51 @@ config_load(const char *path)
 		dict_set(&config->conf, key, value);
 	}
 
+	if ((value = dict_get(&config->conf, "bloom_refresh"))) {
+		e = NULL;
+		ll = strtonum(value, 1, INT_MAX, &e);
+		if (e) {
+			log_warnx("warn: bad value for bloom_refresh: %s", e);
+			goto end;
+		}
+		config->bloom_refresh = ll;
+	}
+	fpr = DEFAULT_BLOOM_FPR;
+	if ((value = dict_get(&config->conf, "bloom_fpr"))) {
+		fpr = strtod(value, &ep);
+		if (*ep || !(fpr > 0 && fpr < 1)) {
+			log_warnx("warn: bad value for bloom_fpr: %s", value);
+			goto end;
+		}
+	}
+	percentile = DEFAULT_HEDGE_PERCENTILE;
+	if ((value = dict_get(&config->conf, "hedge_percentile"))) {
+		e = NULL;
+		percentile = strtonum(value, 1, 100, &e);
+		if (e) {
+			log_warnx("warn: bad value for hedge_percentile: %s", e);
+			goto end;
+		}
+	}
+	delay = 0;
+	if ((value = dict_get(&config->conf, "hedge_delay"))) {
+		e = NULL;
+		delay = strtonum(value, 0, INT_MAX, &e);
+		if (e) {
+			log_warnx("warn: bad value for hedge_delay: %s", e);
+			goto end;
+		}
+		config->hedging = 1;
+	}
+	hedge_init(&config->hedge[REDIS_MASTER], percentile, delay);
+	hedge_init(&config->hedge[REDIS_SLAVE], percentile, delay);
+
+	for (i = 0; i < REDIS_MAX; i++) {
+		bloom_init(&config->bloom[i], fpr);
+		(void)snprintf(name, sizeof name, "bloom_query_%s", services[i]);
+		config->bloom_queries[i] = dict_get(&config->conf, name);
+	}
+
 	free(buf);
 	fclose(fp);
 	return config;
@@ -127,6 +233,383 @@ end:
 	return NULL;
 }
 
+static uint16_t
+cluster_crc16(const char *buf, size_t len)
+{
+	uint16_t	crc = 0;
+	size_t		i;
+	int		j;
+
+	for (i = 0; i < len; i++) {
+		crc ^= (uint16_t)((unsigned char)buf[i] << 8);
+		for (j = 0; j < 8; j++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+/*
+ * Hash slot of a key.  If the key holds a non-empty {tag}, only the tag
+ * is hashed, so that related keys can be kept on the same node.
+ */
+static unsigned int
+cluster_keyslot(const char *key, size_t len)
+{
+	const char	*s, *e;
+
+	if ((s = memchr(key, '{', len)) != NULL &&
+	    (e = memchr(s + 1, '}', len - (s + 1 - key))) != NULL &&
+	    e > s + 1)
+		return cluster_crc16(s + 1, e - s - 1) % REDIS_SLOTS;
+	return cluster_crc16(key, len) % REDIS_SLOTS;
+}
+
+/*
+ * The key a query works on is its first argument, with %s replaced by
+ * the lookup key.
+ */
+static int
+cluster_query_key(const char *query, const char *key, char *buf, size_t sz)
+{
+	const char	*p;
+	size_t		 n, len, klen;
+
+	klen = strlen(key);
+	p = query + strspn(query, " \t");
+	p += strcspn(p, " \t");
+	p += strspn(p, " \t");
+	len = strcspn(p, " \t");
+	for (n = 0; len; ) {
+		if (len >= 2 && p[0] == '%' && p[1] == 's') {
+			if (n + klen >= sz)
+				return -1;
+			memcpy(buf + n, key, klen);
+			n += klen;
+			p += 2;
+			len -= 2;
+		} else {
+			if (n + 1 >= sz)
+				return -1;
+			buf[n++] = *p++;
+			len--;
+		}
+	}
+	buf[n] = '\0';
+	return n;
+}
+
+static int
+cluster_node(struct redis_cluster *c, const char *host, int port)
+{
+	struct redis_node	*nodes;
+	size_t			 i;
+
+	for (i = 0; i < c->nnodes; i++)
+		if (c->nodes[i].port == port && strcmp(c->nodes[i].host, host) == 0)
+			return i;
+
+	nodes = reallocarray(c->nodes, c->nnodes + 1, sizeof(*nodes));
+	if (nodes == NULL) {
+		log_warn("warn: reallocarray");
+		return -1;
+	}
+	c->nodes = nodes;
+	if ((nodes[c->nnodes].host = strdup(host)) == NULL) {
+		log_warn("warn: strdup");
+		return -1;
+	}
+	nodes[c->nnodes].port = port;
+	nodes[c->nnodes].ctx = NULL;
+	return c->nnodes++;
+}
+
+/*
+ * Connections to the nodes are opened on first use, and again after an
+ * error.
+ */
+static redisContext *
+cluster_ctx(struct redis_cluster *c, size_t i)
+{
+	struct redis_node	*n = &c->nodes[i];
+	redisReply		*res;
+
+	if (n->ctx && n->ctx->err) {
+		redisFree(n->ctx);
+		n->ctx = NULL;
+	}
+	if (n->ctx)
+		return n->ctx;
+
+	log_debug("debug: connecting to cluster node %s:%d", n->host, n->port);
+	n->ctx = redisConnect(n->host, n->port);
+	if (n->ctx == NULL || n->ctx->err) {
+		log_warnx("warn: cluster node %s:%d: %s", n->host, n->port,
+		    n->ctx ? n->ctx->errstr : "redisConnect failed");
+		goto fail;
+	}
+	if (c->password) {
+		res = redisCommand(n->ctx, "AUTH %s", c->password);
+		if (res == NULL || res->type == REDIS_REPLY_ERROR) {
+			log_warnx("warn: cluster node %s:%d: authentication "
+			    "failed", n->host, n->port);
+			if (res)
+				freeReplyObject(res);
+			goto fail;
+		}
+		freeReplyObject(res);
+	}
+	return n->ctx;
+
+fail:
+	if (n->ctx)
+		redisFree(n->ctx);
+	n->ctx = NULL;
+	return NULL;
+}
+
+/*
+ * Load the slot map from the first node answering CLUSTER SLOTS.  Only
+ * the masters are used: a lookup must see the latest writes.
+ */
+static int
+cluster_refresh(struct redis_cluster *c)
+{
+	redisContext	*ctx;
+	redisReply	*res, *r, *addr;
+	const char	*host;
+	long long	 start, end, s;
+	size_t		 i, j;
+	int		 n;
+
+	c->updated = time(NULL);
+
+	for (i = 0; i < c->nnodes; i++) {
+		if ((ctx = cluster_ctx(c, i)) == NULL)
+			continue;
+		if ((res = redisCommand(ctx, "CLUSTER SLOTS")) == NULL)
+			continue;
+		if (res->type != REDIS_REPLY_ARRAY) {
+			log_warnx("warn: cluster node %s:%d: bad reply to "
+			    "CLUSTER SLOTS", c->nodes[i].host, c->nodes[i].port);
+			freeReplyObject(res);
+			continue;
+		}
+
+		memset(c->slots, 0, sizeof c->slots);
+		for (j = 0; j < res->elements; j++) {
+			r = res->element[j];
+			if (r->type != REDIS_REPLY_ARRAY || r->elements < 3 ||
+			    r->element[0]->type != REDIS_REPLY_INTEGER ||
+			    r->element[1]->type != REDIS_REPLY_INTEGER)
+				continue;
+			addr = r->element[2];
+			if (addr->type != REDIS_REPLY_ARRAY ||
+			    addr->elements < 2 ||
+			    addr->element[0]->type != REDIS_REPLY_STRING ||
+			    addr->element[1]->type != REDIS_REPLY_INTEGER)
+				continue;
+
+			/* an empty address is the node that answered */
+			host = addr->element[0]->str;
+			if (*host == '\0')
+				host = c->nodes[i].host;
+			n = cluster_node(c, host, addr->element[1]->integer);
+			if (n == -1) {
+				freeReplyObject(res);
+				return 0;
+			}
+			start = r->element[0]->integer;
+			end = r->element[1]->integer;
+			for (s = start < 0 ? 0 : start;
+			    s <= end && s < REDIS_SLOTS; s++)
+				c->slots[s] = n + 1;
+		}
+		freeReplyObject(res);
+
+		log_debug("debug: cluster slot map loaded from %s:%d: "
+		    "%zu nodes, %zu moved, %zu ask", c->nodes[i].host,
+		    c->nodes[i].port, c->nnodes, c->nmoved, c->nask);
+		return 1;
+	}
+
+	log_warnx("warn: no cluster node answered CLUSTER SLOTS");
+	return 0;
+}
+
+static void
+cluster_free(struct redis_cluster *c)
+{
+	size_t	i;
+
+	if (c == NULL)
+		return;
+	for (i = 0; i < c->nnodes; i++) {
+		if (c->nodes[i].ctx)
+			redisFree(c->nodes[i].ctx);
+		free(c->nodes[i].host);
+	}
+	free(c->nodes);
+	free(c->password);
+	free(c);
+}
+
+/*
+ * Seed the node list with the "host:port" addresses of the cluster
+ * option, and load the slot map from them.
+ */
+static struct redis_cluster *
+cluster_init(struct dict *conf)
+{
+	struct redis_cluster	*c;
+	char			*seeds, *s, *p, *value;
+	const char		*e;
+	int			 port;
+	long long		 ll;
+
+	if ((c = calloc(1, sizeof(*c))) == NULL) {
+		log_warn("warn: calloc");
+		return NULL;
+	}
+	c->refresh = DEFAULT_CLUSTER_REFRESH;
+
+	if ((value = dict_get(conf, "cluster_refresh"))) {
+		ll = strtonum(value, 1, INT_MAX, &e);
+		if (e) {
+			log_warnx("warn: bad value for cluster_refresh: %s", e);
+			goto fail;
+		}
+		c->refresh = ll;
+	}
+	if ((value = dict_get(conf, "password")) &&
+	    (c->password = strdup(value)) == NULL) {
+		log_warn("warn: strdup");
+		goto fail;
+	}
+
+	if ((seeds = strdup(dict_get(conf, "cluster"))) == NULL) {
+		log_warn("warn: strdup");
+		goto fail;
+	}
+	for (p = seeds; (s = strsep(&p, ", \t")) != NULL; ) {
+		if (*s == '\0')
+			continue;
+		port = 6379;
+		if ((value = strrchr(s, ':')) != NULL) {
+			*value++ = '\0';
+			port = strtonum(value, 1, 65535, &e);
+			if (e) {
+				log_warnx("warn: bad port for cluster node "
+				    "%s: %s", s, e);
+				free(seeds);
+				goto fail;
+			}
+		}
+		if (cluster_node(c, s, port) == -1) {
+			free(seeds);
+			goto fail;
+		}
+	}
+	free(seeds);
+
+	if (c->nnodes == 0) {
+		log_warnx("warn: no node in cluster option");
+		goto fail;
+	}
+	if (!cluster_refresh(c))
+		goto fail;
+	return c;
+
+fail:
+	cluster_free(c);
+	return NULL;
+}
+
+/*
+ * Run a query on the node serving the slot of its key.  MOVED replies
+ * fix the slot and schedule a reload of the whole map, since a reshard
+ * rarely moves a single slot.  ASK replies are followed for this query
+ * only.
+ */
+static redisReply *
+cluster_command(struct redis_cluster *c, const char *query, const char *key)
+{
+	redisContext	*ctx;
+	redisReply	*res;
+	char		 buf[SMTPD_MAXLINESIZE];
+	char		*p, *port;
+	const char	*e;
+	unsigned int	 slot;
+	size_t		 node;
+	int		 i, n, len, moved, asking = 0;
+
+	if (time(NULL) - c->updated >= c->refresh)
+		(void)cluster_refresh(c);
+
+	if ((len = cluster_query_key(query, key, buf, sizeof buf)) == -1) {
+		log_warnx("warn: key too long for query \"%s\"", query);
+		return NULL;
+	}
+	slot = cluster_keyslot(buf, len);
+	node = c->slots[slot] ? c->slots[slot] - 1 : 0;
+
+	for (i = 0; i < REDIS_REDIRECTS; i++) {
+		if ((ctx = cluster_ctx(c, node)) == NULL) {
+			/* the node may be gone, ask the others */
+			if (!cluster_refresh(c) || c->slots[slot] == 0 ||
+			    c->slots[slot] - 1 == node)
+				return NULL;
+			node = c->slots[slot] - 1;
+			continue;
+		}
+
+		if (asking) {
+			if ((res = redisCommand(ctx, "ASKING")) != NULL)
+				freeReplyObject(res);
+			asking = 0;
+		}
+
+		log_debug("debug: running query \"%s\" on %s:%d (slot %u)",
+		    query, c->nodes[node].host, c->nodes[node].port, slot);
+		if ((res = redisCommand(ctx, query, key)) == NULL) {
+			log_warnx("warn: redisCommand: %s", ctx->errstr);
+			continue;
+		}
+		if (res->type != REDIS_REPLY_ERROR)
+			return res;
+
+		/* "MOVED <slot> <host>:<port>" or "ASK <slot> <host>:<port>" */
+		moved = strncmp(res->str, "MOVED ", 6) == 0;
+		if (!moved && strncmp(res->str, "ASK ", 4) != 0)
+			return res;
+		if ((p = strrchr(res->str, ' ')) == NULL ||
+		    (port = strrchr(++p, ':')) == NULL) {
+			log_warnx("warn: bad redirection: %s", res->str);
+			freeReplyObject(res);
+			return NULL;
+		}
+		*port++ = '\0';
+		n = strtonum(port, 1, 65535, &e);
+		if (e == NULL)
+			n = cluster_node(c, p, n);
+		freeReplyObject(res);
+		if (e || n == -1)
+			return NULL;
+
+		if (moved) {
+			c->slots[slot] = n + 1;
+			c->updated = 0;
+			c->nmoved++;
+		} else {
+			asking = 1;
+			c->nask++;
+		}
+		node = n;
+	}
+
+	log_warnx("warn: too many redirections for key %s", buf);
+	return NULL;
+}
+
 static void
 config_reset(struct config *config)
 {
@@ -142,10 +625,13 @@ config_reset(struct config *config)
 		redisFree(config->master);
 		config->master = NULL;
 	}
+	cluster_free(config->cluster);
+	config->cluster = NULL;
+	config->pending[REDIS_MASTER] = config->pending[REDIS_SLAVE] = 0;
 }
 
 static int
-config_connect(struct config *config)
+config_queries(struct config *config)
 {
 	static const struct {
 		const char	*name;
@@ -161,6 +647,25 @@ config_connect(struct config *config)
 		{ "query_addrname",	"GET addrname:%s" },
 	};
 	size_t	 i;
+	char	*q;
+
+	for (i = 0; i < REDIS_MAX; i++) {
+		q = dict_get(&config->conf, qspec[i].name);
+		if (q)
+			config->queries[i] = strdup(q);
+		else
+			config->queries[i] = strdup(qspec[i].default_query);
+		if (config->queries[i] == NULL) {
+			log_warn("warn: strdup");
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int
+config_connect(struct config *config)
+{
 
 	char	*master = "127.0.0.1";
 	int	master_port = 6379;
@@ -169,8 +674,6 @@ config_connect(struct config *config)
 	char	*password = NULL;
 	int	database = 0;
 
-	char	*q;
-
 	char		*value;
 	const char	*e;
 	long long	 ll;
@@ -182,6 +685,14 @@ config_connect(struct config *config)
 	/* disconnect first, if needed */
 	config_reset(config);
 
+	if (dict_get(&config->conf, "cluster")) {
+		if (!config_queries(config) ||
+		    (config->cluster = cluster_init(&config->conf)) == NULL)
+			goto end;
+		log_debug("debug: connected to cluster");
+		return 1;
+	}
+
 	if ((value = dict_get(&config->conf, "master")))
 		master = value;
 	if ((value = dict_get(&config->conf, "slave")))
@@ -287,17 +798,8 @@ config_connect(struct config *config)
 		}
 	}
 
-	for (i = 0; i < REDIS_MAX; i++) {
-		q = dict_get(&config->conf, qspec[i].name);
-		if (q)
-			config->queries[i] = strdup(q);
-		else
-			config->queries[i] = strdup(qspec[i].default_query);
-		if (config->queries[i] == NULL) {
-			log_warn("warn: strdup");
-			goto end;
-		}
-	}
+	if (!config_queries(config))
+		goto end;
 
 	if (config->master->err && config->slave->err) {
 		log_warnx("warn: redisConnect for master and slave failed");
@@ -318,15 +820,119 @@ static void
 config_free(struct config *config)
 {
 	void	*value;
+	size_t	 i;
 
 	config_reset(config);
 
+	for (i = 0; i < REDIS_MAX; i++)
+		bloom_free(&config->bloom[i]);
+
 	while (dict_poproot(&config->conf, &value))
 		free(value);
 
 	free(config);
 }
 
+/*
+ * Load the keys returned by the bloom query of a service into its filter.
+ * The query must reply with an array of keys, SMEMBERS on a set kept
+ * along with the data for instance.  On failure, the previous filter,
+ * if any, is kept.
+ */
+static void
+table_redis_bloom_load(struct config *config, int i)
+{
+	redisContext	*ctx;
+	redisReply	*res, *elmt;
+	size_t		 n;
+
+	bloom_begin(&config->bloom[i]);
+
+	if (config->cluster) {
+		res = cluster_command(config->cluster, config->bloom_queries[i],
+		    "");
+		if (res && res->type == REDIS_REPLY_ERROR) {
+			log_warnx("warn: bloom_query_%s: %s", services[i],
+			    res->str);
+			goto fail;
+		}
+	} else {
+		if (!config->master->err)
+			ctx = config->master;
+		else if (config->slave && !config->slave->err)
+			ctx = config->slave;
+		else {
+			bloom_abort(&config->bloom[i]);
+			return;
+		}
+		if ((res = redisCommand(ctx, config->bloom_queries[i])) == NULL)
+			log_warnx("warn: redisCommand: %s", ctx->errstr);
+	}
+	if (res == NULL) {
+		bloom_abort(&config->bloom[i]);
+		return;
+	}
+	if (res->type != REDIS_REPLY_ARRAY) {
+		log_warnx("warn: bloom_query_%s does not return an array",
+		    services[i]);
+		goto fail;
+	}
+	for (n = 0; n < res->elements; n++) {
+		elmt = res->element[n];
+		if (elmt == NULL || elmt->type != REDIS_REPLY_STRING)
+			continue;
+		if (bloom_add(&config->bloom[i], elmt->str) == -1) {
+			log_warn("warn: bloom_add");
+			goto fail;
+		}
+	}
+	freeReplyObject(res);
+
+	if (bloom_commit(&config->bloom[i]) == -1) {
+		log_warn("warn: bloom_commit");
+		return;
+	}
+	bloom_log(&config->bloom[i], "table-redis", services[i]);
+	return;
+
+fail:
+	freeReplyObject(res);
+	bloom_abort(&config->bloom[i]);
+}
+
+/*
+ * Return 0 if the key is known to be absent, without asking the server.
+ */
+static int
+table_redis_bloom(int service, const char *key)
+{
+	int	i;
+
+	for (i = 0; i < REDIS_MAX; i++)
+		if (service == 1 << i)
+			break;
+	if (i == REDIS_MAX || config->bloom_queries[i] == NULL)
+		return 1;
+
+	if (bloom_stale(&config->bloom[i], config->bloom_refresh)) {
+		table_redis_drain(REDIS_MASTER);
+		table_redis_drain(REDIS_SLAVE);
+		table_redis_bloom_load(config, i);
+	}
+
+	return bloom_check(&config->bloom[i], key);
+}
+
+static void
+table_redis_bloom_init(struct config *config)
+{
+	int	i;
+
+	for (i = 0; i < REDIS_MAX; i++)
+		if (config->bloom_queries[i])
+			table_redis_bloom_load(config, i);
+}
+
 static int
 table_redis_update(void)
 {
@@ -334,16 +940,199 @@ table_redis_update(void)
 
 	if ((c = config_load(conffile)) == NULL)
 		return 0;
-	if (config_connect(c) == 0) {
+	if (config_connect(c) == 0 ||
+	    table_api_breaker_config(&c->conf) == -1) {
 		config_free(c);
 		return 0;
 	}
+	table_redis_bloom_init(c);
 
 	config_free(config);
 	config = c;
 	return 1;
 }
 
+static redisContext *
+table_redis_ctx(int j)
+{
+	return (j == REDIS_MASTER ? config->master : config->slave);
+}
+
+/*
+ * A query that lost a hedge is left running.  Drop its reply, if it has
+ * arrived, before the server is asked again.  Return 1 if the server can
+ * take a new query.
+ */
+static int
+table_redis_ready(int j)
+{
+	redisContext	*ctx = table_redis_ctx(j);
+	struct pollfd	 pfd;
+	void		*reply;
+
+	if (ctx == NULL || ctx->err)
+		return 0;
+	while (config->pending[j]) {
+		reply = NULL;
+		if (redisGetReplyFromReader(ctx, &reply) != REDIS_OK)
+			return 0;
+		if (reply) {
+			freeReplyObject(reply);
+			config->pending[j] = 0;
+			hedge_record(&config->hedge[j],
+			    hedge_elapsed(&config->sent[j]));
+			break;
+		}
+		pfd.fd = ctx->fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 0) != 1 || redisBufferRead(ctx) != REDIS_OK)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Same as table_redis_ready(), waiting for the reply, before a blocking
+ * redisCommand().
+ */
+static void
+table_redis_drain(int j)
+{
+	redisContext	*ctx = table_redis_ctx(j);
+	void		*reply;
+
+	if (ctx && config->pending[j] && redisGetReply(ctx, &reply) == REDIS_OK)
+		freeReplyObject(reply);
+	config->pending[j] = 0;
+}
+
+static int
+table_redis_send(int j, const char *query, const char *key)
+{
+	redisContext	*ctx = table_redis_ctx(j);
+	int		 done = 0;
+
+	if (!table_redis_ready(j))
+		return 0;
+	if (redisAppendCommand(ctx, query, key) != REDIS_OK)
+		return 0;
+	do {
+		if (redisBufferWrite(ctx, &done) != REDIS_OK) {
+			log_warnx("warn: redisBufferWrite: %s", ctx->errstr);
+			return 0;
+		}
+	} while (!done);
+	config->pending[j] = 1;
+	clock_gettime(CLOCK_MONOTONIC, &config->sent[j]);
+	return 1;
+}
+
+/*
+ * Return 1 and the reply if it has arrived, 0 if not yet, or -1 if the
+ * connection failed.
+ */
+static int
+table_redis_receive(int j, redisReply **resp)
+{
+	redisContext	*ctx = table_redis_ctx(j);
+	void		*reply = NULL;
+
+	if (redisBufferRead(ctx) != REDIS_OK ||
+	    redisGetReplyFromReader(ctx, &reply) != REDIS_OK) {
+		log_warnx("warn: redis: %s", ctx->errstr);
+		return -1;
+	}
+	if (reply == NULL)
+		return 0;
+	config->pending[j] = 0;
+	hedge_record(&config->hedge[j], hedge_elapsed(&config->sent[j]));
+	*resp = reply;
+	return 1;
+}
+
+/*
+ * Send the query to the master, and to the slave as well if the master
+ * has not answered within the hedge delay, derived from its recent
+ * latency.  The first good answer is used.  Return NULL if there is
+ * none, for the caller to run the query the usual way.
+ */
+static redisReply *
+table_redis_hedge(const char *query, const char *key)
+{
+	struct pollfd	 pfd[2];
+	redisReply	*res;
+	double		 delay, left;
+	int		 idx[2], running = 0, hedged = 0, j, k, n, nfds;
+
+	if (++config->nqueries % 10000 == 0)
+		log_info("info: table-redis: %zu lookups, %zu hedged, "
+		    "%zu answered by the slave, hedge delay %.1fms",
+		    config->nqueries, config->nhedged, config->nslave,
+		    config->hedge[REDIS_MASTER].delay);
+
+	delay = hedge_delay(&config->hedge[REDIS_MASTER]);
+	if (table_redis_send(REDIS_MASTER, query, key))
+		running |= 1 << REDIS_MASTER;
+	else if (table_redis_send(REDIS_SLAVE, query, key)) {
+		running |= 1 << REDIS_SLAVE;
+		hedged = 1;
+	}
+
+	while (running) {
+		for (j = 0, nfds = 0; j < 2; j++) {
+			if ((running & (1 << j)) == 0)
+				continue;
+			pfd[nfds].fd = table_redis_ctx(j)->fd;
+			pfd[nfds].events = POLLIN;
+			idx[nfds++] = j;
+		}
+		left = -1;
+		if (!hedged) {
+			left = delay - hedge_elapsed(&config->sent[REDIS_MASTER]);
+			if (left < 0)
+				left = 0;
+		}
+		if ((n = poll(pfd, nfds, left < 0 ? -1 : (int)left + 1)) == -1) {
+			if (errno == EINTR)
+				continue;
+			log_warn("warn: poll");
+			return NULL;
+		}
+		if (n == 0) {
+			hedged = 1;
+			if (table_redis_send(REDIS_SLAVE, query, key)) {
+				running |= 1 << REDIS_SLAVE;
+				config->nhedged++;
+			}
+			continue;
+		}
+
+		for (k = 0; k < nfds; k++) {
+			if (pfd[k].revents == 0)
+				continue;
+			j = idx[k];
+			res = NULL;
+			switch (table_redis_receive(j, &res)) {
+			case 0:
+				continue;
+			case -1:
+				running &= ~(1 << j);
+				continue;
+			}
+			running &= ~(1 << j);
+			if (res->type != REDIS_REPLY_ERROR) {
+				if (j == REDIS_SLAVE)
+					config->nslave++;
+				return res;
+			}
+			log_warnx("warn: table-redis: %s: %s",
+			    j == REDIS_MASTER ? "master" : "slave", res->str);
+			freeReplyObject(res);
+		}
+	}
+	return NULL;
+}
+
 static redisReply *
 table_redis_query(const char *key, int service)
 {
@@ -370,6 +1159,14 @@ retry:
 	if (query == NULL)
 		return NULL;
 
+	if (config->cluster)
+		return cluster_command(config->cluster, query, key);
+
+	if (config->hedging && (res = table_redis_hedge(query, key)) != NULL)
+		return res;
+	table_redis_drain(REDIS_MASTER);
+	table_redis_drain(REDIS_SLAVE);
+
 	if (!config->master->err) {
 		log_debug("debug: running query \"%s\" on master", query);
 		res = redisCommand(config->master, query, key);
@@ -397,9 +1194,13 @@ table_redis_check(int service, struct dict *params, const char *key)
 	int		 r;
 	redisReply	*reply;
 
-	if (config->master == NULL && config_connect(config) == 0)
+	if (config->master == NULL && config->cluster == NULL &&
+	    config_connect(config) == 0)
 		return -1;
 
+	if (table_redis_bloom(service, key) == 0)
+		return 0;
+
 	reply = table_redis_query(key, service);
 	if (reply == NULL)
 		return -1;
@@ -431,15 +1232,20 @@ table_redis_check(int service, struct dict *params, const char *key)
 }
 
 static int
-table_redis_lookup(int service, struct dict *params, const char *key, char *dst, size_t sz)
+table_redis_lookup(int service, struct dict *params, const char *key,
+    struct table_result *out)
 {
 	redisReply	*reply, *elmt;
 	unsigned int	i;
 	int		r;
 
-	if (config->master == NULL && config_connect(config) == 0)
+	if (config->master == NULL && config->cluster == NULL &&
+	    config_connect(config) == 0)
 		return -1;
 
+	if (table_redis_bloom(service, key) == 0)
+		return 0;
+
 	reply = table_redis_query(key, service);
 	if (reply == NULL)
 		return -1;
@@ -449,12 +1255,9 @@ table_redis_lookup(int service, struct dict *params, const char *key, char *dst,
 	case K_ALIAS:
 	case K_CREDENTIALS:
 	case K_USERINFO:
-		memset(dst, 0, sz);
 		if (reply->type == REDIS_REPLY_STRING) {
-			if (strlcat(dst, reply->str, sz) >= sz) {
-				log_warnx("warn: result too large");
+			if (table_result_add(out, NULL, reply->str) == -1)
 				r = -1;
-			}
 		}
 		else if (reply->type == REDIS_REPLY_ARRAY) {
 			if (reply->elements == 0)
@@ -467,13 +1270,11 @@ table_redis_lookup(int service, struct dict *params, const char *key, char *dst,
 					r = -1;
 					break;
 				}
-				if (dst[0] && strlcat(dst, service == K_ALIAS ? ", " : ":", sz) >= sz) {
-					log_warnx("warn: result too large");
-					r = -1;
-				}
-				if (strlcat(dst, elmt->str, sz) >= sz) {
-					log_warnx("warn: result too large");
+				if (table_result_add(out,
+				    service == K_ALIAS ? ", " : ":",
+				    elmt->str) == -1) {
 					r = -1;
+					break;
 				}
 			}
 		}
@@ -486,10 +1287,8 @@ table_redis_lookup(int service, struct dict *params, const char *key, char *dst,
 	case K_MAILADDR:
 	case K_ADDRNAME:
 		if (reply->type == REDIS_REPLY_STRING) {
-			if (strlcpy(dst, reply->str, sz) >= sz) {
-				log_warnx("warn: result too large");
+			if (table_result_add(out, NULL, reply->str) == -1)
 				r = -1;
-			}
 		}
 		else
 			r = -1;
@@ -500,7 +1299,8 @@ table_redis_lookup(int service, struct dict *params, const char *key, char *dst,
 		r = -1;
 	}
 
-	log_debug("debug: table_redis_lookup return %d (result = \"%s\")", r, dst);
+	log_debug("debug: table_redis_lookup return %d (result = \"%s\")", r,
+	    out->len ? out->buf : "");
 	freeReplyObject(reply);
 	return r;
 }
@@ -536,12 +1336,15 @@ main(int argc, char **argv)
 
 	if ((config = config_load(conffile)) == NULL)
 		fatalx("error parsing config file");
+	if (table_api_breaker_config(&config->conf) == -1)
+		fatalx("error parsing config file");
 	if (config_connect(config) == 0)
 		fatalx("could not connect");
+	table_redis_bloom_init(config);
 
 	table_api_on_update(table_redis_update);
 	table_api_on_check(table_redis_check);
-	table_api_on_lookup(table_redis_lookup);
+	table_api_on_lookup_result(table_redis_lookup);
 	table_api_on_fetch(table_redis_fetch);
 	table_api_dispatch();
 
@@ -320,7 +320,8 @@ table_sqlite_check(int service, struct dict *params, const char *key)
 }
 
 static int
-table_sqlite_lookup(int service, struct dict *params, const char *key, char *dst, size_t sz)
+table_sqlite_lookup(int service, struct dict *params, const char *key,
+    struct table_result *out)
 {
 	sqlite3_stmt	*stmt;
 	const char	*value;
@@ -346,16 +347,9 @@ table_sqlite_lookup(int service, struct dict *params, const char *key, char *dst
 
 	switch(service) {
 	case K_ALIAS:
-		memset(dst, 0, sz);
 		do {
 			value = sqlite3_column_text(stmt, 0);
-			if (dst[0] && strlcat(dst, ", ", sz) >= sz) {
-				log_warnx("warn: result too large");
-				r = -1;
-				break;
-			}
-			if (strlcat(dst, value, sz) >= sz) {
-				log_warnx("warn: result too large");
+			if (table_result_add(out, ", ", value) == -1) {
 				r = -1;
 				break;
 			}
@@ -367,29 +361,24 @@ table_sqlite_lookup(int service, struct dict *params, const char *key, char *dst
 		}
 		break;
 	case K_CREDENTIALS:
-		if (snprintf(dst, sz, "%s:%s", sqlite3_column_text(stmt, 0),
-		    sqlite3_column_text(stmt, 1)) >= (ssize_t)sz) {
-			log_warnx("warn: result too large");
+		if (table_result_printf(out, "%s:%s", sqlite3_column_text(stmt, 0),
+		    sqlite3_column_text(stmt, 1)) == -1)
 			r = -1;
-		}
 		break;
 	case K_USERINFO:
-		if (snprintf(dst, sz, "%d:%d:%s", sqlite3_column_int(stmt, 0),
+		if (table_result_printf(out, "%d:%d:%s", sqlite3_column_int(stmt, 0),
 		    sqlite3_column_int(stmt, 1),
-		    sqlite3_column_text(stmt, 2)) >= (ssize_t)sz) {
-			log_warnx("warn: result too large");
+		    sqlite3_column_text(stmt, 2)) == -1)
 			r = -1;
-		}
 		break;
 	case K_DOMAIN:
 	case K_NETADDR:
 	case K_SOURCE:
 	case K_MAILADDR:
 	case K_ADDRNAME:
-		if (strlcpy(dst, sqlite3_column_text(stmt, 0), sz) >= sz) {
-			log_warnx("warn: result too large");
+		if (table_result_add(out, NULL,
+		    sqlite3_column_text(stmt, 0)) == -1)
 			r = -1;
-		}
 		break;
 	default:
 		log_warnx("warn: unknown service %d", service);
@@ -476,7 +465,7 @@ main(int argc, char **argv)
 
 	table_api_on_update(table_sqlite_update);
 	table_api_on_check(table_sqlite_check);
-	table_api_on_lookup(table_sqlite_lookup);
+	table_api_on_lookup_result(table_sqlite_lookup);
 	table_api_on_fetch(table_sqlite_fetch);
 	table_api_dispatch();
 
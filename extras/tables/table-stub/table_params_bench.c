@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Compare the per-request cost of reading the parameters of a check
+ * request, building its flight key and calling the table-stub handler:
+ * - before: parameters in a dict and a printf'd flight key, as table_api
+ *   used to do;
+ * - flat: the parameter array, with the table-stub params handler;
+ * - shim: the parameter array, with a handler registered through the dict
+ *   interface.
+ * Requests are decoded from memory; nothing goes through the pipe.
+ */
+
+#include "table_api.c"
+
+#define main	table_stub_main
+#include "table_stub.c"
+#undef main
+
+#include <err.h>
+
+static char	 msg[16384];
+static size_t	 msglen;
+
+/* the dict-based parsing and flight key, as they were */
+static void
+before_read_params(struct dict *params)
+{
+	size_t	count;
+	char	*key;
+	char	*value;
+
+	dict_init(params);
+
+	table_msg_get(&count, sizeof(count));
+
+	for (;count; count--) {
+		key = rdata;
+		table_msg_get(NULL, strlen(key) + 1);
+		value = rdata;
+		table_msg_get(NULL, strlen(value) + 1);
+		dict_set(params, key, value);
+	}
+}
+
+static const char *
+before_flight_key(int msgtype, int service, struct dict *params,
+    const char *key)
+{
+	const char	*k;
+	void		*iter = NULL;
+	char		*v;
+
+	flightkey.len = 0;
+	if (table_result_printf(&flightkey, "%d:%d:", msgtype, service) == -1)
+		return (NULL);
+	while (dict_iter(params, &iter, &k, (void **)&v))
+		if (table_result_printf(&flightkey, "%zu:%s%zu:%s",
+		    strlen(k), k, strlen(v), v) == -1)
+			return (NULL);
+	if (table_result_add(&flightkey, NULL, key) == -1)
+		return (NULL);
+	return (flightkey.buf);
+}
+
+static int
+stub_check_dict(int service, struct dict *params, const char *key)
+{
+	return -1;
+}
+
+/* a check request for K_ALIAS with n parameters */
+static void
+build(size_t n)
+{
+	size_t	i;
+	int	service = K_ALIAS;
+
+	msglen = 0;
+	memcpy(msg, &service, sizeof(service));
+	msglen += sizeof(service);
+	memcpy(msg + msglen, &n, sizeof(n));
+	msglen += sizeof(n);
+	for (i = 0; i < n; i++)
+		msglen += snprintf(msg + msglen, sizeof(msg) - msglen,
+		    "param%zu%cvalue-of-parameter-%zu", i, '\0', i) + 1;
+	msglen += strlcpy(msg + msglen, "gilles@example.org",
+	    sizeof(msg) - msglen) + 1;
+	if (msglen >= sizeof(msg))
+		errx(1, "request too large");
+}
+
+static double
+elapsed(struct timespec *t0)
+{
+	struct timespec	t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+static double
+run_before(size_t rounds)
+{
+	struct timespec	 t0;
+	struct dict	 d;
+	size_t		 n;
+	int		 service;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (n = 0; n < rounds; n++) {
+		rdata = msg;
+		rlen = msglen;
+		table_msg_get(&service, sizeof(service));
+		before_read_params(&d);
+		if (before_flight_key(PROC_TABLE_CHECK, service, &d, rdata) ==
+		    NULL)
+			errx(1, "flight key");
+		(void)stub_check_dict(service, &d, rdata);
+		while (dict_poproot(&d, NULL))
+			;
+	}
+	return (elapsed(&t0));
+}
+
+static double
+run_after(size_t rounds)
+{
+	struct timespec		 t0;
+	struct table_params	 params;
+	const char		*data;
+	size_t			 n, len;
+	int			 service;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (n = 0; n < rounds; n++) {
+		rdata = msg;
+		rlen = msglen;
+		table_msg_get(&service, sizeof(service));
+		table_read_params(&params);
+		if (table_flight_key(PROC_TABLE_CHECK, service, &params,
+		    rdata) == NULL)
+			errx(1, "flight key");
+		(void)table_handler(PROC_TABLE_CHECK, service, &params, rdata,
+		    &data, &len);
+	}
+	return (elapsed(&t0));
+}
+
+int
+main(int argc, char **argv)
+{
+	static const size_t	 counts[] = { 0, 1, 4, 8, 16, 32 };
+	size_t			 i, rounds = 1000000;
+	double			 tb, tf, ts;
+
+	if (argc > 1)
+		rounds = strtoul(argv[1], NULL, 10);
+	log_init(1);
+
+	printf("%6s %10s %10s %10s %6s\n", "params", "before ns", "flat ns",
+	    "shim ns", "ratio");
+	for (i = 0; i < nitems(counts); i++) {
+		build(counts[i]);
+
+		tb = run_before(rounds);
+
+		table_api_on_check(NULL);
+		table_api_on_check_params(table_stub_check);
+		tf = run_after(rounds);
+
+		table_api_on_check_params(NULL);
+		table_api_on_check(stub_check_dict);
+		ts = run_after(rounds);
+
+		printf("%6zu %10.0f %10.0f %10.0f %6.2f\n", counts[i],
+		    tb * 1e9 / rounds, tf * 1e9 / rounds, ts * 1e9 / rounds,
+		    tb / tf);
+	}
+
+	return (0);
+}
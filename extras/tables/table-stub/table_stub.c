@@ -27,14 +27,15 @@ table_stub_update(void)
 }
 
 static int
-table_stub_check(int service, struct dict *params, const char *key)
+table_stub_check(int service, const struct table_params *params,
+    const char *key)
 {
 	return -1;
 }
 
 static int
-table_stub_lookup(int service, struct dict *params, const char *key, char *dst,
-    size_t sz)
+table_stub_lookup(int service, const struct table_params *params,
+    const char *key, struct table_result *res)
 {
 	return -1;
 }
@@ -66,8 +67,8 @@ main(int argc, char **argv)
 		fatalx("bogus argument(s)");
 
 	table_api_on_update(table_stub_update);
-	table_api_on_check(table_stub_check);
-	table_api_on_lookup(table_stub_lookup);
+	table_api_on_check_params(table_stub_check);
+	table_api_on_lookup_params(table_stub_lookup);
 	table_api_on_fetch(table_stub_fetch);
 	table_api_dispatch();
 
@@ -0,0 +1,872 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_TABLE_SQLITE
+#include <sqlite3.h>
+#endif
+#ifdef HAVE_TABLE_POSTGRES
+#include <libpq-fe.h>
+#endif
+#ifdef HAVE_TABLE_MYSQL
+#include <mysql.h>
+#endif
+
+#include <smtpd-api.h>
+
+#define MAPLOAD_COLS	16
+#define MAPLOAD_BATCH	1000		/* rows per multi-row INSERT */
+#define MAPLOAD_FLUSH	(1024 * 1024)	/* bytes buffered before sending */
+
+#ifndef ER_DUP_KEYNAME
+#define ER_DUP_KEYNAME	1061
+#endif
+
+enum {
+	SPLIT_NONE,	/* the key only */
+	SPLIT_ONE,	/* one value, the rest of the line */
+	SPLIT_LIST,	/* one row per comma separated value */
+	SPLIT_FIELDS	/* colon separated columns */
+};
+
+static const struct {
+	const char	*name;
+	int		 split;
+} services[] = {
+	{ "alias",		SPLIT_LIST },
+	{ "domain",		SPLIT_NONE },
+	{ "credentials",	SPLIT_ONE },
+	{ "netaddr",		SPLIT_NONE },
+	{ "userinfo",		SPLIT_FIELDS },
+	{ "source",		SPLIT_NONE },
+	{ "mailaddr",		SPLIT_NONE },
+	{ "addrname",		SPLIT_ONE },
+};
+
+/* where the rows of a map go, the key column first */
+struct target {
+	char	*table;
+	char	*cols[MAPLOAD_COLS];
+	size_t	 ncols;
+};
+
+struct loader {
+	const char	*name;
+	void		(*open)(struct dict *);
+	void		(*begin)(const struct target *, int);
+	void		(*row)(const struct target *, const char **);
+	void		(*commit)(void);
+	void		(*index)(const struct target *);
+	void		(*close)(void);
+};
+
+static struct {
+	char	*buf;
+	size_t	 len;
+	size_t	 size;
+} out;
+
+static int	verbose;
+
+static void
+out_add(const char *s, size_t len)
+{
+	char	*p;
+	size_t	 size;
+
+	if (out.len + len + 1 > out.size) {
+		for (size = out.size ? out.size : 65536;
+		    size < out.len + len + 1; size *= 2)
+			;
+		if ((p = realloc(out.buf, size)) == NULL)
+			err(1, "realloc");
+		out.buf = p;
+		out.size = size;
+	}
+	memcpy(out.buf + out.len, s, len);
+	out.len += len;
+	out.buf[out.len] = '\0';
+}
+
+static void
+out_str(const char *s)
+{
+	out_add(s, strlen(s));
+}
+
+static double
+elapsed(const struct timespec *t0)
+{
+	struct timespec	t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return ((t1.tv_sec - t0->tv_sec) +
+	    (t1.tv_nsec - t0->tv_nsec) / 1e9);
+}
+
+/* "c1, c2, ..." for the statements */
+static char *
+target_columns(const struct target *t)
+{
+	size_t	i;
+
+	out.len = 0;
+	for (i = 0; i < t->ncols; i++) {
+		if (i)
+			out_str(", ");
+		out_str(t->cols[i]);
+	}
+	return (xstrdup(out.buf, "target_columns"));
+}
+
+static char *
+target_index(const struct target *t)
+{
+	char	*name, *p;
+
+	if (asprintf(&name, "%s_%s_idx", t->table, t->cols[0]) == -1)
+		err(1, "asprintf");
+	for (p = name; *p; p++)
+		if (!isalnum((unsigned char)*p))
+			*p = '_';
+	return (name);
+}
+
+#ifdef HAVE_TABLE_SQLITE
+static sqlite3		*sqlite_db;
+static sqlite3_stmt	*sqlite_stmt;
+
+static int
+sqlite_exec(const char *sql)
+{
+	char	*e;
+
+	if (verbose)
+		warnx("%s", sql);
+	if (sqlite3_exec(sqlite_db, sql, NULL, NULL, &e) != SQLITE_OK) {
+		warnx("sqlite: %s: %s", sql, e);
+		sqlite3_free(e);
+		return (-1);
+	}
+	return (0);
+}
+
+static void
+sqlite_open(struct dict *conf)
+{
+	const char	*dbpath;
+
+	if ((dbpath = dict_get(conf, "dbpath")) == NULL)
+		errx(1, "missing dbpath");
+	if (sqlite3_open(dbpath, &sqlite_db) != SQLITE_OK)
+		errx(1, "sqlite: %s: %s", dbpath, sqlite3_errmsg(sqlite_db));
+}
+
+static void
+sqlite_begin(const struct target *t, int replace)
+{
+	char	*cols, *sql;
+	size_t	 i;
+
+	/*
+	 * No rollback journal, and no fsync until the end.  A replace keeps
+	 * the journal, so that a failed load rolls back to the previous rows.
+	 */
+	if (!replace &&
+	    (sqlite_exec("PRAGMA journal_mode = OFF") == -1 ||
+	    sqlite_exec("PRAGMA synchronous = OFF") == -1))
+		exit(1);
+	if (sqlite_exec("BEGIN") == -1)
+		exit(1);
+	if (replace) {
+		if (asprintf(&sql, "DELETE FROM %s", t->table) == -1)
+			err(1, "asprintf");
+		if (sqlite_exec(sql) == -1)
+			exit(1);
+		free(sql);
+	}
+
+	cols = target_columns(t);
+	out.len = 0;
+	for (i = 0; i < t->ncols; i++)
+		out_str(i ? ", ?" : "?");
+	if (asprintf(&sql, "INSERT INTO %s (%s) VALUES (%s)", t->table, cols,
+	    out.buf) == -1)
+		err(1, "asprintf");
+	if (verbose)
+		warnx("%s", sql);
+	if (sqlite3_prepare_v2(sqlite_db, sql, -1, &sqlite_stmt, NULL)
+	    != SQLITE_OK)
+		errx(1, "sqlite: %s: %s", sql, sqlite3_errmsg(sqlite_db));
+	free(cols);
+	free(sql);
+}
+
+static void
+sqlite_row(const struct target *t, const char **vals)
+{
+	size_t	i;
+
+	for (i = 0; i < t->ncols; i++)
+		sqlite3_bind_text(sqlite_stmt, i + 1, vals[i], -1,
+		    SQLITE_STATIC);
+	if (sqlite3_step(sqlite_stmt) != SQLITE_DONE)
+		errx(1, "sqlite: insert: %s", sqlite3_errmsg(sqlite_db));
+	sqlite3_reset(sqlite_stmt);
+}
+
+static void
+sqlite_commit(void)
+{
+	sqlite3_finalize(sqlite_stmt);
+	sqlite_stmt = NULL;
+	if (sqlite_exec("COMMIT") == -1)
+		exit(1);
+}
+
+static void
+sqlite_index(const struct target *t)
+{
+	char	*name, *sql;
+
+	name = target_index(t);
+	if (asprintf(&sql, "CREATE INDEX IF NOT EXISTS %s ON %s (%s)", name,
+	    t->table, t->cols[0]) == -1)
+		err(1, "asprintf");
+	(void)sqlite_exec(sql);
+	free(name);
+	free(sql);
+}
+
+static void
+sqlite_close(void)
+{
+	sqlite3_close(sqlite_db);
+}
+#endif
+
+#ifdef HAVE_TABLE_POSTGRES
+static PGconn	*pg;
+
+static int
+pg_exec(const char *sql)
+{
+	PGresult	*res;
+	int		 r = 0;
+
+	if (verbose)
+		warnx("%s", sql);
+	res = PQexec(pg, sql);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		warnx("postgres: %s: %s", sql, PQerrorMessage(pg));
+		r = -1;
+	}
+	PQclear(res);
+	return (r);
+}
+
+static void
+pg_open(struct dict *conf)
+{
+	const char	*conninfo;
+
+	if ((conninfo = dict_get(conf, "conninfo")) == NULL)
+		errx(1, "missing conninfo");
+	pg = PQconnectdb(conninfo);
+	if (pg == NULL || PQstatus(pg) != CONNECTION_OK)
+		errx(1, "postgres: %s", pg ? PQerrorMessage(pg) : "PQconnectdb");
+}
+
+static void
+pg_flush(void)
+{
+	if (out.len && PQputCopyData(pg, out.buf, out.len) != 1)
+		errx(1, "postgres: COPY: %s", PQerrorMessage(pg));
+	out.len = 0;
+}
+
+/*
+ * DELETE rather than TRUNCATE: the lookups of the running tables keep
+ * reading the previous rows until the load commits.
+ */
+static void
+pg_begin(const struct target *t, int replace)
+{
+	PGresult	*res;
+	char		*cols, *sql;
+
+	if (pg_exec("BEGIN") == -1)
+		exit(1);
+	if (replace) {
+		if (asprintf(&sql, "DELETE FROM %s", t->table) == -1)
+			err(1, "asprintf");
+		if (pg_exec(sql) == -1)
+			exit(1);
+		free(sql);
+	}
+
+	cols = target_columns(t);
+	if (asprintf(&sql, "COPY %s (%s) FROM STDIN", t->table, cols) == -1)
+		err(1, "asprintf");
+	if (verbose)
+		warnx("%s", sql);
+	res = PQexec(pg, sql);
+	if (PQresultStatus(res) != PGRES_COPY_IN)
+		errx(1, "postgres: %s: %s", sql, PQerrorMessage(pg));
+	PQclear(res);
+	free(cols);
+	free(sql);
+	out.len = 0;
+}
+
+static void
+pg_row(const struct target *t, const char **vals)
+{
+	const char	*p;
+	size_t		 i;
+
+	for (i = 0; i < t->ncols; i++) {
+		if (i)
+			out_add("\t", 1);
+		for (p = vals[i]; *p; p++)
+			switch (*p) {
+			case '\\':
+				out_add("\\\\", 2);
+				break;
+			case '\t':
+				out_add("\\t", 2);
+				break;
+			case '\n':
+				out_add("\\n", 2);
+				break;
+			case '\r':
+				out_add("\\r", 2);
+				break;
+			default:
+				out_add(p, 1);
+			}
+	}
+	out_add("\n", 1);
+	if (out.len >= MAPLOAD_FLUSH)
+		pg_flush();
+}
+
+static void
+pg_commit(void)
+{
+	PGresult	*res;
+
+	pg_flush();
+	if (PQputCopyEnd(pg, NULL) != 1)
+		errx(1, "postgres: COPY: %s", PQerrorMessage(pg));
+	while ((res = PQgetResult(pg)) != NULL) {
+		if (PQresultStatus(res) != PGRES_COMMAND_OK)
+			errx(1, "postgres: COPY: %s", PQerrorMessage(pg));
+		PQclear(res);
+	}
+	if (pg_exec("COMMIT") == -1)
+		exit(1);
+}
+
+static void
+pg_index(const struct target *t)
+{
+	char	*name, *sql;
+
+	name = target_index(t);
+	if (asprintf(&sql, "CREATE INDEX IF NOT EXISTS %s ON %s (%s)", name,
+	    t->table, t->cols[0]) == -1)
+		err(1, "asprintf");
+	(void)pg_exec(sql);
+	free(name);
+	free(sql);
+}
+
+static void
+pg_close(void)
+{
+	PQfinish(pg);
+}
+#endif
+
+#ifdef HAVE_TABLE_MYSQL
+static MYSQL	*my;
+static char	*my_insert;
+static size_t	 my_rows;
+
+static int
+my_exec(const char *sql)
+{
+	if (verbose)
+		warnx("%.200s", sql);
+	if (mysql_query(my, sql) != 0) {
+		warnx("mysql: %.200s: %s", sql, mysql_error(my));
+		return (-1);
+	}
+	return (0);
+}
+
+static void
+my_open(struct dict *conf)
+{
+	if ((my = mysql_init(NULL)) == NULL)
+		errx(1, "mysql_init failed");
+	if (!mysql_real_connect(my, dict_get(conf, "host"),
+	    dict_get(conf, "username"), dict_get(conf, "password"),
+	    dict_get(conf, "database"), 0, NULL, 0))
+		errx(1, "mysql: %s", mysql_error(my));
+}
+
+static void
+my_flush(void)
+{
+	if (my_rows && my_exec(out.buf) == -1)
+		exit(1);
+	out.len = 0;
+	my_rows = 0;
+}
+
+/*
+ * LOAD DATA LOCAL INFILE is disabled on most servers, so the rows are
+ * sent as multi-row INSERTs, in one transaction.
+ */
+static void
+my_begin(const struct target *t, int replace)
+{
+	char	*cols, *sql;
+
+	if (my_exec("START TRANSACTION") == -1)
+		exit(1);
+	if (replace) {
+		if (asprintf(&sql, "DELETE FROM %s", t->table) == -1)
+			err(1, "asprintf");
+		if (my_exec(sql) == -1)
+			exit(1);
+		free(sql);
+	}
+
+	cols = target_columns(t);
+	if (asprintf(&my_insert, "INSERT INTO %s (%s) VALUES ", t->table,
+	    cols) == -1)
+		err(1, "asprintf");
+	free(cols);
+	out.len = 0;
+	my_rows = 0;
+}
+
+static void
+my_row(const struct target *t, const char **vals)
+{
+	char	*esc;
+	size_t	 i, len;
+
+	out_str(my_rows ? ", (" : my_insert);
+	if (my_rows == 0)
+		out_add("(", 1);
+	for (i = 0; i < t->ncols; i++) {
+		len = strlen(vals[i]);
+		if ((esc = malloc(2 * len + 1)) == NULL)
+			err(1, "malloc");
+		len = mysql_real_escape_string(my, esc, vals[i], len);
+		out_str(i ? ", '" : "'");
+		out_add(esc, len);
+		out_add("'", 1);
+		free(esc);
+	}
+	out_add(")", 1);
+	if (++my_rows == MAPLOAD_BATCH || out.len >= MAPLOAD_FLUSH)
+		my_flush();
+}
+
+static void
+my_commit(void)
+{
+	my_flush();
+	if (my_exec("COMMIT") == -1)
+		exit(1);
+	free(my_insert);
+	my_insert = NULL;
+}
+
+static void
+my_index(const struct target *t)
+{
+	char	*name, *sql;
+
+	name = target_index(t);
+	if (asprintf(&sql, "CREATE INDEX %s ON %s (%s)", name, t->table,
+	    t->cols[0]) == -1)
+		err(1, "asprintf");
+	if (verbose)
+		warnx("%s", sql);
+	if (mysql_query(my, sql) != 0 && mysql_errno(my) != ER_DUP_KEYNAME)
+		warnx("mysql: %s: %s", sql, mysql_error(my));
+	free(name);
+	free(sql);
+}
+
+static void
+my_close(void)
+{
+	mysql_close(my);
+}
+#endif
+
+static const struct loader loaders[] = {
+#ifdef HAVE_TABLE_SQLITE
+	{ "sqlite", sqlite_open, sqlite_begin, sqlite_row, sqlite_commit,
+	    sqlite_index, sqlite_close },
+#endif
+#ifdef HAVE_TABLE_POSTGRES
+	{ "postgres", pg_open, pg_begin, pg_row, pg_commit, pg_index,
+	    pg_close },
+#endif
+#ifdef HAVE_TABLE_MYSQL
+	{ "mysql", my_open, my_begin, my_row, my_commit, my_index, my_close },
+#endif
+	{ NULL, NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+static char *
+strip_ws(char *s)
+{
+	char	*e;
+
+	while (isspace((unsigned char)*s))
+		s++;
+	e = s + strlen(s);
+	while (e > s && isspace((unsigned char)e[-1]))
+		*--e = '\0';
+	return (s);
+}
+
+/*
+ * Same format as the configuration files of the table backends.
+ */
+static void
+config_load(const char *path, struct dict *conf)
+{
+	FILE	*fp;
+	char	*buf = NULL, *key, *value;
+	size_t	 sz = 0;
+	ssize_t	 len;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+	while ((len = getline(&buf, &sz, fp)) != -1) {
+		if (buf[len - 1] == '\n')
+			buf[len - 1] = '\0';
+		key = strip_ws(buf);
+		if (*key == '\0' || *key == '#')
+			continue;
+		value = key;
+		strsep(&value, " \t:");
+		if (value == NULL || *(value = strip_ws(value)) == '\0')
+			continue;
+		if (*value == ':')
+			value = strip_ws(value + 1);
+		dict_set(conf, key, xstrdup(value, "config_load"));
+	}
+	free(buf);
+	fclose(fp);
+}
+
+static int
+is_ident(const char *s)
+{
+	if (*s == '\0')
+		return (0);
+	for (; *s; s++)
+		if (!isalnum((unsigned char)*s) && *s != '_' && *s != '.')
+			return (0);
+	return (1);
+}
+
+static char *
+ident(char *s)
+{
+	s += strspn(s, " \t");
+	s[strspn(s, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+	    "0123456789_.")] = '\0';
+	return (s);
+}
+
+static void
+target_add(struct target *t, const char *col)
+{
+	const char	*dot;
+	size_t		 i;
+
+	if ((dot = strrchr(col, '.')) != NULL)
+		col = dot + 1;
+	for (i = 0; i < t->ncols; i++)
+		if (strcmp(t->cols[i], col) == 0)
+			return;
+	if (t->ncols == MAPLOAD_COLS)
+		errx(1, "too many columns");
+	t->cols[t->ncols++] = xstrdup(col, "target_add");
+}
+
+/*
+ * Find the table and columns from the lookup query of the service, in
+ * the "SELECT c1, c2 FROM table WHERE key = ?" form.  The load_<service>
+ * key, "table key c1 c2", is used instead if set.
+ */
+static void
+target_init(struct dict *conf, const char *service, struct target *t)
+{
+	char	 name[64], *q, *s, *from, *where, *col;
+
+	memset(t, 0, sizeof *t);
+
+	(void)snprintf(name, sizeof name, "load_%s", service);
+	if ((q = dict_get(conf, name)) != NULL) {
+		s = q = xstrdup(q, "target_init");
+		while ((col = strsep(&s, " \t,")) != NULL) {
+			if (*col == '\0')
+				continue;
+			if (!is_ident(col))
+				errx(1, "%s: bad name %s", name, col);
+			if (t->table == NULL)
+				t->table = xstrdup(col, "target_init");
+			else
+				target_add(t, col);
+		}
+		free(q);
+		if (t->ncols == 0)
+			errx(1, "%s: missing columns", name);
+		return;
+	}
+
+	(void)snprintf(name, sizeof name, "query_%s", service);
+	if ((q = dict_get(conf, name)) == NULL)
+		errx(1, "neither query_%s nor load_%s is set", service,
+		    service);
+	q = xstrdup(q, "target_init");
+	s = strip_ws(q);
+	if (strncasecmp(s, "select ", 7) != 0 ||
+	    (from = strcasestr(s, " from ")) == NULL ||
+	    (where = strcasestr(from, " where ")) == NULL)
+		errx(1, "cannot parse %s, set load_%s", name, service);
+	*from = '\0';
+	*where = '\0';
+	s += 7;
+
+	t->table = xstrdup(ident(from + 6), "target_init");
+	target_add(t, ident(where + 7));
+	while ((col = strsep(&s, ",")) != NULL) {
+		col = strip_ws(col);
+		if (!is_ident(col))
+			errx(1, "cannot parse %s, set load_%s", name, service);
+		target_add(t, col);
+	}
+	if (!is_ident(t->table) || !is_ident(t->cols[0]))
+		errx(1, "cannot parse %s, set load_%s", name, service);
+	free(q);
+}
+
+/*
+ * Read the map, in the format of the smtpd file tables, and hand each
+ * row to the loader.
+ */
+static size_t
+map_load(FILE *fp, const char *path, int split, const struct loader *l,
+    const struct target *t)
+{
+	const char	*vals[MAPLOAD_COLS];
+	char		*buf = NULL, *key, *value, *v;
+	size_t		 sz = 0, lineno = 0, nrows = 0, n;
+	ssize_t		 len;
+
+	while ((len = getline(&buf, &sz, fp)) != -1) {
+		lineno++;
+		if (buf[len - 1] == '\n')
+			buf[len - 1] = '\0';
+		key = strip_ws(buf);
+		if (*key == '\0' || *key == '#')
+			continue;
+		/* keys of key-only maps may hold colons, IPv6 addresses */
+		value = key;
+		strsep(&value, split == SPLIT_NONE ? " \t" : " \t:");
+		if (value) {
+			value = strip_ws(value);
+			if (*value == ':')
+				value = strip_ws(value + 1);
+		}
+		vals[0] = key;
+
+		if (split == SPLIT_NONE) {
+			l->row(t, vals);
+			nrows++;
+			continue;
+		}
+		if (value == NULL || *value == '\0')
+			errx(1, "%s:%zu: missing value", path, lineno);
+
+		switch (split) {
+		case SPLIT_ONE:
+			vals[1] = value;
+			l->row(t, vals);
+			nrows++;
+			break;
+		case SPLIT_LIST:
+			while ((v = strsep(&value, ",")) != NULL) {
+				if (*(vals[1] = strip_ws(v)) == '\0')
+					continue;
+				l->row(t, vals);
+				nrows++;
+			}
+			break;
+		case SPLIT_FIELDS:
+			for (n = 1; (v = strsep(&value, ":")) != NULL; n++) {
+				if (n == t->ncols)
+					errx(1, "%s:%zu: too many fields",
+					    path, lineno);
+				vals[n] = strip_ws(v);
+			}
+			if (n != t->ncols)
+				errx(1, "%s:%zu: %zu fields, expected %zu",
+				    path, lineno, n - 1, t->ncols - 1);
+			l->row(t, vals);
+			nrows++;
+			break;
+		}
+	}
+	if (ferror(fp))
+		err(1, "%s", path);
+	free(buf);
+	return (nrows);
+}
+
+static void
+usage(void)
+{
+	extern char	*__progname;
+
+	fprintf(stderr, "usage: %s [-nrv] [-t type] config service map\n",
+	    __progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	const struct loader	*l;
+	struct target		 t;
+	struct timespec		 t0;
+	struct dict		 conf;
+	const char		*type = NULL, *path;
+	FILE			*fp;
+	size_t			 i, nrows;
+	double			 s;
+	int			 ch, split, replace = 0, noindex = 0;
+
+	while ((ch = getopt(argc, argv, "nrt:v")) != -1) {
+		switch (ch) {
+		case 'n':
+			noindex = 1;
+			break;
+		case 'r':
+			replace = 1;
+			break;
+		case 't':
+			type = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 3)
+		usage();
+
+	dict_init(&conf);
+	config_load(argv[0], &conf);
+
+	for (i = 0; i < sizeof(services) / sizeof(services[0]); i++)
+		if (strcmp(services[i].name, argv[1]) == 0)
+			break;
+	if (i == sizeof(services) / sizeof(services[0]))
+		errx(1, "unknown service %s", argv[1]);
+	split = services[i].split;
+
+	/* guess the backend from its connection keys */
+	if (type == NULL) {
+		if (dict_get(&conf, "dbpath"))
+			type = "sqlite";
+		else if (dict_get(&conf, "conninfo"))
+			type = "postgres";
+		else if (dict_get(&conf, "host") || dict_get(&conf, "database"))
+			type = "mysql";
+		else
+			errx(1, "cannot guess the backend type, use -t");
+	}
+	for (l = loaders; l->name; l++)
+		if (strcmp(l->name, type) == 0)
+			break;
+	if (l->name == NULL)
+		errx(1, "backend %s is not supported by this build", type);
+
+	target_init(&conf, argv[1], &t);
+	if ((split == SPLIT_NONE && t.ncols != 1) ||
+	    ((split == SPLIT_ONE || split == SPLIT_LIST) && t.ncols != 2) ||
+	    (split == SPLIT_FIELDS && t.ncols < 2))
+		errx(1, "%zu columns in %s do not match the %s maps", t.ncols,
+		    t.table, argv[1]);
+
+	path = argv[2];
+	if (strcmp(path, "-") == 0)
+		fp = stdin;
+	else if ((fp = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+
+	l->open(&conf);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	l->begin(&t, replace);
+	nrows = map_load(fp, path, split, l, &t);
+	l->commit();
+	s = elapsed(&t0);
+	printf("%zu rows loaded into %s in %.2fs (%.0f rows/s)\n", nrows,
+	    t.table, s, s > 0 ? nrows / s : 0);
+
+	if (!noindex) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		l->index(&t);
+		printf("index on %s (%s) in %.2fs\n", t.table, t.cols[0],
+		    elapsed(&t0));
+	}
+
+	l->close();
+	if (fp != stdin)
+		fclose(fp);
+	return 0;
+}
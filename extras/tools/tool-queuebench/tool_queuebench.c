@@ -0,0 +1,893 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <imsg.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <smtpd-api.h>
+
+#define BENCH_MESSAGES	10000
+#define BENCH_SIZE	4096
+#define BENCH_EVPSIZE	8192	/* the envelope buffer of queue_api.c */
+#define BENCH_WALKMAX	10000000
+
+struct phase {
+	const char	*name;
+	size_t		 count;
+	size_t		 failed;
+	size_t		 bytes;
+	double		*latency;	/* us, per operation */
+	double		 elapsed;	/* s, spent in the operations */
+};
+
+struct body {
+	size_t	 size;
+	int	 fd;
+};
+
+#define BODY_TAGOFF	(sizeof(BODY_RECEIVED) - 1)
+#define BODY_RECEIVED	"Received: from client.example.org " \
+	"(client.example.org [192.0.2.1])\n\tby bench.example.org with ESMTP id "
+
+static struct imsgbuf	 ibuf;
+static struct imsg	 imsg;
+static pid_t		 pid;
+static int		 failures;
+
+static double
+since_us(const struct timespec *t0)
+{
+	struct timespec	t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return ((t1.tv_sec - t0->tv_sec) * 1e6 +
+	    (t1.tv_nsec - t0->tv_nsec) / 1e3);
+}
+
+/*
+ * Send a request and wait for its reply, in imsg.  The queue API answers
+ * every request, one at a time, as smtpd expects of it.
+ */
+static void
+queue_call(int type, int fd, const void *p1, size_t l1, const void *p2,
+    size_t l2)
+{
+	struct iovec	iov[2];
+	struct pollfd	pfd;
+	ssize_t		n;
+	int		iovcnt = 0;
+
+	memset(iov, 0, sizeof(iov));
+	if (l1) {
+		iov[iovcnt].iov_base = (void *)p1;
+		iov[iovcnt++].iov_len = l1;
+	}
+	if (l2) {
+		iov[iovcnt].iov_base = (void *)p2;
+		iov[iovcnt++].iov_len = l2;
+	}
+	if (imsg_composev(&ibuf, type, 0, 0, fd, iov, iovcnt) == -1)
+		errx(1, "imsg_composev failed");
+
+	for (;;) {
+		if ((n = imsg_get(&ibuf, &imsg)) == -1)
+			err(1, "imsg_get");
+		if (n) {
+			if (imsg.hdr.type != PROC_QUEUE_OK)
+				errx(1, "bad reply from queue");
+			return;
+		}
+
+		pfd.fd = ibuf.fd;
+		pfd.events = POLLIN;
+		if (ibuf.w.queued)
+			pfd.events |= POLLOUT;
+		if (poll(&pfd, 1, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+		if (pfd.revents & POLLOUT) {
+			if ((n = msgbuf_write(&ibuf.w)) == -1 &&
+			    errno != EAGAIN)
+				err(1, "msgbuf_write");
+			if (n == 0)
+				errx(1, "queue exited");
+		}
+		if (pfd.revents & (POLLIN | POLLHUP)) {
+			if ((n = imsg_read(&ibuf)) == -1 && errno != EAGAIN)
+				err(1, "imsg_read");
+			if (n == 0)
+				errx(1, "queue exited");
+		}
+	}
+}
+
+/* the status that starts most replies */
+static int
+queue_status(void)
+{
+	int	r;
+
+	if (imsg.hdr.len - IMSG_HEADER_SIZE < sizeof(r))
+		errx(1, "short reply from queue");
+	memcpy(&r, imsg.data, sizeof(r));
+	return (r);
+}
+
+static int
+queue_msgid_call(int type, uint32_t msgid)
+{
+	int	r;
+
+	queue_call(type, -1, &msgid, sizeof(msgid), NULL, 0);
+	r = queue_status();
+	imsg_free(&imsg);
+	return (r);
+}
+
+static int
+queue_message_create(uint32_t *msgid)
+{
+	int	r;
+
+	queue_call(PROC_QUEUE_MESSAGE_CREATE, -1, NULL, 0, NULL, 0);
+	if ((r = queue_status()) == 1) {
+		if (imsg.hdr.len - IMSG_HEADER_SIZE < sizeof(r) +
+		    sizeof(*msgid))
+			errx(1, "short reply from queue");
+		memcpy(msgid, (char *)imsg.data + sizeof(r), sizeof(*msgid));
+	}
+	imsg_free(&imsg);
+	return (r);
+}
+
+/* the body is read from its current offset, so rewind it for each use */
+static int
+queue_message_commit(uint32_t msgid, struct body *body)
+{
+	int	fd, r;
+
+	if (lseek(body->fd, 0, SEEK_SET) == -1)
+		err(1, "lseek");
+	if ((fd = dup(body->fd)) == -1)
+		err(1, "dup");
+	queue_call(PROC_QUEUE_MESSAGE_COMMIT, fd, &msgid, sizeof(msgid),
+	    NULL, 0);
+	r = queue_status();
+	imsg_free(&imsg);
+	return (r);
+}
+
+static int
+queue_message_fd_r(uint32_t msgid)
+{
+	int	fd;
+
+	queue_call(PROC_QUEUE_MESSAGE_FD_R, -1, &msgid, sizeof(msgid),
+	    NULL, 0);
+	fd = imsg.fd;
+	imsg_free(&imsg);
+	return (fd);
+}
+
+static int
+queue_envelope_create(uint32_t msgid, const char *buf, size_t len,
+    uint64_t *evpid)
+{
+	int	r;
+
+	queue_call(PROC_QUEUE_ENVELOPE_CREATE, -1, &msgid, sizeof(msgid),
+	    buf, len);
+	if ((r = queue_status()) == 1) {
+		if (imsg.hdr.len - IMSG_HEADER_SIZE < sizeof(r) +
+		    sizeof(*evpid))
+			errx(1, "short reply from queue");
+		memcpy(evpid, (char *)imsg.data + sizeof(r), sizeof(*evpid));
+	}
+	imsg_free(&imsg);
+	return (r);
+}
+
+static int
+queue_envelope_update(uint64_t evpid, const char *buf, size_t len)
+{
+	int	r;
+
+	queue_call(PROC_QUEUE_ENVELOPE_UPDATE, -1, &evpid, sizeof(evpid),
+	    buf, len);
+	r = queue_status();
+	imsg_free(&imsg);
+	return (r);
+}
+
+static int
+queue_envelope_delete(uint64_t evpid)
+{
+	int	r;
+
+	queue_call(PROC_QUEUE_ENVELOPE_DELETE, -1, &evpid, sizeof(evpid),
+	    NULL, 0);
+	r = queue_status();
+	imsg_free(&imsg);
+	return (r);
+}
+
+/* return the length of the envelope, 0 when it cannot be loaded */
+static size_t
+queue_envelope_load(uint64_t evpid, char *buf, size_t len)
+{
+	size_t	n;
+
+	queue_call(PROC_QUEUE_ENVELOPE_LOAD, -1, &evpid, sizeof(evpid),
+	    NULL, 0);
+	n = imsg.hdr.len - IMSG_HEADER_SIZE;
+	if (n > len)
+		errx(1, "envelope too large");
+	memcpy(buf, imsg.data, n);
+	imsg_free(&imsg);
+	return (n);
+}
+
+/*
+ * One step of an envelope walk, or of a message walk when msgid is not
+ * 0: > 0 is the length of the envelope returned, 0 asks to call again,
+ * and -1 ends the walk.
+ */
+static int
+queue_walk(uint32_t msgid, uint64_t *evpid, char *buf, size_t len)
+{
+	size_t	n;
+	int	r;
+
+	if (msgid)
+		queue_call(PROC_QUEUE_MESSAGE_WALK, -1, &msgid, sizeof(msgid),
+		    NULL, 0);
+	else
+		queue_call(PROC_QUEUE_ENVELOPE_WALK, -1, NULL, 0, NULL, 0);
+	if ((r = queue_status()) > 0) {
+		n = imsg.hdr.len - IMSG_HEADER_SIZE;
+		if (n != sizeof(r) + sizeof(*evpid) + r || (size_t)r > len)
+			errx(1, "bad walk reply from queue");
+		memcpy(evpid, (char *)imsg.data + sizeof(r), sizeof(*evpid));
+		memcpy(buf, (char *)imsg.data + sizeof(r) + sizeof(*evpid), r);
+	}
+	imsg_free(&imsg);
+	return (r);
+}
+
+static void
+queue_open(char **argv)
+{
+	uint32_t	version = PROC_QUEUE_API_VERSION;
+	int		sp[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, sp) == -1)
+		err(1, "socketpair");
+	switch (pid = fork()) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		if (dup2(sp[1], STDIN_FILENO) == -1)
+			err(1, "dup2");
+		close(sp[0]);
+		close(sp[1]);
+		execv(argv[0], argv);
+		err(1, "%s", argv[0]);
+	}
+	close(sp[1]);
+	if (fcntl(sp[0], F_SETFL, O_NONBLOCK) == -1)
+		err(1, "fcntl");
+	imsg_init(&ibuf, sp[0]);
+
+	queue_call(PROC_QUEUE_INIT, -1, &version, sizeof(version), NULL, 0);
+	imsg_free(&imsg);
+}
+
+static int
+queue_close(void)
+{
+	int	r, status;
+
+	queue_call(PROC_QUEUE_CLOSE, -1, NULL, 0, NULL, 0);
+	r = queue_status();
+	imsg_free(&imsg);
+	close(ibuf.fd);
+	if (waitpid(pid, &status, 0) == -1)
+		warn("waitpid");
+	return (r);
+}
+
+/*
+ * A message of size bytes, with headers and text lines, tagged so that
+ * bodies committed to different messages differ.
+ */
+static char *
+body_make(size_t size, uint32_t tag)
+{
+	char	*buf, line[128];
+	size_t	 off, n;
+	int	 i;
+
+	if ((buf = malloc(size + 1)) == NULL)
+		err(1, "malloc");
+	n = snprintf(buf, size + 1, BODY_RECEIVED "%08x\n"
+	    "From: sender@example.org\nTo: rcpt@example.org\n"
+	    "Subject: queue bench %08x\n\n", tag, tag);
+	for (off = n < size ? n : size, i = 0; off < size; off += n, i++) {
+		n = snprintf(line, sizeof(line), "line %d of message %08x, "
+		    "filler to make the body look like text.\n", i, tag);
+		if (n > size - off)
+			n = size - off;
+		memcpy(buf + off, line, n);
+	}
+	return (buf);
+}
+
+static void
+body_open(struct body *body, size_t size, uint32_t tag)
+{
+	char	 path[] = "/tmp/queuebench.XXXXXXXXXX", *buf;
+
+	buf = body_make(size, tag);
+	if ((body->fd = mkstemp(path)) == -1)
+		err(1, "mkstemp");
+	(void)unlink(path);
+	if (write(body->fd, buf, size) != (ssize_t)size)
+		err(1, "write");
+	body->size = size;
+	free(buf);
+}
+
+/* an envelope as smtpd dumps it, padded with an error line */
+static size_t
+envelope_make(char *buf, size_t len, uint64_t tag, int rcpt, size_t pad)
+{
+	int	n;
+
+	n = snprintf(buf, len, "version: 2\ntype: mta\n"
+	    "smtpname: bench.example.org\nhelo: client.example.org\n"
+	    "hostname: client.example.org\nsockaddr: 192.0.2.1\n"
+	    "sender: sender@example.org\nrcpt: user%d@example.org\n"
+	    "dest: user%d@example.org\nctime: %llu\nexpire: 345600\n"
+	    "retry: %d\nerrorline: %*s\n", rcpt, rcpt,
+	    (unsigned long long)tag, pad != 0, (int)pad, "");
+	if (n < 0 || (size_t)n >= len)
+		errx(1, "envelope too large");
+	return (n + 1);
+}
+
+/* give the body the id of another message, so that bodies differ */
+static void
+body_tag(struct body *body, uint32_t tag)
+{
+	char	id[9];
+
+	if (body->size < BODY_TAGOFF + 8)
+		return;
+	(void)snprintf(id, sizeof(id), "%08x", tag);
+	if (pwrite(body->fd, id, 8, BODY_TAGOFF) != 8)
+		err(1, "pwrite");
+}
+
+static int
+fd_matches(int fd, const char *buf, size_t len)
+{
+	char	chunk[65536];
+	size_t	off = 0;
+	ssize_t	n;
+
+	while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+		if (off + n > len || memcmp(buf + off, chunk, n) != 0)
+			return (0);
+		off += n;
+	}
+	return (n == 0 && off == len);
+}
+
+static void
+check(const char *what, int ok)
+{
+	printf("%-56s %s\n", what, ok ? "ok" : "FAIL");
+	if (!ok)
+		failures++;
+}
+
+static void
+skip(const char *what, const char *why)
+{
+	printf("%-56s skipped, %s\n", what, why);
+}
+
+/*
+ * Walk the envelopes, of msgid only when it is not 0, and check that
+ * each envelope given appears once with its content.  Envelopes of other
+ * messages already in the queue are ignored by the envelope walk.
+ */
+static void
+check_walk(const char *what, uint32_t msgid, uint64_t *evpids, char **evps,
+    size_t *lens, size_t n)
+{
+	uint64_t	evpid = 0;
+	char		buf[BENCH_EVPSIZE];
+	size_t		i, steps, found = 0, *seen;
+	int		r, ok = 1;
+
+	if ((seen = calloc(n, sizeof(*seen))) == NULL)
+		err(1, "calloc");
+	for (steps = 0; steps < BENCH_WALKMAX; steps++) {
+		if ((r = queue_walk(msgid, &evpid, buf, sizeof(buf))) == -1)
+			break;
+		if (r == 0)
+			continue;
+		found++;
+		for (i = 0; i < n; i++)
+			if (evpids[i] == evpid)
+				break;
+		if (i == n) {
+			/* only our message may be listed by a message walk */
+			if (msgid)
+				ok = 0;
+			continue;
+		}
+		if (seen[i]++ || (size_t)r != lens[i] ||
+		    memcmp(buf, evps[i], r) != 0)
+			ok = 0;
+	}
+	if (steps == BENCH_WALKMAX)
+		ok = 0;
+	for (i = 0; i < n; i++)
+		if (seen[i] != 1)
+			ok = 0;
+	free(seen);
+
+	if (found == 0 && steps < BENCH_WALKMAX)
+		skip(what, "the queue does not walk");
+	else
+		check(what, ok);
+}
+
+/*
+ * Go through the lifecycle smtpd gives messages and envelopes, and check
+ * what each step leaves in the queue.
+ */
+static void
+suite_run(void)
+{
+	struct body	 big, small;
+	uint64_t	 evpids[4], evpid = 0;
+	uint32_t	 a, b, c;
+	char		*evps[4], buf[BENCH_EVPSIZE], *content;
+	size_t		 lens[4], len, i;
+	int		 fd, fd2, ok, r;
+
+	/* message a has three envelopes and a large body, b one */
+	ok = queue_message_create(&a) == 1 && queue_message_create(&b) == 1;
+	check("message create", ok);
+	if (!ok)
+		errx(1, "cannot go on without messages");
+	check("message ids are unique and not 0", a && b && a != b);
+
+	ok = 1;
+	for (i = 0; i < 4; i++) {
+		if ((evps[i] = malloc(BENCH_EVPSIZE)) == NULL)
+			err(1, "malloc");
+		lens[i] = envelope_make(evps[i], BENCH_EVPSIZE, i, i, 0);
+		if (queue_envelope_create(i < 3 ? a : b, evps[i], lens[i],
+		    &evpids[i]) != 1)
+			ok = 0;
+	}
+	check("envelope create", ok);
+	if (!ok)
+		errx(1, "cannot go on without envelopes");
+	check("envelope ids carry their message id",
+	    evpid_to_msgid(evpids[0]) == a && evpid_to_msgid(evpids[2]) == a &&
+	    evpid_to_msgid(evpids[3]) == b);
+	check("envelope ids are unique", evpids[0] != evpids[1] &&
+	    evpids[1] != evpids[2] && evpids[0] != evpids[2]);
+
+	body_open(&big, 1024 * 1024 + 17, a);
+	body_open(&small, 300, b);
+	check("message commit", queue_message_commit(a, &big) == 1 &&
+	    queue_message_commit(b, &small) == 1);
+
+	content = body_make(big.size, a);
+	fd = queue_message_fd_r(a);
+	check("message fd_r gives the body from its start",
+	    fd != -1 && fd_matches(fd, content, big.size));
+	fd2 = queue_message_fd_r(a);
+	check("message fd_r twice gives two readers",
+	    fd2 != -1 && fd_matches(fd2, content, big.size));
+	if (fd != -1)
+		close(fd);
+	if (fd2 != -1)
+		close(fd2);
+	free(content);
+	content = body_make(small.size, b);
+	fd = queue_message_fd_r(b);
+	check("message fd_r keeps bodies apart",
+	    fd != -1 && fd_matches(fd, content, small.size));
+	if (fd != -1)
+		close(fd);
+	free(content);
+
+	ok = 1;
+	for (i = 0; i < 4; i++) {
+		len = queue_envelope_load(evpids[i], buf, sizeof(buf));
+		if (len != lens[i] || memcmp(buf, evps[i], len) != 0)
+			ok = 0;
+	}
+	check("envelope load", ok);
+
+	/* grow, then shrink, as retries and error lines come and go */
+	lens[0] = envelope_make(evps[0], BENCH_EVPSIZE, 0, 0, 2000);
+	r = queue_envelope_update(evpids[0], evps[0], lens[0]);
+	len = queue_envelope_load(evpids[0], buf, sizeof(buf));
+	check("envelope update to a larger envelope", r == 1 &&
+	    len == lens[0] && memcmp(buf, evps[0], len) == 0);
+	lens[0] = envelope_make(evps[0], BENCH_EVPSIZE, 0, 0, 10);
+	r = queue_envelope_update(evpids[0], evps[0], lens[0]);
+	len = queue_envelope_load(evpids[0], buf, sizeof(buf));
+	check("envelope update to a smaller envelope", r == 1 &&
+	    len == lens[0] && memcmp(buf, evps[0], len) == 0);
+
+	check("envelope load of an unknown envelope fails",
+	    queue_envelope_load(evpids[0] ^ 0xffffffff, buf, sizeof(buf))
+	    == 0);
+	do {
+		c = arc4random();
+	} while (c == 0 || c == a || c == b);
+	fd = queue_message_fd_r(c);
+	check("message fd_r of an unknown message fails", fd == -1);
+	if (fd != -1)
+		close(fd);
+
+	/*
+	 * smtpd never loads an envelope it deleted, and queues may delete
+	 * lazily: the walks check that it is gone.
+	 */
+	r = queue_envelope_delete(evpids[2]);
+	check("envelope delete", r == 1 &&
+	    queue_envelope_load(evpids[1], buf, sizeof(buf)) == lens[1]);
+
+	/* walk a's envelopes, evpids[2] aside, then everything */
+	evpids[2] = evpids[3];
+	evps[2] = evps[3];
+	lens[2] = lens[3];
+	check_walk("message walk lists the envelopes of its message", a,
+	    evpids, evps, lens, 2);
+	check_walk("envelope walk lists every envelope once", 0,
+	    evpids, evps, lens, 3);
+
+	/* queues delete a message with its last envelope */
+	ok = queue_message_create(&c) == 1 &&
+	    queue_envelope_create(c, evps[1], lens[1], &evpid) == 1 &&
+	    queue_message_commit(c, &small) == 1 &&
+	    queue_envelope_delete(evpid) == 1;
+	fd = queue_message_fd_r(c);
+	check("envelope delete of the last envelope deletes the message",
+	    ok && fd == -1);
+	if (fd != -1)
+		close(fd);
+
+	/* a session that aborts deletes a message it never committed */
+	ok = queue_message_create(&c) == 1 &&
+	    queue_envelope_create(c, evps[1], lens[1], &evpid) == 1;
+	check("message delete before commit", ok &&
+	    queue_msgid_call(PROC_QUEUE_MESSAGE_DELETE, c) == 1 &&
+	    queue_envelope_load(evpid, buf, sizeof(buf)) == 0);
+
+	r = queue_msgid_call(PROC_QUEUE_MESSAGE_CORRUPT, b);
+	check("message corrupt takes its envelopes out", r == 1 &&
+	    queue_envelope_load(evpids[2], buf, sizeof(buf)) == 0);
+	if (queue_msgid_call(PROC_QUEUE_MESSAGE_UNCORRUPT, b) == 1) {
+		len = queue_envelope_load(evpids[2], buf, sizeof(buf));
+		check("message uncorrupt brings them back", len == lens[2] &&
+		    memcmp(buf, evps[2], len) == 0);
+		queue_msgid_call(PROC_QUEUE_MESSAGE_DELETE, b);
+	} else
+		skip("message uncorrupt brings them back",
+		    "the queue drops corrupt messages");
+
+	r = queue_msgid_call(PROC_QUEUE_MESSAGE_DELETE, a);
+	fd = queue_message_fd_r(a);
+	check("message delete", r == 1 && fd == -1 &&
+	    queue_envelope_load(evpids[0], buf, sizeof(buf)) == 0 &&
+	    queue_envelope_load(evpids[1], buf, sizeof(buf)) == 0);
+	if (fd != -1)
+		close(fd);
+
+	check("close", queue_close() == 1);
+
+	for (i = 0; i < 3; i++)
+		free(evps[i]);
+	close(big.fd);
+	close(small.fd);
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double	x = *(const double *)a, y = *(const double *)b;
+
+	return ((x < y) ? -1 : (x > y));
+}
+
+static double
+percentile(const struct phase *p, double pct)
+{
+	size_t	i;
+
+	i = (size_t)ceil(p->count * pct / 100.0);
+	if (i > 0)
+		i--;
+	return (p->latency[i]);
+}
+
+static void
+phase_init(struct phase *p, const char *name, size_t n)
+{
+	memset(p, 0, sizeof(*p));
+	p->name = name;
+	if ((p->latency = reallocarray(NULL, n, sizeof(double))) == NULL)
+		err(1, "reallocarray");
+}
+
+static void
+phase_add(struct phase *p, double us, int ok)
+{
+	p->latency[p->count++] = us;
+	p->elapsed += us / 1e6;
+	if (!ok)
+		p->failed++;
+}
+
+static void
+phase_report(struct phase *p)
+{
+	if (p->count == 0) {
+		free(p->latency);
+		return;
+	}
+	qsort(p->latency, p->count, sizeof(double), cmp_double);
+	printf("%-10s %9zu %10.0f %8.1f %9.1f %9.1f %9.1f %7zu\n", p->name,
+	    p->count, p->count / p->elapsed, p->bytes / p->elapsed / 1e6,
+	    percentile(p, 50), percentile(p, 99), percentile(p, 99.9),
+	    p->failed);
+	free(p->latency);
+}
+
+/*
+ * Commit every message with its envelopes, then deliver them: read the
+ * body once per message, and load, update and delete each envelope.  The
+ * queue deletes a message with its last envelope.
+ */
+static void
+bench_run(size_t nmessages, struct body *bodies, size_t nbodies,
+    size_t *rcpts, size_t nrcpts, int unique)
+{
+	struct phase	 commit, fdr, envelope;
+	struct timespec	 t0;
+	struct stat	 sb;
+	struct body	*body;
+	uint64_t	*evpids;
+	uint32_t	*msgids;
+	char		 buf[BENCH_EVPSIZE], evp[BENCH_EVPSIZE];
+	size_t		 i, j, k, nevps = 0, len;
+	double		 us;
+	int		 fd, ok;
+
+	for (i = 0; i < nmessages; i++)
+		nevps += rcpts[i % nrcpts];
+	msgids = reallocarray(NULL, nmessages, sizeof(*msgids));
+	evpids = reallocarray(NULL, nevps, sizeof(*evpids));
+	if (msgids == NULL || evpids == NULL)
+		err(1, "reallocarray");
+	phase_init(&commit, "commit", nmessages);
+	phase_init(&fdr, "fd_r", nmessages);
+	phase_init(&envelope, "envelope", nevps * 4);
+
+	for (i = k = 0; i < nmessages; i++) {
+		body = &bodies[i % nbodies];
+
+		/* a commit is timed from the create, envelopes aside */
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (queue_message_create(&msgids[i]) != 1)
+			errx(1, "message create failed");
+		us = since_us(&t0);
+		for (j = 0; j < rcpts[i % nrcpts]; j++, k++) {
+			len = envelope_make(evp, sizeof(evp), k, j, 0);
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			ok = queue_envelope_create(msgids[i], evp, len,
+			    &evpids[k]) == 1;
+			phase_add(&envelope, since_us(&t0), ok);
+			envelope.bytes += len;
+		}
+		if (unique)
+			body_tag(body, msgids[i]);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		ok = queue_message_commit(msgids[i], body) == 1;
+		phase_add(&commit, us + since_us(&t0), ok);
+		commit.bytes += body->size;
+	}
+
+	for (i = k = 0; i < nmessages; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		fd = queue_message_fd_r(msgids[i]);
+		phase_add(&fdr, since_us(&t0), fd != -1);
+		if (fd != -1) {
+			if (fstat(fd, &sb) == 0)
+				fdr.bytes += sb.st_size;
+			close(fd);
+		}
+		for (j = 0; j < rcpts[i % nrcpts]; j++, k++) {
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			len = queue_envelope_load(evpids[k], buf, sizeof(buf));
+			phase_add(&envelope, since_us(&t0), len != 0);
+			envelope.bytes += len;
+
+			len = envelope_make(evp, sizeof(evp), k, j, 40);
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			ok = queue_envelope_update(evpids[k], evp, len) == 1;
+			phase_add(&envelope, since_us(&t0), ok);
+			envelope.bytes += len;
+
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			ok = queue_envelope_delete(evpids[k]) == 1;
+			phase_add(&envelope, since_us(&t0), ok);
+		}
+	}
+
+	printf("%-10s %9s %10s %8s %9s %9s %9s %7s\n", "operation", "count",
+	    "ops/s", "MB/s", "p50(us)", "p99(us)", "p999(us)", "failed");
+	phase_report(&commit);
+	phase_report(&fdr);
+	phase_report(&envelope);
+
+	free(msgids);
+	free(evpids);
+}
+
+/* a list of sizes, with an optional k or m suffix */
+static size_t
+list_parse(char *list, size_t **sizes, long long max, const char *what)
+{
+	const char	*e;
+	char		*s, *p, *suffix;
+	size_t		 n = 0, mult;
+
+	for (s = list; (p = strsep(&s, ",")) != NULL; n++) {
+		mult = 1;
+		suffix = p + strlen(p);
+		if (suffix > p && (suffix[-1] == 'k' || suffix[-1] == 'K'))
+			mult = 1024;
+		else if (suffix > p && (suffix[-1] == 'm' || suffix[-1] == 'M'))
+			mult = 1024 * 1024;
+		if (mult != 1)
+			suffix[-1] = '\0';
+		if ((*sizes = reallocarray(*sizes, n + 1, sizeof(**sizes)))
+		    == NULL)
+			err(1, "reallocarray");
+		(*sizes)[n] = strtonum(p, 1, max / mult, &e) * mult;
+		if (e)
+			errx(1, "%s is %s: %s", what, e, p);
+	}
+	return (n);
+}
+
+static void
+usage(void)
+{
+	extern char	*__progname;
+
+	fprintf(stderr, "usage: %s [-CD] [-n messages] [-r rcpts[,...]] "
+	    "[-s size[,...]]\n"
+	    "\tqueue [arg ...]\n", __progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct body	*bodies;
+	const char	*e;
+	size_t		*sizes = NULL, *rcpts = NULL, nsizes = 0, nrcpts = 0;
+	size_t		 nmessages = BENCH_MESSAGES, i;
+	int		 ch, conformance = 0, unique = 1;
+
+	while ((ch = getopt(argc, argv, "+CDn:r:s:")) != -1) {
+		switch (ch) {
+		case 'C':
+			conformance = 1;
+			break;
+		case 'D':
+			unique = 0;
+			break;
+		case 'n':
+			nmessages = strtonum(optarg, 1, INT_MAX, &e);
+			if (e)
+				errx(1, "messages is %s: %s", e, optarg);
+			break;
+		case 'r':
+			nrcpts = list_parse(optarg, &rcpts, 1000, "recipients");
+			break;
+		case 's':
+			nsizes = list_parse(optarg, &sizes, 64 * 1024 * 1024,
+			    "size");
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 0)
+		usage();
+
+	signal(SIGPIPE, SIG_IGN);
+	queue_open(argv);
+
+	if (conformance) {
+		suite_run();
+		return (failures ? 1 : 0);
+	}
+
+	if (nsizes == 0) {
+		if ((sizes = malloc(sizeof(*sizes))) == NULL)
+			err(1, "malloc");
+		sizes[nsizes++] = BENCH_SIZE;
+	}
+	if (nrcpts == 0) {
+		if ((rcpts = malloc(sizeof(*rcpts))) == NULL)
+			err(1, "malloc");
+		rcpts[nrcpts++] = 1;
+	}
+	if ((bodies = reallocarray(NULL, nsizes, sizeof(*bodies))) == NULL)
+		err(1, "reallocarray");
+	for (i = 0; i < nsizes; i++)
+		body_open(&bodies[i], sizes[i], i);
+
+	bench_run(nmessages, bodies, nsizes, rcpts, nrcpts, unique);
+	if (queue_close() != 1)
+		warnx("queue failed to close");
+
+	for (i = 0; i < nsizes; i++)
+		close(bodies[i].fd);
+	free(bodies);
+	free(sizes);
+	free(rcpts);
+	return (0);
+}
@@ -0,0 +1,510 @@
+/*
+ * Copyright (c) 2026 OpenSMTPD-extras developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <imsg.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <smtpd-api.h>
+
+#define BENCH_REQUESTS	100000
+#define BENCH_WINDOW	1
+#define BENCH_ZIPF	0.99
+
+enum {
+	DIST_UNIFORM,
+	DIST_ZIPF
+};
+
+static const struct {
+	const char	*name;
+	int		 service;
+} services[] = {
+	{ "alias",		K_ALIAS },
+	{ "domain",		K_DOMAIN },
+	{ "credentials",	K_CREDENTIALS },
+	{ "netaddr",		K_NETADDR },
+	{ "userinfo",		K_USERINFO },
+	{ "source",		K_SOURCE },
+	{ "mailaddr",		K_MAILADDR },
+	{ "addrname",		K_ADDRNAME },
+};
+
+struct result {
+	size_t	 found;
+	size_t	 notfound;
+	size_t	 failed;
+	double	*latency;	/* us, per request */
+	size_t	 nlatency;
+	double	 elapsed;	/* s */
+};
+
+static struct imsgbuf	 ibuf;
+static pid_t		 pid;
+
+static char		**keys;
+static size_t		 nkeys;
+static double		*cdf;
+static uint64_t		 seed = 1;
+
+/* xorshift64*, so that runs can be repeated */
+static uint64_t
+rnd(void)
+{
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return (seed * 2685821657736338717ULL);
+}
+
+static double
+rnd_unit(void)
+{
+	return ((rnd() >> 11) * (1.0 / 9007199254740992.0));
+}
+
+/*
+ * Key ranks follow a Zipf law of exponent s: the CDF is computed once,
+ * and sampled by bisection.
+ */
+static void
+zipf_init(double s)
+{
+	double	sum = 0;
+	size_t	i;
+
+	if ((cdf = reallocarray(NULL, nkeys, sizeof(*cdf))) == NULL)
+		err(1, "reallocarray");
+	for (i = 0; i < nkeys; i++) {
+		sum += 1.0 / pow(i + 1, s);
+		cdf[i] = sum;
+	}
+	for (i = 0; i < nkeys; i++)
+		cdf[i] /= sum;
+}
+
+static size_t
+zipf_pick(void)
+{
+	double	u = rnd_unit();
+	size_t	lo = 0, hi = nkeys - 1, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+static void
+keys_load(const char *path)
+{
+	FILE	*fp;
+	char	*buf = NULL, *p;
+	size_t	 sz = 0, keysz = 0;
+	ssize_t	 len;
+
+	if (strcmp(path, "-") == 0)
+		fp = stdin;
+	else if ((fp = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+	while ((len = getline(&buf, &sz, fp)) != -1) {
+		if (len && buf[len - 1] == '\n')
+			buf[--len] = '\0';
+		if (len == 0 || *buf == '#')
+			continue;
+		if (nkeys == keysz) {
+			keysz = keysz ? keysz * 2 : 1024;
+			if ((keys = reallocarray(keys, keysz, sizeof(*keys)))
+			    == NULL)
+				err(1, "reallocarray");
+		}
+		/* keep the key only, the file may be a map */
+		if ((p = strpbrk(buf, " \t")) != NULL) {
+			if (p > buf && p[-1] == ':')
+				p--;
+			*p = '\0';
+		}
+		keys[nkeys++] = xstrdup(buf, "keys_load");
+	}
+	free(buf);
+	if (fp != stdin)
+		fclose(fp);
+	if (nkeys == 0)
+		errx(1, "%s: no keys", path);
+}
+
+static void
+keys_generate(size_t n)
+{
+	size_t	i;
+
+	if ((keys = reallocarray(NULL, n, sizeof(*keys))) == NULL)
+		err(1, "reallocarray");
+	for (i = 0; i < n; i++)
+		if (asprintf(&keys[i], "user%zu@example.org", i) == -1)
+			err(1, "asprintf");
+	nkeys = n;
+}
+
+static double
+elapsed_us(const struct timespec *t0, const struct timespec *t1)
+{
+	return ((t1->tv_sec - t0->tv_sec) * 1e6 +
+	    (t1->tv_nsec - t0->tv_nsec) / 1e3);
+}
+
+/*
+ * Wait for the next message from the table, while flushing what is
+ * queued for it.  Both sides write without waiting for the other, so
+ * the pipe must be drained as we go.
+ */
+static void
+bench_get(struct imsg *imsg)
+{
+	struct pollfd	pfd;
+	ssize_t		n;
+
+	for (;;) {
+		if ((n = imsg_get(&ibuf, imsg)) == -1)
+			err(1, "imsg_get");
+		if (n)
+			return;
+
+		pfd.fd = ibuf.fd;
+		pfd.events = POLLIN;
+		if (ibuf.w.queued)
+			pfd.events |= POLLOUT;
+		if (poll(&pfd, 1, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+		if (pfd.revents & POLLOUT) {
+			if ((n = msgbuf_write(&ibuf.w)) == -1 &&
+			    errno != EAGAIN)
+				err(1, "msgbuf_write");
+			if (n == 0)
+				errx(1, "table exited");
+		}
+		if (pfd.revents & (POLLIN | POLLHUP)) {
+			if ((n = imsg_read(&ibuf)) == -1 && errno != EAGAIN)
+				err(1, "imsg_read");
+			if (n == 0)
+				errx(1, "table exited");
+		}
+	}
+}
+
+static void
+bench_send(int msgtype, int service, const char *key)
+{
+	struct ibuf	*buf;
+	size_t		 count = 0;
+
+	if ((buf = imsg_create(&ibuf, msgtype, 0, 0,
+	    sizeof(service) + sizeof(count) + strlen(key) + 1)) == NULL ||
+	    imsg_add(buf, &service, sizeof(service)) == -1 ||
+	    imsg_add(buf, &count, sizeof(count)) == -1 ||
+	    imsg_add(buf, key, strlen(key) + 1) == -1)
+		errx(1, "imsg_create failed");
+	imsg_close(&ibuf, buf);
+}
+
+static void
+bench_open(char **argv)
+{
+	struct table_open_params op;
+	struct imsg	imsg;
+	int		sp[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, sp) == -1)
+		err(1, "socketpair");
+	switch (pid = fork()) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		if (dup2(sp[1], STDIN_FILENO) == -1)
+			err(1, "dup2");
+		close(sp[0]);
+		close(sp[1]);
+		execv(argv[0], argv);
+		err(1, "%s", argv[0]);
+	}
+	close(sp[1]);
+	if (fcntl(sp[0], F_SETFL, O_NONBLOCK) == -1)
+		err(1, "fcntl");
+	imsg_init(&ibuf, sp[0]);
+
+	memset(&op, 0, sizeof op);
+	op.version = PROC_TABLE_API_STREAM;
+	(void)strlcpy(op.name, "bench", sizeof op.name);
+	if (imsg_compose(&ibuf, PROC_TABLE_OPEN, 0, 0, -1, &op, sizeof op)
+	    == -1)
+		errx(1, "imsg_compose failed");
+	bench_get(&imsg);
+	if (imsg.hdr.type != PROC_TABLE_OK)
+		errx(1, "table refused to open");
+	imsg_free(&imsg);
+}
+
+static void
+bench_close(void)
+{
+	struct pollfd	pfd;
+	int		n, status;
+
+	imsg_compose(&ibuf, PROC_TABLE_CLOSE, 0, 0, -1, NULL, 0);
+	pfd.fd = ibuf.fd;
+	pfd.events = POLLOUT;
+	while (ibuf.w.queued && poll(&pfd, 1, 1000) > 0) {
+		n = msgbuf_write(&ibuf.w);
+		if (n == 0 || (n == -1 && errno != EAGAIN))
+			break;
+	}
+	close(ibuf.fd);
+	if (waitpid(pid, &status, 0) == -1)
+		warn("waitpid");
+}
+
+/*
+ * Keep up to window requests in flight.  Tables answer in order, so the
+ * send times are kept in a ring.
+ */
+static void
+bench_run(int msgtype, int service, size_t nrequests, size_t window,
+    int dist, int missing, struct result *res)
+{
+	struct timespec	*sent, t0, t1, now;
+	struct imsg	 imsg;
+	char		 miss[64];
+	const char	*key;
+	size_t		 nsent = 0, ndone = 0;
+	int		 r;
+
+	memset(res, 0, sizeof *res);
+	if ((res->latency = reallocarray(NULL, nrequests, sizeof(double)))
+	    == NULL || (sent = reallocarray(NULL, window, sizeof(*sent)))
+	    == NULL)
+		err(1, "reallocarray");
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while (ndone < nrequests) {
+		while (nsent < nrequests && nsent - ndone < window) {
+			if ((int)(rnd() % 100) < missing) {
+				(void)snprintf(miss, sizeof miss,
+				    "missing%llu@bench.invalid",
+				    (unsigned long long)(rnd() % 1000000000));
+				key = miss;
+			} else if (dist == DIST_ZIPF)
+				key = keys[zipf_pick()];
+			else
+				key = keys[rnd() % nkeys];
+			clock_gettime(CLOCK_MONOTONIC, &sent[nsent % window]);
+			bench_send(msgtype, service, key);
+			nsent++;
+		}
+
+		bench_get(&imsg);
+		if (imsg.hdr.type == PROC_TABLE_DATA) {
+			/* part of a large lookup result */
+			imsg_free(&imsg);
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (imsg.hdr.type != PROC_TABLE_OK ||
+		    imsg.hdr.len - IMSG_HEADER_SIZE < sizeof(r))
+			errx(1, "bad reply from table");
+		memcpy(&r, imsg.data, sizeof(r));
+		imsg_free(&imsg);
+
+		if (r == 1)
+			res->found++;
+		else if (r == 0)
+			res->notfound++;
+		else
+			res->failed++;
+		res->latency[res->nlatency++] =
+		    elapsed_us(&sent[ndone % window], &now);
+		ndone++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	res->elapsed = elapsed_us(&t0, &t1) / 1e6;
+	free(sent);
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double	x = *(const double *)a, y = *(const double *)b;
+
+	return ((x < y) ? -1 : (x > y));
+}
+
+static double
+percentile(const struct result *res, double p)
+{
+	size_t	i;
+
+	i = (size_t)ceil(res->nlatency * p / 100.0);
+	if (i > 0)
+		i--;
+	return (res->latency[i]);
+}
+
+static void
+bench_report(const char *service, struct result *res)
+{
+	qsort(res->latency, res->nlatency, sizeof(double), cmp_double);
+	printf("%-12s %10.0f %9.1f %9.1f %9.1f %9zu %9zu %7zu\n", service,
+	    res->nlatency / res->elapsed, percentile(res, 50),
+	    percentile(res, 99), percentile(res, 99.9), res->found,
+	    res->notfound, res->failed);
+}
+
+static void
+usage(void)
+{
+	extern char	*__progname;
+
+	fprintf(stderr, "usage: %s [-C] [-c window] [-d uniform | zipf] "
+	    "[-k keyfile | -K nkeys]\n"
+	    "\t[-m missing] [-n requests] [-S seed] [-s service[,...]] "
+	    "[-z exponent]\n"
+	    "\ttable [arg ...]\n", __progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct result	 res;
+	const char	*keyfile = NULL, *e;
+	char		*list = NULL, *s, *name;
+	size_t		 nrequests = BENCH_REQUESTS, window = BENCH_WINDOW;
+	size_t		 ngenerate = 10000, i;
+	double		 zipf = BENCH_ZIPF;
+	int		 ch, dist = DIST_UNIFORM, missing = 0;
+	int		 msgtype = PROC_TABLE_LOOKUP;
+
+	while ((ch = getopt(argc, argv, "Cc:d:K:k:m:n:S:s:z:")) != -1) {
+		switch (ch) {
+		case 'C':
+			msgtype = PROC_TABLE_CHECK;
+			break;
+		case 'c':
+			window = strtonum(optarg, 1, 65536, &e);
+			if (e)
+				errx(1, "window is %s: %s", e, optarg);
+			break;
+		case 'd':
+			if (strcmp(optarg, "uniform") == 0)
+				dist = DIST_UNIFORM;
+			else if (strcmp(optarg, "zipf") == 0)
+				dist = DIST_ZIPF;
+			else
+				usage();
+			break;
+		case 'K':
+			ngenerate = strtonum(optarg, 1, INT_MAX, &e);
+			if (e)
+				errx(1, "number of keys is %s: %s", e, optarg);
+			break;
+		case 'k':
+			keyfile = optarg;
+			break;
+		case 'm':
+			missing = strtonum(optarg, 0, 100, &e);
+			if (e)
+				errx(1, "missing ratio is %s: %s", e, optarg);
+			break;
+		case 'n':
+			nrequests = strtonum(optarg, 1, INT_MAX, &e);
+			if (e)
+				errx(1, "requests is %s: %s", e, optarg);
+			break;
+		case 'S':
+			seed = strtonum(optarg, 1, LLONG_MAX, &e);
+			if (e)
+				errx(1, "seed is %s: %s", e, optarg);
+			break;
+		case 's':
+			list = optarg;
+			break;
+		case 'z':
+			zipf = strtod(optarg, NULL);
+			if (zipf <= 0)
+				errx(1, "bad exponent: %s", optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 0)
+		usage();
+
+	if (keyfile)
+		keys_load(keyfile);
+	else
+		keys_generate(ngenerate);
+	if (dist == DIST_ZIPF)
+		zipf_init(zipf);
+
+	signal(SIGPIPE, SIG_IGN);
+	bench_open(argv);
+
+	printf("%-12s %10s %9s %9s %9s %9s %9s %7s\n", "service", "ops/s",
+	    "p50(us)", "p99(us)", "p999(us)", "found", "notfound", "failed");
+	list = xstrdup(list ? list : "alias", "main");
+	for (s = list; (name = strsep(&s, ",")) != NULL; ) {
+		for (i = 0; i < sizeof(services) / sizeof(services[0]); i++)
+			if (strcmp(services[i].name, name) == 0)
+				break;
+		if (i == sizeof(services) / sizeof(services[0]))
+			errx(1, "unknown service %s", name);
+		bench_run(msgtype, services[i].service, nrequests, window, dist,
+		    missing, &res);
+		bench_report(name, &res);
+		free(res.latency);
+	}
+	free(list);
+
+	bench_close();
+	return 0;
+}
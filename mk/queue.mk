@@ -5,6 +5,7 @@ LIBCOMPAT	 = $(top_builddir)/openbsd-compat/libopenbsd-compat.a
 LDADD		 = $(LIBCOMPAT)
 
 SRCS 	 = $(api_srcdir)/log.c
+SRCS	+= $(api_srcdir)/dedup.c
 SRCS	+= $(api_srcdir)/queue_utils.c
 SRCS	+= $(api_srcdir)/queue_api.c
 SRCS	+= $(api_srcdir)/tree.c
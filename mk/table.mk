@@ -2,9 +2,11 @@ AM_CPPFLAGS	 = -I$(api_srcdir)
 AM_CPPFLAGS	+= -I$(compat_srcdir)
 
 LIBCOMPAT	= $(top_builddir)/openbsd-compat/libopenbsd-compat.a
-LDADD		= $(LIBCOMPAT)
+LDADD		= $(LIBCOMPAT) -lm
 
 SRCS	 = $(api_srcdir)/log.c
+SRCS	+= $(api_srcdir)/bloom.c
+SRCS	+= $(api_srcdir)/hedge.c
 SRCS	+= $(api_srcdir)/table_api.c
 SRCS	+= $(api_srcdir)/tree.c
 SRCS	+= $(api_srcdir)/dict.c